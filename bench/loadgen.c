@@ -0,0 +1,945 @@
+/**
+ * 負荷をかけるクライアント
+ *
+ * ch01 client.c、ch04 client.cは標準入力から1行ずつ読んで応答を待つだけなので、サーバに負荷をかけられない。
+ * ここではch05のサーバ(1行送ると"行:OK\r\n"が返る)に対して
+ * - threads個のスレッドがそれぞれ自分のepollで、合計conns個の接続を張る
+ * - リクエストごとのレイテンシをヒストグラム(../common/hist.h)に記録する
+ * - 1秒ごとの応答数と、最後に秒間リクエスト数、エラー数、レイテンシの分布(p99.99まで)を表示する
+ *   --csvでは結果をCSVの1行で出力する(suite.cが読む)
+ *
+ * 送り方は2通り
+ * - クローズドループ(デフォルト): 各接続は常にdepth個の応答待ちを持ち、応答が1つ返るたびに次を1つ送る
+ *   サーバが止まるとその間は送信も止まるので、止まっている間のレイテンシは記録されず、裾の遅延を過小に見積もる
+ *   (coordinated omission)
+ * - オープンループ(-r rate): 応答とは無関係に、決まった時刻表(一定間隔またはポアソン到着)でリクエストを発生させる
+ *   レイテンシは実際に送った時刻ではなく、送るはずだった時刻から数えるので、
+ *   サーバやこのプログラムの遅れで送信が遅れた分もレイテンシに含まれる
+ *   時刻表はスレッドごとに持ち(rate / threads)、発生したリクエストはスレッドの接続に順番に割り当てる
+ *   --sweep=from:to:stepで提示する負荷を変えながら繰り返し、レイテンシが急に悪化する点(knee)を探す
+ *
+ * 計測期間(warmupの後のduration秒)に発生したリクエストだけを記録する。
+ * 計測期間が終わったら新しいリクエストは発生させず、応答待ちが返るまで最大DRAIN_SEC秒待つ
+ * (最後の方のリクエストを捨てると遅いものほど記録から漏れるため)。
+ * それでも返らなかったものはタイムアウトとして数え、待った時間をレイテンシとして記録する。
+ *
+ * -n reqsで1つの接続でreqs個の応答を受けたら切断して接続し直す(接続の生成・破棄の負荷 クローズドループのみ)。
+ * 秒間の接続数と、connect()を始めてから
+ * - 接続が完了するまで(connect): SYNのキューとaccept()待ちのキューに入るまで
+ * - 最初の応答が返るまで(accept): accept()されるまでの待ちと、サーバの接続ごとの準備(fork()など)を含む
+ * の分布も記録する。
+ *
+ * 1台からループバックで10万接続以上を張るために
+ * - RLIMIT_NOFILEをハードリミットまで上げる
+ * - connect()中の接続を1スレッドあたりCONNECT_INFLIGHT個までにして、サーバのバックログを溢れさせない
+ * - 送信元アドレスを127.0.0.1から127.0.0.nまで振り分ける(-b n)
+ *   送信元アドレス1つあたりのエフェメラルポートは約28000個(ip_local_port_range)しか無いため
+ *   IP_BIND_ADDRESS_NO_PORTでbind()時にはポートを決めず、connect()時に決めさせる
+ * 接続1つあたりのメモリは構造体と応答待ちの時刻のリングだけにしている。
+ *
+ * 1つのリクエストは(size - 1)バイトの'x'と改行で、sizeはサーバの受信バッファ(FRAMER_BUFSIZE)未満にすること。
+ */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/hist.h"
+#include "../common/sock.h"
+
+/**
+ * MAX_EVENTS: 1回のepoll_wait()で受け取るイベント数
+ * CONNECT_INFLIGHT: 1スレッドで同時にconnect()中にする接続数
+ * RECV_BUFSIZE: 受信バッファ(スレッドごと)
+ * MAX_SIZE: リクエストの最大長 サーバのFRAMER_BUFSIZEより小さくする
+ * TMPL_MSGS: 1回のsend()で送るリクエスト数の上限
+ * DRAIN_SEC: 計測期間の後に応答待ちを待つ秒数
+ */
+#define MAX_EVENTS (256)
+#define CONNECT_INFLIGHT (256)
+#define RECV_BUFSIZE (64 * 1024)
+#define MAX_SIZE (4000)
+#define TMPL_MSGS (64)
+#define DRAIN_SEC (5)
+// sweepの最大段数
+#define MAX_STEPS (64)
+
+enum lc_state {
+    LC_INIT, // まだconnect()していない
+    LC_CONNECTING,
+    LC_RUNNING,
+    LC_CLOSED
+};
+
+/**
+ * 接続
+ * 応答は送った順に返るので、送信時刻はリングに入れて先頭から取り出す
+ * オープンループでは応答待ちに上限が無いので、一杯になったら倍にする
+ */
+struct lconn {
+    int fd;
+    enum lc_state state;
+    uint32_t events; // epollに登録しているイベント
+    unsigned int inflight; // 応答待ち(未送信も含む)
+    unsigned int unsent; // 未送信のリクエスト数(送信途中のものも含む)
+    unsigned int off; // 送信途中のリクエストの送信済みバイト数
+    unsigned int head; // ts[]の応答待ちの先頭
+    unsigned int cap; // ts[]の大きさ 2のべき乗
+    unsigned int done; // この接続で受けた応答数
+    int index; // 送信元アドレスを決める接続の番号
+    uint64_t started; // connect()を始めた時刻(ns)
+    uint64_t *ts; // 送信時刻(オープンループでは送るはずだった時刻)(ns)
+};
+
+/**
+ * スレッド
+ * 統計はこのスレッドだけが書き、メインスレッドは__atomic_load_n()で読むだけ
+ */
+struct worker {
+    int no;
+    pthread_t thread_id;
+    int epfd;
+    int tfd; // オープンループの時刻表用のtimerfd
+    struct lconn *conns;
+    int nconn;
+    int next; // 次にconnect()する接続
+    int connecting; // connect()中の数
+    int rr; // オープンループで次にリクエストを割り当てる接続
+    uint64_t next_at; // オープンループで次にリクエストを発生させる時刻(ns)
+    double interval; // オープンループの平均間隔(ns)
+    uint64_t rand; // ポアソン到着用の乱数の状態
+    unsigned long inflight; // 全接続の応答待ち
+    char *tmpl; // TMPL_MSGS個のリクエストを並べたもの 全ての接続でここから送る
+    struct hist hist; // 計測期間中のレイテンシ
+    struct hist hist_connect; // -n 計測期間中に始めたconnect()の完了まで
+    struct hist hist_first; // -n 計測期間中に始めたconnect()から最初の応答まで
+    unsigned long replies; // 受けた応答数(ウォームアップ中も含む)
+    unsigned long connected;
+    unsigned long cycles; // -n 計測期間中に始めて、reqs個の応答を受けて切断した接続
+    unsigned long timeouts; // DRAIN_SEC秒待っても返らなかった応答
+    unsigned long dropped; // オープンループで送る接続が無かったリクエスト(計測期間中のみ)
+    unsigned long err_connect; // connect()の失敗
+    unsigned long err_io; // 送受信エラー
+    unsigned long err_eof; // サーバからの切断
+    unsigned long err_proto; // 送っていない応答
+};
+
+struct config {
+    struct sockaddr_in addr;
+    int conns;
+    int threads;
+    int depth;
+    int size;
+    int duration; // 計測する秒数
+    int warmup; // 計測前の秒数
+    int nsrc; // 送信元アドレスの数 0:指定しない
+    double rate; // オープンループの全体のリクエスト/秒 0:クローズドループ
+    int poisson; // オープンループでポアソン到着にする
+    int csv; // 結果をCSVの1行で出力する(suite.cから読む)
+    unsigned int reqs; // 1つの接続で受ける応答数 0:切断しない
+};
+
+/**
+ * 1回の計測の結果
+ */
+struct result {
+    double offered; // オープンループで提示した負荷
+    double rps; // 応答の返ったリクエスト/秒
+    double cps; // -n 接続/秒
+    struct hist hist, hist_connect, hist_first;
+    unsigned long connected, cycles, timeouts, dropped, err_connect, err_io, err_eof, err_proto;
+};
+
+static struct config g_cfg;
+static volatile sig_atomic_t g_stop; // 新しいリクエストを発生させない
+static volatile sig_atomic_t g_quit; // 応答待ちも待たずに終了する
+static uint64_t g_measure_from; // これ以降に発生したリクエストだけ記録する(ns)
+
+static inline uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec);
+}
+
+/**
+ * 次の到着までの間隔(ns)
+ * ポアソン到着ならば平均intervalの指数分布(xorshift64*の一様乱数から逆関数法で作る)
+ */
+static double next_interval(struct worker *w)
+{
+    double u;
+
+    if (!g_cfg.poisson) {
+        return (w->interval);
+    }
+    w->rand ^= w->rand >> 12;
+    w->rand ^= w->rand << 25;
+    w->rand ^= w->rand >> 27;
+    u = (double) ((w->rand * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0; // [0, 1)
+    return (-log(1.0 - u) * w->interval);
+}
+
+/**
+ * 応答待ちの記録 計測期間中に発生したものだけ
+ */
+static inline void lc_record(struct worker *w, uint64_t ts, uint64_t now)
+{
+    if (ts >= g_measure_from) {
+        hist_record(&w->hist, now > ts ? now - ts : 0);
+    }
+}
+
+static void lc_close(struct worker *w, struct lconn *c, unsigned long *err)
+{
+    if (c->state == LC_CONNECTING) {
+        w->connecting--;
+    }
+    w->inflight -= c->inflight;
+    c->inflight = c->unsent = c->off = 0;
+    (void) close(c->fd);
+    c->fd = -1;
+    c->state = LC_CLOSED;
+    __atomic_add_fetch(err, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * 監視するイベントの更新 未送信がある間だけEPOLLOUTを監視する
+ */
+static void lc_update(struct worker *w, struct lconn *c)
+{
+    struct epoll_event ev;
+    uint32_t want;
+
+    want = EPOLLIN | (c->unsent > 0 ? EPOLLOUT : 0);
+    if (want != c->events) {
+        ev.events = want;
+        ev.data.ptr = c;
+        (void) epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = want;
+    }
+}
+
+/**
+ * リクエストを1つ積む tsは送信時刻(オープンループでは送るはずだった時刻)
+ * 戻り値 0:成功 -1:メモリ不足
+ */
+static int lc_queue(struct worker *w, struct lconn *c, uint64_t ts)
+{
+    uint64_t *p;
+    unsigned int i;
+
+    if (c->inflight == c->cap) {
+        // リングを倍にして、先頭から順に詰め直す
+        if ((p = malloc(sizeof(*p) * c->cap * 2)) == NULL) {
+            return (-1);
+        }
+        for (i = 0; i < c->inflight; i++) {
+            p[i] = c->ts[(c->head + i) & (c->cap - 1)];
+        }
+        free(c->ts);
+        c->ts = p;
+        c->head = 0;
+        c->cap *= 2;
+    }
+    c->ts[(c->head + c->inflight) & (c->cap - 1)] = ts;
+    c->inflight++;
+    c->unsent++;
+    w->inflight++;
+    return (0);
+}
+
+/**
+ * 未送信のリクエストを送信する
+ * どのリクエストも同じ内容なので、tmplのoffから未送信の分(TMPL_MSGS個まで)を1回のsend()で送る
+ */
+static void lc_send(struct worker *w, struct lconn *c)
+{
+    ssize_t len;
+    size_t size, n;
+
+    size = (size_t) g_cfg.size;
+    while (c->unsent > 0) {
+        n = c->unsent < TMPL_MSGS ? c->unsent : TMPL_MSGS;
+        if ((len = send(c->fd, w->tmpl + c->off, n * size - c->off, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                lc_close(w, c, &w->err_io);
+                return;
+            }
+            break;
+        }
+        c->off += (unsigned int) len;
+        c->unsent -= c->off / (unsigned int) size;
+        c->off %= (unsigned int) size;
+    }
+    lc_update(w, c);
+}
+
+/**
+ * 受信
+ * 改行の数だけ応答が返ったとして、先頭の送信時刻から受信した時刻までのレイテンシを記録する
+ * クローズドループで停止中でなければ同じ数だけ次のリクエストを積む
+ */
+static void lc_connect(struct worker *w, struct lconn *c);
+
+/**
+ * -n 接続で受けるリクエスト数に達したか(これ以上積まない)
+ */
+static inline int lc_exhausted(const struct lconn *c)
+{
+    return (g_cfg.reqs > 0 && c->done + c->inflight >= g_cfg.reqs);
+}
+
+/**
+ * -n reqs個の応答を受けた接続を切断して、停止中でなければ接続し直す
+ */
+static void lc_recycle(struct worker *w, struct lconn *c)
+{
+    if (c->started >= g_measure_from) {
+        __atomic_add_fetch(&w->cycles, 1, __ATOMIC_RELAXED);
+    }
+    (void) close(c->fd);
+    c->fd = -1;
+    c->state = LC_CLOSED;
+    if (!g_stop) {
+        lc_connect(w, c);
+    }
+}
+
+static void lc_recv(struct worker *w, struct lconn *c, char *buf)
+{
+    char *p, *end;
+    ssize_t len;
+    unsigned long n;
+    uint64_t now;
+
+    for (;;) {
+        if ((len = recv(c->fd, buf, RECV_BUFSIZE, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                lc_close(w, c, &w->err_io);
+                return;
+            }
+            break;
+        }
+        if (len == 0) {
+            lc_close(w, c, &w->err_eof);
+            return;
+        }
+        // epoll_wait()から戻った時刻では、同じ回に送ったリクエストの応答が先に着いたことになりうる
+        now = clock_ns();
+        n = 0;
+        for (p = buf, end = buf + len; (p = memchr(p, '\n', (size_t) (end - p))) != NULL; p++) {
+            if (c->inflight == 0 || c->inflight == c->unsent) {
+                lc_close(w, c, &w->err_proto);
+                return;
+            }
+            lc_record(w, c->ts[c->head], now);
+            if (c->done++ == 0 && g_cfg.reqs > 0 && c->started >= g_measure_from) {
+                hist_record(&w->hist_first, now - c->started);
+            }
+            c->head = (c->head + 1) & (c->cap - 1);
+            c->inflight--;
+            w->inflight--;
+            n++;
+            if (!g_stop && g_cfg.rate == 0 && !lc_exhausted(c) && lc_queue(w, c, now) == -1) {
+                lc_close(w, c, &w->err_io);
+                return;
+            }
+        }
+        __atomic_add_fetch(&w->replies, n, __ATOMIC_RELAXED);
+        if (g_cfg.reqs > 0 && c->done >= g_cfg.reqs && c->inflight == 0) {
+            lc_recycle(w, c);
+            return;
+        }
+        if (len < RECV_BUFSIZE) {
+            break;
+        }
+    }
+    lc_send(w, c);
+}
+
+/**
+ * connect()の完了
+ * クローズドループではdepth個のリクエストを積んで送信する
+ */
+static void lc_connected(struct worker *w, struct lconn *c, uint64_t now)
+{
+    socklen_t len;
+    int err, i;
+
+    len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+        lc_close(w, c, &w->err_connect);
+        return;
+    }
+    w->connecting--;
+    c->state = LC_RUNNING;
+    __atomic_add_fetch(&w->connected, 1, __ATOMIC_RELAXED);
+    if (g_cfg.reqs > 0 && c->started >= g_measure_from) {
+        hist_record(&w->hist_connect, now - c->started);
+    }
+    for (i = 0; g_cfg.rate == 0 && !g_stop && !lc_exhausted(c) && i < g_cfg.depth; i++) {
+        if (lc_queue(w, c, now) == -1) {
+            lc_close(w, c, &w->err_io);
+            return;
+        }
+    }
+    lc_send(w, c);
+}
+
+/**
+ * ノンブロッキングでconnect()を始める
+ * 送信元アドレスを指定する場合は、接続の番号で127.0.0.1から順に振り分ける
+ */
+static void lc_connect(struct worker *w, struct lconn *c)
+{
+    struct sockaddr_in src;
+    struct epoll_event ev;
+    int opt;
+
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        c->state = LC_CLOSED;
+        __atomic_add_fetch(&w->err_connect, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    opt = 1;
+    (void) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    if (g_cfg.nsrc > 0) {
+        (void) setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &opt, sizeof(opt));
+        (void) memset(&src, 0, sizeof(src));
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + (uint32_t) (c->index % g_cfg.nsrc));
+        (void) bind(c->fd, (struct sockaddr *) &src, sizeof(src));
+    }
+    c->state = LC_CONNECTING;
+    c->head = c->done = 0;
+    c->started = clock_ns();
+    w->connecting++;
+    if (connect(c->fd, (struct sockaddr *) &g_cfg.addr, sizeof(g_cfg.addr)) == -1 && errno != EINPROGRESS) {
+        lc_close(w, c, &w->err_connect);
+        return;
+    }
+    // 完了は書き込み可能で通知される
+    c->events = EPOLLOUT;
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        lc_close(w, c, &w->err_connect);
+    }
+}
+
+/**
+ * オープンループ 時刻表で今までに来ているリクエストを発生させる
+ * 接続に順番に割り当て、送るはずだった時刻(next_at)を記録してすぐに送信する
+ * 次の時刻でtimerfdを張り直す
+ */
+static void open_loop_fire(struct worker *w, uint64_t now)
+{
+    struct itimerspec its;
+    struct lconn *c;
+    int i;
+
+    while (w->next_at <= now) {
+        for (c = NULL, i = 0; i < w->nconn; i++) {
+            c = &w->conns[w->rr];
+            w->rr = (w->rr + 1) % w->nconn;
+            if (c->state == LC_RUNNING) {
+                break;
+            }
+            c = NULL;
+        }
+        if (c == NULL) {
+            // 送れる接続が無い(接続中、または全て切断された)
+            if (w->next_at >= g_measure_from) {
+                __atomic_add_fetch(&w->dropped, 1, __ATOMIC_RELAXED);
+            }
+        } else if (lc_queue(w, c, w->next_at) == -1) {
+            lc_close(w, c, &w->err_io);
+        } else {
+            lc_send(w, c);
+        }
+        w->next_at += (uint64_t) next_interval(w);
+    }
+    (void) memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = (time_t) (w->next_at / 1000000000ULL);
+    its.it_value.tv_nsec = (long) (w->next_at % 1000000000ULL);
+    (void) timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * 返らなかった応答待ち 待った時間をレイテンシとして記録する
+ */
+static void worker_timeout(struct worker *w, uint64_t now)
+{
+    struct lconn *c;
+    unsigned int j;
+    int i;
+
+    for (i = 0; i < w->nconn; i++) {
+        c = &w->conns[i];
+        for (j = 0; j < c->inflight; j++) {
+            lc_record(w, c->ts[(c->head + j) & (c->cap - 1)], now);
+        }
+        w->timeouts += c->inflight;
+    }
+}
+
+/**
+ * スレッド
+ * g_stopの後は新しいリクエストを発生させず、応答待ちが無くなるかg_quitで終了する
+ */
+static void *worker_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    struct lconn *c;
+    char *buf;
+    uint64_t now, expirations;
+    int i, nready;
+
+    if ((buf = malloc(RECV_BUFSIZE)) == NULL) {
+        perror("malloc");
+        return (NULL);
+    }
+    if (g_cfg.rate > 0) {
+        w->next_at = clock_ns();
+        open_loop_fire(w, w->next_at);
+    }
+    while (!g_quit && (!g_stop || w->inflight > 0)) {
+        // connect()中がCONNECT_INFLIGHT個になるまで張っていく
+        while (!g_stop && w->next < w->nconn && w->connecting < CONNECT_INFLIGHT) {
+            lc_connect(w, &w->conns[w->next]);
+            w->next++;
+        }
+        // 停止を確認するため100msでタイムアウトさせる
+        if ((nready = epoll_wait(w->epfd, events, MAX_EVENTS, 100)) == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        now = clock_ns();
+        for (i = 0; i < nready; i++) {
+            if ((c = events[i].data.ptr) == NULL) {
+                // 時刻表のタイマ
+                (void) read(w->tfd, &expirations, sizeof(expirations));
+                if (!g_stop) {
+                    open_loop_fire(w, now);
+                }
+                continue;
+            }
+            if (c->state == LC_CONNECTING) {
+                lc_connected(w, c, now);
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+                lc_recv(w, c, buf);
+            } else if ((events[i].events & EPOLLOUT) && c->state == LC_RUNNING) {
+                lc_send(w, c);
+            }
+        }
+    }
+    worker_timeout(w, clock_ns());
+    free(buf);
+    return (NULL);
+}
+
+/**
+ * スレッドの準備 接続をスレッドに均等に割り振る
+ */
+static int worker_init(struct worker *w, int no)
+{
+    struct epoll_event ev;
+    unsigned int cap;
+    int i;
+
+    (void) memset(w, 0, sizeof(*w));
+    w->no = no;
+    w->nconn = g_cfg.conns / g_cfg.threads + (no < g_cfg.conns % g_cfg.threads);
+    w->tfd = -1;
+    w->rand = 0x9E3779B97F4A7C15ULL * (uint64_t) (no + 1) ^ clock_ns();
+    hist_init(&w->hist);
+    hist_init(&w->hist_connect);
+    hist_init(&w->hist_first);
+    for (cap = 1; cap < (unsigned int) g_cfg.depth; cap *= 2);
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1
+        || (w->conns = calloc((size_t) w->nconn + 1, sizeof(*w->conns))) == NULL
+        || (w->tmpl = malloc((size_t) TMPL_MSGS * (size_t) g_cfg.size)) == NULL) {
+        perror("worker_init");
+        return (-1);
+    }
+    for (i = 0; i < w->nconn; i++) {
+        w->conns[i].fd = -1;
+        w->conns[i].cap = cap;
+        w->conns[i].index = no + i * g_cfg.threads;
+        if ((w->conns[i].ts = malloc(sizeof(uint64_t) * cap)) == NULL) {
+            perror("worker_init");
+            return (-1);
+        }
+    }
+    (void) memset(w->tmpl, 'x', (size_t) TMPL_MSGS * (size_t) g_cfg.size);
+    for (i = 1; i <= TMPL_MSGS; i++) {
+        w->tmpl[i * g_cfg.size - 1] = '\n';
+    }
+    if (g_cfg.rate > 0) {
+        w->interval = 1e9 * g_cfg.threads / g_cfg.rate;
+        if ((w->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+            perror("timerfd_create");
+            return (-1);
+        }
+        // 接続と区別するためdata.ptrはNULLにする
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->tfd, &ev) == -1) {
+            perror("epoll_ctl");
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+static void worker_free(struct worker *w)
+{
+    int i;
+
+    for (i = 0; i < w->nconn; i++) {
+        if (w->conns[i].fd != -1) {
+            (void) close(w->conns[i].fd);
+        }
+        free(w->conns[i].ts);
+    }
+    free(w->conns);
+    free(w->tmpl);
+    if (w->tfd != -1) {
+        (void) close(w->tfd);
+    }
+    (void) close(w->epfd);
+}
+
+/**
+ * 1回の計測
+ * 接続を張り、warmup + duration秒の間負荷をかけて、応答待ちを最大DRAIN_SEC秒待ってから集計する
+ * 接続は計測ごとに張り直す
+ */
+static int run(struct result *res)
+{
+    struct worker *ws;
+    unsigned long replies, prev, connected, prev_connected, inflight;
+    uint64_t stop_at;
+    int i, sec;
+
+    if ((ws = calloc((size_t) g_cfg.threads, sizeof(*ws))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    g_stop = g_quit = 0;
+    g_measure_from = clock_ns() + (uint64_t) g_cfg.warmup * 1000000000ULL;
+    for (i = 0; i < g_cfg.threads; i++) {
+        if (worker_init(&ws[i], i) == -1) {
+            return (-1);
+        }
+        if ((errno = pthread_create(&ws[i].thread_id, NULL, worker_thread, &ws[i])) != 0) {
+            perror("pthread_create");
+            return (-1);
+        }
+    }
+
+    // 1秒ごとの進捗
+    for (prev = prev_connected = 0, sec = 1; sec <= g_cfg.warmup + g_cfg.duration; sec++) {
+        (void) sleep(1);
+        for (replies = connected = 0, i = 0; i < g_cfg.threads; i++) {
+            replies += __atomic_load_n(&ws[i].replies, __ATOMIC_RELAXED);
+            connected += __atomic_load_n(&ws[i].connected, __ATOMIC_RELAXED);
+        }
+        (void) fprintf(stderr, "%3ds%s connected=%lu conns/s=%lu replies/s=%lu\n", sec,
+                       sec <= g_cfg.warmup ? "(warmup)" : "", connected, connected - prev_connected, replies - prev);
+        prev = replies;
+        prev_connected = connected;
+    }
+    g_stop = 1;
+    stop_at = clock_ns();
+
+    // 応答待ちが無くなるまで待つ
+    for (sec = 0; sec < DRAIN_SEC * 10; sec++) {
+        for (inflight = 0, i = 0; i < g_cfg.threads; i++) {
+            inflight += __atomic_load_n(&ws[i].inflight, __ATOMIC_RELAXED);
+        }
+        if (inflight == 0) {
+            break;
+        }
+        (void) usleep(100 * 1000);
+    }
+    g_quit = 1;
+
+    (void) memset(res, 0, sizeof(*res));
+    hist_init(&res->hist);
+    hist_init(&res->hist_connect);
+    hist_init(&res->hist_first);
+    for (i = 0; i < g_cfg.threads; i++) {
+        (void) pthread_join(ws[i].thread_id, NULL);
+        hist_merge(&res->hist, &ws[i].hist);
+        hist_merge(&res->hist_connect, &ws[i].hist_connect);
+        hist_merge(&res->hist_first, &ws[i].hist_first);
+        res->connected += ws[i].connected;
+        res->cycles += ws[i].cycles;
+        res->timeouts += ws[i].timeouts;
+        res->dropped += ws[i].dropped;
+        res->err_connect += ws[i].err_connect;
+        res->err_io += ws[i].err_io;
+        res->err_eof += ws[i].err_eof;
+        res->err_proto += ws[i].err_proto;
+        worker_free(&ws[i]);
+    }
+    free(ws);
+    res->offered = g_cfg.rate;
+    res->rps = (double) (res->hist.total - res->timeouts) / ((double) (stop_at - g_measure_from) / 1e9);
+    res->cps = (double) res->cycles / ((double) (stop_at - g_measure_from) / 1e9);
+    return (0);
+}
+
+/**
+ * CSVの見出し 並びはresult_print()と合わせる
+ */
+#define CSV_HEADER "conns,threads,depth,size,duration,offered,requests,rps,p50_us,p90_us,p99_us,p999_us,max_us,errors," \
+    "reqs_per_conn,cps,connect_p50_us,connect_p99_us,accept_p50_us,accept_p99_us,accept_p999_us"
+
+static void result_print(const struct result *res)
+{
+    if (g_cfg.csv) {
+        (void) printf("%d,%d,%d,%d,%d,%.0f,%llu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%lu,%u,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                      g_cfg.conns, g_cfg.threads,
+                      g_cfg.depth, g_cfg.size, g_cfg.duration, res->offered, (unsigned long long) res->hist.total,
+                      res->rps, (double) hist_value_at(&res->hist, 50.0) / 1000.0,
+                      (double) hist_value_at(&res->hist, 90.0) / 1000.0,
+                      (double) hist_value_at(&res->hist, 99.0) / 1000.0,
+                      (double) hist_value_at(&res->hist, 99.9) / 1000.0, (double) res->hist.max / 1000.0,
+                      res->err_connect + res->err_io + res->err_eof + res->err_proto + res->timeouts + res->dropped,
+                      g_cfg.reqs, res->cps, (double) hist_value_at(&res->hist_connect, 50.0) / 1000.0,
+                      (double) hist_value_at(&res->hist_connect, 99.0) / 1000.0,
+                      (double) hist_value_at(&res->hist_first, 50.0) / 1000.0,
+                      (double) hist_value_at(&res->hist_first, 99.0) / 1000.0,
+                      (double) hist_value_at(&res->hist_first, 99.9) / 1000.0);
+        (void) fflush(stdout);
+        return;
+    }
+    (void) printf("conns=%d threads=%d depth=%d size=%d duration=%ds", g_cfg.conns, g_cfg.threads,
+                  g_cfg.depth, g_cfg.size, g_cfg.duration);
+    if (res->offered > 0) {
+        (void) printf(" offered=%.0f/s (%s)", res->offered, g_cfg.poisson ? "poisson" : "constant");
+    }
+    (void) printf("\nrequests=%llu rps=%.0f connected=%lu\n", (unsigned long long) res->hist.total, res->rps,
+                  res->connected);
+    (void) printf("errors: connect=%lu io=%lu eof=%lu protocol=%lu timeout=%lu dropped=%lu\n", res->err_connect,
+                  res->err_io, res->err_eof, res->err_proto, res->timeouts, res->dropped);
+    hist_print(stdout, "latency", &res->hist);
+    if (g_cfg.reqs > 0) {
+        (void) printf("connections=%lu conns/s=%.0f reqs/conn=%u\n", res->cycles, res->cps, g_cfg.reqs);
+        hist_print(stdout, "connect", &res->hist_connect);
+        hist_print(stdout, "accept", &res->hist_first);
+    }
+}
+
+/**
+ * 提示する負荷を変えながら計測し、kneeを探す
+ * 最初の段のp99のKNEE_FACTOR倍を超えるか、応答の返った割合がKNEE_ACHIEVED未満になる直前の段をkneeとする
+ */
+#define KNEE_FACTOR (10.0)
+#define KNEE_ACHIEVED (0.95)
+
+static int sweep(double from, double to, double step)
+{
+    static struct result res[MAX_STEPS];
+    double base, knee;
+    int i, n;
+
+    for (n = 0; n < MAX_STEPS && from + step * n <= to + 1e-9; n++) {
+        g_cfg.rate = from + step * n;
+        (void) fprintf(stderr, "=== offered %.0f/s\n", g_cfg.rate);
+        if (run(&res[n]) == -1) {
+            return (-1);
+        }
+        result_print(&res[n]);
+    }
+    if (g_cfg.csv) {
+        return (0);
+    }
+    (void) printf("\n%10s %10s %10s %10s %10s %10s %8s\n", "offered", "achieved", "p50(us)", "p99(us)", "p99.9(us)",
+                  "max(us)", "errors");
+    base = 0;
+    knee = -1;
+    for (i = 0; i < n; i++) {
+        (void) printf("%10.0f %10.0f %10.1f %10.1f %10.1f %10.1f %8lu\n", res[i].offered, res[i].rps,
+                      (double) hist_value_at(&res[i].hist, 50.0) / 1000.0,
+                      (double) hist_value_at(&res[i].hist, 99.0) / 1000.0,
+                      (double) hist_value_at(&res[i].hist, 99.9) / 1000.0, (double) res[i].hist.max / 1000.0,
+                      res[i].timeouts + res[i].dropped + res[i].err_io + res[i].err_eof + res[i].err_proto);
+        if (i == 0) {
+            base = (double) hist_value_at(&res[i].hist, 99.0);
+        }
+        if (knee == -2) {
+            continue;
+        }
+        if ((double) hist_value_at(&res[i].hist, 99.0) > base * KNEE_FACTOR
+            || res[i].rps < res[i].offered * KNEE_ACHIEVED) {
+            knee = i > 0 ? res[i - 1].offered : 0;
+            (void) printf("%10s knee: p99 or throughput breaks down here, last good offered load %.0f/s\n", "", knee);
+            knee = -2;
+        }
+    }
+    if (knee == -1) {
+        (void) printf("no knee up to %.0f/s\n", res[n - 1].offered);
+    }
+    return (0);
+}
+
+/**
+ * ファイルディスクリプタの上限をハードリミットまで上げる
+ */
+static void raise_nofile(int need)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur != RLIM_INFINITY && (rlim_t) need > rl.rlim_cur) {
+        (void) fprintf(stderr, "warning: RLIMIT_NOFILE=%lu < %d connections\n", (unsigned long) rl.rlim_cur, need);
+    }
+}
+
+static void usage(void)
+{
+    (void) fprintf(stderr, "loadgen [-c conns] [-t threads] [-d depth] [-s size] [-T sec] [-w warmup] [-b srcaddrs]\n"
+                   "        [-r rate | --sweep=from:to:step] [--poisson] [--csv] [-n reqs] host port\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "conns", required_argument, NULL, 'c' },
+        { "threads", required_argument, NULL, 't' },
+        { "depth", required_argument, NULL, 'd' },
+        { "size", required_argument, NULL, 's' },
+        { "duration", required_argument, NULL, 'T' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "src", required_argument, NULL, 'b' },
+        { "rate", required_argument, NULL, 'r' },
+        { "sweep", required_argument, NULL, 'S' },
+        { "poisson", no_argument, NULL, 'p' },
+        { "csv", no_argument, NULL, 'C' },
+        { "reqs", required_argument, NULL, 'n' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct result res;
+    double from, to, step;
+    int ch;
+
+    g_cfg.conns = 100;
+    g_cfg.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    g_cfg.depth = 1;
+    g_cfg.size = 64;
+    g_cfg.duration = 10;
+    g_cfg.warmup = 2;
+    from = to = step = 0;
+    while ((ch = getopt_long(argc, argv, "c:t:d:s:T:w:b:r:S:pCn:", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'c':
+            g_cfg.conns = atoi(optarg);
+            break;
+        case 't':
+            g_cfg.threads = atoi(optarg);
+            break;
+        case 'd':
+            g_cfg.depth = atoi(optarg);
+            break;
+        case 's':
+            g_cfg.size = atoi(optarg);
+            break;
+        case 'T':
+            g_cfg.duration = atoi(optarg);
+            break;
+        case 'w':
+            g_cfg.warmup = atoi(optarg);
+            break;
+        case 'b':
+            g_cfg.nsrc = atoi(optarg);
+            break;
+        case 'r':
+            g_cfg.rate = atof(optarg);
+            break;
+        case 'S':
+            if (sscanf(optarg, "%lf:%lf:%lf", &from, &to, &step) != 3 || from <= 0 || to < from || step <= 0) {
+                usage();
+                return (EX_USAGE);
+            }
+            break;
+        case 'p':
+            g_cfg.poisson = 1;
+            break;
+        case 'C':
+            g_cfg.csv = 1;
+            break;
+        case 'n':
+            g_cfg.reqs = (unsigned int) atoi(optarg);
+            break;
+        default:
+            usage();
+            return (EX_USAGE);
+        }
+    }
+    if (argc - optind != 2 || g_cfg.conns < 1 || g_cfg.threads < 1 || g_cfg.depth < 1 || g_cfg.rate < 0
+        || g_cfg.size < 1 || g_cfg.size > MAX_SIZE || g_cfg.duration < 1 || g_cfg.warmup < 0
+        || (g_cfg.reqs > 0 && (g_cfg.rate > 0 || step > 0))) {
+        usage();
+        return (EX_USAGE);
+    }
+    if (g_cfg.threads > g_cfg.conns) {
+        g_cfg.threads = g_cfg.conns;
+    }
+    if (client_addr(argv[optind], argv[optind + 1], &g_cfg.addr) == -1) {
+        return (EX_NOHOST);
+    }
+    raise_nofile(g_cfg.conns + 64);
+    (void) signal(SIGPIPE, SIG_IGN);
+
+    if (g_cfg.csv) {
+        (void) printf("%s\n", CSV_HEADER);
+    }
+    if (step > 0) {
+        return (sweep(from, to, step) == -1 ? EX_OSERR : EX_OK);
+    }
+    if (run(&res) == -1) {
+        return (EX_OSERR);
+    }
+    result_print(&res);
+    return (res.err_connect + res.err_io + res.err_eof + res.err_proto + res.timeouts > 0 ? EX_TEMPFAIL : EX_OK);
+}
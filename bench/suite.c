@@ -0,0 +1,587 @@
+/**
+ * サーバの方式ごとのベンチマーク
+ *
+ * ch05 serverの各方式(--engine)を、接続数・リクエストの大きさ・パイプラインの深さの組み合わせごとに
+ * ループバックで起動し、loadgen(クローズドループ)で負荷をかけて
+ * - 秒間リクエスト数、レイテンシ(p50/p90/p99/p99.9/max)、エラー数(loadgen --csvの出力)
+ * - サーバのCPU時間(ユーザ/システム)、リクエストあたりのCPU時間、コンテキストスイッチ数、最大RSS
+ * を集め、1つの組み合わせごとにCSVとJSONに1行ずつ書き出す。
+ *
+ * サーバは組み合わせごとに起動し直し、終了時にwait4()で受け取るrusageを使う。
+ * wait4()のrusageは回収済みの子プロセスの分を含むので、fork、preforkの方式でも子プロセスのCPU時間が入る
+ * (最大RSSは合計ではなく、プロセスのうち最大のもの)。
+ * 負荷をかけている間のloadgen自身の負荷は含まない。
+ *
+ * -n reqsでは1つの接続でreqs個の応答を受けたら接続し直させ(loadgen -n)、接続の生成・破棄の負荷を測る。
+ * 秒間の接続数、connect()から最初の応答までの分布(accept()されるまでの待ちを含む)、
+ * 接続あたりのサーバのCPU時間と、その間に増えたListenOverflows(/proc/net/netstat 受け付け待ちのキューが溢れて
+ * 捨てたSYN・ACKの数、システム全体)も記録する。
+ *
+ * -B baseline.csvで以前の結果(別のマシン、別のビルド)を読み、同じ組み合わせの秒間リクエスト数と
+ * p99の変化を表示する。
+ *
+ * preforkは1プロセスが1接続ずつ処理するので、workersを接続数にして起動する。
+ */
+#define _GNU_SOURCE
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * READY_TIMEOUT_MS: サーバがconnect()を受け付けるようになるまで待つ時間
+ * SETTLE_MS: loadgenの終了後、サーバが切断を処理し終わるまで待つ時間
+ * TERM_TIMEOUT_MS: SIGTERMの後、サーバの終了を待つ時間(過ぎたらプロセスグループごとSIGKILL)
+ * MAX_LIST: -e、-c、-s、-dに並べられる数
+ * MAX_ROWS: -Bで読む結果の行数
+ */
+#define READY_TIMEOUT_MS (5000)
+#define SETTLE_MS (300)
+#define TERM_TIMEOUT_MS (5000)
+#define MAX_LIST (16)
+#define MAX_ROWS (4096)
+
+/**
+ * 1つの組み合わせの結果
+ */
+struct row {
+    char engine[16];
+    int conns, size, depth;
+    unsigned long requests, errors;
+    double rps, p50, p90, p99, p999, max; // レイテンシはus
+    int reqs; // 1つの接続で受ける応答数 0:切断しない
+    double cps, connect_p50, connect_p99, accept_p50, accept_p99, accept_p999;
+    long overflows; // ListenOverflowsの増分 -1:読めない
+    double utime, stime; // サーバのCPU時間(秒)
+    long nvcsw, nivcsw, maxrss; // maxrssはKB
+};
+
+struct list {
+    int n;
+    char *v[MAX_LIST];
+};
+
+static struct {
+    const char *server; // サーバのパス
+    const char *loadgen; // loadgenのパス
+    const char *port;
+    const char *output; // 出力ファイル名(.csv、.jsonを付ける)
+    const char *baseline; // 比較する以前の結果
+    int duration;
+    int warmup;
+    int threads; // loadgenのスレッド数 0:loadgenのデフォルト
+    int workers; // サーバのworkers 0:サーバのデフォルト
+    int reqs; // loadgen -n
+    struct list engines, conns, sizes, depths;
+} g_cfg;
+
+/**
+ * カンマ区切りを分割する(文字列はそのまま書き換える)
+ */
+static int parse_list(char *s, struct list *l)
+{
+    char *p, *save;
+
+    l->n = 0;
+    for (p = strtok_r(s, ",", &save); p != NULL; p = strtok_r(NULL, ",", &save)) {
+        if (l->n == MAX_LIST) {
+            (void) fprintf(stderr, "too many values (max %d)\n", MAX_LIST);
+            return (-1);
+        }
+        l->v[l->n++] = p;
+    }
+    return (l->n > 0 ? 0 : -1);
+}
+
+static void sleep_ms(int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long) (ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR);
+}
+
+/**
+ * プログラムの起動
+ * 自分のプロセスグループを作らせ(残った子プロセスもまとめて終了させられるように)、
+ * 標準出力はoutfd(-1ならば/dev/null)、標準エラー出力は/dev/nullにする
+ */
+static pid_t spawn(char *const argv[], int outfd)
+{
+    pid_t pid;
+    int null;
+
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return (-1);
+    }
+    if (pid == 0) {
+        (void) setpgid(0, 0);
+        if ((null = open("/dev/null", O_RDWR)) != -1) {
+            (void) dup2(null, STDIN_FILENO);
+            (void) dup2(outfd != -1 ? outfd : null, STDOUT_FILENO);
+            (void) dup2(null, STDERR_FILENO);
+        }
+        (void) execv(argv[0], argv);
+        _exit(EX_OSERR);
+    }
+    return (pid);
+}
+
+/**
+ * サーバがconnect()を受け付けるまで待つ
+ */
+static int wait_ready(pid_t pid)
+{
+    struct sockaddr_in addr;
+    int i, soc, ret;
+
+    (void) memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short) atoi(g_cfg.port));
+    for (i = 0; i < READY_TIMEOUT_MS / 50; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            // 起動に失敗した(ポートが使用中など)
+            return (-1);
+        }
+        if ((soc = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+            return (-1);
+        }
+        ret = connect(soc, (struct sockaddr *) &addr, sizeof(addr));
+        (void) close(soc);
+        if (ret == 0) {
+            return (0);
+        }
+        sleep_ms(50);
+    }
+    return (-1);
+}
+
+/**
+ * /proc/net/netstatのTcpExtの値
+ * 見出しの行と値の行が交互に並んでいるので、見出しでの位置を探して値の行の同じ位置を読む
+ * 戻り値 値 -1:無い
+ */
+static long netstat_get(const char *name)
+{
+    char head[4096], vals[4096], *hp, *vp, *hs, *vs;
+    long ret;
+    FILE *fp;
+
+    if ((fp = fopen("/proc/net/netstat", "r")) == NULL) {
+        return (-1);
+    }
+    ret = -1;
+    while (ret == -1 && fgets(head, sizeof(head), fp) != NULL && fgets(vals, sizeof(vals), fp) != NULL) {
+        if (strncmp(head, "TcpExt:", 7) != 0) {
+            continue;
+        }
+        hp = strtok_r(head, " \n", &hs);
+        vp = strtok_r(vals, " \n", &vs);
+        while (hp != NULL && vp != NULL) {
+            if (strcmp(hp, name) == 0) {
+                ret = atol(vp);
+                break;
+            }
+            hp = strtok_r(NULL, " \n", &hs);
+            vp = strtok_r(NULL, " \n", &vs);
+        }
+    }
+    (void) fclose(fp);
+    return (ret);
+}
+
+/**
+ * サーバを終了させてrusageを受け取る
+ */
+static void server_stop(pid_t pid, struct rusage *ru)
+{
+    int i;
+
+    (void) kill(pid, SIGTERM);
+    for (i = 0; i < TERM_TIMEOUT_MS / 50; i++) {
+        if (wait4(pid, NULL, WNOHANG, ru) == pid) {
+            (void) kill(-pid, SIGKILL);
+            return;
+        }
+        sleep_ms(50);
+    }
+    (void) fprintf(stderr, "server pid=%d did not exit, killing\n", (int) pid);
+    (void) kill(-pid, SIGKILL);
+    (void) wait4(pid, NULL, 0, ru);
+}
+
+/**
+ * 1つの組み合わせの計測
+ * 戻り値 0:成功 -1:失敗(rowは埋まっていない)
+ */
+static int run_cell(const char *engine, int conns, int size, int depth, struct row *r)
+{
+    char s_engine[32], s_workers[16], s_conns[16], s_size[16], s_depth[16], s_duration[16], s_warmup[16],
+        s_threads[16], s_reqs[16], line[512];
+    char *sargv[8], *largv[24];
+    struct rusage ru;
+    FILE *fp;
+    pid_t spid, lpid;
+    long overflows;
+    int fd[2], n, got, status;
+
+    (void) snprintf(s_engine, sizeof(s_engine), "--engine=%s", engine);
+    n = 0;
+    sargv[n++] = (char *) g_cfg.server;
+    sargv[n++] = s_engine;
+    if (strcmp(engine, "prefork") == 0 || g_cfg.workers > 0) {
+        (void) snprintf(s_workers, sizeof(s_workers), "--workers=%d",
+                        strcmp(engine, "prefork") == 0 ? conns : g_cfg.workers);
+        sargv[n++] = s_workers;
+    }
+    sargv[n++] = (char *) g_cfg.port;
+    sargv[n] = NULL;
+    if ((spid = spawn(sargv, -1)) == -1) {
+        return (-1);
+    }
+    if (wait_ready(spid) == -1) {
+        (void) fprintf(stderr, "server --engine=%s did not become ready\n", engine);
+        server_stop(spid, &ru);
+        return (-1);
+    }
+
+    (void) snprintf(s_conns, sizeof(s_conns), "%d", conns);
+    (void) snprintf(s_size, sizeof(s_size), "%d", size);
+    (void) snprintf(s_depth, sizeof(s_depth), "%d", depth);
+    (void) snprintf(s_duration, sizeof(s_duration), "%d", g_cfg.duration);
+    (void) snprintf(s_warmup, sizeof(s_warmup), "%d", g_cfg.warmup);
+    (void) snprintf(s_threads, sizeof(s_threads), "%d", g_cfg.threads);
+    (void) snprintf(s_reqs, sizeof(s_reqs), "%d", g_cfg.reqs);
+    n = 0;
+    largv[n++] = (char *) g_cfg.loadgen;
+    largv[n++] = "--csv";
+    largv[n++] = "-c";
+    largv[n++] = s_conns;
+    largv[n++] = "-s";
+    largv[n++] = s_size;
+    largv[n++] = "-d";
+    largv[n++] = s_depth;
+    largv[n++] = "-T";
+    largv[n++] = s_duration;
+    largv[n++] = "-w";
+    largv[n++] = s_warmup;
+    if (g_cfg.threads > 0) {
+        largv[n++] = "-t";
+        largv[n++] = s_threads;
+    }
+    if (g_cfg.reqs > 0) {
+        largv[n++] = "-n";
+        largv[n++] = s_reqs;
+    }
+    largv[n++] = "127.0.0.1";
+    largv[n++] = (char *) g_cfg.port;
+    largv[n] = NULL;
+    if (pipe2(fd, O_CLOEXEC) == -1) {
+        perror("pipe2");
+        server_stop(spid, &ru);
+        return (-1);
+    }
+    overflows = netstat_get("ListenOverflows");
+    lpid = spawn(largv, fd[1]);
+    (void) close(fd[1]);
+    if (lpid == -1 || (fp = fdopen(fd[0], "r")) == NULL) {
+        (void) close(fd[0]);
+        server_stop(spid, &ru);
+        return (-1);
+    }
+    // 見出しの次の行が結果
+    (void) memset(r, 0, sizeof(*r));
+    got = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "%d,%*d,%d,%d,%*d,%*f,%lu,%lf,%lf,%lf,%lf,%lf,%lf,%lu,%d,%lf,%lf,%lf,%lf,%lf,%lf", &r->conns,
+                   &r->depth, &r->size, &r->requests, &r->rps, &r->p50, &r->p90, &r->p99, &r->p999, &r->max,
+                   &r->errors, &r->reqs, &r->cps, &r->connect_p50, &r->connect_p99, &r->accept_p50, &r->accept_p99,
+                   &r->accept_p999) == 18) {
+            got = 1;
+        }
+    }
+    (void) fclose(fp);
+    (void) waitpid(lpid, &status, 0);
+    r->overflows = overflows == -1 ? -1 : netstat_get("ListenOverflows") - overflows;
+
+    // 切断を処理させてから終了させる(fork、threadの方式では接続ごとの実行単位が終わるのを待つ)
+    sleep_ms(SETTLE_MS);
+    server_stop(spid, &ru);
+    if (!got) {
+        (void) fprintf(stderr, "loadgen failed (status=%d)\n", status);
+        return (-1);
+    }
+    (void) snprintf(r->engine, sizeof(r->engine), "%s", engine);
+    r->utime = (double) ru.ru_utime.tv_sec + (double) ru.ru_utime.tv_usec / 1e6;
+    r->stime = (double) ru.ru_stime.tv_sec + (double) ru.ru_stime.tv_usec / 1e6;
+    r->nvcsw = ru.ru_nvcsw;
+    r->nivcsw = ru.ru_nivcsw;
+    r->maxrss = ru.ru_maxrss;
+    return (0);
+}
+
+/**
+ * リクエストあたりのサーバのCPU時間(us)
+ * CPU時間はウォームアップ中も含むので、その分のリクエスト数を秒間リクエスト数から見積もって足す
+ */
+static double cpu_per_req(const struct row *r)
+{
+    double reqs;
+
+    reqs = (double) r->requests + r->rps * g_cfg.warmup;
+    return (reqs > 0 ? (r->utime + r->stime) * 1e6 / reqs : 0);
+}
+
+/**
+ * 接続あたりのサーバのCPU時間(us) 見積もり方はcpu_per_req()と同じ
+ */
+static double cpu_per_conn(const struct row *r)
+{
+    double conns;
+
+    conns = r->cps * (g_cfg.duration + g_cfg.warmup);
+    return (conns > 0 ? (r->utime + r->stime) * 1e6 / conns : 0);
+}
+
+#define CSV_HEADER "engine,conns,size,depth,requests,rps,p50_us,p90_us,p99_us,p999_us,max_us,errors," \
+    "user_s,sys_s,cpu_us_per_req,nvcsw,nivcsw,maxrss_kb,reqs_per_conn,cps,connect_p50_us,connect_p99_us," \
+    "accept_p50_us,accept_p99_us,accept_p999_us,listen_overflows,cpu_us_per_conn"
+
+static void csv_write(FILE *fp, const struct row *r)
+{
+    (void) fprintf(fp, "%s,%d,%d,%d,%lu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%lu,%.3f,%.3f,%.2f,%ld,%ld,%ld,"
+                   "%d,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%ld,%.2f\n", r->engine, r->conns, r->size, r->depth, r->requests,
+                   r->rps, r->p50, r->p90, r->p99, r->p999, r->max, r->errors, r->utime, r->stime, cpu_per_req(r),
+                   r->nvcsw, r->nivcsw, r->maxrss, r->reqs, r->cps, r->connect_p50, r->connect_p99, r->accept_p50,
+                   r->accept_p99, r->accept_p999, r->overflows, cpu_per_conn(r));
+    (void) fflush(fp);
+}
+
+static void json_write(FILE *fp, const struct row *r, int first)
+{
+    (void) fprintf(fp, "%s  {\"engine\": \"%s\", \"conns\": %d, \"size\": %d, \"depth\": %d, \"requests\": %lu, "
+                   "\"rps\": %.0f, \"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, "
+                   "\"max_us\": %.1f, \"errors\": %lu, \"user_s\": %.3f, \"sys_s\": %.3f, \"cpu_us_per_req\": %.2f, "
+                   "\"nvcsw\": %ld, \"nivcsw\": %ld, \"maxrss_kb\": %ld, \"reqs_per_conn\": %d, \"cps\": %.0f, "
+                   "\"connect_p50_us\": %.1f, \"connect_p99_us\": %.1f, \"accept_p50_us\": %.1f, \"accept_p99_us\": %.1f, "
+                   "\"accept_p999_us\": %.1f, \"listen_overflows\": %ld, \"cpu_us_per_conn\": %.2f}",
+                   first ? "" : ",\n", r->engine, r->conns, r->size, r->depth, r->requests, r->rps, r->p50, r->p90,
+                   r->p99, r->p999, r->max, r->errors, r->utime, r->stime, cpu_per_req(r), r->nvcsw, r->nivcsw,
+                   r->maxrss, r->reqs, r->cps, r->connect_p50, r->connect_p99, r->accept_p50, r->accept_p99,
+                   r->accept_p999, r->overflows, cpu_per_conn(r));
+    (void) fflush(fp);
+}
+
+/**
+ * 以前の結果(このプログラムが書いたCSV)を読む
+ * 戻り値 行数 -1:エラー
+ */
+static int baseline_load(const char *path, struct row *rows)
+{
+    char line[512];
+    struct row *r;
+    FILE *fp;
+    int n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    for (n = 0; n < MAX_ROWS && fgets(line, sizeof(line), fp) != NULL;) {
+        r = &rows[n];
+        if (sscanf(line, "%15[^,],%d,%d,%d,%lu,%lf,%lf,%lf,%lf,%lf,%lf,%lu,%*f,%*f,%*f,%*d,%*d,%*d,%d,%lf", r->engine,
+                   &r->conns, &r->size, &r->depth, &r->requests, &r->rps, &r->p50, &r->p90, &r->p99, &r->p999,
+                   &r->max, &r->errors, &r->reqs, &r->cps) == 14) {
+            n++;
+        }
+    }
+    (void) fclose(fp);
+    return (n);
+}
+
+static const struct row *baseline_find(const struct row *rows, int n, const struct row *r)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcmp(rows[i].engine, r->engine) == 0 && rows[i].conns == r->conns && rows[i].size == r->size
+            && rows[i].depth == r->depth && rows[i].reqs == r->reqs) {
+            return (&rows[i]);
+        }
+    }
+    return (NULL);
+}
+
+static void usage(void)
+{
+    (void) fprintf(stderr, "suite [-e engines] [-c conns] [-s sizes] [-d depths] [-T sec] [-w warmup] [-t threads]\n"
+                   "      [-W workers] [-n reqs] [-p port] [-o output] [-B baseline.csv] [-S server] [-L loadgen]\n"
+                   "  engines, conns, sizes, depths are comma separated lists\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static char engines[] = "select,poll,epoll,fork,thread,prefork,prethread,pipeline";
+    static char conns[] = "10,100,1000";
+    static char sizes[] = "64,1024";
+    static char depths[] = "1,8";
+    static struct row base[MAX_ROWS];
+    char path[1024];
+    struct row r;
+    const struct row *b;
+    FILE *csv, *json;
+    int ch, nbase, ie, ic, is, id, first, failed;
+
+    g_cfg.server = "../ch05/server";
+    g_cfg.loadgen = "./loadgen";
+    g_cfg.port = "15050";
+    g_cfg.output = "results";
+    g_cfg.duration = 5;
+    g_cfg.warmup = 1;
+    (void) parse_list(engines, &g_cfg.engines);
+    (void) parse_list(conns, &g_cfg.conns);
+    (void) parse_list(sizes, &g_cfg.sizes);
+    (void) parse_list(depths, &g_cfg.depths);
+    while ((ch = getopt(argc, argv, "e:c:s:d:T:w:t:W:n:p:o:B:S:L:")) != -1) {
+        switch (ch) {
+        case 'e':
+            if (parse_list(optarg, &g_cfg.engines) == -1) {
+                return (EX_USAGE);
+            }
+            break;
+        case 'c':
+            if (parse_list(optarg, &g_cfg.conns) == -1) {
+                return (EX_USAGE);
+            }
+            break;
+        case 's':
+            if (parse_list(optarg, &g_cfg.sizes) == -1) {
+                return (EX_USAGE);
+            }
+            break;
+        case 'd':
+            if (parse_list(optarg, &g_cfg.depths) == -1) {
+                return (EX_USAGE);
+            }
+            break;
+        case 'T':
+            g_cfg.duration = atoi(optarg);
+            break;
+        case 'w':
+            g_cfg.warmup = atoi(optarg);
+            break;
+        case 't':
+            g_cfg.threads = atoi(optarg);
+            break;
+        case 'W':
+            g_cfg.workers = atoi(optarg);
+            break;
+        case 'n':
+            g_cfg.reqs = atoi(optarg);
+            break;
+        case 'p':
+            g_cfg.port = optarg;
+            break;
+        case 'o':
+            g_cfg.output = optarg;
+            break;
+        case 'B':
+            g_cfg.baseline = optarg;
+            break;
+        case 'S':
+            g_cfg.server = optarg;
+            break;
+        case 'L':
+            g_cfg.loadgen = optarg;
+            break;
+        default:
+            usage();
+            return (EX_USAGE);
+        }
+    }
+    if (optind != argc || g_cfg.duration < 1 || g_cfg.warmup < 0 || g_cfg.reqs < 0) {
+        usage();
+        return (EX_USAGE);
+    }
+    nbase = 0;
+    if (g_cfg.baseline != NULL && (nbase = baseline_load(g_cfg.baseline, base)) == -1) {
+        return (EX_NOINPUT);
+    }
+    (void) snprintf(path, sizeof(path), "%s.csv", g_cfg.output);
+    if ((csv = fopen(path, "w")) == NULL) {
+        perror(path);
+        return (EX_CANTCREAT);
+    }
+    (void) snprintf(path, sizeof(path), "%s.json", g_cfg.output);
+    if ((json = fopen(path, "w")) == NULL) {
+        perror(path);
+        return (EX_CANTCREAT);
+    }
+    (void) signal(SIGPIPE, SIG_IGN);
+    (void) fprintf(csv, "%s\n", CSV_HEADER);
+    (void) fprintf(json, "[\n");
+    (void) printf("%-10s %6s %5s %5s %10s %9s %9s %9s %7s %9s %9s %8s\n", "engine", "conns", "size", "depth", "rps",
+                  "p50(us)", "p99(us)", "p999(us)", "errors", "cpu/req", "ctxsw", "rss(KB)");
+    if (g_cfg.reqs > 0) {
+        (void) printf("%-10s %6s %5s %5s %10s %9s %9s %9s %7s %9s\n", "", "", "", "", "conns/s", "acc50(us)",
+                      "acc99(us)", "acc999(us)", "ovflw", "cpu/conn");
+    }
+
+    first = 1;
+    failed = 0;
+    for (ie = 0; ie < g_cfg.engines.n; ie++) {
+        for (ic = 0; ic < g_cfg.conns.n; ic++) {
+            for (is = 0; is < g_cfg.sizes.n; is++) {
+                for (id = 0; id < g_cfg.depths.n; id++) {
+                    if (run_cell(g_cfg.engines.v[ie], atoi(g_cfg.conns.v[ic]), atoi(g_cfg.sizes.v[is]),
+                                 atoi(g_cfg.depths.v[id]), &r) == -1) {
+                        (void) printf("%-10s %6s %5s %5s failed\n", g_cfg.engines.v[ie], g_cfg.conns.v[ic],
+                                      g_cfg.sizes.v[is], g_cfg.depths.v[id]);
+                        failed++;
+                        continue;
+                    }
+                    csv_write(csv, &r);
+                    json_write(json, &r, first);
+                    first = 0;
+                    (void) printf("%-10s %6d %5d %5d %10.0f %9.1f %9.1f %9.1f %7lu %9.2f %9ld %8ld", r.engine,
+                                  r.conns, r.size, r.depth, r.rps, r.p50, r.p99, r.p999, r.errors, cpu_per_req(&r),
+                                  r.nvcsw + r.nivcsw, r.maxrss);
+                    if ((b = baseline_find(base, nbase, &r)) != NULL && b->rps > 0 && b->p99 > 0) {
+                        (void) printf("  rps %+.1f%% p99 %+.1f%%", (r.rps / b->rps - 1) * 100,
+                                      (r.p99 / b->p99 - 1) * 100);
+                    }
+                    (void) printf("\n");
+                    if (g_cfg.reqs > 0) {
+                        (void) printf("%-10s %6s %5s %5s %10.0f %9.1f %9.1f %9.1f %7ld %9.2f\n", "", "", "", "", r.cps,
+                                      r.accept_p50, r.accept_p99, r.accept_p999, r.overflows, cpu_per_conn(&r));
+                    }
+                    (void) fflush(stdout);
+                }
+            }
+        }
+    }
+    (void) fprintf(json, "\n]\n");
+    (void) fclose(json);
+    (void) fclose(csv);
+    (void) fprintf(stderr, "results: %s.csv %s.json\n", g_cfg.output, g_cfg.output);
+    return (failed > 0 ? EX_TEMPFAIL : EX_OK);
+}
@@ -0,0 +1,212 @@
+/**
+ * タイミングホイール(../common/twheel.h)の計測と検査
+ *
+ * 接続ごとのタイマはリクエストのたびに張り直すので、張り直しの速さがそのままイベントループの負荷になる。
+ * ここでは
+ * - 張り直し: n個のタイマを登録しておき、ランダムな期限(1ms〜IDLEの60秒)で順に張り直す1回あたりの時間
+ * - 登録・取り消し: 登録されていないタイマを登録して取り消す1組あたりの時間
+ * を計測する。期限の乱数は先に作っておき、計測には含めない。
+ *
+ * -c では時刻を進める代わりに仮の時刻を使って、ランダムな張り直し・取り消し・時刻の進み方で
+ * - 期限より前に発火しないこと
+ * - 遅れが(2ティック + 時刻の進み)以内であること
+ *   (期限は張った時のティックの次から数えてティックに切り上げるので最大2ティック、
+ *    発火するのはその後に時刻を進めた時なので、さらに最大で1回の進み分遅れる)
+ * を検査する。違反があれば終了コードを1にする。
+ *
+ * twheelbench [-n timers] [-r rounds] [-c]
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sysexits.h>
+#include <time.h>
+
+#include "../common/twheel.h"
+
+#define TICK_MS (100)
+#define MAX_TIMEOUT_MS (60 * 1000)
+// 検査で1回に進める時刻の最大(ms)
+#define CHECK_STEP_MS (250)
+#define CHECK_STEPS (200000)
+
+struct btimer {
+    struct twheel_timer t;
+    uint64_t deadline; // 検査用 この時刻(ms)より前に発火してはいけない
+};
+
+static uint64_t g_vnow; // 検査の仮の時刻(ms)
+static unsigned long g_fired, g_early, g_late;
+static uint64_t g_max_late;
+
+/**
+ * 乱数 計測の邪魔にならないようにxorshiftで
+ */
+static uint64_t g_rand = 88172645463325252ULL;
+
+static uint64_t xrand(void)
+{
+    g_rand ^= g_rand << 13;
+    g_rand ^= g_rand >> 7;
+    g_rand ^= g_rand << 17;
+    return (g_rand);
+}
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec);
+}
+
+static void bench_fire(struct twheel_timer *t, void *arg)
+{
+    g_fired++;
+}
+
+static void check_fire(struct twheel_timer *t, void *arg)
+{
+    struct btimer *b = arg;
+
+    g_fired++;
+    if (g_vnow < b->deadline) {
+        g_early++;
+    } else if (g_vnow - b->deadline > g_max_late) {
+        g_max_late = g_vnow - b->deadline;
+    }
+    if (g_vnow > b->deadline + 2 * TICK_MS + CHECK_STEP_MS) {
+        g_late++;
+    }
+}
+
+/**
+ * 張り直しと登録・取り消しの計測
+ */
+static void bench(struct btimer *tm, unsigned long n, int rounds)
+{
+    struct twheel w;
+    unsigned long *ms;
+    unsigned long i, k;
+    uint64_t start, ns;
+    int r;
+
+    if ((ms = malloc(sizeof(ms[0]) * n)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        ms[i] = 1 + xrand() % MAX_TIMEOUT_MS;
+    }
+    twheel_init(&w, TICK_MS, 0);
+    for (i = 0; i < n; i++) {
+        twheel_timer_init(&tm[i].t, bench_fire, &tm[i]);
+        twheel_add(&w, &tm[i].t, ms[i]);
+    }
+
+    // 張り直し 期限をずらして別のスロットに移す
+    start = clock_ns();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0, k = (unsigned long) r; i < n; i++, k++) {
+            twheel_add(&w, &tm[i].t, ms[k % n]);
+        }
+    }
+    ns = clock_ns() - start;
+    (void) printf("re-arm:  %lu timers x %d rounds  %.1f ns/op\n", n, rounds, (double) ns / ((double) n * rounds));
+
+    // 登録・取り消し
+    for (i = 0; i < n; i++) {
+        twheel_del(&w, &tm[i].t);
+    }
+    start = clock_ns();
+    for (r = 0; r < rounds; r++) {
+        for (i = 0, k = (unsigned long) r; i < n; i++, k++) {
+            twheel_add(&w, &tm[i].t, ms[k % n]);
+            twheel_del(&w, &tm[i].t);
+        }
+    }
+    ns = clock_ns() - start;
+    (void) printf("add+del: %lu timers x %d rounds  %.1f ns/op\n", n, rounds, (double) ns / ((double) n * rounds));
+    free(ms);
+}
+
+/**
+ * 期限の検査
+ * 時刻を0〜CHECK_STEP_MSずつ進め、そのたびにいくつかのタイマをランダムに張り直すか取り消す
+ * 期限は最後にtwheel_advance()に渡した時刻から数えるので、張り直しは進めた直後に行う
+ * 戻り値 0:OK -1:違反あり
+ */
+static int check(struct btimer *tm, unsigned long n)
+{
+    struct twheel w;
+    unsigned long i, ms;
+    int s, j;
+
+    g_vnow = 1000;
+    twheel_init(&w, TICK_MS, g_vnow);
+    for (i = 0; i < n; i++) {
+        twheel_timer_init(&tm[i].t, check_fire, &tm[i]);
+    }
+    for (s = 0; s < CHECK_STEPS; s++) {
+        g_vnow += xrand() % (CHECK_STEP_MS + 1);
+        (void) twheel_advance(&w, g_vnow);
+        for (j = 0; j < 8; j++) {
+            i = xrand() % n;
+            if (xrand() % 8 == 0) {
+                twheel_del(&w, &tm[i].t);
+                continue;
+            }
+            // 1段目に収まる短いものから4段目まで
+            ms = xrand() % 4 == 0 ? xrand() % (TICK_MS * 4) : xrand() % (MAX_TIMEOUT_MS * 100);
+            twheel_add(&w, &tm[i].t, ms);
+            tm[i].deadline = g_vnow + ms;
+        }
+    }
+    (void) printf("check: %d steps  fired %lu  early %lu  late %lu  max late %lu ms\n",
+        CHECK_STEPS, g_fired, g_early, g_late, (unsigned long) g_max_late);
+    return (g_early > 0 || g_late > 0 ? -1 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct btimer *tm;
+    unsigned long n;
+    int ch, rounds, do_check, ret;
+
+    n = 100000;
+    rounds = 10;
+    do_check = 0;
+    while ((ch = getopt(argc, argv, "n:r:c")) != -1) {
+        switch (ch) {
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        case 'c':
+            do_check = 1;
+            break;
+        default:
+            (void) fprintf(stderr, "twheelbench [-n timers] [-r rounds] [-c]\n");
+            return (EX_USAGE);
+        }
+    }
+    if (n == 0 || rounds <= 0) {
+        (void) fprintf(stderr, "twheelbench [-n timers] [-r rounds] [-c]\n");
+        return (EX_USAGE);
+    }
+    if ((tm = calloc(n, sizeof(tm[0]))) == NULL) {
+        perror("calloc");
+        return (EX_OSERR);
+    }
+    ret = 0;
+    if (do_check) {
+        ret = check(tm, n) == -1 ? 1 : 0;
+    } else {
+        bench(tm, n, rounds);
+    }
+    free(tm);
+    return (ret);
+}
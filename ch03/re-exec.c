@@ -1,7 +1,22 @@
 /**
  * ch01のサーバプログラムの改良版
  * execve()を使って再初期化をできるようにした
+ *
+ * 以前はSIGHUPのハンドラの中でサーバソケットも含めてクローズしてからexecve()していたため、
+ * 再起動の間はポートが閉じ、バックログに溜まっていた接続はリセットされ、通信中のクライアントも切れていた。
+ *
+ * ここではnginxと同じように、サーバソケットを新しいプロセスに引き継いで入れ替える。
+ * 1. SIGHUPを受けたらfork()して子プロセスで自分自身をexecve()する
+ *    サーバソケットはクローズせずに継承させ、その番号を環境変数LISTEN_FDで渡す
+ * 2. 新しいプロセスはsocket()、bind()せずにLISTEN_FDのソケットをそのまま使い、
+ *    準備ができたらREADY_FDのパイプに書き込んで知らせる
+ * 3. 古いプロセスは通知を受けたらサーバソケットをクローズしてaccept()をやめる
+ *    (同じソケットなのでバックログに溜まっている接続は新しいプロセスがaccept()する)
+ * 4. 古いプロセスは通信中のクライアントの処理を最大GRACE_SEC秒まで続けてから終了する
+ * 新しいプロセスが起動に失敗した場合は、古いプロセスがそのまま処理を続ける。
  */
+#define _GNU_SOURCE
+
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -13,43 +28,62 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+
 /**
  * execve()ではオープン中のディスクリプタがクローズされない
- * シグナルハンドラでexecve()する前にstdin stdout stderr以外のディスクリプタを全てクローズする必要がある。
+ * 子プロセスでexecve()する前に、引き継ぐもの以外のstdin stdout stderr以外のディスクリプタを全てクローズする。
  * その最大値をプリプロセッサ命令で定義しておく
  */
 // クローズする最大ディスクリプタ値
 #define MAXFD 64
-// コマンドライン引数、環境変数のアドレス保持用
+// 新しいプロセスの準備完了を待つ秒数
+#ifndef READY_TIMEOUT_SEC
+#define READY_TIMEOUT_SEC 10
+#endif
+// 入れ替え後に古いプロセスが通信中のクライアントを処理し続ける最大秒数
+#ifndef GRACE_SEC
+#define GRACE_SEC 30
+#endif
+// 引き継ぎに使う環境変数
+#define ENV_LISTEN_FD "LISTEN_FD"
+#define ENV_READY_FD "READY_FD"
+
+// コマンドライン引数のアドレス保持用
 int *argc_;
 char ***argv_;
-char ***envp_;
+extern char **environ;
+
+// SIGHUPを受けた
+volatile sig_atomic_t g_gotsighup = 0;
+// サーバソケット 引き継いだ後は-1
+int g_soc = -1;
+// 引き継ぎ後の終了期限 0:引き継いでいない
+time_t g_drain_until = 0;
+// 待ち合わせ中だけ使うシグナルマスク(SIGHUPを受け付ける)
+sigset_t g_waitmask;
 
 /**
  * SIGHUPハンドラ
- * 最初に3から64までのディスクリプタをclose()する
- * このサンプルだとオープンしていないディスクリプタに対してもclose()するが問題ない
+ * フラグを立てるだけにして、引き継ぎは待ち合わせから戻った所で行う
+ * (fork()、execve()、待ち合わせはシグナルハンドラの中でやるべきではない)
+ * SIGHUPは普段はブロックしておき、ppoll()で待っている間だけ受け付ける
+ * (フラグを見てからaccept()、recv()でブロックするまでの間に来たSIGHUPを取りこぼさない)
  */
 void sig_hangup_handler(int sig)
 {
-    int i;
-    (void) fprintf(stderr, "sig_hangup_handler(%d)\n", sig);
-    // stdin stdout stderr以外をクローズ
-    for (i = 3; i < MAXFD; i++) {
-        (void) close(i);
-    }
-
-    // 自プロセスの上書き再実行
-    if (execve((*argv_)[0], (*argv_), (*envp_)) == -1) {
-        perror("execve");
-    }
+    (void) sig;
+    g_gotsighup = 1;
 }
 
 void send_recv_loop(int);
@@ -163,37 +197,219 @@ int server_socket(const char *portnm)
   return (soc);
 }
 
+/**
+ * 新しいプロセスの起動
+ * サーバソケットとパイプの書き込み側だけを残してexecve()する
+ * 戻り値 子プロセスのID -1:エラー
+ */
+pid_t upgrade_spawn(int soc, int pfd[2])
+{
+    char buf[32];
+    pid_t pid;
+    int i;
+
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return (-1);
+    }
+    if (pid != 0) {
+        return (pid);
+    }
+    // 子プロセス シグナルマスクを戻しておく
+    (void) sigprocmask(SIG_SETMASK, &g_waitmask, NULL);
+    (void) snprintf(buf, sizeof(buf), "%d", soc);
+    (void) setenv(ENV_LISTEN_FD, buf, 1);
+    (void) snprintf(buf, sizeof(buf), "%d", pfd[1]);
+    (void) setenv(ENV_READY_FD, buf, 1);
+    // stdin stdout stderrと引き継ぐもの以外をクローズ
+    for (i = 3; i < MAXFD; i++) {
+        if (i != soc && i != pfd[1]) {
+            (void) close(i);
+        }
+    }
+    // 引き継ぐものはexecve()でクローズされないようにする
+    (void) fcntl(soc, F_SETFD, 0);
+    (void) fcntl(pfd[1], F_SETFD, 0);
+    // 自プロセスのプログラムを再実行
+    (void) execve((*argv_)[0], (*argv_), environ);
+    perror("execve");
+    _exit(EX_OSERR);
+}
+
+/**
+ * サーバソケットの引き継ぎ
+ * 新しいプロセスを起動し、READY_FDへの書き込みをREADY_TIMEOUT_SEC秒まで待つ
+ * 準備ができたらサーバソケットをクローズし、GRACE_SEC秒後を終了期限にする
+ * 戻り値 0:引き継いだ -1:失敗(このプロセスが処理を続ける)
+ */
+int upgrade(void)
+{
+    struct pollfd pfd;
+    int pipefd[2], ready, ret;
+    pid_t pid;
+    char c;
+
+    g_gotsighup = 0;
+    if (g_soc == -1) {
+        // 引き継ぎ済み
+        return (-1);
+    }
+    (void) fprintf(stderr, "upgrade: starting %s\n", (*argv_)[0]);
+    if (pipe(pipefd) == -1) {
+        perror("pipe");
+        return (-1);
+    }
+    // 読み込み側は子プロセスに継承させない
+    (void) fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+    if ((pid = upgrade_spawn(g_soc, pipefd)) == -1) {
+        (void) close(pipefd[0]);
+        (void) close(pipefd[1]);
+        return (-1);
+    }
+    // 書き込み側をクローズしておくと、子プロセスが通知せずに終了した場合にEOFになる
+    (void) close(pipefd[1]);
+
+    pfd.fd = pipefd[0];
+    pfd.events = POLLIN;
+    ready = 0;
+    for (;;) {
+        if ((ret = poll(&pfd, 1, READY_TIMEOUT_SEC * 1000)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+        } else if (ret == 0) {
+            (void) fprintf(stderr, "upgrade: pid=%d not ready in %d sec\n", (int) pid, READY_TIMEOUT_SEC);
+        } else if (read(pipefd[0], &c, 1) == 1) {
+            ready = 1;
+        }
+        break;
+    }
+    (void) close(pipefd[0]);
+    g_gotsighup = 0;
+    if (!ready) {
+        // 失敗 起動途中の子プロセスは止めて回収する
+        (void) kill(pid, SIGTERM);
+        (void) waitpid(pid, NULL, 0);
+        (void) fprintf(stderr, "upgrade: failed, keep serving\n");
+        return (-1);
+    }
+
+    // 新しいプロセスが同じソケットでaccept()しているので、こちらはやめる
+    (void) close(g_soc);
+    g_soc = -1;
+    g_drain_until = time(NULL) + GRACE_SEC;
+    (void) fprintf(stderr, "upgrade: pid=%d ready, draining (grace %d sec)\n", (int) pid, GRACE_SEC);
+    return (0);
+}
+
+/**
+ * 引き継がれたサーバソケット
+ * 環境変数LISTEN_FDがあれば、その番号のディスクリプタが待ち受け中のソケットか確認して使う
+ * 戻り値 ソケット -1:引き継いでいない
+ */
+int inherited_socket(void)
+{
+    char *p, *end;
+    long fd;
+    int opt;
+    socklen_t opt_len;
+
+    if ((p = getenv(ENV_LISTEN_FD)) == NULL) {
+        return (-1);
+    }
+    fd = strtol(p, &end, 10);
+    (void) unsetenv(ENV_LISTEN_FD);
+    opt_len = sizeof(opt);
+    if (*p == '\0' || *end != '\0' || fd < 3 || fd >= MAXFD
+        || getsockopt((int) fd, SOL_SOCKET, SO_ACCEPTCONN, &opt, &opt_len) == -1 || !opt) {
+        (void) fprintf(stderr, "%s=%s: not a listening socket\n", ENV_LISTEN_FD, p);
+        return (-1);
+    }
+    (void) fcntl((int) fd, F_SETFD, FD_CLOEXEC);
+    (void) fprintf(stderr, "inherited socket fd=%ld\n", fd);
+    return ((int) fd);
+}
+
+/**
+ * 起動したプロセスへの準備完了の通知
+ * 環境変数READY_FDがあれば1バイト書き込んでクローズする
+ */
+void notify_ready(void)
+{
+    char *p;
+    int fd;
+
+    if ((p = getenv(ENV_READY_FD)) == NULL) {
+        return;
+    }
+    fd = atoi(p);
+    (void) unsetenv(ENV_READY_FD);
+    if (fd < 3 || fd >= MAXFD) {
+        return;
+    }
+    if (write(fd, "R", 1) != 1) {
+        perror("write");
+    }
+    (void) close(fd);
+}
+
+/**
+ * 受信可能になるまで待つ
+ * 待っている間だけSIGHUPを受け付け、SIGHUPを受けた場合は-1(errno=EINTR)を返す
+ * 戻り値 ppoll()と同じ timeout_msが負ならば無期限
+ */
+int wait_readable(int fd, int timeout_ms)
+{
+  struct pollfd pfd;
+  struct timespec ts;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  ts.tv_sec = timeout_ms / 1000;
+  ts.tv_nsec = (long) (timeout_ms % 1000) * 1000000;
+  return (ppoll(&pfd, 1, timeout_ms < 0 ? NULL : &ts, &g_waitmask));
+}
+
 /**
  * アクセプトループ
- * ch01と変わらない
+ * ch01とほぼ同じ
  *
  * accept()を呼び出すと、待ち受け状態から1つの接続を受け付ける。
- * 1つも待ちがない場合この関数はブロックする
+ * 1つも待ちがない場合この関数はブロックする ここではSIGHUPを受けるためにwait_readable()で待つ
+ * SIGHUPを受けた場合は引き継ぎを行い、引き継いだらループを抜ける
  * 
  * 他の処理と多重化したい場合はselect() poll()などを利用する。
  */
-void accept_loop(int soc)
+void accept_loop(void)
 {
   char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
   struct sockaddr_storage from;
   int acc;
   socklen_t len;
 
-  for (;;) {
+  while (g_soc != -1) {
+    if (g_gotsighup) {
+      (void) upgrade();
+      continue;
+    }
+    if (wait_readable(g_soc, -1) == -1) {
+      if (errno != EINTR) {
+        perror("ppoll");
+      }
+      continue;
+    }
     len = (socklen_t) sizeof(from);
-
     // 接続受付
-    if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+    if ((acc = accept(g_soc, (struct sockaddr *) &from, &len)) == -1) {
       if (errno != EINTR) {
         perror("accept");
       }
     } else {
       (void) getnameinfo((struct sockaddr *) &from, len, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
       (void) fprintf(stderr, "accept: %s:%s\n", hbuf, sbuf);
-
       // 送受信ループ
       send_recv_loop(acc);
-
       // アクセプトソケットのクローズ
       (void) close(acc);
       acc = 0;
@@ -201,70 +417,60 @@ void accept_loop(int soc)
   }
 }
 
-/**
- * テスト
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-  const char *ps;
-  char *pd, *pde;
-  size_t dlen, lest;
-
-  for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-  dlen = pd - dst;
-  if (size - dlen == 0) {
-    return (dlen + strlen(src));
-  }
-
-  pde = dst + size - 1;
-  for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-    *pd = *ps;
-  }
-
-  for (; pd <= pde; pd++) {
-    *pd = '\0';
-  }
-
-  while(*ps++);
-  return (dlen + (ps - src - 1));
-}
 /**
  * 送受信ループ
- * ch01と変わらない
+ * ch01とほぼ同じ
  * send() 送信
  * recv() 受信
+ * 受信待ち中にSIGHUPを受けた場合は引き継ぎを行い、このクライアントの処理は続ける
+ * 引き継ぎ後は終了期限までにデータが来なければ打ち切る
  */
 void send_recv_loop(int acc)
 {
-  char buf[512], *ptr;
+  char buf[512];
+  struct iobuf in = IOBUF_INIT(buf);
+  struct resp resp;
+  size_t mlen;
   ssize_t len;
+  time_t left;
+  int ret;
+
   for (;;) {
+    if (g_gotsighup) {
+      (void) upgrade();
+    }
+    left = -1;
+    if (g_drain_until != 0 && (left = g_drain_until - time(NULL)) <= 0) {
+      (void) fprintf(stderr, "drain: grace period expired\n");
+      break;
+    }
+    // 受信待ち
+    if ((ret = wait_readable(acc, left < 0 ? -1 : (int) left * 1000)) <= 0) {
+      if (ret == -1 && errno != EINTR) {
+        perror("ppoll");
+        break;
+      }
+      continue;
+    }
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = iobuf_recv(acc, &in, 0)) == -1) {
       // エラー
       perror("recv");
       break;
     }
-
     if (len == 0) {
       // end of file
       (void) fprintf(stderr, "recv:EOF\n");
       break;
     }
-
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-      *ptr = '\0';
-    }
-    (void) fprintf(stderr, "[client]%s\n", buf);
-
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
-
+    // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+    mlen = msg_line_len(in.data, in.len);
+    (void) fprintf(stderr, "[client]%.*s\n", (int) mlen, in.data);
+    // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+    resp_init(&resp);
+    (void) resp_add_ok(&resp, in.data, mlen);
     // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+    if ((len = resp_send(acc, &resp, MSG_NOSIGNAL)) == -1) {
       // エラー
       perror("send");
       break;
@@ -274,44 +480,49 @@ void send_recv_loop(int acc)
 
 /**
  * main
- * ch01とほぼ同じだが、コマンドライン引数、環境変数をグローバル変数のポインタに保持させ、
+ * ch01とほぼ同じだが、コマンドライン引数をグローバル変数のポインタに保持させ、
  * SIGHUPのハンドラをsigaction()で指定する
+ * 環境変数LISTEN_FDがあれば、サーバソケットは作らずに引き継いだものを使う
  */
-int main(int argc, char *argv[], char *envp[])
+int main(int argc, char *argv[])
 {
   struct sigaction sa;
+  sigset_t set;
 
-  int soc;
   // 引数にポート番号が指定されているか
   if (argc <= 1) {
     (void) fprintf(stderr, "server port\n");
     return (EX_USAGE);
   }
 
-  /** コマンドライン引数、環境変数のアドレスをグローバルに保持 */
+  /** コマンドライン引数のアドレスをグローバルに保持 */
   argc_ = &argc;
   argv_ = &argv;
-  envp_ = &envp;
 
-  /** SIGHUPのシグナルハンドラを指定 */
+  /** SIGHUPのシグナルハンドラを指定 普段はブロックし、待ち合わせ中だけ受け付ける */
   (void) sigaction(SIGHUP, (struct sigaction *) NULL, &sa);
   sa.sa_handler = sig_hangup_handler;
-  sa.sa_flags = SA_NODEFER;
+  (void) sigemptyset(&sa.sa_mask);
+  sa.sa_flags = 0;
   (void) sigaction(SIGHUP, &sa, (struct sigaction *) NULL);
+  (void) sigemptyset(&set);
+  (void) sigaddset(&set, SIGHUP);
+  (void) sigprocmask(SIG_BLOCK, &set, &g_waitmask);
+  (void) sigdelset(&g_waitmask, SIGHUP);
   (void) fprintf(stderr, "sigaction():end\n");
 
-  // サーバソケットの準備
-  if ((soc = server_socket(argv[1])) == -1) {
+  // サーバソケットの準備 引き継いだものがあればそれを使う
+  if ((g_soc = inherited_socket()) == -1 && (g_soc = server_socket(argv[1])) == -1) {
     (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
     return (EX_UNAVAILABLE);
   }
-
   (void) fprintf(stderr, "ready for accept\n");
-  // アクセプトループ
-  accept_loop(soc);
+  // 起動元のプロセスに準備ができたことを知らせる
+  notify_ready();
+
+  // アクセプトループ 引き継いだら抜ける
+  accept_loop();
 
-  (void) fprintf(stderr, "closing the socket\n");
-  // ソケットクローズ
-  (void) close(soc);
+  (void) fprintf(stderr, "exit pid=%d\n", (int) getpid());
   return (EX_OK);
 }
\ No newline at end of file
@@ -20,6 +20,8 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+
 void send_recv_loop(int);
 
 /**
@@ -126,33 +128,6 @@ void accept_loop(int soc)
   }
 }
 
-/**
- * テスト
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-  const char *ps;
-  char *pd, *pde;
-  size_t dlen, lest;
-
-  for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-  dlen = pd - dst;
-  if (size - dlen == 0) {
-    return (dlen + strlen(src));
-  }
-
-  pde = dst + size - 1;
-  for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-    *pd = *ps;
-  }
-
-  for (; pd <= pde; pd++) {
-    *pd = '\0';
-  }
-
-  while(*ps++);
-  return (dlen + (ps - src - 1));
-}
 /**
  * 送受信ループ
  * send() 送信
@@ -160,11 +135,14 @@ size_t mystrlcat(char *dst, const char *src, size_t size)
  */
 void send_recv_loop(int acc)
 {
-  char buf[512], *ptr;
+  char buf[512];
+  struct iobuf in = IOBUF_INIT(buf);
+  struct resp resp;
+  size_t mlen;
   ssize_t len;
   for (;;) {
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = iobuf_recv(acc, &in, 0)) == -1) {
       // エラー
       perror("recv");
       break;
@@ -176,19 +154,16 @@ void send_recv_loop(int acc)
       break;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-      *ptr = '\0';
-    }
-    (void) fprintf(stderr, "[client]%s\n", buf);
+    // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+    mlen = msg_line_len(in.data, in.len);
+    (void) fprintf(stderr, "[client]%.*s\n", (int) mlen, in.data);
 
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
+    // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+    resp_init(&resp);
+    (void) resp_add_ok(&resp, in.data, mlen);
 
     // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+    if ((len = resp_send(acc, &resp, 0)) == -1) {
       // エラー
       perror("send");
       break;
@@ -0,0 +1,799 @@
+/**
+ * ch05
+ * 方式を実行時に切り替えられるサーバ
+ *
+ * server2.cからserver9.cまでは多重化の方式ごとに別のプログラムになっていて、
+ * server_socket()や送受信の処理をそれぞれコピーして持ち、少しずつ違う不具合を抱えていた。
+ * また-gだけで最適化無しでビルドしているため、方式同士の性能を比べる意味が無かった。
+ *
+ * ここでは1つのプログラムで方式を--engineで選べるようにし、
+ * 接続ごとの処理(../common/conn.h)とサーバソケットの準備(../common/sock.h)は全ての方式で共通にする。
+ * 方式ごとに違うのは「どうやってreadyを待ち、どの実行単位でconn_handle()を呼ぶか」だけになる。
+ *
+ *   select    select() 1スレッド (server2.c)
+ *   poll      poll() 1スレッド (server3.c)
+ *   epoll     epoll 1スレッド (server4.c)
+ *   fork      1接続1プロセス (server5.c)
+ *   thread    1接続1スレッド (server6.c)
+ *   prefork   workers個のプロセスがそれぞれaccept() (server7.c)
+ *   prethread workers個のスレッドがそれぞれ自分のepollを持つ (server8.c)
+ *   pipeline  アクセプトするスレッドと、workers個の送受信するスレッド(epoll)に分ける (server9.c)
+ *
+ * pipelineについて: server9.cは受信と送信を別スレッドに分けていたが、
+ * 接続ごとの送信待ち(outq)を2つのスレッドで触るとロックが必要になり、共通の処理にできない。
+ * ここでは段の分け方をアクセプトと送受信にして、アクセプトしたディスクリプタをパイプで送受信のスレッドに渡す。
+ *
+ * 統計(アクセプト数、接続数、処理した行数)はREPORT_SEC秒ごとに表示する。
+ * サーバ内部のレイテンシ(../common/lat.h アクセプトから最初の受信、受信から応答、pipelineのキューの待ち)は
+ * SIGUSR1で標準エラー出力に表示し、--lat-fileを指定した場合は--lat-interval秒ごとにファイルに追記する。
+ */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "../common/conn.h"
+#include "../common/conntab.h"
+#include "../common/lat.h"
+#include "../common/log.h"
+#include "../common/sock.h"
+
+/**
+ * MAX_EVENTS: 1回のepoll_wait()で受け取るイベント数
+ * ACCEPT_BATCH: 1回readyになった時にaccept()する上限
+ * THREAD_STACK: 1接続1スレッドのスレッドのスタックサイズ
+ * REPORT_SEC: 統計を表示する間隔 0ならば表示しない
+ */
+#define MAX_EVENTS (256)
+#define ACCEPT_BATCH (16)
+#define THREAD_STACK (256 * 1024)
+#ifndef REPORT_SEC
+#define REPORT_SEC (10)
+#endif
+// epollのループのタイミングホイールの1ティック
+#define TIMER_TICK_MS (100)
+
+struct engine {
+    const char *name;
+    int (*run)(int soc, int workers);
+    int shared; // fork()するので統計を共有メモリに置く
+    const char *desc;
+};
+
+/**
+ * epollのループ(epoll、prethread、pipeline)
+ * soc、inboxのどちらか一方から接続を受け取る
+ */
+struct loop {
+    int no;
+    int soc; // サーバソケット -1:使わない
+    int inbox[2]; // アクセプトしたディスクリプタを受け取るパイプ -1:使わない
+    int epfd;
+    pthread_t thread_id;
+    struct twheel wheel; // 接続ごとのタイムアウト このループだけが触る
+};
+
+/**
+ * アクセプトしたディスクリプタとその時刻
+ * pipelineのパイプ、threadのスレッドの引数で渡す
+ */
+struct accepted {
+    int fd;
+    uint64_t at; // lat_clock()
+};
+
+/**
+ * アクセプト
+ * nonblockが真ならばアクセプトソケットをノンブロッキングにする
+ * 戻り値 アクセプトソケット -1:無し(ノンブロッキングのサーバソケットのEAGAINも含む)
+ */
+static int do_accept(int soc, int nonblock)
+{
+    struct sockaddr_storage from;
+    socklen_t len;
+    int acc;
+
+    len = (socklen_t) sizeof(from);
+    if ((acc = accept4(soc, (struct sockaddr *) &from, &len, SOCK_CLOEXEC | (nonblock ? SOCK_NONBLOCK : 0))) == -1) {
+        if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+            perror("accept");
+        }
+        return (-1);
+    }
+    LOGDEBUG("accept:%P", &from);
+    return (acc);
+}
+
+/**
+ * select() 1スレッド
+ * 監視中のディスクリプタはconntabで持ち、監視するイベントが変わった時だけマスクを更新する
+ */
+static int engine_select(int soc, int workers)
+{
+    struct conntab tbl;
+    struct conn *c;
+    fd_set rall, wall, rmask, wmask;
+    int acc, fd, i, n, nready;
+    short events, revents;
+
+    (void) workers;
+    if (sock_nonblock(soc) == -1 || conntab_init(&tbl, 64) == -1) {
+        perror("engine_select");
+        return (-1);
+    }
+    FD_ZERO(&rall);
+    FD_ZERO(&wall);
+    (void) conntab_add(&tbl, soc, POLLIN);
+    FD_SET(soc, &rall);
+    for (;;) {
+        rmask = rall;
+        wmask = wall;
+        if ((nready = select(conntab_maxfd(&tbl) + 1, &rmask, &wmask, NULL, NULL)) == -1) {
+            if (errno != EINTR) {
+                perror("select");
+            }
+            continue;
+        }
+        if (FD_ISSET(soc, &rmask)) {
+            nready--;
+            for (n = 0; n < ACCEPT_BATCH && (acc = do_accept(soc, 1)) != -1; n++) {
+                if (acc >= FD_SETSIZE || (c = conn_new(acc, lat_clock())) == NULL) {
+                    LOGWARN("cannot accept fd=%d", acc);
+                    (void) close(acc);
+                } else if (conntab_add(&tbl, acc, POLLIN) == -1) {
+                    LOGWARN("cannot accept fd=%d", acc);
+                    conn_close(c);
+                } else {
+                    conntab_set_data(&tbl, acc, c);
+                    c->events = POLLIN;
+                    FD_SET(acc, &rall);
+                }
+            }
+        }
+        // 削除すると末尾がその位置に入ってくるので、その場合は添字を進めない
+        for (i = 0; nready > 0 && i < tbl.count;) {
+            fd = tbl.pfd[i].fd;
+            revents = (short) ((FD_ISSET(fd, &rmask) ? POLLIN : 0) | (FD_ISSET(fd, &wmask) ? POLLOUT : 0));
+            if (fd == soc || revents == 0) {
+                i++;
+                continue;
+            }
+            nready -= ((revents & POLLIN) != 0) + ((revents & POLLOUT) != 0);
+            c = conntab_data(&tbl, fd);
+            if ((events = conn_handle(c, revents)) == 0) {
+                FD_CLR(fd, &rall);
+                FD_CLR(fd, &wall);
+                (void) conntab_del(&tbl, fd);
+                conn_close(c);
+                continue;
+            }
+            if (events != c->events) {
+                if (events & POLLIN) {
+                    FD_SET(fd, &rall);
+                } else {
+                    FD_CLR(fd, &rall);
+                }
+                if (events & POLLOUT) {
+                    FD_SET(fd, &wall);
+                } else {
+                    FD_CLR(fd, &wall);
+                }
+                c->events = events;
+            }
+            i++;
+        }
+    }
+    // NOT REACHED
+    return (0);
+}
+
+/**
+ * poll() 1スレッド
+ * conntabのpollfdの配列をそのままpoll()に渡す
+ */
+static int engine_poll(int soc, int workers)
+{
+    struct conntab tbl;
+    struct conn *c;
+    int acc, accepting, fd, i, n, nready;
+    short events, revents;
+
+    (void) workers;
+    accepting = 0;
+    if (sock_nonblock(soc) == -1 || conntab_init(&tbl, 64) == -1) {
+        perror("engine_poll");
+        return (-1);
+    }
+    (void) conntab_add(&tbl, soc, POLLIN);
+    for (;;) {
+        if ((nready = poll(tbl.pfd, (nfds_t) tbl.count, -1)) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        // 追加するとpfdが再確保されることがあるので、走査の後でアクセプトする
+        for (i = 0; nready > 0 && i < tbl.count;) {
+            fd = tbl.pfd[i].fd;
+            if ((revents = tbl.pfd[i].revents) == 0) {
+                i++;
+                continue;
+            }
+            nready--;
+            if (fd == soc) {
+                accepting = 1;
+                i++;
+                continue;
+            }
+            c = conntab_data(&tbl, fd);
+            if ((events = conn_handle(c, revents)) == 0) {
+                (void) conntab_del(&tbl, fd);
+                conn_close(c);
+                continue;
+            }
+            if (events != c->events) {
+                conntab_set_events(&tbl, fd, events);
+                c->events = events;
+            }
+            i++;
+        }
+        if (accepting) {
+            accepting = 0;
+            for (n = 0; n < ACCEPT_BATCH && (acc = do_accept(soc, 1)) != -1; n++) {
+                if ((c = conn_new(acc, lat_clock())) == NULL) {
+                    LOGWARN("cannot accept fd=%d", acc);
+                    (void) close(acc);
+                } else if (conntab_add(&tbl, acc, POLLIN) == -1) {
+                    LOGWARN("cannot accept fd=%d", acc);
+                    conn_close(c);
+                } else {
+                    conntab_set_data(&tbl, acc, c);
+                    c->events = POLLIN;
+                }
+            }
+        }
+    }
+    // NOT REACHED
+    return (0);
+}
+
+/**
+ * epollのループの準備
+ * exclusive: サーバソケットをEPOLLEXCLUSIVEで登録する(複数のループで同じソケットを待つ場合)
+ * pipe_in: サーバソケットの代わりにパイプからディスクリプタを受け取る
+ */
+static int loop_init(struct loop *lp, int no, int soc, int exclusive, int pipe_in)
+{
+    struct epoll_event ev;
+
+    lp->no = no;
+    lp->soc = pipe_in ? -1 : soc;
+    lp->inbox[0] = lp->inbox[1] = -1;
+    twheel_init(&lp->wheel, TIMER_TICK_MS, twheel_clock_ms());
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+    if (pipe_in && (pipe2(lp->inbox, O_CLOEXEC) == -1 || sock_nonblock(lp->inbox[0]) == -1)) {
+        perror("pipe2");
+        return (-1);
+    }
+    // 接続を受け取る側はdata.ptrをNULLにして区別する
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0);
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, pipe_in ? lp->inbox[0] : lp->soc, &ev) == -1) {
+        perror("epoll_ctl");
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * 接続をループに登録する
+ */
+static void loop_add(struct loop *lp, int acc, uint64_t accepted)
+{
+    struct epoll_event ev;
+    struct conn *c;
+
+    if ((c = conn_new(acc, accepted)) == NULL) {
+        LOGWARN("<%d>cannot accept fd=%d", lp->no, acc);
+        (void) close(acc);
+        return;
+    }
+    c->events = POLLIN;
+    ev.data.ptr = c;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+        perror("epoll_ctl");
+        conn_close(c);
+        return;
+    }
+    conn_arm(c, &lp->wheel);
+}
+
+/**
+ * 新しい接続の受け取り
+ * サーバソケットからはACCEPT_BATCH個までaccept()し、パイプからは溜まっている分を全て読む
+ * パイプで受け取った場合はアクセプトしてからここまでの時間をキューの待ちとして記録する
+ */
+static void loop_incoming(struct loop *lp)
+{
+    struct accepted in[ACCEPT_BATCH];
+    ssize_t len;
+    uint64_t now;
+    int acc, i, n;
+
+    if (lp->soc != -1) {
+        for (n = 0; n < ACCEPT_BATCH && (acc = do_accept(lp->soc, 1)) != -1; n++) {
+            loop_add(lp, acc, lat_clock());
+        }
+        return;
+    }
+    // struct accepted単位で書かれる(PIPE_BUF以下の書き込みは分割されない)
+    while ((len = read(lp->inbox[0], in, sizeof(in))) > 0) {
+        now = lat_clock();
+        for (i = 0; i < (int) (len / (ssize_t) sizeof(in[0])); i++) {
+            lat_record(LAT_QUEUE, in[i].at, now);
+            loop_add(lp, in[i].fd, in[i].at);
+        }
+    }
+}
+
+/**
+ * epollのループ
+ * POLLIN、POLLOUTとEPOLLIN、EPOLLOUTは同じ値なので、eventsをそのままconn_handle()に渡す
+ * 監視するイベントが変わった時だけEPOLL_CTL_MODする
+ * (クローズすればepollからは自動的に外れる)
+ * epoll_wait()は次のタイムアウトの期限まで待ち、起きたらホイールを進める
+ */
+static void *loop_thread(void *arg)
+{
+    struct loop *lp = arg;
+    struct epoll_event events[MAX_EVENTS], ev;
+    struct conn *c;
+    int i, nready;
+    short want;
+
+    for (;;) {
+        nready = epoll_wait(lp->epfd, events, MAX_EVENTS, twheel_next_timeout(&lp->wheel, twheel_clock_ms(), -1));
+        // 期限の来た接続はshutdown()される クローズはこの後のイベントで行う
+        (void) twheel_advance(&lp->wheel, twheel_clock_ms());
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nready; i++) {
+            if ((c = events[i].data.ptr) == NULL) {
+                loop_incoming(lp);
+                continue;
+            }
+            if ((want = conn_handle(c, (short) events[i].events)) == 0) {
+                conn_close(c);
+                continue;
+            }
+            if (want != c->events) {
+                ev.data.ptr = c;
+                ev.events = (uint32_t) want;
+                (void) epoll_ctl(lp->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->events = want;
+            }
+            conn_arm(c, &lp->wheel);
+        }
+    }
+    // NOT REACHED
+    return (NULL);
+}
+
+/**
+ * epoll 1スレッド
+ */
+static int engine_epoll(int soc, int workers)
+{
+    struct loop lp;
+
+    (void) workers;
+    if (sock_nonblock(soc) == -1 || loop_init(&lp, 0, soc, 0, 0) == -1) {
+        return (-1);
+    }
+    (void) loop_thread(&lp);
+    return (0);
+}
+
+/**
+ * workers個のループを作ってスレッドを起動する
+ */
+static struct loop *loops_start(int soc, int workers, int exclusive, int pipe_in)
+{
+    struct loop *lps;
+    int i;
+
+    if ((lps = calloc((size_t) workers, sizeof(*lps))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    for (i = 0; i < workers; i++) {
+        if (loop_init(&lps[i], i, soc, exclusive, pipe_in) == -1) {
+            return (NULL);
+        }
+        if ((errno = pthread_create(&lps[i].thread_id, NULL, loop_thread, &lps[i])) != 0) {
+            perror("pthread_create");
+            return (NULL);
+        }
+    }
+    return (lps);
+}
+
+/**
+ * workers個のスレッドがそれぞれ自分のepollで同じサーバソケットを待つ
+ * EPOLLEXCLUSIVEで1つの接続に対して起こされるのは1つのスレッドだけにする
+ */
+static int engine_prethread(int soc, int workers)
+{
+    struct loop *lps;
+
+    if (sock_nonblock(soc) == -1 || (lps = loops_start(soc, workers, 1, 0)) == NULL) {
+        return (-1);
+    }
+    (void) pthread_join(lps[0].thread_id, NULL);
+    return (0);
+}
+
+/**
+ * このスレッドはブロッキングでaccept()だけを行い、workers個のループに順番にパイプで渡す
+ */
+static int engine_pipeline(int soc, int workers)
+{
+    struct loop *lps;
+    struct accepted out;
+    int next;
+
+    if ((lps = loops_start(soc, workers, 0, 1)) == NULL) {
+        return (-1);
+    }
+    for (next = 0;;) {
+        if ((out.fd = do_accept(soc, 1)) == -1) {
+            continue;
+        }
+        out.at = lat_clock();
+        if (write(lps[next].inbox[1], &out, sizeof(out)) != (ssize_t) sizeof(out)) {
+            perror("write");
+            (void) close(out.fd);
+        }
+        next = (next + 1) % workers;
+    }
+    // NOT REACHED
+    return (0);
+}
+
+/**
+ * 終了した子プロセスを回収する
+ */
+static void sig_chld_handler(int sig)
+{
+    int saved;
+
+    (void) sig;
+    saved = errno;
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    errno = saved;
+}
+
+/**
+ * 1接続1プロセス
+ * 子プロセスはSIGCHLDのハンドラで回収する
+ * (SA_NOCLDWAITで自動的に回収させると、子プロセスのCPU時間が親のRUSAGE_CHILDRENに入らず、
+ *  ../bench/suite.cがwait4()で取るサーバのCPU時間に表れない)
+ */
+static int engine_fork(int soc, int workers)
+{
+    struct sigaction sa;
+    uint64_t at;
+    pid_t pid;
+    int acc;
+
+    (void) workers;
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_chld_handler;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    (void) sigaction(SIGCHLD, &sa, NULL);
+    for (;;) {
+        if ((acc = do_accept(soc, 0)) == -1) {
+            continue;
+        }
+        at = lat_clock();
+        if ((pid = fork()) == 0) {
+            // 子プロセス
+            (void) close(soc);
+            conn_serve(acc, at);
+            lat_release();
+            exit(EX_OK);
+        }
+        if (pid == -1) {
+            perror("fork");
+        }
+        (void) close(acc);
+    }
+    // NOT REACHED
+    return (0);
+}
+
+static void *conn_thread(void *arg)
+{
+    struct accepted a = *(struct accepted *) arg;
+
+    free(arg);
+    conn_serve(a.fd, a.at);
+    lat_release();
+    return (NULL);
+}
+
+/**
+ * 1接続1スレッド
+ * スタックはTHREAD_STACKにしておく(デフォルトの8MBでは接続数だけ仮想メモリを使う)
+ */
+static int engine_thread(int soc, int workers)
+{
+    pthread_attr_t attr;
+    pthread_t id;
+    struct accepted *a;
+    int acc;
+
+    (void) workers;
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    (void) pthread_attr_setstacksize(&attr, THREAD_STACK);
+    for (;;) {
+        if ((acc = do_accept(soc, 0)) == -1) {
+            continue;
+        }
+        if ((a = malloc(sizeof(*a))) == NULL) {
+            perror("malloc");
+            (void) close(acc);
+            continue;
+        }
+        a->fd = acc;
+        a->at = lat_clock();
+        if ((errno = pthread_create(&id, &attr, conn_thread, a)) != 0) {
+            perror("pthread_create");
+            free(a);
+            (void) close(acc);
+        }
+    }
+    // NOT REACHED
+    return (0);
+}
+
+/**
+ * preforkの子プロセスの起動
+ * 子プロセスはブロッキングでaccept()して1接続ずつ処理する
+ */
+static pid_t prefork_spawn(int soc)
+{
+    pid_t pid;
+    int acc;
+
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return (-1);
+    }
+    if (pid == 0) {
+        (void) signal(SIGTERM, SIG_DFL);
+        (void) signal(SIGINT, SIG_DFL);
+        for (;;) {
+            if ((acc = do_accept(soc, 0)) != -1) {
+                conn_serve(acc, lat_clock());
+            }
+        }
+    }
+    return (pid);
+}
+
+// preforkの親プロセスへの終了の指示
+static volatile sig_atomic_t g_terminate;
+
+static void sig_term_handler(int sig)
+{
+    (void) sig;
+    g_terminate = 1;
+}
+
+/**
+ * workers個の子プロセスがそれぞれブロッキングでaccept()する
+ * 1つの子プロセスは1接続ずつ処理するので、同時に処理できるのはworkers個の接続まで
+ * 親プロセスは子プロセスが終了したら作り直す
+ * SIGTERM、SIGINTでは子プロセスを終了させて回収してから終了する(子プロセスのCPU時間を親に集計させる)
+ */
+static int engine_prefork(int soc, int workers)
+{
+    struct sigaction sa;
+    pid_t pid, *pids;
+    int i, status;
+
+    if ((pids = calloc((size_t) workers, sizeof(*pids))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    // wait()を中断させるのでSA_RESTARTは付けない
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_term_handler;
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGINT, &sa, NULL);
+    for (i = 0; i < workers; i++) {
+        if ((pids[i] = prefork_spawn(soc)) == -1) {
+            return (-1);
+        }
+    }
+    while (!g_terminate) {
+        if ((pid = wait(&status)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("wait");
+            return (-1);
+        }
+        LOGWARN("child pid=%d exited status=%d, restarting", (int) pid, status);
+        // 子プロセスはlat_release()せずに終わるので、スロットを累計に回収する
+        lat_reap(pid);
+        for (i = 0; i < workers && pids[i] != pid; i++);
+        if (i < workers && (pids[i] = prefork_spawn(soc)) == -1) {
+            return (-1);
+        }
+    }
+    for (i = 0; i < workers; i++) {
+        (void) kill(pids[i], SIGTERM);
+    }
+    for (i = 0; i < workers; i++) {
+        (void) waitpid(pids[i], NULL, 0);
+    }
+    free(pids);
+    return (0);
+}
+
+static const struct engine g_engines[] = {
+    { "select", engine_select, 0, "select() 1 thread" },
+    { "poll", engine_poll, 0, "poll() 1 thread" },
+    { "epoll", engine_epoll, 0, "epoll 1 thread" },
+    { "fork", engine_fork, 1, "1 process per connection" },
+    { "thread", engine_thread, 0, "1 thread per connection" },
+    { "prefork", engine_prefork, 1, "workers processes blocking in accept()" },
+    { "prethread", engine_prethread, 0, "workers threads, each with its own epoll" },
+    { "pipeline", engine_pipeline, 0, "1 accept thread + workers epoll threads" },
+};
+
+/**
+ * 統計の表示
+ * fork()する方式でも共有メモリの統計を読むので、親プロセスのこのスレッドだけで表示できる
+ */
+static void *report_thread(void *arg)
+{
+    struct conn_stat st, prev;
+
+    (void) arg;
+    (void) memset(&prev, 0, sizeof(prev));
+    for (;;) {
+        (void) sleep(REPORT_SEC);
+        conn_stat_get(&st);
+        LOGINFO("<<accepted:%lu active:%lu msgs:%lu (%lu/s)>>", st.accepted, st.accepted - st.closed,
+                st.msgs, (st.msgs - prev.msgs) / REPORT_SEC);
+        prev = st;
+    }
+    // NOT REACHED
+    return (NULL);
+}
+
+static void usage(void)
+{
+    size_t i;
+
+    (void) fprintf(stderr, "server [--engine=name] [--workers=n] [--lat-file=path [--lat-interval=sec]] port\n");
+    for (i = 0; i < sizeof(g_engines) / sizeof(g_engines[0]); i++) {
+        (void) fprintf(stderr, "  %-10s %s\n", g_engines[i].name, g_engines[i].desc);
+    }
+}
+
+/**
+ * main
+ * 方式を選び、サーバソケットを作ってその方式のループに入る
+ * workersの省略時はCPU数
+ */
+int main(int argc, char *argv[])
+{
+    static const struct option opts[] = {
+        { "engine", required_argument, NULL, 'e' },
+        { "workers", required_argument, NULL, 'w' },
+        { "lat-file", required_argument, NULL, 'l' },
+        { "lat-interval", required_argument, NULL, 'i' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    const struct engine *eng;
+    const char *name, *lat_file;
+    pthread_t id;
+    size_t i;
+    int ch, soc, workers, lat_interval;
+
+    name = "epoll";
+    workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    lat_file = NULL;
+    lat_interval = 10;
+    while ((ch = getopt_long(argc, argv, "e:w:l:i:h", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'e':
+            name = optarg;
+            break;
+        case 'w':
+            workers = atoi(optarg);
+            break;
+        case 'l':
+            lat_file = optarg;
+            break;
+        case 'i':
+            lat_interval = atoi(optarg);
+            break;
+        default:
+            usage();
+            return (EX_USAGE);
+        }
+    }
+    if (optind >= argc) {
+        usage();
+        return (EX_USAGE);
+    }
+    for (eng = NULL, i = 0; i < sizeof(g_engines) / sizeof(g_engines[0]); i++) {
+        if (strcmp(g_engines[i].name, name) == 0) {
+            eng = &g_engines[i];
+        }
+    }
+    if (eng == NULL) {
+        (void) fprintf(stderr, "unknown engine: %s\n", name);
+        usage();
+        return (EX_USAGE);
+    }
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    (void) signal(SIGPIPE, SIG_IGN);
+    if (conn_stat_init(eng->shared) == -1) {
+        perror("conn_stat_init");
+        return (EX_OSERR);
+    }
+    // 方式のスレッドやプロセスを作る前にSIGUSR1をブロックさせる
+    if (lat_init() == -1 || lat_start(lat_file, lat_interval) == -1) {
+        perror("lat_start");
+        return (EX_OSERR);
+    }
+    // サーバソケットの準備
+    if ((soc = server_socket(argv[optind])) == -1) {
+        (void) fprintf(stderr, "server_socket(%s):error\n", argv[optind]);
+        return (EX_UNAVAILABLE);
+    }
+    if (REPORT_SEC > 0 && (errno = pthread_create(&id, NULL, report_thread, NULL)) != 0) {
+        perror("pthread_create");
+    }
+    (void) fprintf(stderr, "ready for accept engine=%s workers=%d\n", eng->name, workers);
+    if (eng->run(soc, workers) == -1) {
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+    (void) close(soc);
+    return (EX_OK);
+}
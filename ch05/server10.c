@@ -0,0 +1,717 @@
+/**
+ * ch05
+ * マルチリアクタ: SO_REUSEPORTでワーカーごとにサーバソケットを持つ
+ * 
+ * server8.cのプリスレッド型ではaccept()をg_lockで排他しながら行い、
+ * アクセプトしたスレッドはそのクライアントとの送受信が終わるまでsend_recv_loop()から戻らない。
+ * スレッド数以上のクライアントは同時に処理できず、ロックの取り合いも発生する。
+ * 
+ * ここではワーカースレッドごとに
+ * - SO_REUSEPORTを指定したサーバソケット
+ * - EPOLLのディスクリプタ(server4.cのエッジトリガ版と同じイベントループ)
+ * - 接続テーブル
+ * を持たせ、それぞれを1つのCPUに固定する。
+ * 
+ * 接続要求はカーネルがソケットごとのバックログに振り分けるので、ワーカー間で共有するデータやロックは無い。
+ * ワーカー数は指定が無ければプロセスのCPUアフィニティマスクに含まれるCPU数とする。
+ */
+#define _GNU_SOURCE // accept4(), pthread_setaffinity_np()のため
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include "../common/log.h"
+#include "../common/twheel.h"
+
+/**
+ * ワーカー
+ * 
+ * accepted, countは状態表示のためメインスレッドからも読むので__atomic組み込み関数で読み書きする
+ */
+struct worker {
+    int no;
+    int cpu; // 固定するCPU番号
+    int soc; // このワーカー専用のサーバソケット
+    pthread_t thread_id;
+    unsigned long accepted;
+    int count;
+};
+
+/**
+ * 接続受付準備
+ * 
+ * server4.cと同じだが、SO_REUSEPORTを追加している。
+ * ワーカーの数だけ呼び出して、同じポートにbind()したサーバソケットを作る。
+ */
+int server_socket(const char *portnm)
+{
+  char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+  struct addrinfo hints, *res0;
+  int soc, opt, errcode;
+  socklen_t opt_len;
+
+  // アドレス情報のヒントをゼロクリア
+  (void) memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET; // IP
+  hints.ai_socktype = SOCK_STREAM; // TCP
+  hints.ai_flags = AI_PASSIVE; // サーバソケット
+
+  /**
+   * アドレス情報の決定
+   * 
+   * getaddrinfoはアドレス情報を決定するためのヒントを与えることでsockaddr型構造体を得ることができる。
+   * ヒントとなる情報を格納した不完全なaddrinfo構造体を与えると、必要なメンバが全てそろったaddrinfo型構造体を返す。
+   * 
+   * 第4引数に、決定されたアドレス情報を格納したaddrinfo構造体のポインタを渡す。
+   * getaddrinfoを呼んだ時点でアロケートされるため利用後はfreeaddrinfo()で解放する
+   */
+  if ((errcode = getaddrinfo(NULL, portnm, &hints, &res0)) != 0) {
+    (void) fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(errcode));
+    return -1;
+  }
+
+  if ((errcode = getnameinfo(res0->ai_addr, res0->ai_addrlen, nbuf, sizeof(nbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
+    (void) fprintf(stderr, "getnameinfo(): %s\n", gai_strerror(errcode));
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  (void) fprintf(stderr, "port=%s\n", sbuf);
+
+  /**
+   * ソケットの生成
+   * 
+   * socket()でソケットディスクリプタを得る
+   */
+  if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+    perror("socket");
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  /**
+   * ソケットオプション(再利用フラグ)設定
+   * 
+   * 再利用フラグの設定を行わずにbind()してしまうと、クライアントの通信が中断した場合や、
+   * 並列処理でクライアントとの通信が終わってしまった場合などに、同じアドレスとポートの組み合わせでbind()できなくなる
+   * 
+   * 試す場合はこの処理をコメントアウトして起動して、再起動するとエラーになる
+   */
+  opt = 1;
+  opt_len = sizeof(opt);
+  if (setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, opt_len) == -1) {
+    perror("setsockopt");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  /**
+   * ソケットオプション(SO_REUSEPORT)設定
+   * 
+   * 同じアドレスとポートに複数のソケットをbind()できるようにする。
+   * カーネルが接続要求をそれぞれのソケットのバックログに振り分けるので、
+   * ワーカーごとにサーバソケットを持てばaccept()の排他が要らなくなる。
+   */
+  if (setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &opt, opt_len) == -1) {
+    perror("setsockopt");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  /**
+   * ソケットにアドレスを指定
+   * 
+   * bind()でソケットにアドレスを指定する
+   * sockaddr構造体を使ってアドレスを指定する
+   * 
+   * res0->ai_addrが sockaddr型　その構造体のサイズであるres0->ai_addrlenを指定する。
+   */
+  // ソケットにアドレスを指定
+  if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+    perror("bind");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  /**
+   * アクセスバックログの指定
+   * 
+   * listen()を呼び出すことで、このソケットに対するアクセスバックログ(接続待ちのキューの数)を指定する。
+   * 
+   * SOMAXCONNはシステムでの最大値となる linuxでは128
+   * 
+   * 小さい数を指定すると、接続要求(SYN)に対して、何も応答しないという現象が起きやすくなる。
+   * クライアント側は応答がないのでSYNの再送を繰り返してしまう。
+   * 
+   * listen()を呼び出すとソケットは接続待ち受け可能な状態になる
+   * socket()で作られたばかりのソケットは、待ち受け可能ではないので、listen()せずにaccept()するとエラーになる
+   * 
+   * listen()されたソケットに対してクライアントからの接続要求があった場合 TCPの3way handshakeが加療する
+   */
+  if (listen(soc, SOMAXCONN) == -1) {
+    perror("listen");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return -1;
+  }
+
+  freeaddrinfo(res0);
+  return (soc);
+}
+
+/**
+ * 接続ごとの状態と接続テーブル
+ * 
+ * server4.cのエッジトリガ版と同じ。
+ * 接続テーブルはワーカーごとに持つので排他は不要。
+ * 接続ごとのタイムアウトもserver4.cと同じで、タイミングホイール(../common/twheel.h)をワーカーごとに持つ。
+ */
+
+// 1回のepoll_wait()で受け取るイベント数(同時接続数の上限ではない)
+#define ET_MAX_EVENTS (1024)
+// 接続ごとの受信バッファサイズ(send_recv()のbufと同じ)
+#define ET_RBUF_SIZE (512)
+// 送信待ちがこれを超えたら受信を止めて送信を優先する
+#define ET_WBUF_HIGH (64 * 1024)
+
+/**
+ * 接続ごとのタイムアウト(ms)
+ * IDLE: 行の切れ目で何も送ってこない
+ * READ: 行の途中で止まっている(少しずつ送ってきても延長しない)
+ * WRITE: 送信待ちが減らない(相手が受信しない)
+ */
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef READ_TIMEOUT_MS
+#define READ_TIMEOUT_MS (10 * 1000)
+#endif
+#ifndef WRITE_TIMEOUT_MS
+#define WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+// タイミングホイールの1ティック
+#define TIMER_TICK_MS (100)
+
+enum conn_timeout_kind {
+    TMO_IDLE,
+    TMO_READ,
+    TMO_WRITE
+};
+
+/**
+ * 接続の状態
+ * CONN_READING: EAGAINまで受信し、応答を送信バッファに積む
+ * CONN_WRITING: 送信待ちが多いため受信を止め、EPOLLOUTで送信の続きを行う
+ * CONN_CLOSING: EOFを受信した 送信待ちを送り切ったらクローズする
+ */
+enum conn_state {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSING
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    char rbuf[ET_RBUF_SIZE]; // 改行が来ていない受信途中のデータ
+    size_t rlen;
+    char *wbuf; // 送信待ちのデータ wbuf[woff]からwbuf[wlen - 1]までが未送信
+    size_t woff, wlen, wsize;
+    struct twheel_timer timer; // タイムアウト
+    enum conn_timeout_kind tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+};
+
+/**
+ * 接続テーブル
+ * ディスクリプタ番号でO(1)で引けるようにし、足りなくなったら倍々で拡張する
+ */
+struct conn_table {
+    struct conn **conn;
+    int size;
+    int count;
+    struct twheel wheel; // 接続ごとのタイムアウト
+};
+
+/**
+ * タイムアウト
+ * shutdown()だけして、EPOLLHUPからいつもの経路(EOF、送信エラー)でクローズさせる
+ */
+void conn_timeout(struct twheel_timer *t, void *arg)
+{
+    struct conn *c = arg;
+
+    LOGINFO("[fd%d] %s timeout", c->fd, c->tkind == TMO_WRITE ? "write" : c->tkind == TMO_READ ? "read" : "idle");
+    (void) shutdown(c->fd, SHUT_RDWR);
+}
+
+/**
+ * タイムアウトの張り直し
+ * イベントを処理するたびに呼ぶ。状態に応じて1つだけ張る(張り直しはO(1))。
+ * - 送信待ちがある: WRITE 送信待ちが減った時だけ張り直す
+ * - 行の途中: READ 最初に行の途中になった時から数え、張り直さない
+ * - それ以外: IDLE 毎回張り直す
+ */
+void conn_arm(struct conn_table *tbl, struct conn *c)
+{
+    enum conn_timeout_kind kind;
+    unsigned long ms;
+
+    if (c->wlen > c->woff) {
+        kind = TMO_WRITE;
+        ms = WRITE_TIMEOUT_MS;
+    } else if (c->rlen > 0) {
+        kind = TMO_READ;
+        ms = READ_TIMEOUT_MS;
+    } else {
+        kind = TMO_IDLE;
+        ms = IDLE_TIMEOUT_MS;
+    }
+    if (kind == c->tkind && twheel_pending(&c->timer)
+        && (kind == TMO_READ || (kind == TMO_WRITE && c->wlen - c->woff >= c->tmark))) {
+        return;
+    }
+    c->tkind = kind;
+    c->tmark = c->wlen - c->woff;
+    twheel_add(&tbl->wheel, &c->timer, ms);
+}
+
+/**
+ * 接続の登録
+ */
+struct conn *conn_table_add(struct conn_table *tbl, int fd)
+{
+    struct conn **new_conn, *c;
+    int new_size;
+
+    if (fd >= tbl->size) {
+        for (new_size = (tbl->size > 0) ? tbl->size : 1024; new_size <= fd; new_size *= 2);
+        if ((new_conn = realloc(tbl->conn, sizeof(struct conn *) * new_size)) == NULL) {
+            perror("realloc");
+            return (NULL);
+        }
+        (void) memset(new_conn + tbl->size, 0, sizeof(struct conn *) * (new_size - tbl->size));
+        tbl->conn = new_conn;
+        tbl->size = new_size;
+    }
+    if ((c = calloc(1, sizeof(struct conn))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    c->fd = fd;
+    c->state = CONN_READING;
+    twheel_timer_init(&c->timer, conn_timeout, c);
+    tbl->conn[fd] = c;
+    tbl->count++;
+    return (c);
+}
+
+/**
+ * 接続の削除
+ * close()するとEPOLLの監視対象からも自動的に外れる
+ */
+void conn_table_del(struct conn_table *tbl, struct conn *c)
+{
+    tbl->conn[c->fd] = NULL;
+    tbl->count--;
+    twheel_del(&tbl->wheel, &c->timer);
+    (void) close(c->fd);
+    free(c->wbuf);
+    free(c);
+}
+
+/**
+ * 送信バッファへの追加
+ * 送信済みの領域を詰めてから、それでも足りなければ拡張する
+ */
+int conn_append(struct conn *c, const char *data, size_t len)
+{
+    char *new_wbuf;
+    size_t new_size;
+
+    if (c->woff > 0 && c->wlen + len > c->wsize) {
+        (void) memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+    if (c->wlen + len > c->wsize) {
+        for (new_size = (c->wsize > 0) ? c->wsize : 1024; new_size < c->wlen + len; new_size *= 2);
+        if ((new_wbuf = realloc(c->wbuf, new_size)) == NULL) {
+            perror("realloc");
+            return (-1);
+        }
+        c->wbuf = new_wbuf;
+        c->wsize = new_size;
+    }
+    (void) memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+    return (0);
+}
+
+/**
+ * 送信バッファのフラッシュ
+ * EAGAINになるまで送信する
+ * 戻り値 0:送信完了または送信待ち -1:エラー
+ */
+int conn_flush(struct conn *c)
+{
+    ssize_t len;
+
+    while (c->woff < c->wlen) {
+        if ((len = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 続きはEPOLLOUTで送信する
+                return (0);
+            }
+            perror("send");
+            return (-1);
+        }
+        c->woff += len;
+    }
+    c->woff = c->wlen = 0;
+    return (0);
+}
+
+/**
+ * 受信データから行を切り出して応答を作成
+ * 改行が来ていない残りは次の受信まで持ち越す
+ * 改行が無いままバッファが一杯になった場合はsend_recv()と同様にそこまでを1メッセージとする
+ */
+int conn_parse(struct conn *c)
+{
+    char *start, *end, *nl;
+    size_t len;
+
+    start = c->rbuf;
+    end = c->rbuf + c->rlen;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        len = nl - start;
+        if (len > 0 && start[len - 1] == '\r') {
+            len--;
+        }
+        // 応答文字列作成
+        if (conn_append(c, start, len) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+            return (-1);
+        }
+        start = nl + 1;
+    }
+    if (start == c->rbuf && c->rlen == sizeof(c->rbuf)) {
+        if (conn_append(c, c->rbuf, c->rlen) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+            return (-1);
+        }
+        start = end;
+    }
+    c->rlen = end - start;
+    (void) memmove(c->rbuf, start, c->rlen);
+    return (0);
+}
+
+/**
+ * 受信
+ * EAGAINになるまで受信する。送信待ちがET_WBUF_HIGHを超えたら途中でCONN_WRITINGに移る
+ * 戻り値 0:正常 -1:エラー
+ */
+int conn_read(struct conn *c)
+{
+    ssize_t len;
+
+    while (c->state == CONN_READING) {
+        if ((len = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("recv");
+            return (-1);
+        }
+        if (len == 0) {
+            // EOF 改行の無い最後の行にも応答し、送信待ちを送り切ってからクローズする
+            if (c->rlen > 0) {
+                if (conn_append(c, c->rbuf, c->rlen) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+                    return (-1);
+                }
+                c->rlen = 0;
+            }
+            c->state = CONN_CLOSING;
+            break;
+        }
+        c->rlen += len;
+        if (conn_parse(c) == -1) {
+            return (-1);
+        }
+        if (c->wlen - c->woff > ET_WBUF_HIGH) {
+            if (conn_flush(c) == -1) {
+                return (-1);
+            }
+            if (c->wlen - c->woff > ET_WBUF_HIGH) {
+                // 相手が受信しないので送信できるようになるまで受信を止める
+                c->state = CONN_WRITING;
+            }
+        }
+    }
+    return (conn_flush(c));
+}
+
+/**
+ * イベント処理(状態遷移)
+ * 戻り値 0:継続 -1:クローズする
+ */
+int conn_handle(struct conn *c, uint32_t events)
+{
+    if (events & EPOLLERR) {
+        return (-1);
+    }
+    if ((events & EPOLLOUT) && c->woff < c->wlen) {
+        if (conn_flush(c) == -1) {
+            return (-1);
+        }
+    }
+    if (c->state == CONN_WRITING && c->woff == c->wlen) {
+        // 送信し終わったので受信を再開する
+        // エッジトリガでは止めている間に届いたデータは通知されないため、ここで受信する
+        c->state = CONN_READING;
+        events |= EPOLLIN;
+    }
+    if (c->state == CONN_READING && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        if (conn_read(c) == -1) {
+            return (-1);
+        }
+    }
+    if (c->state == CONN_CLOSING && c->woff == c->wlen) {
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * ディスクリプタ上限の引き上げ
+ * 10万接続を超えるような場合はソフトリミットをハードリミットまで上げておく
+ */
+void raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("setrlimit");
+        return;
+    }
+    LOGINFO("RLIMIT_NOFILE=%lu", (unsigned long) rl.rlim_cur);
+}
+
+/**
+ * ワーカースレッド
+ * 
+ * server4.cのaccept_loop_et()と同じイベントループを、自分専用のサーバソケットに対して回す。
+ * epoll_wait()のタイムアウトは次に接続のタイムアウトが来るまでの時間にする。
+ */
+void * worker_thread(void *arg)
+{
+    struct worker *w;
+    struct conn_table tbl;
+    struct conn *c;
+    struct sockaddr_storage from;
+    struct epoll_event ev, *events;
+    cpu_set_t cpus;
+    int acc, i, epollfd, nfds, flags;
+    socklen_t len;
+
+    w = (struct worker *) arg;
+
+    // 自スレッドをCPUに固定
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        LOGERR("[worker%d] pthread_setaffinity_np(cpu%d):error", w->no, w->cpu);
+    }
+
+    // サーバソケットもノンブロッキングにしてEAGAINまでaccept4()できるようにする
+    if ((flags = fcntl(w->soc, F_GETFL, 0)) == -1 || fcntl(w->soc, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return ((void *) 0);
+    }
+    if ((events = malloc(sizeof(struct epoll_event) * ET_MAX_EVENTS)) == NULL) {
+        perror("malloc");
+        return ((void *) 0);
+    }
+    if ((epollfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        free(events);
+        return ((void *) 0);
+    }
+    ev.data.fd = w->soc;
+    ev.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, w->soc, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        free(events);
+        return ((void *) 0);
+    }
+    (void) memset(&tbl, 0, sizeof(tbl));
+    twheel_init(&tbl.wheel, TIMER_TICK_MS, twheel_clock_ms());
+
+    for (;;) {
+        nfds = epoll_wait(epollfd, events, ET_MAX_EVENTS, twheel_next_timeout(&tbl.wheel, twheel_clock_ms(), 10 * 1000));
+        // 期限の来た接続はshutdown()される クローズはこの後のイベントで行う
+        (void) twheel_advance(&tbl.wheel, twheel_clock_ms());
+        if (nfds == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == w->soc) {
+                // バックログが空になるまで接続受付
+                for (;;) {
+                    len = (socklen_t) sizeof(from);
+                    if ((acc = accept4(w->soc, (struct sockaddr *) &from, &len, SOCK_NONBLOCK)) == -1) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("accept4");
+                        }
+                        break;
+                    }
+                    if ((c = conn_table_add(&tbl, acc)) == NULL) {
+                        (void) close(acc);
+                        continue;
+                    }
+                    ev.data.fd = acc;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+                        perror("epoll_ctl");
+                        conn_table_del(&tbl, c);
+                        continue;
+                    }
+                    conn_arm(&tbl, c);
+                    __atomic_add_fetch(&w->accepted, 1, __ATOMIC_RELAXED);
+                }
+            } else if ((c = tbl.conn[events[i].data.fd]) != NULL) {
+                if (conn_handle(c, events[i].events) == -1) {
+                    // エラーまたは切断
+                    conn_table_del(&tbl, c);
+                } else {
+                    conn_arm(&tbl, c);
+                }
+            }
+        }
+        __atomic_store_n(&w->count, tbl.count, __ATOMIC_RELAXED);
+    }
+
+    (void) close(epollfd);
+    free(events);
+    pthread_exit((void *) 0);
+    // NOT REACHED
+    return ((void *) 0);
+}
+
+/**
+ * main
+ * 
+ * ワーカー数の分だけサーバソケットを準備してから、ワーカースレッドを起動する。
+ * ソケットを先に全部作っておくのは、一部のワーカーだけがbind()済みの状態で接続が偏らないようにするため。
+ * 
+ * 親スレッドはserver8.cと同様に10秒おきにワーカーごとの状態を表示する。
+ */
+int main(int argc, char *argv[])
+{
+    struct worker *workers;
+    cpu_set_t cpus;
+    int i, cpu, num_cpu, num_worker;
+
+    // 引数にポート番号が指定されているか?
+    if (argc <= 1) {
+        (void) fprintf(stderr, "server10 port [workers]\n");
+        return (EX_USAGE);
+    }
+
+    // ワーカー数の決定 デフォルトはCPUアフィニティマスクのCPU数
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+        perror("sched_getaffinity");
+        return (EX_OSERR);
+    }
+    num_cpu = CPU_COUNT(&cpus);
+    num_worker = (argc >= 3) ? atoi(argv[2]) : num_cpu;
+    if (num_worker <= 0) {
+        (void) fprintf(stderr, "workers error (%s)\n", argv[2]);
+        return (EX_USAGE);
+    }
+    if ((workers = calloc(num_worker, sizeof(struct worker))) == NULL) {
+        perror("calloc");
+        return (EX_OSERR);
+    }
+    raise_nofile_limit();
+
+    // サーバソケットの準備 CPUはマスクに含まれるものを順に割り当てる
+    for (i = 0, cpu = -1; i < num_worker; i++) {
+        do {
+            cpu = (cpu + 1) % CPU_SETSIZE;
+        } while (!CPU_ISSET(cpu, &cpus));
+        workers[i].no = i;
+        workers[i].cpu = cpu;
+        if ((workers[i].soc = server_socket(argv[1])) == -1) {
+            (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
+            return (EX_UNAVAILABLE);
+        }
+    }
+
+    // ワーカースレッドの生成
+    for (i = 0; i < num_worker; i++) {
+        if (pthread_create(&workers[i].thread_id, NULL, worker_thread, &workers[i]) != 0) {
+            perror("pthread_create");
+            return (EX_OSERR);
+        }
+    }
+    (void) fprintf(stderr, "ready for accept (%d workers on %d cpus)\n", num_worker, num_cpu);
+
+    for (;;) {
+        (void) sleep(10);
+        for (i = 0; i < num_worker; i++) {
+            (void) fprintf(stderr, "<<worker%d cpu%d>> accepted:%lu child count:%d\n",
+                           i, workers[i].cpu,
+                           __atomic_load_n(&workers[i].accepted, __ATOMIC_RELAXED),
+                           __atomic_load_n(&workers[i].count, __ATOMIC_RELAXED));
+        }
+    }
+
+    // NOT REACHED
+    for (i = 0; i < num_worker; i++) {
+        (void) close(workers[i].soc);
+    }
+    free(workers);
+    return (EX_OK);
+}
@@ -21,8 +21,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/conntab.h"
+#include "../common/framer.h"
+#include "../common/iobuf.h"
+#include "../common/log.h"
+#include "../common/outq.h"
+#include "../common/twheel.h"
+
+struct client;
+int send_recv(int, struct client *, int);
+
 /**
  * 接続受付準備
  * 
@@ -159,51 +170,207 @@ int server_socket(const char *portnm)
  * - 5: タイムアウトまでの待ち時間
  */
 
-// 最大同時処理数
-#define MAX_CHILD (20)
+/**
+ * 接続ごとのタイムアウト(ms)
+ * IDLE: 行の切れ目で何も送ってこない
+ * READ: 行の途中で止まっている(少しずつ送ってきても延長しない)
+ * WRITE: 送信待ちが減らない(相手が受信しない)
+ */
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef READ_TIMEOUT_MS
+#define READ_TIMEOUT_MS (10 * 1000)
+#endif
+#ifndef WRITE_TIMEOUT_MS
+#define WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+// タイミングホイールの1ティック
+#define TIMER_TICK_MS (100)
+
+enum client_timeout {
+    TMO_IDLE,
+    TMO_READ,
+    TMO_WRITE
+};
+
+/**
+ * 接続ごとの状態
+ * conntabのスロットのデータとして持つ
+ */
+struct client {
+    int fd;
+    struct framer fr; // 受信 行の途中を次のrecv()まで持ち越す
+    struct outq out; // 送信待ち
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+    struct twheel_timer timer; // タイムアウト
+    enum client_timeout tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+};
+
+/**
+ * 監視するイベントの決定
+ * 
+ * 送信待ちがある間だけ書き込み可能を監視する。
+ * 送信待ちがOUTQ_HIGHを超えてからOUTQ_LOWを下回るまでと、EOFの後は受信を監視しない。
+ * 戻り値 POLLIN、POLLOUTの組み合わせ 0:EOFの後に送り切ったのでクローズしてよい
+ */
+short client_events(struct client *cl)
+{
+    short events;
+
+    events = 0;
+    if (!cl->eof && outq_readable(&cl->out)) {
+        events |= POLLIN;
+    }
+    if (outq_pending(&cl->out) > 0) {
+        events |= POLLOUT;
+    }
+    return (events);
+}
+
+/**
+ * タイムアウト
+ * ここではクローズせずにshutdown()だけしておき、イベントループのいつもの経路(EOF、送信エラー)でクローズさせる
+ */
+void client_timeout(struct twheel_timer *t, void *arg)
+{
+    struct client *cl = arg;
+
+    LOGINFO("[fd%d] %s timeout", cl->fd, cl->tkind == TMO_WRITE ? "write" : cl->tkind == TMO_READ ? "read" : "idle");
+    (void) shutdown(cl->fd, SHUT_RDWR);
+}
+
+/**
+ * タイムアウトの張り直し
+ * 
+ * イベントを処理するたびに呼ぶ。状態に応じて1つだけ張る(張り直しはO(1))。
+ * - 送信待ちがある: WRITE 送信待ちが減った時だけ張り直す
+ * - 行の途中: READ 最初に行の途中になった時から数え、張り直さない
+ * - それ以外: IDLE 毎回張り直す
+ */
+void client_arm(struct twheel *w, struct client *cl)
+{
+    enum client_timeout kind;
+    unsigned long ms;
+
+    if (outq_pending(&cl->out) > 0) {
+        kind = TMO_WRITE;
+        ms = WRITE_TIMEOUT_MS;
+    } else if (framer_pending(&cl->fr) > 0) {
+        kind = TMO_READ;
+        ms = READ_TIMEOUT_MS;
+    } else {
+        kind = TMO_IDLE;
+        ms = IDLE_TIMEOUT_MS;
+    }
+    if (kind == cl->tkind && twheel_pending(&cl->timer)
+        && (kind == TMO_READ || (kind == TMO_WRITE && outq_pending(&cl->out) >= cl->tmark))) {
+        return;
+    }
+    cl->tkind = kind;
+    cl->tmark = outq_pending(&cl->out);
+    twheel_add(w, &cl->timer, ms);
+}
+
+/**
+ * 接続ごとの状態の作成
+ */
+struct client *client_new(int fd)
+{
+    struct client *cl;
+
+    if ((cl = calloc(1, sizeof(*cl))) == NULL) {
+        return (NULL);
+    }
+    cl->fd = fd;
+    framer_init(&cl->fr);
+    outq_init(&cl->out);
+    twheel_timer_init(&cl->timer, client_timeout, cl);
+    return (cl);
+}
+
+void client_free(struct twheel *w, struct client *cl)
+{
+    twheel_del(w, &cl->timer);
+    outq_free(&cl->out);
+    free(cl);
+}
+
+/**
+ * 送信待ちの表示
+ * 送信待ちのある接続ごとのバイト数と、全接続の合計
+ */
+void output_report(struct conntab *tbl, int soc)
+{
+    struct client *cl;
+    int i, fd;
+
+    for (i = 0; i < tbl->count; i++) {
+        fd = tbl->pfd[i].fd;
+        if (fd != soc && (cl = conntab_data(tbl, fd)) != NULL && outq_pending(&cl->out) > 0) {
+            LOGINFO("[child%d] output:%zu%s", conntab_slot(tbl, fd), outq_pending(&cl->out),
+                    cl->out.paused ? " (paused)" : "");
+        }
+    }
+    LOGINFO("<<output total:%zu>>", outq_total());
+}
 
 /**
  * アクセプトループ
+ * 
+ * クライアントはconntab(../common/conntab.h)で管理する。
+ * 以前はchild[MAX_CHILD]を毎回走査してマスクを作り直していたが、
+ * ここでは監視中のディスクリプタを登録したマスク(all、wall)を監視するイベントが変わった時だけ更新し、
+ * select()にはそのコピーを渡す。readyになったものは詰めた配列を走査し、select()の戻り値の数だけ見たら止める。
+ * 
+ * 送信はノンブロッキングで行い、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * 送信待ちがある接続だけ書き込み可能(wall)も監視する。
+ * 
+ * 接続ごとのタイムアウトはタイミングホイール(../common/twheel.h)で管理し、
+ * select()のタイムアウトは次に期限が来るまでの時間にする(最長10秒)。
+ * 
+ * select()で扱えるのはFD_SETSIZE未満のディスクリプタだけなので、それ以上は受け付けない。
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    int child[MAX_CHILD];
+    struct conntab tbl;
+    struct twheel wheel;
+    struct client *cl;
     struct timeval timeout;
     struct sockaddr_storage from;
-    int acc, child_no, width, i, count, pos, ret;
+    int acc, i, fd, nready, ret;
     socklen_t len;
-    fd_set mask;
-
-    // child配列の初期化
-    for (i = 0; i < MAX_CHILD; i++) {
-        child[i] = -1;
+    short events;
+    time_t last, now;
+    int ms;
+    fd_set all, wall, mask, wmask;
+
+    if (conntab_init(&tbl, 64) == -1) {
+        perror("conntab_init");
+        return;
     }
-    child_no = 0;
-
+    FD_ZERO(&all);
+    FD_ZERO(&wall);
+    // サーバソケットもテーブルに入れておく
+    (void) conntab_add(&tbl, soc, POLLIN);
+    FD_SET(soc, &all);
+    twheel_init(&wheel, TIMER_TICK_MS, twheel_clock_ms());
+
+    last = time(NULL);
     for (;;) {
-        // select()用マスクの作成
-        FD_ZERO(&mask); // ゼロクリア
-        FD_SET(soc, &mask); // 監視するディスクリプタをマスクに登録する
-        width = soc + 1;
-        count = 0;
-        for (i = 0; i < child_no; i++) {
-            if (child[i] != -1) {
-                FD_SET(child[i], &mask);
-                if (child[i] + 1 > width) {
-                    // select()の第1引数に渡す
-                    width = child[i] + 1;
-                    count++;
-                }
-            }
-        }
-        (void) fprintf(stderr, "<<child count:%d>>\n", count);
+        // select()用マスク 書き換えられるのでコピーを渡す
+        mask = all;
+        wmask = wall;
+        LOGDEBUG("<<child count:%d>>", tbl.count - 1);
 
         /**
          * select()用タイムアウト値のセット
+         * 次に接続のタイムアウトが来るまで 無ければ10秒
          */
-        timeout.tv_sec = 10;
-        timeout.tv_usec = 0;
+        ms = twheel_next_timeout(&wheel, twheel_clock_ms(), 10 * 1000);
+        timeout.tv_sec = ms / 1000;
+        timeout.tv_usec = (ms % 1000) * 1000;
 
         /**
          * select()呼び出し
@@ -211,18 +378,27 @@ void accept_loop(int soc)
          * 
          * タイムアウト時間を短くしすぎると、無限ループに近い状態になる。select()でreadyを監視する意味が薄れるので注意
          */
-        switch (select(width, (fd_set *) &mask, NULL, NULL, &timeout)) {
+        nready = select(conntab_maxfd(&tbl) + 1, &mask, &wmask, NULL, &timeout);
+        // 期限の来た接続はshutdown()される クローズはこの後の送受信で行う
+        (void) twheel_advance(&wheel, twheel_clock_ms());
+        if ((now = time(NULL)) - last >= 10) {
+            output_report(&tbl, soc);
+            last = now;
+        }
+        switch (nready) {
         case -1:
             // エラー
-            perror("select");
+            if (errno != EINTR) {
+                perror("select");
+            }
             break;
         case 0:
-            // タイムアウト
+            // タイムアウト shutdown()した接続を次のselect()で拾う
             break;
         default:
-            (void) fprintf(stderr, "default");
             // readyあり 1以上が返った場合
             if (FD_ISSET(soc, &mask)) {
+                nready--;
                 // サーバソケットready
                 len = (socklen_t) sizeof(from);
                 // 接続受付
@@ -231,57 +407,71 @@ void accept_loop(int soc)
                         perror("accept");
                     }
                 } else {
-                    (void) getnameinfo((struct sockaddr *) &from, len,
-                                hbuf, sizeof(hbuf),
-                                sbuf, sizeof(sbuf),
-                                NI_NUMERICHOST | NI_NUMERICSERV);
-                    (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-
-                    // childの空きを検索
-                    pos = -1;
-                    for (i = 0; i < child_no; i++) {
-                        if (child[i] == -1) {
-                            pos = i;
-                            break;
-                        }
-                    }
-
-                    // childの空きがない場合
-                    if (pos == -1) {
-                        // childにこれ以上格納できない
-                        if (child_no + 1 >= MAX_CHILD) {
-                            (void) fprintf(stderr, "child is full : cannot accept \n");
-                            // クローズ
-                            (void) close(acc);
-                        } else {
-                            child_no++;
-                            pos = child_no - 1;
-                        }
-
-                    }
-                    if (pos != -1) {
-                        // childに格納
-                        child[pos] = acc;
+                    LOGINFO("accept:%P", &from);
+                    if (acc >= FD_SETSIZE || (cl = client_new(acc)) == NULL) {
+                        // select()で監視できない、または接続ごとの状態を確保できない
+                        LOGWARN("child is full : cannot accept");
+                        (void) close(acc);
+                    } else if (conntab_add(&tbl, acc, POLLIN) == -1) {
+                        // テーブルを伸ばせない
+                        LOGWARN("child is full : cannot accept");
+                        client_free(&wheel, cl);
+                        (void) close(acc);
+                    } else {
+                        conntab_set_data(&tbl, acc, cl);
+                        client_arm(&wheel, cl);
+                        FD_SET(acc, &all);
                     }
                 }
             }
             // アクセプトしたソケットがready
-            for (i = 0; i < child_no; i++) {
-                // childが存在している場合
-                if (child[i] != -1) {
-                    if (FD_ISSET(child[i], &mask)) {
-                        // 送受信
-
-                        // エラーまたは切断
-                        if ((ret = send_recv(child[i], i)) == -1) {
-                            // クローズする
-                            (void) close(child[i]);
-
-                            // childを空きにする
-                            child[i] = -1;
-                        }
+            // 削除すると末尾がその位置に入ってくるので、その場合は添字を進めない
+            for (i = 0; nready > 0 && i < tbl.count;) {
+                fd = tbl.pfd[i].fd;
+                if (fd == soc || (!FD_ISSET(fd, &mask) && !FD_ISSET(fd, &wmask))) {
+                    i++;
+                    continue;
+                }
+                cl = conntab_data(&tbl, fd);
+                ret = 0;
+                if (FD_ISSET(fd, &wmask)) {
+                    nready--;
+                    // 送信待ちの続き
+                    if ((ret = outq_flush(fd, &cl->out)) == -1) {
+                        perror("send");
                     }
                 }
+                if (FD_ISSET(fd, &mask)) {
+                    nready--;
+                    // 送受信
+                    if (ret != -1) {
+                        ret = send_recv(fd, cl, conntab_slot(&tbl, fd));
+                    }
+                }
+                if (ret == -1 || (events = client_events(cl)) == 0) {
+                    // エラーまたは切断 クローズしてテーブルから外す
+                    client_free(&wheel, cl);
+                    (void) close(fd);
+                    FD_CLR(fd, &all);
+                    FD_CLR(fd, &wall);
+                    (void) conntab_del(&tbl, fd);
+                    continue;
+                }
+                if (events != conntab_events(&tbl, fd)) {
+                    conntab_set_events(&tbl, fd, events);
+                    if (events & POLLIN) {
+                        FD_SET(fd, &all);
+                    } else {
+                        FD_CLR(fd, &all);
+                    }
+                    if (events & POLLOUT) {
+                        FD_SET(fd, &wall);
+                    } else {
+                        FD_CLR(fd, &wall);
+                    }
+                }
+                client_arm(&wheel, cl);
+                i++;
             }
             break;
         }
@@ -289,47 +479,27 @@ void accept_loop(int soc)
 }
 
 
-/**
- * サイズ指定文字列連結
- * 
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
-
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
-
 /**
  * 送受信
  * 今回送受信は1回終えるごとにselect()のループに戻る必要がある
  * ch01とは処理が異なる
  * 
- * 単純にrecv()で受診し、応答をsend()で送信したら返るだけの処理
+ * recv()したデータから完全な行を全て切り出し(../common/framer.h)、各行の応答をまとめて1回で送信する。
+ * 改行が来ていない残りは接続ごとのframerに持ち越す。
+ * 送信はノンブロッキングで、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * EOFの場合は改行の無い最後の行にも応答し、cl->eofを立てる(送信待ちを送り切ってからクローズする)。
+ * 
+ * 戻り値 0:継続 -1:エラー
  */
-int send_recv(int acc, int child_no)
+int send_recv(int acc, struct client *cl, int child_no)
 {
-    char buf[512], *ptr;
+    struct resp resp;
+    const char *line;
+    size_t mlen;
     ssize_t len;
 
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = framer_recv(acc, &cl->fr, 0)) == -1) {
         // エラー
         perror("recv");
         return (-1);
@@ -337,22 +507,27 @@ int send_recv(int acc, int child_no)
 
     if (len == 0) {
         // EOF
-        (void) fprintf(stderr, "[child%d] recv:EOF\n", child_no);
-        return (-1);
+        LOGINFO("[child%d] recv:EOF", child_no);
+        cl->eof = 1;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-        *ptr = '\0';
+    // 行の切り出し・表示 行は受信バッファを指しているので'\0'終端は不要
+    resp_init(&resp);
+    while (framer_next(&cl->fr, &line, &mlen) || (cl->eof && framer_rest(&cl->fr, &line, &mlen))) {
+        LOGDEBUG("[child%d]%.*s", child_no, (int) mlen, line);
+        // 応答作成 各行と":OK\r\n"をiovecで並べるだけでコピーはしない
+        if (resp_add_ok(&resp, line, mlen) == -1) {
+            // iovが一杯 ここまでを送信して続ける
+            if (outq_send(acc, &cl->out, &resp) == -1) {
+                perror("send");
+                return (-1);
+            }
+            (void) resp_add_ok(&resp, line, mlen);
+        }
     }
-    (void) fprintf(stderr, "[child%d]%s\n", child_no, buf);
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = strlen(buf);
 
-    // 応答
-    if ((len = send(acc, buf, len, 0)) == -1) {
+    // 応答 まとめて1回で送信する 送れなかった分は送信待ちに積む
+    if (resp.iovcnt > 0 && outq_send(acc, &cl->out, &resp) == -1) {
         // エラー
         perror("send");
         return (-1);
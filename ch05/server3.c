@@ -28,8 +28,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/conntab.h"
+#include "../common/framer.h"
+#include "../common/iobuf.h"
+#include "../common/log.h"
+#include "../common/outq.h"
+#include "../common/twheel.h"
+
 /**
  * 接続受付準備
  * ch05 server2.cと同じ
@@ -143,46 +151,172 @@ int server_socket(const char *portnm)
 
 
 /**
- * サイズ指定文字列連結
+ * 接続ごとのタイムアウト(ms)
+ * IDLE: 行の切れ目で何も送ってこない
+ * READ: 行の途中で止まっている(少しずつ送ってきても延長しない)
+ * WRITE: 送信待ちが減らない(相手が受信しない)
+ */
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef READ_TIMEOUT_MS
+#define READ_TIMEOUT_MS (10 * 1000)
+#endif
+#ifndef WRITE_TIMEOUT_MS
+#define WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+// タイミングホイールの1ティック
+#define TIMER_TICK_MS (100)
+
+enum client_timeout {
+    TMO_IDLE,
+    TMO_READ,
+    TMO_WRITE
+};
+
+/**
+ * 接続ごとの状態
+ * conntabのスロットのデータとして持つ
+ */
+struct client {
+    int fd;
+    struct framer fr; // 受信 行の途中を次のrecv()まで持ち越す
+    struct outq out; // 送信待ち
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+    struct twheel_timer timer; // タイムアウト
+    enum client_timeout tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+};
+
+/**
+ * 監視するイベントの決定
  * 
+ * 送信待ちがある間だけ書き込み可能を監視する。
+ * 送信待ちがOUTQ_HIGHを超えてからOUTQ_LOWを下回るまでと、EOFの後は受信を監視しない。
+ * 戻り値 POLLIN、POLLOUTの組み合わせ 0:EOFの後に送り切ったのでクローズしてよい
  */
-size_t mystrlcat(char *dst, const char *src, size_t size)
+short client_events(struct client *cl)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+    short events;
+
+    events = 0;
+    if (!cl->eof && outq_readable(&cl->out)) {
+        events |= POLLIN;
     }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+    if (outq_pending(&cl->out) > 0) {
+        events |= POLLOUT;
     }
+    return (events);
+}
 
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/**
+ * タイムアウト
+ * ここではクローズせずにshutdown()だけしておき、イベントループのいつもの経路(EOF、送信エラー)でクローズさせる
+ */
+void client_timeout(struct twheel_timer *t, void *arg)
+{
+    struct client *cl = arg;
+
+    LOGINFO("[fd%d] %s timeout", cl->fd, cl->tkind == TMO_WRITE ? "write" : cl->tkind == TMO_READ ? "read" : "idle");
+    (void) shutdown(cl->fd, SHUT_RDWR);
+}
+
+/**
+ * タイムアウトの張り直し
+ * 
+ * イベントを処理するたびに呼ぶ。状態に応じて1つだけ張る(張り直しはO(1))。
+ * - 送信待ちがある: WRITE 送信待ちが減った時だけ張り直す
+ * - 行の途中: READ 最初に行の途中になった時から数え、張り直さない
+ * - それ以外: IDLE 毎回張り直す
+ */
+void client_arm(struct twheel *w, struct client *cl)
+{
+    enum client_timeout kind;
+    unsigned long ms;
+
+    if (outq_pending(&cl->out) > 0) {
+        kind = TMO_WRITE;
+        ms = WRITE_TIMEOUT_MS;
+    } else if (framer_pending(&cl->fr) > 0) {
+        kind = TMO_READ;
+        ms = READ_TIMEOUT_MS;
+    } else {
+        kind = TMO_IDLE;
+        ms = IDLE_TIMEOUT_MS;
+    }
+    if (kind == cl->tkind && twheel_pending(&cl->timer)
+        && (kind == TMO_READ || (kind == TMO_WRITE && outq_pending(&cl->out) >= cl->tmark))) {
+        return;
     }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
+    cl->tkind = kind;
+    cl->tmark = outq_pending(&cl->out);
+    twheel_add(w, &cl->timer, ms);
+}
+
+/**
+ * 接続ごとの状態の作成
+ */
+struct client *client_new(int fd)
+{
+    struct client *cl;
+
+    if ((cl = calloc(1, sizeof(*cl))) == NULL) {
+        return (NULL);
+    }
+    cl->fd = fd;
+    framer_init(&cl->fr);
+    outq_init(&cl->out);
+    twheel_timer_init(&cl->timer, client_timeout, cl);
+    return (cl);
+}
+
+void client_free(struct twheel *w, struct client *cl)
+{
+    twheel_del(w, &cl->timer);
+    outq_free(&cl->out);
+    free(cl);
+}
+
+/**
+ * 送信待ちの表示
+ * 送信待ちのある接続ごとのバイト数と、全接続の合計
+ */
+void output_report(struct conntab *tbl, int soc)
+{
+    struct client *cl;
+    int i, fd;
+
+    for (i = 0; i < tbl->count; i++) {
+        fd = tbl->pfd[i].fd;
+        if (fd != soc && (cl = conntab_data(tbl, fd)) != NULL && outq_pending(&cl->out) > 0) {
+            LOGINFO("[child%d] output:%zu%s", conntab_slot(tbl, fd), outq_pending(&cl->out),
+                    cl->out.paused ? " (paused)" : "");
+        }
+    }
+    LOGINFO("<<output total:%zu>>", outq_total());
 }
 
 /**
  * 送受信
- * 今回送受信は1回終えるごとにselect()のループに戻る必要がある
+ * 今回送受信は1回終えるごとにpoll()のループに戻る必要がある
  * ch01とは処理が異なる
  * 
- * 単純にrecv()で受診し、応答をsend()で送信したら返るだけの処理
+ * recv()したデータから完全な行を全て切り出し(../common/framer.h)、各行の応答をまとめて1回で送信する。
+ * 改行が来ていない残りは接続ごとのframerに持ち越す。
+ * 送信はノンブロッキングで、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * EOFの場合は改行の無い最後の行にも応答し、cl->eofを立てる(送信待ちを送り切ってからクローズする)。
+ * 
+ * 戻り値 0:継続 -1:エラー
  */
-int send_recv(int acc, int child_no)
+int send_recv(int acc, struct client *cl, int child_no)
 {
-    char buf[512], *ptr;
+    struct resp resp;
+    const char *line;
+    size_t mlen;
     ssize_t len;
 
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = framer_recv(acc, &cl->fr, 0)) == -1) {
         // エラー
         perror("recv");
         return (-1);
@@ -190,22 +324,27 @@ int send_recv(int acc, int child_no)
 
     if (len == 0) {
         // EOF
-        (void) fprintf(stderr, "[child%d] recv:EOF\n", child_no);
-        return (-1);
+        LOGINFO("[child%d] recv:EOF", child_no);
+        cl->eof = 1;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-        *ptr = '\0';
+    // 行の切り出し・表示 行は受信バッファを指しているので'\0'終端は不要
+    resp_init(&resp);
+    while (framer_next(&cl->fr, &line, &mlen) || (cl->eof && framer_rest(&cl->fr, &line, &mlen))) {
+        LOGDEBUG("[child%d]%.*s", child_no, (int) mlen, line);
+        // 応答作成 各行と":OK\r\n"をiovecで並べるだけでコピーはしない
+        if (resp_add_ok(&resp, line, mlen) == -1) {
+            // iovが一杯 ここまでを送信して続ける
+            if (outq_send(acc, &cl->out, &resp) == -1) {
+                perror("send");
+                return (-1);
+            }
+            (void) resp_add_ok(&resp, line, mlen);
+        }
     }
-    (void) fprintf(stderr, "[child%d]%s\n", child_no, buf);
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = strlen(buf);
 
-    // 応答
-    if ((len = send(acc, buf, len, 0)) == -1) {
+    // 応答 まとめて1回で送信する 送れなかった分は送信待ちに積む
+    if (resp.iovcnt > 0 && outq_send(acc, &cl->out, &resp) == -1) {
         // エラー
         perror("send");
         return (-1);
@@ -225,13 +364,10 @@ int send_recv(int acc, int child_no)
  * - 2: poll()でセットされたディスクリプタがreadyになるのを待つ
  * - 3: pollfd型構造体のreventsメンバで、どのディスクリプタがreadyになったか調べる
  */
-// 最大同時処理数
-#define MAX_CHILD (20)
-
 /**
  * アクセプトループ
  * 
- * poll()ではpolldfd型構造体(ここではtargets[])に監視したい情報をセット
+ * poll()ではpolldfd型構造体(ここではtbl.pfd[])に監視したい情報をセット
  * pllfd型構造体には、fdのほかeventsに監視したい内容もセットできる
  * 
  * 結果はreventsにセットされる。
@@ -248,47 +384,59 @@ int send_recv(int acc, int child_no)
  * 
  * グローバル変数errnoにEINTRがセットされる
  * 0はタイムアウト
+ * 
+ * pollfdの配列はconntab(../common/conntab.h)が詰めた状態で持っているので、毎回作り直さずにそのままpoll()に渡す。
+ * 追加は末尾へ、削除は末尾と入れ替えるだけなので、ループ1回の処理はreadyになった数に比例する。
+ * 
+ * 送信はノンブロッキングで行い、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * 送信待ちがある接続だけeventsにPOLLOUTを加え、送信待ちが多い間はPOLLINを外す。
+ * 
+ * 接続ごとのタイムアウトはタイミングホイール(../common/twheel.h)で管理し、
+ * poll()のタイムアウトは次に期限が来るまでの時間にする(最長10秒)。
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    int child[MAX_CHILD];
+    struct conntab tbl;
+    struct twheel wheel;
+    struct client *cl;
     struct sockaddr_storage from;
-    int acc, child_no, i, j, count, pos, ret;
+    int acc, i, fd, nready, ret;
     socklen_t len;
-    struct pollfd targets[MAX_CHILD + 1];
-    // child配列の初期化
-    for (i = 0; i < MAX_CHILD; i++) {
-        child[i] = -1;
+    short events, revents;
+    time_t last, now;
+
+    if (conntab_init(&tbl, 64) == -1) {
+        perror("conntab_init");
+        return;
     }
-    child_no = 0;
+    // サーバソケットは先頭(tbl.pfd[0])
+    (void) conntab_add(&tbl, soc, POLLIN);
+    twheel_init(&wheel, TIMER_TICK_MS, twheel_clock_ms());
+    last = time(NULL);
     for (;;) {
-        // poll()用データの作成
-        count = 0;
-        targets[count].fd = soc;
-        targets[count].events = POLLIN;
-        count++;
-
-        // pollfd型構造体に監視したい情報をセットする
-        for (i = 0; i < child_no; i++) {
-            if (child[i] != -1) {
-                targets[count].fd = child[i]; 
-                targets[count].events = POLLIN; // POLLIN: データの読み出しready
-                count++;
-            }
+        LOGDEBUG("<<child count: %d>>", tbl.count - 1);
+        // タイムアウトは次に接続のタイムアウトが来るまで 無ければ10秒
+        nready = poll(tbl.pfd, (nfds_t) tbl.count, twheel_next_timeout(&wheel, twheel_clock_ms(), 10 * 1000));
+        // 期限の来た接続はshutdown()される クローズはこの後の送受信で行う
+        (void) twheel_advance(&wheel, twheel_clock_ms());
+        if ((now = time(NULL)) - last >= 10) {
+            output_report(&tbl, soc);
+            last = now;
         }
-        (void) fprintf(stderr, "<<child count: %d>>\n", count - 1);
-        switch (poll(targets, count, 10 * 1000)) {
+        switch (nready) {
         case -1:
             // エラー
-            perror("poll");
+            if (errno != EINTR) {
+                perror("poll");
+            }
             break;
         case 0:
             // タイムアウト
             break;
         default:
             // サーバソケットready
-            if (targets[0].revents & POLLIN) {
+            if (tbl.pfd[0].revents & POLLIN) {
+                nready--;
                 len = (socklen_t) sizeof(from);
                 // 接続受付
                 if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
@@ -296,62 +444,55 @@ void accept_loop(int soc)
                         perror("accept");
                     }
                 } else {
-                    (void) getnameinfo((struct sockaddr *) &from, len,
-                                        hbuf, sizeof(hbuf),
-                                        sbuf, sizeof(sbuf),
-                                        NI_NUMERICHOST | NI_NUMERICSERV);
-                    (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-
-                    // childの空きを検索
-                    pos = -1;
-                    for (i = 0; i < child_no; i++) {
-                        if (child[i] == -1) {
-                            pos = i;
-                            break;
-                        }
-                    }
-
-                    if (pos == -1) {
-                      // 空きが無い
-                      if (child_no + 1 >= MAX_CHILD) {
-                          // childにこれ以上格納できない
-                          (void) fprintf(stderr, "child is full : cannot accept \n");
-                          // クローズ
-                          (void) close(acc);
-                      } else {
-                          child_no++;
-                          pos = child_no - 1;
-                      }
-                    } 
-
-                    if (pos != -1) {
-                        // childに格納
-                        (void) fprintf(stderr, "child client has been set. pos: %d \n", pos);
-                        child[pos] = acc;
+                    LOGINFO("accept:%P", &from);
+                    // 末尾に追加 reventsは0なので今回のループでは処理されない
+                    if ((cl = client_new(acc)) == NULL) {
+                        LOGWARN("child is full : cannot accept");
+                        (void) close(acc);
+                    } else if (conntab_add(&tbl, acc, POLLIN) == -1) {
+                        LOGWARN("child is full : cannot accept");
+                        client_free(&wheel, cl);
+                        (void) close(acc);
+                    } else {
+                        conntab_set_data(&tbl, acc, cl);
+                        client_arm(&wheel, cl);
                     }
                 }
             }
 
             // アクセプトしたソケットがready
-            for (i = 1; i < count; i++) {
-                if (targets[i].revents & (POLLIN | POLLERR)) {
-                    /**
-                     * 送受信
-                     * クライアント番号をpollfd型構造体のtargetsで調べるには
-                     * 先頭にサーバソケットが入っているので-1して扱う
-                     */
-                    if ((ret = send_recv(targets[i].fd, i - 1)) == -1) {
-                        // エラーまたは切断
-                        (void) close(targets[i].fd);
-                        // childを空きにする
-                        for (j = 0; j < child_no; j++) {
-                            if (child[j] == targets[i].fd) {
-                                child[j] = -1;
-                                break;
-                            }
-                        }
+            // 削除すると末尾がその位置に入ってくるので、その場合は添字を進めない
+            for (i = 1; nready > 0 && i < tbl.count;) {
+                if ((revents = tbl.pfd[i].revents) == 0) {
+                    i++;
+                    continue;
+                }
+                nready--;
+                fd = tbl.pfd[i].fd;
+                events = tbl.pfd[i].events;
+                cl = conntab_data(&tbl, fd);
+                ret = 0;
+                if ((events & POLLOUT) && (revents & (POLLOUT | POLLERR | POLLHUP))) {
+                    // 送信待ちの続き
+                    if ((ret = outq_flush(fd, &cl->out)) == -1) {
+                        perror("send");
                     }
                 }
+                if (ret != -1 && (events & POLLIN) && (revents & (POLLIN | POLLERR | POLLHUP))) {
+                    // 送受信 クライアント番号はスロット番号
+                    ret = send_recv(fd, cl, conntab_slot(&tbl, fd));
+                }
+                if (ret == -1 || (events = client_events(cl)) == 0) {
+                    // エラーまたは切断
+                    client_free(&wheel, cl);
+                    (void) close(fd);
+                    (void) conntab_del(&tbl, fd);
+                    continue;
+                }
+                // 送信待ちがある間だけPOLLOUT、送信待ちが多い間はPOLLINを外す
+                tbl.pfd[i].events = events;
+                client_arm(&wheel, cl);
+                i++;
             }
             break;
         }
@@ -13,24 +13,53 @@
  * EPOLLを使えば、この問題を回避できる。
  */
 
+#define _GNU_SOURCE // accept4()のため
+#include <sys/epoll.h>
+#include <sys/mman.h> // io_uringのリングのmmap()のため
 #include <sys/param.h>
+#include <sys/resource.h> // ETモードでディスクリプタ上限を引き上げるため
 #include <sys/socket.h>
+#include <sys/syscall.h> // io_uringのシステムコールのため
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/conntab.h"
+#include "../common/framer.h"
+#include "../common/iobuf.h"
+#include "../common/log.h"
+#include "../common/outq.h"
+#include "../common/twheel.h"
+
+struct client;
+int send_recv(int, struct client *, int);
+
+/**
+ * モード
+ * l: レベルトリガ(accept_loop())
+ * e: エッジトリガ・ノンブロッキング(accept_loop_et())
+ * u: io_uring(accept_loop_uring())
+ */
+char g_mode = 'l';
+// io_uringでSQPOLLを使うか
+int g_sqpoll = 0;
+
 /**
  * 接続受付
  * 
@@ -169,20 +198,183 @@ int server_socket(const char *portnm)
 // 最大同時処理数
 #define MAX_CHILD (20)
 
+/**
+ * 接続ごとのタイムアウト(ms)
+ * IDLE: 行の切れ目で何も送ってこない
+ * READ: 行の途中で止まっている(少しずつ送ってきても延長しない)
+ * WRITE: 送信待ちが減らない(相手が受信しない)
+ */
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef READ_TIMEOUT_MS
+#define READ_TIMEOUT_MS (10 * 1000)
+#endif
+#ifndef WRITE_TIMEOUT_MS
+#define WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+// タイミングホイールの1ティック
+#define TIMER_TICK_MS (100)
+
+enum client_timeout {
+    TMO_IDLE,
+    TMO_READ,
+    TMO_WRITE
+};
+
+/**
+ * 接続ごとの状態
+ * conntabのスロットのデータとして持つ
+ */
+struct client {
+    int fd;
+    struct framer fr; // 受信 行の途中を次のrecv()まで持ち越す
+    struct outq out; // 送信待ち
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+    struct twheel_timer timer; // タイムアウト
+    enum client_timeout tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+};
+
+/**
+ * 監視するイベントの決定
+ * 
+ * 送信待ちがある間だけ書き込み可能を監視する。
+ * 送信待ちがOUTQ_HIGHを超えてからOUTQ_LOWを下回るまでと、EOFの後は受信を監視しない。
+ * 戻り値 POLLIN、POLLOUTの組み合わせ 0:EOFの後に送り切ったのでクローズしてよい
+ */
+short client_events(struct client *cl)
+{
+    short events;
+
+    events = 0;
+    if (!cl->eof && outq_readable(&cl->out)) {
+        events |= POLLIN;
+    }
+    if (outq_pending(&cl->out) > 0) {
+        events |= POLLOUT;
+    }
+    return (events);
+}
+
+/**
+ * タイムアウト
+ * ここではクローズせずにshutdown()だけしておき、イベントループのいつもの経路(EOF、送信エラー)でクローズさせる
+ */
+void client_timeout(struct twheel_timer *t, void *arg)
+{
+    struct client *cl = arg;
+
+    LOGINFO("[fd%d] %s timeout", cl->fd, cl->tkind == TMO_WRITE ? "write" : cl->tkind == TMO_READ ? "read" : "idle");
+    (void) shutdown(cl->fd, SHUT_RDWR);
+}
+
+/**
+ * タイムアウトの張り直し
+ * 
+ * イベントを処理するたびに呼ぶ。状態に応じて1つだけ張る(張り直しはO(1))。
+ * - 送信待ちがある: WRITE 送信待ちが減った時だけ張り直す
+ * - 行の途中: READ 最初に行の途中になった時から数え、張り直さない
+ * - それ以外: IDLE 毎回張り直す
+ */
+void client_arm(struct twheel *w, struct client *cl)
+{
+    enum client_timeout kind;
+    unsigned long ms;
+
+    if (outq_pending(&cl->out) > 0) {
+        kind = TMO_WRITE;
+        ms = WRITE_TIMEOUT_MS;
+    } else if (framer_pending(&cl->fr) > 0) {
+        kind = TMO_READ;
+        ms = READ_TIMEOUT_MS;
+    } else {
+        kind = TMO_IDLE;
+        ms = IDLE_TIMEOUT_MS;
+    }
+    if (kind == cl->tkind && twheel_pending(&cl->timer)
+        && (kind == TMO_READ || (kind == TMO_WRITE && outq_pending(&cl->out) >= cl->tmark))) {
+        return;
+    }
+    cl->tkind = kind;
+    cl->tmark = outq_pending(&cl->out);
+    twheel_add(w, &cl->timer, ms);
+}
+
+/**
+ * 接続ごとの状態の作成
+ */
+struct client *client_new(int fd)
+{
+    struct client *cl;
+
+    if ((cl = calloc(1, sizeof(*cl))) == NULL) {
+        return (NULL);
+    }
+    cl->fd = fd;
+    framer_init(&cl->fr);
+    outq_init(&cl->out);
+    twheel_timer_init(&cl->timer, client_timeout, cl);
+    return (cl);
+}
+
+void client_free(struct twheel *w, struct client *cl)
+{
+    twheel_del(w, &cl->timer);
+    outq_free(&cl->out);
+    free(cl);
+}
+
+/**
+ * 送信待ちの表示
+ * 送信待ちのある接続ごとのバイト数と、全接続の合計
+ */
+void output_report(struct conntab *tbl, int soc)
+{
+    struct client *cl;
+    int i, fd;
+
+    for (i = 0; i < tbl->count; i++) {
+        fd = tbl->pfd[i].fd;
+        if (fd != soc && (cl = conntab_data(tbl, fd)) != NULL && outq_pending(&cl->out) > 0) {
+            LOGINFO("[child%d] output:%zu%s", conntab_slot(tbl, fd), outq_pending(&cl->out),
+                    cl->out.paused ? " (paused)" : "");
+        }
+    }
+    LOGINFO("<<output total:%zu>>", outq_total());
+}
+
 /**
  * アクセプトループ
+ * 
+ * 送信はノンブロッキングで行い、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * 送信待ちがある接続だけEPOLLOUTを監視し、送信待ちが多い間はEPOLLINを外す。
+ * 監視中のイベントはconntabのpollfdのeventsに覚えておき、変わった時だけepoll_ctl()する。
+ * 
+ * 接続ごとのタイムアウトはタイミングホイール(../common/twheel.h)で管理し、
+ * epoll_wait()のタイムアウトは次に期限が来るまでの時間にする(最長10秒)。
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    struct conntab tbl;
+    struct twheel wheel;
+    struct client *cl;
     struct sockaddr_storage from;
-    int acc, count, i, epollfd, nfds, ret;
+    int acc, count, i, fd, epollfd, nfds, ret;
     socklen_t len;
-    struct epoll_event ev, events[MAX_CHILD];
+    short want;
+    time_t last, now;
+    struct epoll_event ev, events[MAX_CHILD + 1];
 
+    // 接続ごとの状態をディスクリプタで引く
+    if (conntab_init(&tbl, MAX_CHILD) == -1) {
+        perror("conntab_init");
+        return;
+    }
     // epoll_create()でEPOLLを使うためのディスクリプタを得る
     if ((epollfd = epoll_create(MAX_CHILD + 1)) == -1) {
         perror("epoll_create");
+        conntab_free(&tbl);
         return;
     }
 
@@ -203,10 +395,20 @@ void accept_loop(int soc)
         return;
     }
     count = 0;
+    twheel_init(&wheel, TIMER_TICK_MS, twheel_clock_ms());
+    last = time(NULL);
     for (;;) {
-        (void) fprintf(stderr, "<<child count: %d>>\n", count);
+        LOGDEBUG("<<child count: %d>>", count);
         // epoll_wait()でセットされたディスクリプタがreadyになるのを待つ
-        switch ((nfds = epoll_wait(epollfd, events, MAX_CHILD + 1, 10 * 1000))) {
+        // タイムアウトは次に接続のタイムアウトが来るまで 無ければ10秒
+        nfds = epoll_wait(epollfd, events, MAX_CHILD + 1, twheel_next_timeout(&wheel, twheel_clock_ms(), 10 * 1000));
+        // 期限の来た接続はshutdown()される クローズはこの後の送受信で行う
+        (void) twheel_advance(&wheel, twheel_clock_ms());
+        if ((now = time(NULL)) - last >= 10) {
+            output_report(&tbl, soc);
+            last = now;
+        }
+        switch (nfds) {
         case -1:
             // エラー
             perror("epoll_wait");
@@ -230,44 +432,72 @@ void accept_loop(int soc)
                             perror("accept");
                         }
                     } else {
-                        (void) getnameinfo((struct sockaddr *) &from, len,
-                                                    hbuf, sizeof(hbuf),
-                                                    sbuf, sizeof(sbuf),
-                                                    NI_NUMERICHOST | NI_NUMERICSERV);
-                        (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+                        LOGINFO("accept:%P", &from);
                         
                         // 空きが無い
-                        if (coutn + 1 >= MAX_CHILD) {
+                        if (count + 1 >= MAX_CHILD
+                            || (cl = client_new(acc)) == NULL) {
                             // これ以上接続できない
-                            (void) fprintf(stderr, "connection is full : cannot accept\n");
+                            LOGWARN("connection is full : cannot accept");
                             // クローズ
                             (void) close(acc);
+                        } else if (conntab_add(&tbl, acc, POLLIN) == -1) {
+                            LOGWARN("connection is full : cannot accept");
+                            client_free(&wheel, cl);
+                            (void) close(acc);
                         } else {
+                            conntab_set_data(&tbl, acc, cl);
+                            client_arm(&wheel, cl);
                             ev.data.fd = acc;
                             ev.events = EPOLLIN;
                             if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
                                 perror("epoll_ctl");
                                 (void) close(acc);
-                                (void) close(epfd);
+                                (void) close(epollfd);
                                 return;
                             }
                             count++;
                         }
                     }
                 } else {
-                    // 送受信
-                    if ((ret = send_recv(events[i].data.fd, events[i].data.fd)) == -1) {
+                    fd = events[i].data.fd;
+                    cl = conntab_data(&tbl, fd);
+                    ret = 0;
+                    if ((conntab_events(&tbl, fd) & POLLOUT) && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                        // 送信待ちの続き
+                        if ((ret = outq_flush(fd, &cl->out)) == -1) {
+                            perror("send");
+                        }
+                    }
+                    if (ret != -1 && (conntab_events(&tbl, fd) & POLLIN) && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                        // 送受信
+                        ret = send_recv(fd, cl, fd);
+                    }
+                    if (ret == -1 || (want = client_events(cl)) == 0) {
                         // エラーまたは切断
                         // epoll_ctl()で監視が不要になったディスクリプタを削除する
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, &ev) == -1) {
+                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
                             perror("epoll_ctl");
-                            (void) close(events[i].data.fd);
-                            (void) close(epfd);
+                            (void) close(fd);
+                            (void) close(epollfd);
                             return;
                         }
                         // クローズ
-                        (void) close(events[i].data.fd);
+                        client_free(&wheel, cl);
+                        (void) conntab_del(&tbl, fd);
+                        (void) close(fd);
                         count--;
+                    } else {
+                        if (want != conntab_events(&tbl, fd)) {
+                            // 監視するイベントの変更
+                            ev.data.fd = fd;
+                            ev.events = ((want & POLLIN) ? EPOLLIN : 0) | ((want & POLLOUT) ? EPOLLOUT : 0);
+                            if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+                                perror("epoll_ctl");
+                            }
+                            conntab_set_events(&tbl, fd, want);
+                        }
+                        client_arm(&wheel, cl);
                     }
                 }
             }
@@ -275,49 +505,1129 @@ void accept_loop(int soc)
         }
     }
     (void) close(epollfd);
+    conntab_free(&tbl);
 }
 
 /**
- * サイズ指定文字列連結
- * 
+ * エッジトリガ・ノンブロッキング版の接続受付
+ *
+ * accept_loop()はレベルトリガでEPOLLINのみを監視し、readyになるたびにrecv()を1回だけ行う。
+ * 同時接続数もMAX_CHILDとevents[]の大きさで制限されている。
+ *
+ * accept_loop_et()では以下のように処理する
+ * - サーバソケットはaccept4(SOCK_NONBLOCK)でEAGAINになるまでバックログを全て受け付ける
+ * - アクセプトソケットは接続ごとに受信・送信バッファを持ち、EAGAINになるまで受信・送信する
+ * - 送信しきれなかった分はEPOLLOUTで通知された時に続きを送信する
+ * - 接続テーブルはディスクリプタ番号をインデックスにした配列で、足りなくなったら拡張する
+ * - 接続ごとのタイムアウト(IDLE、READ、WRITE)はaccept_loop()と同じくタイミングホイールで管理し、
+ *   epoll_wait()のタイムアウトは次に期限が来るまでの時間にする
+ *
+ * エッジトリガでは状態が変化した瞬間にしか通知されないため、EAGAINになるまで読み書きしないと
+ * 残ったデータについての通知は二度と来ない点に注意。
+ */
+
+// 1回のepoll_wait()で受け取るイベント数(同時接続数の上限ではない)
+#define ET_MAX_EVENTS (1024)
+// 接続ごとの受信バッファサイズ
+#define ET_RBUF_SIZE (512)
+// 送信待ちがこれを超えたら受信を止めて送信を優先する
+#define ET_WBUF_HIGH (64 * 1024)
+// io_uring版で止めた受信を再開する送信待ちの量
+#define ET_WBUF_LOW (16 * 1024)
+
+/**
+ * 接続の状態
+ * CONN_READING: EAGAINまで受信し、応答を送信バッファに積む
+ * CONN_WRITING: 送信待ちが多いため受信を止め、EPOLLOUTで送信の続きを行う
+ * CONN_CLOSING: EOFを受信した 送信待ちを送り切ったらクローズする
+ */
+enum conn_state {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_CLOSING
+};
+
+struct conn {
+    int fd;
+    enum conn_state state;
+    char rbuf[ET_RBUF_SIZE]; // 改行が来ていない受信途中のデータ
+    size_t rlen;
+    char *wbuf; // 送信待ちのデータ wbuf[woff]からwbuf[wlen - 1]までが未送信
+    size_t woff, wlen, wsize;
+    struct twheel_timer timer; // タイムアウト(accept_loop()と同じIDLE、READ、WRITE)
+    enum client_timeout tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+    // 以下はio_uring版でのみ使う
+    char *sbuf; // 送信中のデータ 送信が完了するまで内容を動かせないためwbufとは分ける
+    size_t soff, slen, ssize;
+    uint32_t gen; // 世代番号
+    int recving, sending, dirty;
+    int paused; // 送信待ちがET_WBUF_HIGHを超えたので、ET_WBUF_LOWを下回るまでrecvを投入しない
+};
+
+/**
+ * 接続テーブル
+ * ディスクリプタ番号でO(1)で引けるようにし、足りなくなったら倍々で拡張する
+ * 接続ごとのタイムアウトのタイミングホイールもここに持つ(10万接続でも張り直しはO(1))
+ */
+struct conn_table {
+    struct conn **conn;
+    int size;
+    int count;
+    struct twheel wheel;
+};
+
+/**
+ * 接続テーブルの初期化
+ */
+void conn_table_init(struct conn_table *tbl)
+{
+    (void) memset(tbl, 0, sizeof(*tbl));
+    twheel_init(&tbl->wheel, TIMER_TICK_MS, twheel_clock_ms());
+}
+
+/**
+ * 送信待ちの量(積んでいる分と、io_uring版で送信中の分)
+ */
+size_t conn_pending(struct conn *c)
+{
+    return ((c->wlen - c->woff) + (c->slen - c->soff));
+}
+
+/**
+ * タイムアウト
+ * client_timeout()と同じくshutdown()だけして、EOF、送信エラーとしていつもの経路でクローズさせる
+ * (エッジトリガ版ではEPOLLHUPが、io_uring版では受信・送信の完了が届く)
+ */
+void conn_timeout(struct twheel_timer *t, void *arg)
+{
+    struct conn *c = arg;
+
+    LOGINFO("[fd%d] %s timeout", c->fd, c->tkind == TMO_WRITE ? "write" : c->tkind == TMO_READ ? "read" : "idle");
+    (void) shutdown(c->fd, SHUT_RDWR);
+}
+
+/**
+ * タイムアウトの張り直し
+ * client_arm()と同じ 送信待ちがあればWRITE(減った時だけ張り直す)、
+ * 行の途中ならばREAD(張り直さない)、それ以外はIDLE(毎回張り直す)
+ */
+void conn_arm(struct conn_table *tbl, struct conn *c)
+{
+    enum client_timeout kind;
+    unsigned long ms;
+
+    if (conn_pending(c) > 0) {
+        kind = TMO_WRITE;
+        ms = WRITE_TIMEOUT_MS;
+    } else if (c->rlen > 0) {
+        kind = TMO_READ;
+        ms = READ_TIMEOUT_MS;
+    } else {
+        kind = TMO_IDLE;
+        ms = IDLE_TIMEOUT_MS;
+    }
+    if (kind == c->tkind && twheel_pending(&c->timer)
+        && (kind == TMO_READ || (kind == TMO_WRITE && conn_pending(c) >= c->tmark))) {
+        return;
+    }
+    c->tkind = kind;
+    c->tmark = conn_pending(c);
+    twheel_add(&tbl->wheel, &c->timer, ms);
+}
+
+/**
+ * 接続の登録
+ */
+struct conn *conn_table_add(struct conn_table *tbl, int fd)
+{
+    struct conn **new_conn, *c;
+    int new_size;
+
+    if (fd >= tbl->size) {
+        for (new_size = (tbl->size > 0) ? tbl->size : 1024; new_size <= fd; new_size *= 2);
+        if ((new_conn = realloc(tbl->conn, sizeof(struct conn *) * new_size)) == NULL) {
+            perror("realloc");
+            return (NULL);
+        }
+        (void) memset(new_conn + tbl->size, 0, sizeof(struct conn *) * (new_size - tbl->size));
+        tbl->conn = new_conn;
+        tbl->size = new_size;
+    }
+    if ((c = calloc(1, sizeof(struct conn))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    c->fd = fd;
+    c->state = CONN_READING;
+    twheel_timer_init(&c->timer, conn_timeout, c);
+    tbl->conn[fd] = c;
+    tbl->count++;
+    return (c);
+}
+
+/**
+ * 接続の削除
+ * close()するとEPOLLの監視対象からも自動的に外れる
+ */
+void conn_table_del(struct conn_table *tbl, struct conn *c)
+{
+    tbl->conn[c->fd] = NULL;
+    tbl->count--;
+    twheel_del(&tbl->wheel, &c->timer);
+    (void) close(c->fd);
+    free(c->wbuf);
+    free(c->sbuf);
+    free(c);
+}
+
+/**
+ * 送信バッファへの追加
+ * 送信済みの領域を詰めてから、それでも足りなければ拡張する
+ */
+int conn_append(struct conn *c, const char *data, size_t len)
+{
+    char *new_wbuf;
+    size_t new_size;
+
+    if (c->woff > 0 && c->wlen + len > c->wsize) {
+        (void) memmove(c->wbuf, c->wbuf + c->woff, c->wlen - c->woff);
+        c->wlen -= c->woff;
+        c->woff = 0;
+    }
+    if (c->wlen + len > c->wsize) {
+        for (new_size = (c->wsize > 0) ? c->wsize : 1024; new_size < c->wlen + len; new_size *= 2);
+        if ((new_wbuf = realloc(c->wbuf, new_size)) == NULL) {
+            perror("realloc");
+            return (-1);
+        }
+        c->wbuf = new_wbuf;
+        c->wsize = new_size;
+    }
+    (void) memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+    return (0);
+}
+
+/**
+ * 送信バッファのフラッシュ
+ * EAGAINになるまで送信する
+ * 戻り値 0:送信完了または送信待ち -1:エラー
+ */
+int conn_flush(struct conn *c)
+{
+    ssize_t len;
+
+    while (c->woff < c->wlen) {
+        if ((len = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // 続きはEPOLLOUTで送信する
+                return (0);
+            }
+            perror("send");
+            return (-1);
+        }
+        c->woff += len;
+    }
+    c->woff = c->wlen = 0;
+    return (0);
+}
+
+/**
+ * 受信データから行を切り出して応答を作成
+ * 改行が来ていない残りは次の受信まで持ち越す
+ * 改行が無いままバッファが一杯になった場合はsend_recv()と同様にそこまでを1メッセージとする
+ */
+int conn_parse(struct conn *c)
+{
+    char *start, *end, *nl;
+    size_t len;
+
+    start = c->rbuf;
+    end = c->rbuf + c->rlen;
+    while ((nl = memchr(start, '\n', end - start)) != NULL) {
+        len = nl - start;
+        if (len > 0 && start[len - 1] == '\r') {
+            len--;
+        }
+        // 応答文字列作成
+        if (conn_append(c, start, len) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+            return (-1);
+        }
+        start = nl + 1;
+    }
+    if (start == c->rbuf && c->rlen == sizeof(c->rbuf)) {
+        if (conn_append(c, c->rbuf, c->rlen) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+            return (-1);
+        }
+        start = end;
+    }
+    c->rlen = end - start;
+    (void) memmove(c->rbuf, start, c->rlen);
+    return (0);
+}
+
+/**
+ * 受信
+ * EAGAINになるまで受信する。送信待ちがET_WBUF_HIGHを超えたら途中でCONN_WRITINGに移る
+ * 戻り値 0:正常 -1:エラー
+ */
+int conn_read(struct conn *c)
+{
+    ssize_t len;
+
+    while (c->state == CONN_READING) {
+        if ((len = recv(c->fd, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            perror("recv");
+            return (-1);
+        }
+        if (len == 0) {
+            // EOF 改行の無い最後の行にも応答し、送信待ちを送り切ってからクローズする
+            if (c->rlen > 0) {
+                if (conn_append(c, c->rbuf, c->rlen) == -1 || conn_append(c, ":OK\r\n", 5) == -1) {
+                    return (-1);
+                }
+                c->rlen = 0;
+            }
+            c->state = CONN_CLOSING;
+            break;
+        }
+        c->rlen += len;
+        if (conn_parse(c) == -1) {
+            return (-1);
+        }
+        if (c->wlen - c->woff > ET_WBUF_HIGH) {
+            if (conn_flush(c) == -1) {
+                return (-1);
+            }
+            if (c->wlen - c->woff > ET_WBUF_HIGH) {
+                // 相手が受信しないので送信できるようになるまで受信を止める
+                c->state = CONN_WRITING;
+            }
+        }
+    }
+    return (conn_flush(c));
+}
+
+/**
+ * イベント処理(状態遷移)
+ * 戻り値 0:継続 -1:クローズする
+ */
+int conn_handle(struct conn *c, uint32_t events)
+{
+    if (events & EPOLLERR) {
+        return (-1);
+    }
+    if ((events & EPOLLOUT) && c->woff < c->wlen) {
+        if (conn_flush(c) == -1) {
+            return (-1);
+        }
+    }
+    if (c->state == CONN_WRITING && c->woff == c->wlen) {
+        // 送信し終わったので受信を再開する
+        // エッジトリガでは止めている間に届いたデータは通知されないため、ここで受信する
+        c->state = CONN_READING;
+        events |= EPOLLIN;
+    }
+    if (c->state == CONN_READING && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+        if (conn_read(c) == -1) {
+            return (-1);
+        }
+    }
+    if (c->state == CONN_CLOSING && c->woff == c->wlen) {
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * ディスクリプタ上限の引き上げ
+ * 10万接続を超えるような場合はソフトリミットをハードリミットまで上げておく
+ */
+void raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("setrlimit");
+        return;
+    }
+    LOGINFO("RLIMIT_NOFILE=%lu", (unsigned long) rl.rlim_cur);
+}
+
+/**
+ * アクセプトループ(エッジトリガ版)
+ */
+void accept_loop_et(int soc)
+{
+    struct conn_table tbl;
+    struct conn *c;
+    struct sockaddr_storage from;
+    struct epoll_event ev, *events;
+    int acc, i, epollfd, nfds, flags;
+    socklen_t len;
+
+    // サーバソケットもノンブロッキングにしてEAGAINまでaccept4()できるようにする
+    if ((flags = fcntl(soc, F_GETFL, 0)) == -1 || fcntl(soc, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return;
+    }
+    if ((events = malloc(sizeof(struct epoll_event) * ET_MAX_EVENTS)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    if ((epollfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        free(events);
+        return;
+    }
+    ev.data.fd = soc;
+    ev.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        free(events);
+        return;
+    }
+    conn_table_init(&tbl);
+
+    for (;;) {
+        // タイムアウトは次に接続のタイムアウトが来るまで 無ければ10秒
+        nfds = epoll_wait(epollfd, events, ET_MAX_EVENTS, twheel_next_timeout(&tbl.wheel, twheel_clock_ms(), 10 * 1000));
+        // 期限の来た接続はshutdown()される クローズはこの後のイベントで行う
+        (void) twheel_advance(&tbl.wheel, twheel_clock_ms());
+        if (nfds == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        if (nfds == 0) {
+            // タイムアウト 接続数のみ表示(1件ごとの表示は大量接続時に負荷になるので行わない)
+            LOGDEBUG("<<child count: %d>>", tbl.count);
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.fd == soc) {
+                // バックログが空になるまで接続受付
+                for (;;) {
+                    len = (socklen_t) sizeof(from);
+                    if ((acc = accept4(soc, (struct sockaddr *) &from, &len, SOCK_NONBLOCK)) == -1) {
+                        if (errno == EINTR || errno == ECONNABORTED) {
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            // EMFILEなど 残りは次の接続要求の通知で受け付ける
+                            perror("accept4");
+                        }
+                        break;
+                    }
+                    if ((c = conn_table_add(&tbl, acc)) == NULL) {
+                        (void) close(acc);
+                        continue;
+                    }
+                    // EPOLLOUTも最初から登録しておけば、送信待ちの有無でepoll_ctl()し直す必要がない
+                    ev.data.fd = acc;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+                        perror("epoll_ctl");
+                        conn_table_del(&tbl, c);
+                        continue;
+                    }
+                    conn_arm(&tbl, c);
+                }
+            } else if ((c = tbl.conn[events[i].data.fd]) != NULL) {
+                if (conn_handle(c, events[i].events) == -1) {
+                    // エラーまたは切断
+                    conn_table_del(&tbl, c);
+                } else {
+                    conn_arm(&tbl, c);
+                }
+            }
+        }
+    }
+    (void) close(epollfd);
+    free(events);
+}
+
+/**
+ * io_uring版の接続受付
+ *
+ * select() poll() EPOLLはいずれも「readyの待ち合わせ」「recv()」「send()」で
+ * 1リクエストあたり2〜3回のシステムコールが必要になる。
+ *
+ * io_uringではカーネルと共有したリングバッファ(SQ:投入キュー CQ:完了キュー)に
+ * 操作を積んでおき、完了した結果をまとめて受け取る。ここでは以下を使う
+ * - マルチショットaccept: 1つのSQEで接続のたびに完了(CQE)が届く
+ * - マルチショットrecv: 1つのSQEで受信のたびにCQEが届く
+ *   受信バッファはあらかじめ登録した提供バッファリング(provided buffer ring)からカーネルが選ぶ
+ * - send: 1回分のCQEを処理し終えてから、応答のあった接続の分をまとめて投入する
+ *
+ * CQEの処理とSQEの投入はio_uring_enter()の1回のシステムコールで行う。
+ * SQPOLLモードではカーネルのスレッドがSQを監視するため、投入のためのシステムコールも不要になる。
+ *
+ * liburingは使わず、システムコールとmmap()で直接リングを扱う。
+ * (マルチショットrecvはLinux 6.0以降が必要)
+ */
+
+// SQのエントリ数 CQはこの4倍にする
+#define UR_ENTRIES (4096)
+// 提供バッファの個数(2のべき乗)とサイズ
+#define UR_BUF_COUNT (4096)
+#define UR_BUF_SIZE (2048)
+// 提供バッファのグループID
+#define UR_BGID (0)
+// SQPOLLのカーネルスレッドが休止するまでの時間(ms)
+#define UR_SQ_THREAD_IDLE (2000)
+
+/**
+ * user_dataに操作の種類・ディスクリプタ・世代番号を詰める
+ * クローズ後に同じディスクリプタ番号が再利用された場合に、古いCQEを世代番号で見分ける
+ */
+enum {
+    UR_OP_ACCEPT = 1,
+    UR_OP_RECV,
+    UR_OP_SEND,
+    UR_OP_CANCEL
+};
+#define UR_DATA(op_, fd_, gen_) (((uint64_t) (gen_) << 32) | ((uint64_t) (fd_) << 8) | (uint64_t) (op_))
+#define UR_DATA_OP(d_) ((int) ((d_) & 0xff))
+#define UR_DATA_FD(d_) ((int) (((d_) >> 8) & 0xffffff))
+#define UR_DATA_GEN(d_) ((uint32_t) ((d_) >> 32))
+
+struct uring {
+    int fd;
+    int sqpoll;
+    int ext_arg; // io_uring_enter()にタイムアウトを渡せる(IORING_FEAT_EXT_ARG Linux 5.11以降)
+    // SQ
+    unsigned *sq_head, *sq_tail, *sq_flags, *sq_array;
+    unsigned sq_mask, sq_entries;
+    unsigned sq_local_tail; // 投入前のSQEも含めたtail
+    struct io_uring_sqe *sqes;
+    // CQ
+    unsigned *cq_head, *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // mmap()した領域
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+    // 提供バッファリング
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    unsigned br_tail;
+    // このラウンドで応答が積まれた接続
+    int *dirty;
+    int ndirty, dirty_size;
+    uint32_t gen;
+};
+
+/**
+ * 提供バッファをリングに戻す
+ * uring_buf_commit()でtailを公開するまでカーネルからは見えない
+ */
+void uring_buf_add(struct uring *r, int bid)
+{
+    struct io_uring_buf *b;
+
+    b = &r->br->bufs[r->br_tail & (UR_BUF_COUNT - 1)];
+    b->addr = (uint64_t) (uintptr_t) (r->bufs + (size_t) bid * UR_BUF_SIZE);
+    b->len = UR_BUF_SIZE;
+    b->bid = (uint16_t) bid;
+    r->br_tail++;
+}
+
+void uring_buf_commit(struct uring *r)
+{
+    __atomic_store_n(&r->br->tail, (uint16_t) r->br_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * io_uringの初期化
+ * SQ, CQ, SQEの領域をmmap()し、提供バッファリングを登録する
+ */
+int uring_init(struct uring *r, int sqpoll)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    unsigned i;
+
+    (void) memset(r, 0, sizeof(*r));
+    (void) memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = UR_ENTRIES * 4;
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = UR_SQ_THREAD_IDLE;
+    }
+    if ((r->fd = (int) syscall(__NR_io_uring_setup, UR_ENTRIES, &p)) == -1) {
+        perror("io_uring_setup");
+        return (-1);
+    }
+    r->sqpoll = sqpoll;
+    r->ext_arg = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    if (!r->ext_arg) {
+        LOGWARN("io_uring: no IORING_FEAT_EXT_ARG, connection timeouts are checked only on completions");
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->sq_size = r->cq_size = MAX(r->sq_size, r->cq_size);
+    }
+    if ((r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        perror("mmap");
+        (void) close(r->fd);
+        return (-1);
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else if ((r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        perror("mmap");
+        (void) munmap(r->sq_ptr, r->sq_size);
+        (void) close(r->fd);
+        return (-1);
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        r->fd, IORING_OFF_SQES)) == MAP_FAILED) {
+        perror("mmap");
+        return (-1);
+    }
+    r->sq_head = (unsigned *) ((char *) r->sq_ptr + p.sq_off.head);
+    r->sq_tail = (unsigned *) ((char *) r->sq_ptr + p.sq_off.tail);
+    r->sq_flags = (unsigned *) ((char *) r->sq_ptr + p.sq_off.flags);
+    r->sq_array = (unsigned *) ((char *) r->sq_ptr + p.sq_off.array);
+    r->sq_mask = *(unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_entries = *(unsigned *) ((char *) r->sq_ptr + p.sq_off.ring_entries);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *) ((char *) r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned *) ((char *) r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = *(unsigned *) ((char *) r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ptr + p.cq_off.cqes);
+    // SQのインデックス配列はSQEと1対1に固定しておく
+    for (i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+
+    // 提供バッファリングの登録
+    if ((r->br = mmap(NULL, UR_BUF_COUNT * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (-1);
+    }
+    if ((r->bufs = malloc((size_t) UR_BUF_COUNT * UR_BUF_SIZE)) == NULL) {
+        perror("malloc");
+        return (-1);
+    }
+    (void) memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) r->br;
+    reg.ring_entries = UR_BUF_COUNT;
+    reg.bgid = UR_BGID;
+    if (syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register(IORING_REGISTER_PBUF_RING)");
+        return (-1);
+    }
+    for (i = 0; i < UR_BUF_COUNT; i++) {
+        uring_buf_add(r, (int) i);
+    }
+    uring_buf_commit(r);
+    return (0);
+}
+
+/**
+ * SQの投入とCQEの待ち合わせ
+ * wait_nrが0なら投入のみ
+ * timeout_ms: CQEを待つ最長時間 -1:無期限 (接続のタイムアウトを処理するため)
+ * 戻り値 -1:エラー(タイムアウトはエラーにしない)
  */
-size_t mystrlcat(char *dst, const char *src, size_t size)
+int uring_enter(struct uring *r, unsigned wait_nr, int timeout_ms)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned to_submit, flags;
+    void *argp;
+    size_t argsz;
+    int ret;
 
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+    to_submit = r->sq_local_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    flags = (wait_nr > 0) ? IORING_ENTER_GETEVENTS : 0;
+    if (r->sqpoll) {
+        // SQPOLLではカーネルスレッドが休止している場合のみ起こす
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        to_submit = 0;
+        if (flags == 0) {
+            return (0);
+        }
+    }
+    argp = NULL;
+    argsz = 0;
+    if (wait_nr > 0 && timeout_ms >= 0 && r->ext_arg) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long) (timeout_ms % 1000) * 1000000;
+        (void) memset(&arg, 0, sizeof(arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
     }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+    while ((ret = (int) syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, argp, argsz)) == -1) {
+        if (errno == ETIME) {
+            // タイムアウト 投入は済んでいる
+            return (0);
+        }
+        if (errno != EINTR) {
+            perror("io_uring_enter");
+            return (-1);
+        }
+    }
+    return (ret);
+}
+
+/**
+ * 空きSQEの取得
+ * SQが一杯の場合は溜まっている分を投入してから取得する
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    while (r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries) {
+        if (uring_enter(r, 0, -1) == -1) {
+            return (NULL);
+        }
     }
+    sqe = &r->sqes[r->sq_local_tail & r->sq_mask];
+    (void) memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+    return (sqe);
+}
+
+/**
+ * マルチショットacceptの投入
+ */
+int uring_prep_accept(struct uring *r, int soc)
+{
+    struct io_uring_sqe *sqe;
 
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        return (-1);
     }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = soc;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = UR_DATA(UR_OP_ACCEPT, soc, 0);
+    return (0);
+}
+
+/**
+ * マルチショットrecvの投入
+ * バッファは指定せず、提供バッファリングからカーネルに選ばせる
+ */
+int uring_prep_recv(struct uring *r, struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        return (-1);
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = UR_BGID;
+    sqe->user_data = UR_DATA(UR_OP_RECV, c->fd, c->gen);
+    c->recving = 1;
+    return (0);
+}
+
+/**
+ * マルチショットrecvの取り消しの投入
+ * 取り消されたrecvは-ECANCELEDで(IORING_CQE_F_MOREなしで)完了する
+ */
+int uring_prep_cancel_recv(struct uring *r, struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        return (-1);
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = UR_DATA(UR_OP_RECV, c->fd, c->gen);
+    sqe->user_data = UR_DATA(UR_OP_CANCEL, c->fd, c->gen);
+    return (0);
+}
+
+/**
+ * sendの投入
+ * 送信中はバッファが動かないように、応答を積むwbufと送信中のsbufを入れ替えてから送る
+ */
+int uring_prep_send(struct uring *r, struct conn *c)
+{
+    struct io_uring_sqe *sqe;
+    char *tmp;
+    size_t tmp_size;
+
+    if (c->soff == c->slen) {
+        if (c->wlen == c->woff) {
+            return (0);
+        }
+        tmp = c->sbuf;
+        tmp_size = c->ssize;
+        c->sbuf = c->wbuf;
+        c->ssize = c->wsize;
+        c->soff = c->woff;
+        c->slen = c->wlen;
+        c->wbuf = tmp;
+        c->wsize = tmp_size;
+        c->woff = c->wlen = 0;
+    }
+    if ((sqe = uring_get_sqe(r)) == NULL) {
+        return (-1);
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (c->sbuf + c->soff);
+    sqe->len = (uint32_t) (c->slen - c->soff);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = UR_DATA(UR_OP_SEND, c->fd, c->gen);
+    c->sending = 1;
+    return (0);
+}
+
+/**
+ * 応答が積まれた接続を記録し、ラウンドの最後にまとめてsendを投入する
+ */
+void uring_mark_dirty(struct uring *r, struct conn *c)
+{
+    int *new_dirty, new_size;
+
+    if (c->dirty || c->sending || c->wlen == c->woff) {
+        return;
+    }
+    if (r->ndirty == r->dirty_size) {
+        new_size = (r->dirty_size > 0) ? r->dirty_size * 2 : 1024;
+        if ((new_dirty = realloc(r->dirty, sizeof(int) * new_size)) == NULL) {
+            perror("realloc");
+            return;
+        }
+        r->dirty = new_dirty;
+        r->dirty_size = new_size;
+    }
+    r->dirty[r->ndirty++] = c->fd;
+    c->dirty = 1;
+}
+
+/**
+ * 受信データの処理
+ * 提供バッファの内容をrbufに移しながら、server4.cのエッジトリガ版と同じconn_parse()で行を切り出す
+ */
+int uring_conn_input(struct conn *c, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        n = MIN(len, sizeof(c->rbuf) - c->rlen);
+        (void) memcpy(c->rbuf + c->rlen, data, n);
+        c->rlen += n;
+        data += n;
+        len -= n;
+        if (conn_parse(c) == -1) {
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/**
+ * 受信の一時停止
+ * 読まないクライアントの応答を際限なく積まないように、送信待ちがET_WBUF_HIGHを超えたら
+ * マルチショットrecvを取り消す(エッジトリガ版のCONN_WRITINGに相当)
+ * 取り消しが効くまでに届いていた分のCQEは処理するので、送信待ちはET_WBUF_HIGHを少し超えることがあるが、
+ * それは提供バッファリング(UR_BUF_COUNT * UR_BUF_SIZE)に入っていた分までで、それ以上は受信しない
+ */
+int uring_conn_pause(struct uring *r, struct conn *c)
+{
+    if (c->paused || conn_pending(c) <= ET_WBUF_HIGH) {
+        return (0);
+    }
+    c->paused = 1;
+    if (c->recving) {
+        return (uring_prep_cancel_recv(r, c));
+    }
+    return (0);
+}
+
+/**
+ * 受信の再開
+ * 止めている接続の送信待ちがET_WBUF_LOW以下になったらrecvを投入し直す
+ * (取り消したrecvの完了がまだ届いていない場合は、届いた時にもう一度呼ばれる)
+ */
+int uring_conn_resume(struct uring *r, struct conn *c)
+{
+    if (!c->paused || c->recving || c->state == CONN_CLOSING || conn_pending(c) > ET_WBUF_LOW) {
+        return (0);
+    }
+    c->paused = 0;
+    return (uring_prep_recv(r, c));
+}
+
+/**
+ * 終了処理
+ * recvもsendも完了していればクローズする
+ * recvが残っている場合はshutdown()でEOFを返させる
+ */
+void uring_conn_close(struct conn_table *tbl, struct conn *c)
+{
+    c->state = CONN_CLOSING;
+    if (c->recving) {
+        (void) shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    if (!c->sending && !c->dirty) {
+        conn_table_del(tbl, c);
+    }
+}
+
+/**
+ * CQEの処理
+ */
+void uring_handle_cqe(struct uring *r, struct conn_table *tbl, int soc, struct io_uring_cqe *cqe)
+{
+    struct conn *c;
+    int op, fd, bid;
+
+    op = UR_DATA_OP(cqe->user_data);
+    fd = UR_DATA_FD(cqe->user_data);
+
+    if (op == UR_OP_ACCEPT) {
+        if (cqe->res >= 0) {
+            if ((c = conn_table_add(tbl, cqe->res)) == NULL) {
+                (void) close(cqe->res);
+            } else {
+                c->gen = ++r->gen;
+                if (uring_prep_recv(r, c) == -1) {
+                    conn_table_del(tbl, c);
+                } else {
+                    conn_arm(tbl, c);
+                }
+            }
+        } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            LOGERR("accept: %s", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            // マルチショットが終了したので投入し直す
+            (void) uring_prep_accept(r, soc);
+        }
+        return;
+    }
+    if (op == UR_OP_CANCEL) {
+        // 結果は取り消したrecvのCQEで扱う(完了済みで-ENOENTの場合もある)
+        return;
+    }
+
+    c = (fd < tbl->size) ? tbl->conn[fd] : NULL;
+    if (c != NULL && c->gen != UR_DATA_GEN(cqe->user_data)) {
+        // クローズ済みの古い接続のCQE
+        c = NULL;
+    }
+
+    if (op == UR_OP_RECV) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            if (c != NULL && cqe->res > 0 && c->state != CONN_CLOSING) {
+                if (uring_conn_input(c, r->bufs + (size_t) bid * UR_BUF_SIZE, (size_t) cqe->res) == -1 ||
+                    uring_conn_pause(r, c) == -1) {
+                    uring_conn_close(tbl, c);
+                }
+            }
+            // 処理が終わったバッファはすぐにリングへ戻す(公開はラウンドの最後)
+            uring_buf_add(r, bid);
+        }
+        if (c == NULL) {
+            return;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            c->recving = 0;
+            if (c->paused && (cqe->res > 0 || cqe->res == -ENOBUFS || cqe->res == -ECANCELED) &&
+                c->state != CONN_CLOSING) {
+                // 受信を止めている 送信待ちが減っていれば再開し、そうでなければsendの完了で再開する
+                if (uring_conn_resume(r, c) == -1) {
+                    uring_conn_close(tbl, c);
+                    return;
+                }
+            } else if ((cqe->res > 0 || cqe->res == -ENOBUFS) && c->state != CONN_CLOSING) {
+                // 提供バッファが尽きた場合などは投入し直す
+                if (uring_prep_recv(r, c) == -1) {
+                    uring_conn_close(tbl, c);
+                    return;
+                }
+            } else if (cqe->res == 0 && c->state != CONN_CLOSING) {
+                // EOF 改行の無い最後の行にも応答してからクローズする
+                if (c->rlen > 0) {
+                    if (conn_append(c, c->rbuf, c->rlen) == 0) {
+                        (void) conn_append(c, ":OK\r\n", 5);
+                    }
+                    c->rlen = 0;
+                }
+                c->state = CONN_CLOSING;
+            } else {
+                if (cqe->res < 0 && cqe->res != -ECONNRESET) {
+                    LOGERR("recv: %s", strerror(-cqe->res));
+                }
+                c->state = CONN_CLOSING;
+            }
+        }
+        uring_mark_dirty(r, c);
+        if (c->state == CONN_CLOSING) {
+            uring_conn_close(tbl, c);
+        } else {
+            conn_arm(tbl, c);
+        }
+        return;
+    }
+
+    if (op == UR_OP_SEND) {
+        if (c == NULL) {
+            return;
+        }
+        c->sending = 0;
+        if (cqe->res < 0) {
+            if (cqe->res != -EPIPE && cqe->res != -ECONNRESET) {
+                LOGERR("send: %s", strerror(-cqe->res));
+            }
+            c->soff = c->slen = 0;
+            c->woff = c->wlen = 0;
+            uring_conn_close(tbl, c);
+            return;
+        }
+        c->soff += (size_t) cqe->res;
+        if (c->soff < c->slen) {
+            // 送り切れなかった分を続けて送信
+            if (uring_prep_send(r, c) == -1) {
+                uring_conn_close(tbl, c);
+            } else if (c->state != CONN_CLOSING) {
+                conn_arm(tbl, c);
+            }
+            return;
+        }
+        c->soff = c->slen = 0;
+        uring_mark_dirty(r, c);
+        if (c->state == CONN_CLOSING) {
+            uring_conn_close(tbl, c);
+        } else if (uring_conn_resume(r, c) == -1) {
+            uring_conn_close(tbl, c);
+        } else {
+            conn_arm(tbl, c);
+        }
+    }
+}
+
+/**
+ * アクセプトループ(io_uring版)
+ *
+ * 1ラウンドの流れ
+ * 1: io_uring_enter()で投入済みのSQEをカーネルに渡し、CQEが1つ以上届くまで待つ
+ * 2: 届いているCQEを全て処理する(受信データから応答を作りwbufに積む)
+ * 3: 使い終わった提供バッファをまとめてリングに戻す
+ * 4: 応答が積まれた接続のsendをまとめてSQに積む(次のio_uring_enter()で投入される)
+ *
+ * 送信待ちがET_WBUF_HIGHを超えた接続はrecvを取り消し、sendの完了でET_WBUF_LOWまで減ったら投入し直す。
+ * 接続ごとのタイムアウトはエッジトリガ版と同じで、CQEを待つ時間を次に期限が来るまでにする。
+ */
+void accept_loop_uring(int soc, int sqpoll)
+{
+    struct uring r;
+    struct conn_table tbl;
+    struct conn *c;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail;
+    int i;
+
+    if (uring_init(&r, sqpoll) == -1) {
+        LOGERR("uring_init():error");
+        return;
+    }
+    conn_table_init(&tbl);
+    if (uring_prep_accept(&r, soc) == -1) {
+        return;
+    }
+
+    for (;;) {
+        if (uring_enter(&r, 1, twheel_next_timeout(&tbl.wheel, twheel_clock_ms(), -1)) == -1) {
+            break;
+        }
+        head = *r.cq_head;
+        tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            cqe = &r.cqes[head & r.cq_mask];
+            uring_handle_cqe(&r, &tbl, soc, cqe);
+        }
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        uring_buf_commit(&r);
+        // 期限の来た接続はshutdown()される 受信・送信の完了でクローズする
+        (void) twheel_advance(&tbl.wheel, twheel_clock_ms());
+
+        // 応答のsendをまとめて投入
+        for (i = 0; i < r.ndirty; i++) {
+            if ((c = tbl.conn[r.dirty[i]]) == NULL) {
+                continue;
+            }
+            c->dirty = 0;
+            if (!c->sending && uring_prep_send(&r, c) == -1) {
+                uring_conn_close(&tbl, c);
+                continue;
+            }
+            if (c->state == CONN_CLOSING) {
+                uring_conn_close(&tbl, c);
+            }
+        }
+        r.ndirty = 0;
+    }
+    (void) close(r.fd);
 }
 
 /**
  * 送受信
- * 今回送受信は1回終えるごとにselect()のループに戻る必要がある
+ * 今回送受信は1回終えるごとにepoll_wait()のループに戻る必要がある
  * ch01とは処理が異なる
  * 
- * 単純にrecv()で受診し、応答をsend()で送信したら返るだけの処理
+ * recv()したデータから完全な行を全て切り出し(../common/framer.h)、各行の応答をまとめて1回で送信する。
+ * 改行が来ていない残りは接続ごとのframerに持ち越す。
+ * 送信はノンブロッキングで、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * EOFの場合は改行の無い最後の行にも応答し、cl->eofを立てる(送信待ちを送り切ってからクローズする)。
+ * 
+ * 戻り値 0:継続 -1:エラー
  */
-int send_recv(int acc, int child_no)
+int send_recv(int acc, struct client *cl, int child_no)
 {
-    char buf[512], *ptr;
+    struct resp resp;
+    const char *line;
+    size_t mlen;
     ssize_t len;
 
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = framer_recv(acc, &cl->fr, 0)) == -1) {
         // エラー
         perror("recv");
         return (-1);
@@ -325,22 +1635,27 @@ int send_recv(int acc, int child_no)
 
     if (len == 0) {
         // EOF
-        (void) fprintf(stderr, "[child%d] recv:EOF\n", child_no);
-        return (-1);
+        LOGINFO("[child%d] recv:EOF", child_no);
+        cl->eof = 1;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-        *ptr = '\0';
+    // 行の切り出し・表示 行は受信バッファを指しているので'\0'終端は不要
+    resp_init(&resp);
+    while (framer_next(&cl->fr, &line, &mlen) || (cl->eof && framer_rest(&cl->fr, &line, &mlen))) {
+        LOGDEBUG("[child%d]%.*s", child_no, (int) mlen, line);
+        // 応答作成 各行と":OK\r\n"をiovecで並べるだけでコピーはしない
+        if (resp_add_ok(&resp, line, mlen) == -1) {
+            // iovが一杯 ここまでを送信して続ける
+            if (outq_send(acc, &cl->out, &resp) == -1) {
+                perror("send");
+                return (-1);
+            }
+            (void) resp_add_ok(&resp, line, mlen);
+        }
     }
-    (void) fprintf(stderr, "[child%d]%s\n", child_no, buf);
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = strlen(buf);
 
-    // 応答
-    if ((len = send(acc, buf, len, 0)) == -1) {
+    // 応答 まとめて1回で送信する 送れなかった分は送信待ちに積む
+    if (resp.iovcnt > 0 && outq_send(acc, &cl->out, &resp) == -1) {
         // エラー
         perror("send");
         return (-1);
@@ -358,9 +1673,22 @@ int main(int argc, char *argv[])
     int soc;
     // 引数にポート番号が指定されているか?
     if (argc <= 1) {
-        (void) fprintf(stderr, "server2 port\n");
+        (void) fprintf(stderr, "server4 port [[L]evel/[E]dge/io_[U]ring] [[S]qpoll]\n");
         return (EX_USAGE);
     }
+    // モードオプションの判定
+    if (argc >= 3 && toupper(argv[2][0]) == 'E') {
+        (void) fprintf(stderr, "Edge-triggered mode\n");
+        g_mode = 'e';
+        raise_nofile_limit();
+    } else if (argc >= 3 && toupper(argv[2][0]) == 'U') {
+        g_mode = 'u';
+        g_sqpoll = (argc >= 4 && toupper(argv[3][0]) == 'S');
+        (void) fprintf(stderr, "io_uring mode%s\n", g_sqpoll ? " (SQPOLL)" : "");
+        raise_nofile_limit();
+    } else {
+        g_mode = 'l';
+    }
     // サーバソケットの準備
     if ((soc = server_socket(argv[1])) == -1) {
         (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
@@ -368,7 +1696,13 @@ int main(int argc, char *argv[])
     }
     (void) fprintf(stderr, "ready for accept\n");
     // アクセプトループ
-    accept_loop(soc);
+    if (g_mode == 'e') {
+        accept_loop_et(soc);
+    } else if (g_mode == 'u') {
+        accept_loop_uring(soc, g_sqpoll);
+    } else {
+        accept_loop(soc);
+    }
 
     // ソケットクローズ
     (void) close(soc);
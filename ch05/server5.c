@@ -22,6 +22,9 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+#include "../common/log.h"
+
 /**
  * 接続受付準備
  * 
@@ -134,44 +137,20 @@ int server_socket(const char *portnm)
 }
 
 
-/**
- * サイズ指定文字列連結
- * 
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
-
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
-
 /**
  * 送受信ループ
  * ch01 server.cと同一だが、デバッグ用にプロセスID(getpid()で取得)をログ表示させる。
  */
 void send_recv_loop(int acc)
 {
-  char buf[512], *ptr;
+  char buf[512];
+  struct iobuf in = IOBUF_INIT(buf);
+  struct resp resp;
+  size_t mlen;
   ssize_t len;
   for (;;) {
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = iobuf_recv(acc, &in, 0)) == -1) {
       // エラー
       perror("recv");
       break;
@@ -179,23 +158,20 @@ void send_recv_loop(int acc)
 
     if (len == 0) {
       // end of file
-      (void) fprintf(stderr, "<%d>recv:EOF\n", getpid());
+      LOGINFO("<%d>recv:EOF", getpid());
       break;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-      *ptr = '\0';
-    }
-    (void) fprintf(stderr, "<%d>[client]%s\n", getpid(), buf);
+    // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+    mlen = msg_line_len(in.data, in.len);
+    LOGDEBUG("<%d>[client]%.*s", getpid(), (int) mlen, in.data);
 
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
+    // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+    resp_init(&resp);
+    (void) resp_add_ok(&resp, in.data, mlen);
 
     // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+    if ((len = resp_send(acc, &resp, 0)) == -1) {
       // エラー
       perror("send");
       break;
@@ -246,7 +222,6 @@ void send_recv_loop(int acc)
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
     struct sockaddr_storage from;
     int acc, status;
     pid_t pid;
@@ -262,11 +237,7 @@ void accept_loop(int soc)
                 perror("accept");
             }
         } else {
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                            hbuf, sizeof(hbuf),
-                            sbuf, sizeof(sbuf),
-                            NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+            LOGINFO("accept:%P", &from);
             if ((pid = fork()) == 0) {
                 /**
                  * 0: プロセスが複製されたときの子プロセス側
@@ -280,7 +251,8 @@ void accept_loop(int soc)
                 send_recv_loop(acc);
                 // アクセプトソケットクローズ
                 (void) close(acc);
-                // 子プロセス終了
+                // 子プロセス終了 _exit()ではatexit()が呼ばれないので、溜まったログはここで書き出す
+                log_flush();
                 _exit(1);
             } else if (pid > 0) {
                 // fork()成功 親プロセス
@@ -302,16 +274,15 @@ void accept_loop(int soc)
              */
             if ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
                 // 子プロセス終了あり
-                (void) fprintf(stderr, "accept_loop:waitpid:pid=%d, status=%d\n", pid, status);
-                (void) fprintf(stderr,
-                                " WIFEXITED: %d, WEXITSSTATUS:%d, WIFSIGNALED:%d,"
-                                "WTERMSIG:%d, WIFSTOPPED:%d, WSTOPSIG:%d\n",
-                                WIFEXITED(status),
-                                WEXITSTATUS(status),
-                                WIFSIGNALED(status),
-                                WTERMSIG(status),
-                                WIFSTOPPED(status),
-                                WSTOPSIG(status));
+                LOGINFO("accept_loop:waitpid:pid=%d, status=%d", pid, status);
+                LOGINFO(" WIFEXITED: %d, WEXITSSTATUS:%d, WIFSIGNALED:%d,"
+                        "WTERMSIG:%d, WIFSTOPPED:%d, WSTOPSIG:%d",
+                        WIFEXITED(status),
+                        WEXITSTATUS(status),
+                        WIFSIGNALED(status),
+                        WTERMSIG(status),
+                        WIFSTOPPED(status),
+                        WSTOPSIG(status));
             }
         }
     }
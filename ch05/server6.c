@@ -4,6 +4,9 @@
  * 
  * pthreadを使ってマルチスレッドの機能を使う
  */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -17,12 +20,20 @@
 #include <errno.h>
 #include <pthread.h> // 追加
 #include <signal.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+#include "../common/log.h"
+#include "../common/outq.h"
+#include "../common/pool.h"
+
 /**
  * 接続受付準備
  * 
@@ -143,144 +154,305 @@ int server_socket(const char *portnm)
  * マルチスレッドではpthread_create()という関数に明示的にスレッドとして生成したい関数を指定する。
  * その指定された関数から別スレッドになる
  * 
- * ここではsend_recv_loop()をスレッド開始関数とする　今回は名前を変えてsend_recv_thread()という関数にする
+ * 以前は接続ごとにpthread_create()していたが、スレッド生成のコストが接続ごとにかかり、
+ * デフォルトのスタック(8MB)のスレッドが上限無く増えていた。
+ * ここでは起動時に決まった数のワーカスレッドをスレッドプール(../common/pool.h)として作っておき、
+ * 接続を仕事(タスク)として投入する。
+ * 
+ * モード
+ * - N(ノンブロッキング): アクセプトループがepollで受信可能になった接続を見つけ、その接続の処理をタスクとして投入する。
+ *   タスクは受信できるだけ処理したら(EAGAIN)epollに戻して終わるので、少ないワーカで多数の接続を扱える。
+ *   送信もノンブロッキングで、送れなかった応答は接続ごとの送信待ちに積んで、書き込み可能になったら続きを送る。
+ *   読まないクライアントがいてもワーカがsend()で止まらない。
+ * - B(ブロッキング): これまでと同じsend_recv_loop()をタスクとして実行する。接続中はワーカを1つ占有するので、
+ *   スタックを小さくしたワーカを多めに用意する。
  */
 
-
 /**
- * サイズ指定文字列連結
+ * プリプロセッサ定義・グローバル変数
  * 
+ * TASK_BUDGET: 1回のタスクで処理するメッセージの上限 他の接続が待たされないように、超えたらepollに戻す
+ * REPORT_SEC: ワーカごとの統計を表示する間隔
  */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
+#define TASK_BUDGET (16)
+#define REPORT_SEC (10)
+#define MAX_EVENTS (256)
 
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
+char g_mode = 'N';
+int g_epfd = -1;
+struct pool *g_pool;
+
+/**
+ * Nモードの接続
+ * epollのdata.ptrに持つ(サーバソケットはNULL)
+ * EPOLLONESHOTなので、同時にこの接続を扱うワーカは1つだけ
+ */
+struct client {
+    int fd;
+    struct outq out; // 送れなかった応答
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+};
 
 /**
  * 送受信
  * 
- * 送受信スレッド
+ * 送受信ループ(Bモード)
  * 
- * 送受信自体はこれまでと同じだが、pthread_create()に渡すために、関数のシグニチャ(型)が変わっている。
+ * 送受信自体はこれまでと同じで、1つの接続が終わるまで戻らない。
  */
-void * send_recv_thread(void *arg)
+void send_recv_loop(int acc)
 {
-    char buf[512], *ptr;
+    char buf[512];
+    struct iobuf in = IOBUF_INIT(buf);
+    struct resp resp;
+    size_t mlen;
     ssize_t len;
-    int acc;
-
-    /**
-     * スレッドのデタッチ
-     * 
-     * 関数の先頭で行う。
-     * これを行うか、pthread_create()の第2引数でPTHREAD_CREATE_DETACHEDを指定しておかないと
-     * スレッドが終了してもpthread_join()で終了状態を得るまでリソースが解放されない。
-     * マルチプロセスのfork() wait()のようなもの
-     */
-    (void) pthread_detach(pthread_self());
-    // 引数の取得
-    acc = (int) arg;
 
     for (;;) {
         /** 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        if ((len = iobuf_recv(acc, &in, 0)) == -1) {
             /* エラー */
             perror("recv");
             break;
         }
         if (len == 0) {
             /* EOF */
-            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
+            LOGINFO("<%d>recv:EOF", (int) pthread_self());
             break;
         }
 
-        /* 文字列化・表示 */
-        buf[len] = '\0';
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
+        /* 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要 */
+        mlen = msg_line_len(in.data, in.len);
 
-        (void) fprintf(stderr, "<%d>[client]%s\n", (int) pthread_self(), buf);
-        /* 応答文字列作成 */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
+        LOGDEBUG("<%d>[client]%.*s", (int) pthread_self(), (int) mlen, in.data);
+        /* 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない */
+        resp_init(&resp);
+        (void) resp_add_ok(&resp, in.data, mlen);
         /* 応答 */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+        if ((len = resp_send(acc, &resp, 0)) == -1) {
             /* エラー */
             perror("send");
             break;
         }
     }
+}
+
+/**
+ * Bモードのタスク
+ * 引数はアクセプトソケット
+ */
+void block_task(void *arg)
+{
+    int acc = (int) (intptr_t) arg;
+
+    send_recv_loop(acc);
     /* アクセプトソケットのクローズ
      * マルチスレッドの場合はあくまでも1プロセスの中の処理で、クローズやメモリの解放忘れはプロセスが終了するまで解放されない。
      */
     (void) close(acc);
-    pthread_exit((void *) 0);
-    /* NOT REACHED */
-    return ((void *) 0);
+}
+
+/**
+ * 接続のクローズ クローズするとepollからも外れる
+ */
+void client_close(struct client *cl)
+{
+    (void) close(cl->fd);
+    outq_free(&cl->out);
+    free(cl);
+}
+
+/**
+ * 監視するイベントの決定
+ * 送信待ちがある間だけEPOLLOUT、送信待ちが多い間とEOFの後はEPOLLINを外す
+ * 戻り値 0:EOFの後に送り切ったのでクローズしてよい
+ */
+uint32_t client_events(struct client *cl)
+{
+    uint32_t events;
+
+    events = 0;
+    if (!cl->eof && outq_readable(&cl->out)) {
+        events |= EPOLLIN;
+    }
+    if (outq_pending(&cl->out) > 0) {
+        events |= EPOLLOUT;
+    }
+    return (events);
+}
+
+/**
+ * Nモードのタスク
+ * 
+ * 読み書き可能になった接続について、送信待ちがあれば送り、受信できるだけ(最大TASK_BUDGET件)処理する。
+ * recv()、send()はどちらもMSG_DONTWAITで行い、EAGAINになったらEPOLLONESHOTでepollに登録し直して終わる。
+ * EPOLLONESHOTなので、このタスクが終わるまで同じ接続のタスクが別のワーカで動くことはない。
+ * 
+ * 送れなかった応答はoutq_send()で送信待ちに積み、送信待ちがある間はEPOLLOUTも監視する。
+ * 送信待ちがOUTQ_HIGHを超えたら、減るまで受信しない(読まないクライアントの分を溜め込まない)。
+ */
+void conn_task(void *arg)
+{
+    char buf[512];
+    struct iobuf in = IOBUF_INIT(buf);
+    struct client *cl = arg;
+    struct resp resp;
+    struct epoll_event ev;
+    size_t mlen;
+    ssize_t len;
+    int acc, i;
+
+    acc = cl->fd;
+    if (outq_pending(&cl->out) > 0 && outq_flush(acc, &cl->out) == -1) {
+        perror("send");
+        client_close(cl);
+        return;
+    }
+    for (i = 0; i < TASK_BUDGET && !cl->eof && outq_readable(&cl->out); i++) {
+        /** 受信 */
+        if ((len = iobuf_recv(acc, &in, MSG_DONTWAIT)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            /* エラー */
+            perror("recv");
+            client_close(cl);
+            return;
+        }
+        if (len == 0) {
+            /* EOF 送信待ちを送り切ってからクローズする */
+            LOGINFO("<%d>recv:EOF", (int) pthread_self());
+            cl->eof = 1;
+            break;
+        }
+
+        /* 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要 */
+        mlen = msg_line_len(in.data, in.len);
+
+        LOGDEBUG("<%d>[client]%.*s", (int) pthread_self(), (int) mlen, in.data);
+        /* 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない */
+        resp_init(&resp);
+        (void) resp_add_ok(&resp, in.data, mlen);
+        /* 応答 送れなかった分は送信待ちに積む */
+        if (outq_send(acc, &cl->out, &resp) == -1) {
+            /* エラー */
+            perror("send");
+            client_close(cl);
+            return;
+        }
+    }
+
+    /* 受信データが無くなった、上限、送信待ちが多い、またはEOF epollに戻す */
+    if ((ev.events = client_events(cl)) == 0) {
+        client_close(cl);
+        return;
+    }
+    ev.data.ptr = cl;
+    ev.events |= EPOLLONESHOT;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, acc, &ev) == -1) {
+        perror("epoll_ctl");
+        client_close(cl);
+    }
+}
+
+/**
+ * ワーカごとの統計の表示
+ * depth: キューに溜まっているタスク数 run: 実行したタスク数 stolen: 他のワーカから盗んだタスク数
+ */
+void pool_report(void)
+{
+    struct pool_stat st;
+    int i;
+
+    for (i = 0; i < g_pool->nworker; i++) {
+        pool_stat(g_pool, i, &st);
+        LOGINFO("<<worker%d>> depth:%lu run:%lu stolen:%lu", i, st.depth, st.run, st.stolen);
+    }
 }
 
 /**
  * アクセプトループ
+ * 
+ * サーバソケットとNモードの接続をepollで監視する。
+ * 接続はEPOLLONESHOTで登録しておき、読み書き可能になったらタスクとして投入する(投入した時点で監視から外れる)。
+ * タイムアウトごとにワーカの統計を表示する。
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    struct epoll_event ev, events[MAX_EVENTS];
     struct sockaddr_storage from;
-    int acc;
+    struct client *cl;
+    time_t last, now;
+    int acc, i, nfds;
     socklen_t len;
-    pthread_t thread_id;
-    void *send_recv_thread(void *arg);
 
+    if ((g_epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return;
+    }
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(g_epfd);
+        return;
+    }
+
+    last = time(NULL);
     for (;;) {
-        len = (socklen_t) sizeof(from);
-        // 接続受付
-        if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+        if ((nfds = epoll_wait(g_epfd, events, MAX_EVENTS, REPORT_SEC * 1000)) == -1) {
             if (errno != EINTR) {
-                perror("accept");
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        if ((now = time(NULL)) - last >= REPORT_SEC) {
+            pool_report();
+            last = now;
+        }
+        for (i = 0; i < nfds; i++) {
+            if ((cl = events[i].data.ptr) != NULL) {
+                // 読み書き可能になった接続
+                if (pool_submit(g_pool, conn_task, cl) == -1) {
+                    perror("pool_submit");
+                    client_close(cl);
+                }
+                continue;
+            }
+
+            len = (socklen_t) sizeof(from);
+            // 接続受付
+            if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+                if (errno != EINTR) {
+                    perror("accept");
+                }
+                continue;
+            }
+            LOGINFO("accept:%P", &from);
+
+            if (g_mode == 'B') {
+                // 接続中ワーカを1つ占有する
+                if (pool_submit(g_pool, block_task, (void *) (intptr_t) acc) == -1) {
+                    perror("pool_submit");
+                    (void) close(acc);
+                }
+                continue;
+            }
+            if ((cl = calloc(1, sizeof(*cl))) == NULL) {
+                perror("calloc");
+                (void) close(acc);
+                continue;
             }
-        } else {
-            (void) getnameinfo((struct sockaddr *) &from, &len,
-                                        hbuf, sizeof(hbuf),
-                                        sbuf, sizeof(sbuf),
-                                        NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-
-            /**
-             * スレッド生成
-             * 
-             * pthread_createでsend_recv_threadを開始関数としてスレッド生成する。
-             * pthread_createでは1つだけスレッド開始関数に引数を渡せる。今回はアクセプトソケットを渡すようにしている。
-             * 本来はグローバル変数を確保して、それのアドレスを渡さないといけない。その場合はロックを行わないと以上動作する可能性がある。
-             * そのため値渡しにしている
-             * 
-             * pthread_create()の引数
-             * 1: スレッド属性 NULLを指定するとデフォルト属性(合流可能・デフォルトスケジューリング)
-             * 
-             * マルチスレッドの場合スレッド生成後に子スレッドはこの関数には2度と戻れない
-             */
-            if (pthread_create(&thread_id, NULL, send_recv_thread, (void *) acc) != 0) {
-                perror("pthread_create");
-            } else {
-                (void) fprintf(stderr, "pthread_create:create:thread_id=%d\n", (int) thread_id);
+            cl->fd = acc;
+            outq_init(&cl->out);
+            ev.data.ptr = cl;
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+                perror("epoll_ctl");
+                client_close(cl);
             }
         }
     }
@@ -291,16 +463,46 @@ void accept_loop(int soc)
  * main
  * 
  * ch01 server.cとほぼ同じ
+ * 
+ * 起動時にワーカスレッドを全て作っておく。
+ * ワーカ数のデフォルトはNモードではCPU数、Bモードでは同時に処理できる接続数になるので多めにし、その分スタックを小さくする。
  */
 int main(int argc, char *argv[])
 {
-    int soc;
+    cpu_set_t cpus;
+    size_t stack_kb;
+    int soc, nworker;
 
     // 引数にポート番号が指定されているか?
     if (argc <= 1) {
-        (void) fprintf(stderr, "server5 port\n");
+        (void) fprintf(stderr, "server6 port [[N]onblock/[B]lock] [workers] [stack KB]\n");
         return (EX_USAGE);
     }
+    if (argc >= 3) {
+        g_mode = (char) toupper(argv[2][0]);
+        if (g_mode != 'N' && g_mode != 'B') {
+            (void) fprintf(stderr, "mode error (%s)\n", argv[2]);
+            return (EX_USAGE);
+        }
+    }
+    if (g_mode == 'B') {
+        nworker = 64;
+        stack_kb = 64;
+    } else {
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("sched_getaffinity");
+            return (EX_OSERR);
+        }
+        nworker = CPU_COUNT(&cpus);
+        stack_kb = 0; // デフォルト
+    }
+    if (argc >= 4 && (nworker = atoi(argv[3])) <= 0) {
+        (void) fprintf(stderr, "workers error (%s)\n", argv[3]);
+        return (EX_USAGE);
+    }
+    if (argc >= 5) {
+        stack_kb = (size_t) atoi(argv[4]);
+    }
 
     // サーバソケットの準備
     if ((soc = server_socket(argv[1])) == -1) {
@@ -308,7 +510,14 @@ int main(int argc, char *argv[])
         return (EX_UNAVAILABLE);
     }
 
-    (void) fprintf(stderr, "ready for accept\n");
+    // ワーカスレッドの生成
+    if ((g_pool = pool_create(nworker, stack_kb * 1024)) == NULL) {
+        perror("pool_create");
+        return (EX_OSERR);
+    }
+
+    (void) fprintf(stderr, "ready for accept (%s mode, %d workers, stack %zuKB)\n",
+                   g_mode == 'B' ? "blocking" : "non-blocking", nworker, stack_kb);
 
     // アクセプトループ
     accept_loop(soc);
@@ -317,4 +526,3 @@ int main(int argc, char *argv[])
     (void) close(soc);
     return (EX_OK);
 }
-
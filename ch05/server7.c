@@ -2,17 +2,28 @@
  * ch05
  * 5.7.1 マルチプロセスによる多重化 子プロセスのプリフォーク型
  * 
- * サーバソケットを準備してから、子プロセスをあらかじめ決めた数だけ起動し、排他処理を
- * 行いながらアクセプトさせ、送受信処理を行わせる。
+ * サーバソケットを準備してから、子プロセスをあらかじめ起動しておき、アクセプトさせ、送受信処理を行わせる。
  * 
  * マルチプロセスのポイントは、排他をどのように行うか。
  * IPCのセマフォを使う方法や、flock(), lockf(), fcntl()など様々な方法がある
- * ここでは一番汎用的でわかりやすいlockf()を使ったファイルでのロックを使う
+ * 以前はlockf()を使ったファイルでのロックでaccept()を1つの子プロセスずつに絞っていたが、
+ * 接続ごとにファイルロックの獲得・解放のシステムコールが2回ずつ必要になる。
  * 
- * lockf()は内部でfcntl()を呼び出している。直接fcntl()を使っての排他と同等。
- * flock()はNFSで使えず、古い感じがある。
+ * ここではロックを使わずに、カーネルに振り分けさせる。
+ * - E(EPOLLEXCLUSIVE): 子プロセスごとのepollに共有のサーバソケットをEPOLLEXCLUSIVEで登録する。
+ *   接続要求が来た時に起こされるのは待っている子プロセスのうち1つ(以上)だけになり、全員が起こされること(thundering herd)が無い。
+ * - R(SO_REUSEPORT): 子プロセスごとにSO_REUSEPORTのサーバソケットを作る。接続はカーネルがソケットごとに振り分ける。
+ *   子プロセスが終了するとそのソケットのバックログに残っていた接続はリセットされる点に注意。
+ *   また振り分けは接続要求の時点で決まるので、処理中の子プロセスに振り分けられた接続はその子プロセスが空くまで待たされる。
+ * 
+ * 子プロセスの数はApacheのpreforkと同様に、親プロセス(スーパーバイザ)が空いている(アイドル)子プロセスの数を見て増減させる。
+ * 子プロセスは共有メモリのスコアボードに自分の状態(アイドル・処理中)を書き、親プロセスはそれを1秒ごとに見て
+ * - アイドルがMIN_SPARE未満なら子プロセスを増やす(1, 2, 4, ...と倍々に、MAX_CHILDまで)
+ * - アイドルがMAX_SPAREを超えていればアイドルの子プロセスを1つ終了させる
+ * - 終了した子プロセスはwaitpid()で回収してスロットを空ける(足りなくなれば上の処理で作り直される)
  */
-#include <sys/file.h> // 追加
+#include <sys/epoll.h> // 追加
+#include <sys/mman.h> // 追加
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -24,49 +35,70 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+#include "../common/log.h"
+
 /**
  * プリプロセッサ定義・グローバル変数
  * 
- * 子プロセスの数とロックファイルのパスを定義する。
- * ここではオーバーした場合のテストがしやすいように子プロセス数は2にしている。
- */
-#define NUM_CHILD 2
-#define LOCK_FILE "./server7.lock"
-
-/**
- * ロックファイルのfdをグローバルで定義。
+ * MIN_SPARE、MAX_SPARE: アイドルの子プロセス数の下限・上限 起動時はMIN_SPAREだけ作る
+ * MAX_CHILD: 子プロセス数の上限 (スコアボードの大きさ)
+ * MAX_SPAWN_RATE: 1秒間に作る子プロセス数の上限
+ * REPORT_SEC: スコアボードを表示する間隔
  * 
- * これまでのサンプルと似たような状態にしておくのと、
- * 将来的にシグナル処理をきちんと作るときに便利なためグローバルにしておく。
- **/
-int g_lock_fd = -1;
+ * 起動時引数でMIN_SPARE、MAX_SPARE、MAX_CHILDは変更できる。
+ */
+#define MIN_SPARE (2)
+#define MAX_SPARE (5)
+#define MAX_CHILD (32)
+#define MAX_SPAWN_RATE (32)
+#define REPORT_SEC (10)
+// 終了時にSIGTERMを送ってからSIGKILLするまでの猶予(秒)
+#define STOP_GRACE_SEC (5)
 
 /**
- * 接続受付
- * ch01 server.cとほぼ同じ
- * アクセプトの前に排他処理のためロック獲得を行う。
- * lockf()は第2引数にF_LOCKを指定すると、ロックが獲得できるまで待つ。
- * 
- * ロックが獲得できた場合にアクセプトをおこない、ロックを解放する。
- * ロックの解放はlockf()の第2引数にF_ULOCKを指定する。
+ * スコアボード
  * 
- * 送受信処理を行なった後、アクセプトソケットをクローズし、またロック獲得待ちになる。
+ * mmap()でMAP_SHARED | MAP_ANONYMOUSの領域を作ってからfork()するので、親子で同じメモリを見る。
+ * 1つのスロットには1つの子プロセスの状態が入る。stateは子プロセスが、それ以外は親プロセスが書く。
  */
+enum slot_state {
+    SLOT_EMPTY, // 空き
+    SLOT_STARTING, // fork()した直後 アイドルとして数える
+    SLOT_IDLE, // 接続待ち
+    SLOT_BUSY, // 送受信中
+    SLOT_STOPPING // 親プロセスが終了を指示した
+};
+
+struct score {
+    pid_t pid;
+    int state;
+    unsigned long served; // 処理した接続数
+};
+
+struct score *g_score;
+int g_max_child = MAX_CHILD;
+char g_mode = 'E';
+volatile sig_atomic_t g_stop; // 子プロセス:終了の指示 親プロセス:SIGINT, SIGTERM
 
 /**
  * 接続受付準備
  * 
  * ソケットの生成から接続待受の段階ではマルチクライアントに関する配慮は必要ない
  * ch01 server.cと同じ関数を利用
+ * 
+ * reuseportが0以外の場合はSO_REUSEPORTを指定する(Rモードで子プロセスごとに呼び出す)。
  */
-int server_socket(const char *portnm)
+int server_socket(const char *portnm, int reuseport)
 {
   char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
   struct addrinfo hints, *res0;
@@ -128,6 +160,12 @@ int server_socket(const char *portnm)
     freeaddrinfo(res0);
     return -1;
   }
+  if (reuseport && setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &opt, opt_len) == -1) {
+    perror("setsockopt");
+    (void) close(soc);
+    freeaddrinfo(res0);
+    return -1;
+  }
 
   /**
    * ソケットにアドレスを指定
@@ -172,44 +210,20 @@ int server_socket(const char *portnm)
 }
 
 
-/**
- * サイズ指定文字列連結
- * 
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
-
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
-
 /**
  * 送受信ループ
  * ch01 server.cと同一だが、デバッグ用にプロセスID(getpid()で取得)をログ表示させる。
  */
 void send_recv_loop(int acc)
 {
-  char buf[512], *ptr;
+  char buf[512];
+  struct iobuf in = IOBUF_INIT(buf);
+  struct resp resp;
+  size_t mlen;
   ssize_t len;
   for (;;) {
     // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    if ((len = iobuf_recv(acc, &in, 0)) == -1) {
       // エラー
       perror("recv");
       break;
@@ -217,23 +231,20 @@ void send_recv_loop(int acc)
 
     if (len == 0) {
       // end of file
-      (void) fprintf(stderr, "<%d>recv:EOF\n", getpid());
+      LOGINFO("<%d>recv:EOF", getpid());
       break;
     }
 
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-      *ptr = '\0';
-    }
-    (void) fprintf(stderr, "<%d>[client]%s\n", getpid(), buf);
+    // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+    mlen = msg_line_len(in.data, in.len);
+    LOGDEBUG("<%d>[client]%.*s", getpid(), (int) mlen, in.data);
 
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
+    // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+    resp_init(&resp);
+    (void) resp_add_ok(&resp, in.data, mlen);
 
     // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
+    if ((len = resp_send(acc, &resp, 0)) == -1) {
       // エラー
       perror("send");
       break;
@@ -241,48 +252,276 @@ void send_recv_loop(int acc)
   }
 }
 
+/**
+ * 子プロセスの終了指示(SIGTERM)
+ */
+void sig_term_handler(int sig)
+{
+  (void) sig;
+  g_stop = 1;
+}
+
 /**
  * アクセプトループ
+ * 
+ * 子プロセスで実行する。slotはスコアボードの自分の位置。
+ * サーバソケットをepollで待ち、readyになったらaccept()する。
+ * EモードではEPOLLEXCLUSIVEで登録するので、1つの接続要求で起こされるのは一部の子プロセスだけになる。
+ * 起こされても他の子プロセスが先にaccept()する場合があるので、サーバソケットはノンブロッキングにしておく。
+ * 
+ * SIGTERMは普段はブロックしておき、epoll_pwait()で待っている間だけ受け取る。
+ * 送受信中に終了を指示された場合は、その接続が終わってから終了する。
  */
-void accept_loop(int soc)
+void accept_loop(int soc, int slot)
 {
-  char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+  struct epoll_event ev;
   struct sockaddr_storage from;
-  int acc;
+  sigset_t waitmask;
+  int epfd, acc;
   socklen_t len;
 
-  for (;;) {
-    /**
-     * ロック獲得
-     */
-    (void) fprintf(stderr, "<%d>ロック獲得開始\n", getpid());
-    (void) lockf(g_lock_fd, F_LOCK, 0);
-    (void) fprintf(stderr, "<%d>ロック獲得! \n", getpid());
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("epoll_create1");
+    return;
+  }
+  ev.data.fd = soc;
+  ev.events = EPOLLIN | (g_mode == 'E' ? EPOLLEXCLUSIVE : 0);
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+    perror("epoll_ctl");
+    (void) close(epfd);
+    return;
+  }
+  (void) fcntl(soc, F_SETFL, fcntl(soc, F_GETFL, 0) | O_NONBLOCK);
+  (void) sigprocmask(SIG_SETMASK, NULL, &waitmask);
+  (void) sigdelset(&waitmask, SIGTERM);
+
+  while (!g_stop) {
+    __atomic_store_n(&g_score[slot].state, SLOT_IDLE, __ATOMIC_RELEASE);
+    if (epoll_pwait(epfd, &ev, 1, -1, &waitmask) == -1) {
+      if (errno != EINTR) {
+        perror("epoll_pwait");
+      }
+      continue;
+    }
 
     len = (socklen_t) sizeof(from);
     /**
      * 接続受付
      */
     if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
-      if (errno != EINTR) {
+      if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
         perror("accept");
       }
-      (void) fprintf(stderr, "<%d>ロック解放\n", getpid());
-      // ロック解放
-      (void) lockf(g_lock_fd, F_ULOCK, 0);
-    } else {
-      (void) getnameinfo((struct sockaddr *) &from, len,
-                                    hbuf, sizeof(hbuf),
-                                    sbuf, sizeof(sbuf),
-                                    NI_NUMERICHOST | NI_NUMERICSERV);
-      (void) fprintf(stderr, "<%d>accept:%s:%s\n", getpid(), hbuf, sbuf);
-      (void) fprintf(stderr, "<%d>ロック解放\n", getpid());
-      // ロック解放
-      (void) lockf(g_lock_fd, F_ULOCK, 0);
-      // 送受信ループ
-      send_recv_loop(acc);
-      // アクセプトソケットクローズ
-      (void) close(acc);
+      continue;
+    }
+    // アクセプトソケットはブロッキングに戻す
+    (void) fcntl(acc, F_SETFL, fcntl(acc, F_GETFL, 0) & ~O_NONBLOCK);
+    __atomic_store_n(&g_score[slot].state, SLOT_BUSY, __ATOMIC_RELEASE);
+    LOGINFO("<%d>accept:%P", getpid(), &from);
+    // 送受信ループ
+    send_recv_loop(acc);
+    // アクセプトソケットクローズ
+    (void) close(acc);
+    __atomic_add_fetch(&g_score[slot].served, 1, __ATOMIC_RELAXED);
+  }
+  (void) close(epfd);
+}
+
+/**
+ * 子プロセスの生成
+ * 
+ * 空いているスロットを使う。子プロセスではSIGTERMのハンドラを設定してアクセプトループに入る。
+ * Rモードでは子プロセスが自分のサーバソケットを作る(socには-1が渡される)。
+ */
+pid_t spawn_child(int soc, const char *portnm)
+{
+  struct sigaction sa;
+  sigset_t mask;
+  pid_t pid;
+  int slot;
+
+  for (slot = 0; slot < g_max_child; slot++) {
+    if (g_score[slot].state == SLOT_EMPTY) {
+      break;
+    }
+  }
+  if (slot >= g_max_child) {
+    return (-1);
+  }
+  g_score[slot].state = SLOT_STARTING;
+  g_score[slot].served = 0;
+  if ((pid = fork()) == 0) {
+    // 子プロセス SIGTERMはepoll_pwait()の間だけ受け取る
+    (void) sigemptyset(&mask);
+    (void) sigaddset(&mask, SIGTERM);
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_term_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) signal(SIGINT, SIG_IGN);
+    if (g_mode == 'R' && (soc = server_socket(portnm, 1)) == -1) {
+      _exit(1);
+    }
+    accept_loop(soc, slot);
+    // _exit()ではatexit()が呼ばれないので、溜まったログはここで書き出す
+    log_flush();
+    _exit(0);
+  } else if (pid > 0) {
+    // fork()成功: 親プロセス
+    g_score[slot].pid = pid;
+  } else {
+    // fork()失敗
+    perror("fork");
+    g_score[slot].state = SLOT_EMPTY;
+  }
+  return (pid);
+}
+
+/**
+ * 子プロセスを全て終了させる
+ * 
+ * SIGTERMを送り、STOP_GRACE_SEC秒経っても終了しない子プロセスにはSIGKILLを送る。
+ * 子プロセスはSIGTERMをepoll_pwait()の間だけ受け取るので、アイドルのキープアライブ接続で
+ * recv()している子プロセスは、相手が切断するまでSIGTERMに気付かない。
+ */
+void stop_children(void)
+{
+  time_t deadline;
+  pid_t pid;
+  int i, alive;
+
+  for (i = 0; i < g_max_child; i++) {
+    if (g_score[i].state != SLOT_EMPTY && g_score[i].pid > 0) {
+      (void) kill(g_score[i].pid, SIGTERM);
+    }
+  }
+  deadline = time(NULL) + STOP_GRACE_SEC;
+  for (;;) {
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+      for (i = 0; i < g_max_child; i++) {
+        if (g_score[i].pid == pid) {
+          g_score[i].pid = 0;
+          g_score[i].state = SLOT_EMPTY;
+          break;
+        }
+      }
+    }
+    if (pid == -1 && errno == ECHILD) {
+      // 全て終了した
+      return;
+    }
+    if (time(NULL) >= deadline) {
+      break;
+    }
+    (void) usleep(100 * 1000);
+  }
+  alive = 0;
+  for (i = 0; i < g_max_child; i++) {
+    if (g_score[i].pid > 0) {
+      (void) kill(g_score[i].pid, SIGKILL);
+      alive++;
+    }
+  }
+  LOGWARN("<<%d>> %d children did not exit within %d sec, killed", getpid(), alive, STOP_GRACE_SEC);
+  while (wait(NULL) > 0 || errno == EINTR);
+}
+
+/**
+ * 親プロセスの終了指示(SIGINT, SIGTERM)
+ */
+void sig_stop_handler(int sig)
+{
+  (void) sig;
+  g_stop = 1;
+}
+
+/**
+ * スコアボードの表示
+ * Apacheのserver-statusと同様に1文字で各スロットの状態を表す
+ * '_': アイドル 'W': 処理中 'S': 起動中 'G': 終了中 '.': 空き
+ */
+void report_scoreboard(void)
+{
+  static const char mark[] = ".S_WG"; // enum slot_stateの順
+  char line[MAX_CHILD * 8 + 1];
+  unsigned long served;
+  int i;
+
+  served = 0;
+  for (i = 0; i < g_max_child && i < (int) sizeof(line) - 1; i++) {
+    line[i] = mark[__atomic_load_n(&g_score[i].state, __ATOMIC_ACQUIRE)];
+    served += __atomic_load_n(&g_score[i].served, __ATOMIC_RELAXED);
+  }
+  line[i] = '\0';
+  LOGINFO("<<%d>> scoreboard [%s] served:%lu", getpid(), line, served);
+}
+
+/**
+ * 子プロセスの管理(1秒ごと)
+ * 
+ * - 終了した子プロセスを回収してスロットを空ける
+ * - アイドルが少なければ作る 1回に作る数は足りない間は倍々に増やす(Apacheと同じ)
+ * - アイドルが多すぎればアイドルのものを1つ終了させる
+ */
+void maintain_children(int soc, const char *portnm, int min_spare, int max_spare, int *spawn_rate)
+{
+  pid_t pid;
+  int i, status, idle, total, last_idle, n;
+
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    for (i = 0; i < g_max_child; i++) {
+      if (g_score[i].pid == pid) {
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+          LOGWARN("<<%d>> child %d exited unexpectedly (status=%d)", getpid(), pid, status);
+        }
+        g_score[i].pid = 0;
+        __atomic_store_n(&g_score[i].state, SLOT_EMPTY, __ATOMIC_RELEASE);
+        break;
+      }
+    }
+  }
+
+  idle = total = 0;
+  last_idle = -1;
+  for (i = 0; i < g_max_child; i++) {
+    switch (__atomic_load_n(&g_score[i].state, __ATOMIC_ACQUIRE)) {
+    case SLOT_IDLE:
+      last_idle = i;
+      /* FALLTHROUGH */
+    case SLOT_STARTING:
+      idle++;
+      total++;
+      break;
+    case SLOT_BUSY:
+    case SLOT_STOPPING:
+      total++;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (idle < min_spare && total < g_max_child) {
+    n = *spawn_rate;
+    if (n > min_spare - idle) {
+      n = min_spare - idle;
+    }
+    for (i = 0; i < n && total < g_max_child; i++, total++) {
+      if (spawn_child(soc, portnm) <= 0) {
+        break;
+      }
+    }
+    LOGINFO("<<%d>> spawned %d children (idle:%d total:%d)", getpid(), i, idle, total);
+    if (*spawn_rate < MAX_SPAWN_RATE) {
+      *spawn_rate *= 2;
+    }
+  } else {
+    *spawn_rate = 1;
+    if (idle > max_spare && last_idle != -1) {
+      // 番号の大きいアイドルから減らす
+      __atomic_store_n(&g_score[last_idle].state, SLOT_STOPPING, __ATOMIC_RELEASE);
+      (void) kill(g_score[last_idle].pid, SIGTERM);
     }
   }
 }
@@ -291,86 +530,89 @@ void accept_loop(int soc)
  * main
  * 
  * 今までと違い、main()が結構変わる。
- * サーバソケットを準備した後、ロックファイルの生成を行い、子プロセスを所定の個数起動する。
+ * サーバソケット(Eモード)とスコアボードを準備した後、MIN_SPAREだけ子プロセスを起動する。
  * 
- * それぞれの子プロセスでは接続受付処理を行わせる。親プロセスはその後は何も行わないのでpause()で無限に待たせればよい。
- * ここではロックファイルの状態を10秒おきに表示させている。
+ * 親プロセスはスーパーバイザとして1秒ごとに子プロセスの数を調整し、10秒おきにスコアボードを表示する。
+ * SIGINT, SIGTERMを受けたら子プロセスを全て終了させてから終了する。
  */
 int main(int argc, char *argv[])
 {
-  int i, soc;
-  pid_t pid;
+  struct sigaction sa;
+  time_t last, now;
+  int i, soc, min_spare, max_spare, spawn_rate;
 
   // 引数にポートが指定されているか
   if (argc <= 1) {
-    (void) fprintf(stderr, "server7 port\n");
+    (void) fprintf(stderr, "server7 port [[E]POLLEXCLUSIVE/[R]euseport] [min spare] [max spare] [max children]\n");
+    return (EX_USAGE);
+  }
+  if (argc >= 3) {
+    g_mode = (char) toupper(argv[2][0]);
+    if (g_mode != 'E' && g_mode != 'R') {
+      (void) fprintf(stderr, "mode error (%s)\n", argv[2]);
+      return (EX_USAGE);
+    }
+  }
+  min_spare = (argc >= 4) ? atoi(argv[3]) : MIN_SPARE;
+  max_spare = (argc >= 5) ? atoi(argv[4]) : MAX_SPARE;
+  g_max_child = (argc >= 6) ? atoi(argv[5]) : MAX_CHILD;
+  if (min_spare < 1 || max_spare < min_spare || g_max_child < min_spare || g_max_child > MAX_CHILD * 8) {
+    (void) fprintf(stderr, "spare/children error (%d, %d, %d)\n", min_spare, max_spare, g_max_child);
     return (EX_USAGE);
   }
 
-  // サーバソケットの準備
-  if ((soc = server_socket(argv[1])) == -1) {
+  // サーバソケットの準備 Rモードでは子プロセスがそれぞれ作る
+  soc = -1;
+  if (g_mode == 'E' && (soc = server_socket(argv[1], 0)) == -1) {
     (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
     return (EX_UNAVAILABLE);
   }
 
-  // ロックファイルの生成
-  if ((g_lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666)) == -1) {
-    perror("open");
-    return (EX_UNAVAILABLE);
+  // スコアボードの生成 fork()した子プロセスと共有する
+  if ((g_score = mmap(NULL, sizeof(struct score) * (size_t) g_max_child, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+    perror("mmap");
+    return (EX_OSERR);
   }
 
-  /**
-   * ファイル名の削除
-   * 生成後unlink()で見かけ上削除する
-   * 
-   * このプログラム内でディスクリプタが使えれば良いだけ。
-   * 削除忘れ防止と・邪魔にならないように消している。
-   * 
-   * Unix系OSではunlink()されてもディスクリプタを使用している間はファイルの実体は削除せず、
-   * 全てのディスクリプタがクローズされると本当に削除される。
-   */
-  (void) unlink(LOCK_FILE);
-  (void) fprintf(stderr, "start %d children\n", NUM_CHILD);
-
-  /**
-   * 子プロセスを指定した個数生成
-   * 
-   * 子プロセスの生成は毎回同様fork()で行う。
-   * 戻り値が0の場合は子プロセスなので接続受付処理を行う。
-   * 
-   * 接続受付処理は無限ループのため、_exit(1)はこのサンプルでは実行されない。
-   */
-  for (i = 0; i < NUM_CHILD; i++) {
-    if ((pid = fork()) == 0) {
-      /**
-       * 子プロセス
-       * アクセプトループ
-       */
-      accept_loop(soc);
-      _exit(1);
-    } else if (pid > 0) {
-      // fork()成功: 親プロセス
-    } else {
-      // fork()失敗
-      perror("fork");
-    }
+  (void) fprintf(stderr, "start %d children (%s mode, spare %d-%d, max %d)\n", min_spare,
+                 g_mode == 'E' ? "EPOLLEXCLUSIVE" : "SO_REUSEPORT", min_spare, max_spare, g_max_child);
+  for (i = 0; i < min_spare; i++) {
+    (void) spawn_child(soc, argv[1]);
   }
   (void) fprintf(stderr, "ready for accept\n");
+
+  // 親プロセスはSIGINT, SIGTERMで終了する
+  (void) memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_stop_handler;
+  (void) sigemptyset(&sa.sa_mask);
+  (void) sigaction(SIGINT, &sa, NULL);
+  (void) sigaction(SIGTERM, &sa, NULL);
+
   /**
-   * 待ち・ロック状態の表示
+   * 子プロセスの管理
    * 
-   * 子プロセス生成後、親プロセスは何もすることがないので、sleep()で10秒おきにロックファイルの状態を表示する
-   * lockf()の第2引数にF_TESTを渡すことで状態を取得できる。
-   * 
-   * 無限ループなのでこの先のclose()は実行されない。
+   * 1秒ごとに子プロセスの数を調整する。
    */
-  for (;;) {
-    (void) sleep(10);
-    (void) fprintf(stderr, "<<%d>>ロック状態: %d\n", getpid(), lockf(g_lock_fd, F_TEST, 0));
+  spawn_rate = 1;
+  last = time(NULL);
+  while (!g_stop) {
+    (void) sleep(1);
+    maintain_children(soc, argv[1], min_spare, max_spare, &spawn_rate);
+    if ((now = time(NULL)) - last >= REPORT_SEC) {
+      report_scoreboard();
+      last = now;
+    }
   }
+
+  // 子プロセスを全て終了させる
+  stop_children();
+
   // ソケットクローズ
-  (void) close(soc);
-  (void) close(g_lock_fd);
+  if (soc != -1) {
+    (void) close(soc);
+  }
+  (void) munmap(g_score, sizeof(struct score) * (size_t) g_max_child);
 
   return (EX_OK);
-}
\ No newline at end of file
+}
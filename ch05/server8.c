@@ -5,11 +5,26 @@
  * アクセプトを子スレッドで並列化する。
  * pthreadを使ってマルチスレッドの機能を使う
  * 
- * マルチスレッドでの排他処理はミューテックすが使われる。
- * pthreadの標準装備で、ファイルなどを使わず、シンプルでわかりやすい
- * 
  * マルチスレッド同様にサーバソケット準備後に子スレッドを所定の個数起動する。
+ * 
+ * 以前は各スレッドがミューテックスで排他しながらaccept()し、その接続が切れるまでsend_recv_loop()でブロックしていた。
+ * そのため接続したまま何も送らないクライアントがスレッド数だけいると、サーバ全体が止まっていた。
+ * 
+ * ここでは各スレッドがそれぞれepollのイベントループを持ち、ノンブロッキングで多数の接続を扱う。
+ * - サーバソケットは全スレッドのepollにEPOLLEXCLUSIVEで登録する。
+ *   接続要求が来ると起こされるのは待っているスレッドのうちの1つ(または少数)なので、ミューテックスは不要になる。
+ * - アクセプトした接続はそのスレッドのepollに登録し、以後はそのスレッドだけが扱う(スレッド間で接続を共有しない)
+ * CPUを使う量はクライアント数ではなくスレッド数で決まる。
+ * 
+ * 送信はノンブロッキングで、送れなかった分は接続ごとの送信待ち(../common/outq.h)に積む。
+ * 送信待ちがある接続だけEPOLLOUTを監視し、送信待ちが多い間はEPOLLINを外す。
+ * 
+ * 何も送ってこない接続と、送信待ちが減らない(受信しない)接続はタイムアウトで切る。
+ * タイマーはスレッドごとのタイミングホイール(../common/twheel.h)で持ち、epoll_wait()のタイムアウトを次の期限にする。
  */
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -21,7 +36,9 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <pthread.h> // 追加
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,24 +46,59 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+#include "../common/log.h"
+#include "../common/outq.h"
+#include "../common/twheel.h"
+
 /**
  * プリプロセッサ定義・グローバル変数
  *
- * 起動する子スレッドの個数をプリプロセッサ命令で定義。
- * オーバーした場合のテストしやすいように2個にする。
+ * MSG_BUDGET: 1つの接続を1回に処理するメッセージの上限 他の接続が待たされないように、超えたら次のepoll_wait()に回す
+ * ACCEPT_BATCH: 1回起こされた時にaccept()する上限 1つのスレッドに接続が偏らないようにする
+ * REPORT_SEC: スレッドごとの統計を表示する間隔
+ * IDLE_TIMEOUT_MS: 何も送ってこない接続を切るまでの時間
+ * WRITE_TIMEOUT_MS: 送信待ちが減らない接続を切るまでの時間
+ * TIMER_TICK_MS: タイミングホイールの1ティック
  * 
- * ミューテックスも、ソースをこれまでと似たようにするためにグローバルにした。
- * 現在ロック中のスレッドIDを格納しておくg_lock_idという変数も定義した。
- * 
- * ミューテックスは PTHREAD_MUTEX_INITIALIZERで初期化可能。
- * またpthread_mutex_init()で初期化も可能。
- * 
- * ミューテックスにはロックせずにロック状態を調べる手段がない。
- * そのため親スレッドのロック状態デバッグ表示用にg_lock_idにロック中のスレッドIDを格納しておく
+ * 統計はスレッドごとの構造体に持ち、各スレッドは自分の分しか書かないのでロックは不要。
+ * 親スレッドは__atomic_load_n()で読むだけ。
  */
-#define NUM_CHILD 2
-pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
-int g_lock_id = -1;
+#define MAX_EVENTS (256)
+#define MSG_BUDGET (16)
+#define ACCEPT_BATCH (16)
+#define REPORT_SEC (10)
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef WRITE_TIMEOUT_MS
+#define WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+#define TIMER_TICK_MS (100)
+
+struct loop {
+    int no;
+    int soc; // サーバソケット
+    int epfd;
+    pthread_t thread_id;
+    struct twheel wheel; // 接続ごとのタイムアウト このスレッドだけが触る
+    unsigned long conns; // 現在の接続数
+    unsigned long accepted; // アクセプトした数
+    unsigned long msgs; // 処理したメッセージ数
+};
+
+/**
+ * 接続ごとの状態
+ * epollのdata.ptrに持つ サーバソケットはdata.ptrがNULL
+ */
+struct client {
+    int fd;
+    struct outq out; // 送信待ち
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+    uint32_t events; // 監視中のイベント
+    struct twheel_timer timer; // タイムアウト
+    size_t tmark; // 書き込みのタイムアウトを張った時の送信待ち 0:アイドルのタイムアウト
+};
 
 /**
  * 接続受付準備
@@ -160,241 +212,254 @@ int server_socket(const char *portnm)
 }
 
 /**
- * 接続受付
+ * 監視するイベントの決定
  * 
- * 前のコードとはかなり異なる。
- * マルチプロセスではfork()した時点で並列処理が開始されるので、関数の途中で枝分かれして並列処理が開始されていた
- * 
- * マルチスレッドではpthread_create()という関数に明示的にスレッドとして生成したい関数を指定する。
- * その指定された関数から別スレッドになる
- * 
- * ここではsend_recv_loop()をスレッド開始関数とする　今回は名前を変えてsend_recv_thread()という関数にする
+ * 送信待ちがある間だけ書き込み可能を監視する。
+ * 送信待ちがOUTQ_HIGHを超えてからOUTQ_LOWを下回るまでと、EOFの後は受信を監視しない。
+ * 戻り値 EPOLLIN、EPOLLOUTの組み合わせ 0:EOFの後に送り切ったのでクローズしてよい
  */
+uint32_t client_events(struct client *cl)
+{
+    uint32_t events;
 
+    events = 0;
+    if (!cl->eof && outq_readable(&cl->out)) {
+        events |= EPOLLIN;
+    }
+    if (outq_pending(&cl->out) > 0) {
+        events |= EPOLLOUT;
+    }
+    return (events);
+}
 
 /**
- * サイズ指定文字列連結
- * 
+ * タイムアウト
+ * shutdown()だけして、EPOLLHUPからいつもの経路(EOF、送信エラー)でクローズさせる
  */
-size_t mystrlcat(char *dst, const char *src, size_t size)
+void client_timeout(struct twheel_timer *t, void *arg)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
+    struct client *cl = arg;
+
+    LOGINFO("[fd%d] %s timeout", cl->fd, cl->tmark > 0 ? "write" : "idle");
+    (void) shutdown(cl->fd, SHUT_RDWR);
+}
 
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/**
+ * タイムアウトの張り直し
+ * 送信待ちがなければアイドルのタイムアウトを毎回張り直す。
+ * 送信待ちがあれば書き込みのタイムアウトにし、送信待ちが減った時だけ張り直す。
+ */
+void client_arm(struct loop *lp, struct client *cl)
+{
+    size_t pending;
+
+    pending = outq_pending(&cl->out);
+    if (pending > 0 && cl->tmark > 0 && pending >= cl->tmark && twheel_pending(&cl->timer)) {
+        return;
     }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
+    cl->tmark = pending;
+    twheel_add(&lp->wheel, &cl->timer, pending > 0 ? WRITE_TIMEOUT_MS : IDLE_TIMEOUT_MS);
 }
 
 /**
- * 送受信
+ * 受信可能になった接続の処理
+ * 
+ * 受信できるだけ(最大MSG_BUDGET件)処理する。ソケットはノンブロッキングなのでEAGAINになったら戻る。
+ * epollはレベルトリガなので、上限で打ち切って受信データが残っていても次のepoll_wait()でまた通知される。
  * 
- * 送受信スレッド
+ * 応答はoutq_send()で送り、送れなかった分(EAGAIN、途中までの送信)は送信待ちに積んでEPOLLOUTで続きを送る。
+ * 送信待ちがOUTQ_HIGHを超えたら受信をやめる(読まないクライアントの分を溜め込まない)。
  * 
- * 送受信自体はこれまでと同じだが、pthread_create()に渡すために、関数のシグニチャ(型)が変わっている。
+ * 戻り値 0:継続(EOFの場合はcl->eofを立てる) -1:エラー
  */
-void * send_recv_thread(void *arg)
+int conn_readable(struct loop *lp, struct client *cl)
 {
-    char buf[512], *ptr;
+    int acc = cl->fd;
+    char buf[512];
+    struct iobuf in = IOBUF_INIT(buf);
+    struct resp resp;
+    size_t mlen;
     ssize_t len;
-    int acc;
-
-    /**
-     * スレッドのデタッチ
-     * 
-     * 関数の先頭で行う。
-     * これを行うか、pthread_create()の第2引数でPTHREAD_CREATE_DETACHEDを指定しておかないと
-     * スレッドが終了してもpthread_join()で終了状態を得るまでリソースが解放されない。
-     * マルチプロセスのfork() wait()のようなもの
-     */
-    (void) pthread_detach(pthread_self());
-    // 引数の取得
-    acc = (int) arg;
+    int i;
 
-    for (;;) {
-        /** 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-            /* エラー */
+    for (i = 0; i < MSG_BUDGET; i++) {
+        // 受信
+        if ((len = iobuf_recv(acc, &in, 0)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return (0);
+            }
+            // エラー
             perror("recv");
             break;
         }
         if (len == 0) {
-            /* EOF */
-            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
-            break;
+            // end of file 送信待ちを送り切ってからクローズする
+            LOGINFO("<%d>recv:EOF", lp->no);
+            cl->eof = 1;
+            return (0);
         }
 
-        /* 文字列化・表示 */
-        buf[len] = '\0';
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
+        // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+        mlen = msg_line_len(in.data, in.len);
+        LOGDEBUG("<%d>[client]%.*s", lp->no, (int) mlen, in.data);
+
+        // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+        resp_init(&resp);
+        (void) resp_add_ok(&resp, in.data, mlen);
 
-        (void) fprintf(stderr, "<%d>[client]%s\n", (int) pthread_self(), buf);
-        /* 応答文字列作成 */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
-        /* 応答 */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            /* エラー */
+        // 応答 送れなかった分は送信待ちに積む
+        if (outq_send(acc, &cl->out, &resp) == -1) {
+            // エラー
             perror("send");
+            return (-1);
+        }
+        __atomic_add_fetch(&lp->msgs, 1, __ATOMIC_RELAXED);
+        if (!outq_readable(&cl->out)) {
+            // 送信待ちが多いので、送れるまで受信しない
             break;
         }
     }
-    /* アクセプトソケットのクローズ
-     * マルチスレッドの場合はあくまでも1プロセスの中の処理で、クローズやメモリの解放忘れはプロセスが終了するまで解放されない。
-     */
-    (void) close(acc);
-    pthread_exit((void *) 0);
-    /* NOT REACHED */
-    return ((void *) 0);
+    if (i < MSG_BUDGET && !cl->eof && outq_readable(&cl->out)) {
+        // recv()のエラー
+        return (-1);
+    }
+    return (0);
 }
 
 /**
- * 送受信ループ
- * ch01 server.cと同一だが、デバッグ用にスレッドIDを表示させる。
+ * 接続のイベントの処理
+ * 
+ * 書き込み可能ならば送信待ちを送り、読み込み可能ならば受信する。
+ * その後、監視するイベントが変わった時だけepoll_ctl()する。
+ * エラーの場合と、EOFの後に送信待ちを送り切った場合はクローズする。
  */
-void send_recv_loop(int acc)
+void conn_event(struct loop *lp, struct client *cl, uint32_t revents)
 {
-  char buf[512], *ptr;
-  ssize_t len;
-  for (;;) {
-    // 受信
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-      // エラー
-      perror("recv");
-      break;
-    }
+    struct epoll_event ev;
+    uint32_t want;
+    int ret;
 
-    if (len == 0) {
-      // end of file
-      (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
-      break;
+    ret = 0;
+    if ((cl->events & EPOLLOUT) && (revents & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        if ((ret = outq_flush(cl->fd, &cl->out)) == -1) {
+            perror("send");
+        }
     }
-
-    // 文字列化・表示
-    buf[len] = '\0';
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-      *ptr = '\0';
+    // EPOLLERR、EPOLLHUPもrecv()で検出する
+    if (ret != -1 && (cl->events & EPOLLIN) && (revents & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+        ret = conn_readable(lp, cl);
     }
-    (void) fprintf(stderr, "<%d>[client]%s\n", (int) pthread_self(), buf);
-
-    // 応答文字列作成
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = (ssize_t) strlen(buf);
-
-    // 応答
-    if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-      // エラー
-      perror("send");
-      break;
+    if (ret == -1 || (want = client_events(cl)) == 0) {
+        // アクセプトソケットのクローズ クローズするとepollからも外れる
+        twheel_del(&lp->wheel, &cl->timer);
+        (void) close(cl->fd);
+        outq_free(&cl->out);
+        free(cl);
+        __atomic_sub_fetch(&lp->conns, 1, __ATOMIC_RELAXED);
+        return;
     }
-  }
+    if (want != cl->events) {
+        ev.data.ptr = cl;
+        ev.events = want;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, cl->fd, &ev) == -1) {
+            perror("epoll_ctl");
+        }
+        cl->events = want;
+    }
+    client_arm(lp, cl);
 }
 
 /**
  * 接続受付
  * 
- * スレッド関数としてコールされる。
- * ミューテックスで排他しながらアクセプトし、送受信処理を行う。
+ * サーバソケットはノンブロッキングなので、他のスレッドが先にaccept()した場合はEAGAINで戻る。
+ * アクセプトソケットはaccept4()でノンブロッキングにして、このスレッドのepollに登録する。
  */
-void * accept_thread(void *arg)
+void accept_ready(struct loop *lp)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
     struct sockaddr_storage from;
-    int acc, soc;
+    struct epoll_event ev;
+    struct client *cl;
     socklen_t len;
+    int acc, i;
 
-    /**
-     * 引数の取得
-     * 引数にサーバソケットのディスクリプタが渡されるので、キャストして値を得る。
-     */
-    soc = *(int *) arg;
+    for (i = 0; i < ACCEPT_BATCH; i++) {
+        len = (socklen_t) sizeof(from);
+        if ((acc = accept4(lp->soc, (struct sockaddr *) &from, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED) {
+                perror("accept");
+            }
+            return;
+        }
+        LOGINFO("<%d>accept:%P", lp->no, &from);
+
+        if ((cl = calloc(1, sizeof(*cl))) == NULL) {
+            perror("calloc");
+            (void) close(acc);
+            continue;
+        }
+        cl->fd = acc;
+        outq_init(&cl->out);
+        twheel_timer_init(&cl->timer, client_timeout, cl);
+        cl->events = EPOLLIN;
+        ev.data.ptr = cl;
+        ev.events = cl->events;
+        if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+            perror("epoll_ctl");
+            (void) close(acc);
+            free(cl);
+            continue;
+        }
+        client_arm(lp, cl);
+        __atomic_add_fetch(&lp->conns, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&lp->accepted, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * イベントループ
+ * 
+ * スレッド関数としてコールされる。
+ * 自分のepollにサーバソケットをEPOLLEXCLUSIVEで登録し、接続受付と送受信を1つのループで行う。
+ * epoll_wait()は次のタイムアウトの期限まで待ち、起きたらホイールを進めて期限の来た接続をshutdown()する。
+ */
+void * loop_thread(void *arg)
+{
+    struct loop *lp = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int i, nfds;
 
     /**
      * スレッドのデタッチ
      * 
-     * ここではスレッドのジョインはしないのでデタッチしておく。(TODO ?)
+     * ここではスレッドのジョインはしないのでデタッチしておく。
      * デタッチするとそのスレッドは親スレッドに合流できなくなる。
      * (すなわち終了コードなどの取得ができなくなる)
      * しかし、終了時にそのスレッドが占有していたリソースはすぐに解放される。
      */
     pthread_detach(pthread_self());
 
-    /**
-     * 
-     * 1: ロック獲得
-     * 2: accept()で接続受付
-     * 3: send_recv_loop()で送受信
-     * 4: アクセプトソケットクローズ
-     * 5: またアクセプトするためのロック獲得を行う。
-     */
     for (;;) {
-        (void) fprintf(stderr, "<%d>ロック獲得開始\n", (int) pthread_self());
-
-        /**
-         * pthread_mutex_lock()でロックの獲得を行う。
-         * 
-         * 獲得できるまでブロックされる。
-         * ブロックとは、その関数が実行された時点でロックが獲得できるまでプログラムの実行が止まること。
-         * ソケットもブロッキングモードでは受信可能になるまでブロックするのと同じ。
-         */
-        (void) pthread_mutex_lock(&g_lock);
-
-        /**
-         * 自分のスレッドIDの格納
-         */
-        g_lock_id = (int) pthread_self();
-        (void) fprintf(stderr, "<%d>ロック獲得!\n", (int) pthread_self());
-        len = (socklen_t) sizeof(from);
-        /**
-         * 接続受付
-         */
-        if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+        nfds = epoll_wait(lp->epfd, events, MAX_EVENTS, twheel_next_timeout(&lp->wheel, twheel_clock_ms(), -1));
+        (void) twheel_advance(&lp->wheel, twheel_clock_ms());
+        if (nfds == -1) {
             if (errno != EINTR) {
-                perror("accept");
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.ptr == NULL) {
+                accept_ready(lp);
+            } else {
+                conn_event(lp, (struct client *) events[i].data.ptr, events[i].events);
             }
-            (void) fprintf(stderr, "<%d>ロック解放\n", (int) pthread_self());
-            // アンロック
-            g_lock_id = -1;
-            (void) pthread_mutex_unlock(&g_lock);
-        } else {
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                                                    hbuf, sizeof(hbuf),
-                                                    sbuf, sizeof(sbuf),
-                                                    NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-            (void) fprintf(stderr, "<%d>ロック解放\n", (int) pthread_self());
-
-            /**
-             * アンロック
-             * TODO なぜここでアンロック? 送受信ループの後ではない?
-             * forループ内で、ループの先頭でロック獲得し、ループの終了でアンロックする。
-             * 
-             * 注意
-             * アンロックする前にg_lock_idを-1に戻す順序を間違えないようにする
-             * 先にpthread_mutex_unlock()してからg_lock_id = -1すると他のスレッドがロックを獲得できてしまい、
-             * g_lock_idにスレッドIDを書き込んだ後で-1を書いてしまうことが起こり得る。
-             */
-            g_lock_id = -1;
-            (void) pthread_mutex_unlock(&g_lock);
-            // 送受信ループ
-            send_recv_loop(acc);
-            // アクセプトソケットのクローズ
-            (void) close(acc);
         }
     }
 
@@ -404,51 +469,121 @@ void * accept_thread(void *arg)
     return ((void *) 0);
 }
 
+/**
+ * イベントループの準備
+ * 
+ * EPOLLEXCLUSIVEは同じサーバソケットを登録した複数のepollのうち、待っているものを全て起こさずに1つ(または少数)だけ起こす。
+ * EPOLLEXCLUSIVEはEPOLL_CTL_ADDでのみ指定でき、EPOLL_CTL_MODはできない。
+ */
+int loop_init(struct loop *lp, int no, int soc)
+{
+    struct epoll_event ev;
+
+    (void) memset(lp, 0, sizeof(*lp));
+    lp->no = no;
+    lp->soc = soc;
+    twheel_init(&lp->wheel, TIMER_TICK_MS, twheel_clock_ms());
+    if ((lp->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+    // 接続と区別するためdata.ptrはNULLにする
+    ev.data.ptr = NULL;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(lp->epfd);
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * スレッドごとの統計の表示
+ * conns: 現在の接続数 accepted: アクセプトした数 msgs: 処理したメッセージ数
+ */
+void loop_report(struct loop *loops, int nloop)
+{
+    int i;
+
+    for (i = 0; i < nloop; i++) {
+        LOGINFO("<<thread%d>> conns:%lu accepted:%lu msgs:%lu", i,
+                __atomic_load_n(&loops[i].conns, __ATOMIC_RELAXED),
+                __atomic_load_n(&loops[i].accepted, __ATOMIC_RELAXED),
+                __atomic_load_n(&loops[i].msgs, __ATOMIC_RELAXED));
+    }
+}
+
 /**
  * main
  * 
  * サーバソケット準備した後、子スレッドを所定の個数起動する。
  * 
- * スレッド開始関数は接続受付処理のaccept_thread()。
- * 親スレッドはその後何もすることがないので10秒に一度現在のロック状態をデバッグ表示する。
+ * スレッド開始関数はイベントループのloop_thread()。スレッド数のデフォルトはCPU数。
+ * 親スレッドはその後何もすることがないので10秒に一度スレッドごとの統計を表示する。
  */
 int main(int argc, char *argv[])
 {
-    int i, soc;
-    pthread_t thread_id;
+    cpu_set_t cpus;
+    struct loop *loops;
+    int i, soc, nloop;
 
     // 引数にポート番号が指定されているか?
     if (argc <= 1) {
-        (void) fprintf(stderr, "server8 port\n");
+        (void) fprintf(stderr, "server8 port [threads]\n");
         return (EX_USAGE);
     }
+    if (argc >= 3) {
+        if ((nloop = atoi(argv[2])) <= 0) {
+            (void) fprintf(stderr, "threads error (%s)\n", argv[2]);
+            return (EX_USAGE);
+        }
+    } else {
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("sched_getaffinity");
+            return (EX_OSERR);
+        }
+        nloop = CPU_COUNT(&cpus);
+    }
 
     // サーバソケットの準備
     if ((soc = server_socket(argv[1])) == -1) {
         (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
         return (EX_UNAVAILABLE);
     }
+    // 複数のスレッドが起こされた場合に、accept()できなかったスレッドがブロックしないようにする
+    if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL, 0) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+
+    if ((loops = calloc((size_t) nloop, sizeof(*loops))) == NULL) {
+        perror("calloc");
+        (void) close(soc);
+        return (EX_OSERR);
+    }
     // 子スレッドの生成
-    for (i = 0; i < NUM_CHILD; i++) {
+    for (i = 0; i < nloop; i++) {
+        if (loop_init(&loops[i], i, soc) == -1) {
+            return (EX_OSERR);
+        }
         // スレッド生成
-        if (pthread_create(&thread_id, NULL, accept_thread, (void *) &soc) != 0) {
+        if ((errno = pthread_create(&loops[i].thread_id, NULL, loop_thread, &loops[i])) != 0) {
             perror("pthread_create");
-        } else {
-            (void) fprintf(stderr, "pthread_create:create_thread_id=%d\n", (int) thread_id);
+            return (EX_OSERR);
         }
+        (void) fprintf(stderr, "pthread_create:create_thread_id=%d\n", (int) loops[i].thread_id);
     }
 
-    (void) fprintf(stderr, "ready for accept\n");
+    (void) fprintf(stderr, "ready for accept (%d threads)\n", nloop);
 
     for (;;) {
-        (void) sleep(10);
-        (void) fprintf(stderr, "<<%d>>ロック状態: %d\n", getpid(), (int) g_lock_id);
+        (void) sleep(REPORT_SEC);
+        loop_report(loops, nloop);
     }
 
     // ソケットクローズ
     (void) close(soc);
-    // ミューテックスの破棄
-    (void) pthread_mutex_destroy(&g_lock);
     return (EX_OK);
 }
-
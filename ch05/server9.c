@@ -14,8 +14,12 @@
  * 
  * EPOLLを用いたserver4.cをベースにsend()を専用のワーカースレッドに任せるサンプルを実装する。
  * 送受信が別れると当然スレッド間のデータの受け渡しが必要となる。
+ *
+ * 受信から送信までの時間、キューで待った時間、アクセプトから最初の受信までの時間を../common/lat.hに記録し、
+ * SIGUSR1で標準エラー出力に表示する。
  */
-// sys/epoll.h macでは使えないので除外
+#include <sys/epoll.h>
+#include <sys/eventfd.h> // 送信スレッドの起床・受信再開の通知のため
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
@@ -29,42 +33,71 @@
 #include <errno.h>
 #include <pthread.h> // ワーカースレッドのために必要
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+#include "../common/lat.h"
+#include "../common/log.h"
+
 /**
  * プリプロセッサ定義・グローバル変数
  * 
  * 1つのスレッドでアクセプト・受診を行い、送信は他のスレッドにデータを渡して行うことになる。
  * 今までよりも複雑になる。
- * ここでは5.8.2で説明したキュー(リングバッファ)を配列として定義する
+ * 
+ * 5.8.2で説明したキュー(リングバッファ)をミューテックスと条件変数で排他すると、
+ * 1件ごとにロックと通知が発生する。ここでは次のようにしている
+ * - 受信スレッド1つと送信スレッド1つの間のキュー(SPSC)なので、ロックを使わずhead/tailのアトミック操作だけで受け渡す
+ * - キューには受信データのポインタを入れ、512バイトのデータ自体はコピーしない
+ * - 送信スレッドはキューが空の間だけeventfdで眠り、起きたらキューにあるものを全て送信する
+ * - キューが一杯になったら、そのキューを使う接続のEPOLLINを止めて受信を待たせる(バックプレッシャ)
  */
-#define MAXQUEUESZ 4096
+#define MAXQUEUESZ 4096 // 2のべき乗にすること
 #define MAXSENDER 2
-#define QUEUE_NEXT(i_) (((i_) + 1) % MAXQUEUESZ)
+#define QUEUE_MASK (MAXQUEUESZ - 1)
 
+/**
+ * 受信データ
+ * lenが0の場合はEOFを表す。送信スレッドはそれより前のデータを送信してからクローズする
+ */
 struct queue_data {
     int acc;
-    char buf[512];
     ssize_t len;
+    uint64_t recv_at; // 受信した(キューに入れた)時刻 lat_clock()
+    struct queue_data *next; // 受信スレッド側の保留リスト用
+    char buf[512];
 };
 
 /**
- * リングバッファキュー
+ * SPSCリングバッファキュー
+ * 
+ * headは送信スレッドだけが、tailは受信スレッドだけが書き換える。
+ * それぞれが同じキャッシュラインを取り合わないように64バイト境界に揃えている。
  */
 struct queue {
-    int front;
-    int last;
-    struct queue_data data[MAXQUEUESZ];
-    pthread_mutex_t mutex;
-    pthread_cond_t cond;
+    struct queue_data *data[MAXQUEUESZ];
+    unsigned long head __attribute__((aligned(64))); // 次に取り出す位置(送信スレッド)
+    int sleeping; // 送信スレッドがeventfdで眠っている
+    unsigned long tail __attribute__((aligned(64))); // 次に入れる位置(受信スレッド)
+    int paused; // EPOLLINを止めている接続がある
+    int efd; // 送信スレッドを起こすためのeventfd
+    // 以下は受信スレッドだけが使う
+    int wake; // このラウンドで追加した
+    int *paused_fds; // EPOLLINを止めている接続
+    int npaused, paused_size;
+    struct queue_data *pending, *pending_last; // キューが一杯で入れられなかったEOF
 };
 
 struct queue g_queue[MAXSENDER];
 
+// 送信スレッドがキューを空にしたことを受信スレッドに知らせるeventfd
+int g_resume_efd = -1;
+
 /**
  * 接続受付
  * server4.cと同じ
@@ -203,16 +236,164 @@ int server_socket(const char *portnm)
 // 最大同時処理数
 #define MAX_CHILD (20)
 
+/**
+ * キューに追加(受信スレッド)
+ * 戻り値 0:追加した -1:キューが一杯
+ */
+int queue_push(struct queue *q, struct queue_data *d)
+{
+    unsigned long tail;
+
+    tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= MAXQUEUESZ) {
+        return (-1);
+    }
+    q->data[tail & QUEUE_MASK] = d;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    q->wake = 1;
+    return (0);
+}
+
+/**
+ * キューが一杯か(受信スレッド)
+ */
+int queue_full(struct queue *q)
+{
+    return (q->tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= MAXQUEUESZ);
+}
+
+/**
+ * EOFの追加(受信スレッド)
+ * EOFは捨てられないので、キューが一杯の時は保留リストにつないでおき、空きができたら追加する
+ */
+void queue_push_eof(struct queue *q, struct queue_data *d)
+{
+    d->next = NULL;
+    if (q->pending == NULL && queue_push(q, d) == 0) {
+        return;
+    }
+    if (q->pending == NULL) {
+        q->pending = d;
+    } else {
+        q->pending_last->next = d;
+    }
+    q->pending_last = d;
+}
+
+void queue_flush_pending(struct queue *q)
+{
+    struct queue_data *d;
+
+    while ((d = q->pending) != NULL && queue_push(q, d) == 0) {
+        q->pending = d->next;
+    }
+}
+
+/**
+ * 送信スレッドを起こす(受信スレッド)
+ * 
+ * epoll_wait()から戻ったイベントを全て処理した後に1回だけ呼ぶ。
+ * 送信スレッドが眠っている場合(キューが空から空でなくなった場合)だけeventfdに書き込む。
+ * 
+ * 送信スレッドは「sleepingを立てる→キューを確認」、受信スレッドは「tailを進める→sleepingを確認」の順で
+ * 行うので、どちらかが必ず相手の変更を見ることになり、起こし損ねることは無い。
+ */
+void queue_wakeup(struct queue *q)
+{
+    uint64_t one = 1;
+
+    if (!q->wake) {
+        return;
+    }
+    q->wake = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        (void) write(q->efd, &one, sizeof(one));
+    }
+}
+
+/**
+ * 受信の再開(受信スレッド)
+ * EPOLLINを止めていた接続を元に戻す
+ * 既にEOFなどでEPOLLから外した接続はepoll_ctl()がエラーになるが無視してよい
+ */
+void queue_resume(struct queue *q, int epollfd)
+{
+    struct epoll_event ev;
+    int i;
+
+    queue_flush_pending(q);
+    if (q->npaused == 0 || queue_full(q)) {
+        return;
+    }
+    __atomic_store_n(&q->paused, 0, __ATOMIC_SEQ_CST);
+    for (i = 0; i < q->npaused; i++) {
+        ev.data.fd = q->paused_fds[i];
+        ev.events = EPOLLIN;
+        (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, q->paused_fds[i], &ev);
+    }
+    q->npaused = 0;
+}
+
+/**
+ * 受信の一時停止(受信スレッド)
+ * キューが一杯なので接続のEPOLLINを止める
+ * 
+ * pausedを立てた後にもう一度キューを確認し、既に送信スレッドが空にしていればすぐに再開する
+ */
+void queue_pause(struct queue *q, int epollfd, int fd)
+{
+    struct epoll_event ev;
+    int *new_fds, new_size;
+
+    if (q->npaused == q->paused_size) {
+        new_size = (q->paused_size > 0) ? q->paused_size * 2 : 64;
+        if ((new_fds = realloc(q->paused_fds, sizeof(int) * new_size)) == NULL) {
+            perror("realloc");
+            return;
+        }
+        q->paused_fds = new_fds;
+        q->paused_size = new_size;
+    }
+    ev.data.fd = fd;
+    ev.events = 0;
+    if (epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return;
+    }
+    q->paused_fds[q->npaused++] = fd;
+    __atomic_store_n(&q->paused, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == q->tail) {
+        queue_resume(q, epollfd);
+    }
+}
+
 /**
  * アクセプトループ
+ * 
+ * 受信データはmalloc()した領域に受信し、そのポインタをキューに入れる。領域は送信スレッドがfree()する。
+ * キューが一杯の場合は受信せずにその接続のEPOLLINを止め、送信スレッドがキューを空にしたら
+ * g_resume_efd経由で知らされて再開する。
+ * 
+ * EOFやエラーの場合もすぐにはクローズせず、EOFをキューに入れて送信スレッドにクローズさせる。
+ * (未送信のデータが残っている間にクローズすると、送信スレッドが別の接続に再利用されたディスクリプタへ送信してしまうため)
  */
 void accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
     struct sockaddr_storage from;
-    int acc, count, i, qi, epollfd, nfds;
-    socklen_t lfen;
-    struct epoll_event ev, events[MAX_CHILD + 1];
+    struct queue_data *d;
+    struct queue *q;
+    uint64_t val, *accepted_at;
+    int acc, count, i, qi, epollfd, nfds, fd, maxfd;
+    socklen_t flen;
+    struct epoll_event ev, events[MAX_CHILD + 2];
+
+    // ディスクリプタごとのアクセプトした時刻 最初の受信までの時間を記録したら0にする
+    maxfd = (int) sysconf(_SC_OPEN_MAX);
+    if ((accepted_at = calloc((size_t) maxfd, sizeof(*accepted_at))) == NULL) {
+        perror("calloc");
+        return;
+    }
 
     // epoll_create()でEPOLLを使うためのディスクリプタを得る
     if ((epollfd = epoll_create(1)) == -1) {
@@ -236,11 +417,19 @@ void accept_loop(int soc)
         (void) close(epollfd);
         return;
     }
+    // 受信再開の通知
+    ev.data.fd = g_resume_efd;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_resume_efd, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        return;
+    }
     count = 0;
     for (;;) {
-        (void) fprintf(stderr, "<<child count: %d>>\n", count);
+        LOGDEBUG("<<child count: %d>>", count);
         // epoll_wait()でセットされたディスクリプタがreadyになるのを待つ
-        switch ((nfds = epoll_wait(epollfd, events, MAX_CHILD + 1, 10 * 1000))) {
+        switch ((nfds = epoll_wait(epollfd, events, MAX_CHILD + 2, 10 * 1000))) {
         case -1:
             // エラー
             perror("epoll_wait");
@@ -254,8 +443,15 @@ void accept_loop(int soc)
              * poll()との違いは、epoll_wait()から戻った後、ループする回数が本当に処理するべきディスクリプタ数(nfds)のみ
              */
             for (i = 0; i < nfds; i++) {
-                // ソケットがreadyになっている
-                if (events[i].data.fd == soc) {
+                fd = events[i].data.fd;
+                if (fd == g_resume_efd) {
+                    // 送信スレッドがキューを空にした 受信を再開する
+                    (void) read(g_resume_efd, &val, sizeof(val));
+                    for (qi = 0; qi < MAXSENDER; qi++) {
+                        queue_resume(&g_queue[qi], epollfd);
+                    }
+                } else if (fd == soc) {
+                    // ソケットがreadyになっている
                     flen = (socklen_t) sizeof(from);
 
                     // 接続受付
@@ -264,16 +460,12 @@ void accept_loop(int soc)
                             perror("accept");
                         }
                     } else {
-                        (void) getnameinfo((struct sockaddr *) &from, flen,
-                                                    hbuf, sizeof(hbuf),
-                                                    sbuf, sizeof(sbuf),
-                                                    NI_NUMERICHOST | NI_NUMERICSERV);
-                        (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+                        LOGINFO("accept:%P", &from);
                         
                         // 空きが無い
-                        if (coutn + 1 >= MAX_CHILD) {
+                        if (count + 1 >= MAX_CHILD) {
                             // これ以上接続できない
-                            (void) fprintf(stderr, "connection is full : cannot accept\n");
+                            LOGWARN("connection is full : cannot accept");
                             // クローズ
                             (void) close(acc);
                         } else {
@@ -283,124 +475,152 @@ void accept_loop(int soc)
                                 perror("epoll_ctl");
                                 return;
                             }
+                            if (acc < maxfd) {
+                                accepted_at[acc] = lat_clock();
+                            }
                             count++;
                         }
                     }
                 } else {
                     // リングバッファキュー用のインデックス計算
-                    qi = events[i].data.fd % MAXSENDER;
-                    
-                    // キューの末尾にデータ設定
-                    g_queue[qi].data[g_queue[qi].last].acc = events[i].data.fd;
-                    g_queue[qi].data[g_queue[qi].last].len
-                        = recv(g_queue[qi].data[g_queue[qi].last].acc,
-                               g_queue[qi].data[g_queue[qi].last].buf,
-                               sizeof(g_queue[qi].data[g_queue[qi].last].buf),
-                               0);
+                    qi = fd % MAXSENDER;
+                    q = &g_queue[qi];
+
+                    if (queue_full(q) && !(events[i].events & (EPOLLERR | EPOLLHUP))) {
+                        // キューが一杯なので受信を止める
+                        queue_pause(q, epollfd, fd);
+                        continue;
+                    }
+                    if ((d = malloc(sizeof(struct queue_data))) == NULL) {
+                        perror("malloc");
+                        continue;
+                    }
+                    d->acc = fd;
                     // 受信
-                    switch (g_queue[qi].data[g_queue[qi].last].len) {
+                    if (queue_full(q)) {
+                        // 止めている接続のエラー通知 受信はせずにEOF扱いにする
+                        // (recv()していないのでerrnoは関係なく、case -1のperror()を通さない)
+                        d->len = 0;
+                    } else {
+                        d->len = recv(fd, d->buf, sizeof(d->buf) - 1, 0);
+                    }
+                    d->recv_at = lat_clock();
+                    if (d->len > 0 && fd < maxfd && accepted_at[fd] != 0) {
+                        lat_record(LAT_FIRST_BYTE, accepted_at[fd], d->recv_at);
+                        accepted_at[fd] = 0;
+                    }
+                    switch (d->len) {
                     case -1:
                         // エラー
-                        perror("recv");
-                        break; // 本だとここのbreakがなかった
+                        if (errno != ECONNRESET) {
+                            perror("recv");
+                        }
+                        // FALLTHROUGH
                     case 0:
                         // EOF
-                        (void) fprintf(stderr, "[child%d]recv:EOF\n", events[i].data.fd);
+                        LOGINFO("[child%d]recv:EOF", fd);
                         // エラーまたは切断
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, &ev) == -1) {
+                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
                             perror("epoll_ctl");
                             return;
                         }
-                        // クローズ
-                        (void) close(events[i].data.fd);
+                        // クローズは送信スレッドが行う
+                        if (fd < maxfd) {
+                            accepted_at[fd] = 0;
+                        }
+                        d->len = 0;
+                        queue_push_eof(q, d);
                         count--;
                         break;
                     default:
-                        // キューを次に進める。
-                        (void) pthread_mutex_lock(&g_queue[qi].mutex);
-                        g_queue[qi].last = QUEUE_NEXT(g_queue[qi].last);
-                        (void) pthread_cond_signal(&g_queue[qi].cond); // 通知
-                        (void) pthread_mutex_unlock(&g_queue[qi].mutex);
+                        // キューに追加 (一杯でないことは確認済み)
+                        (void) queue_push(q, d);
                         break;
                     }
                 }
             }
             break;
         }
+        // まとめて送信スレッドを起こす
+        for (qi = 0; qi < MAXSENDER; qi++) {
+            queue_flush_pending(&g_queue[qi]);
+            queue_wakeup(&g_queue[qi]);
+        }
     }
     (void) close(epollfd);
 }
 
-/**
- * サイズ指定文字列連結
- * 
- */
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\n' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; &ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
-
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
-
 /**
  * 送受信
  * server4.cと違い、送信はスレッドとなるため、send_recv()はsend_thread()というスレッド開始スレッドにする。
  * 
- * キューの説明通り、デキューをしてそのデータを送信するような関数とする。
+ * キューにあるデータを全て取り出して送信し、キューが空になったらeventfdで眠る。
+ * 眠る前にsleepingを立ててからキューをもう一度確認するのは、queue_wakeup()との行き違いを防ぐため。
+ * 
+ * キューを空にした時に受信を止めている接続があれば、g_resume_efdで受信スレッドに知らせる。
  */
 // 送信スレッド
-void send_thread(void *arg)
+void * send_thread(void *arg)
 {
-    char *ptr;
+    struct queue *q;
+    struct queue_data *d;
+    unsigned long head, tail;
+    uint64_t val;
+    struct resp resp;
+    size_t mlen;
     ssize_t len;
-    int i, qi;
-    qi = (int) arg; // 引数からリングバッファキューのインデックスを取得
+
+    q = &g_queue[(intptr_t) arg]; // 引数からリングバッファキューのインデックスを取得
 
     for (;;) {
-        (void) pthread_mutex_lock(&g_queue[qi].mutex);
-        // リングバッファキューが満杯でない場合
-        if (g_queue[qi].last != g_queue[qi].front) {
-            i = g_queue[qi].front;
-            g_queue[qi].front = QUEUE_NEXT(g_queue[qi].front); // frontのインデックスを進める。
-            (void) pthread_mutex_unlock(&g_queue[qi].mutex);
-        } else {
-            // リングバッファキューが満杯の場合
-            (void) pthread_cond_wait(&g_queue[qi].cond, &g_queue[qi].mutex);
-            (void) pthread_mutex_unlock(&g_queue[qi].mutex);
+        head = q->head;
+        tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            // キューが空 受信を止めている接続があれば再開させる
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (__atomic_exchange_n(&q->paused, 0, __ATOMIC_SEQ_CST)) {
+                val = 1;
+                (void) write(g_resume_efd, &val, sizeof(val));
+            }
+            __atomic_store_n(&q->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&q->tail, __ATOMIC_SEQ_CST) != head) {
+                // 眠る前に追加されていた
+                (void) __atomic_exchange_n(&q->sleeping, 0, __ATOMIC_SEQ_CST);
+                continue;
+            }
+            (void) read(q->efd, &val, sizeof(val));
             continue;
         }
 
-        // 文字列化・表示
-        g_queue[qi].data[i].buf[g_queue[qi].data[i].len] = '\0';
-        if ((ptr = strpbrk(g_queue[qi].data[i].buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
-        (void) fprintf(stderr, "[child%d]%s\n", g_queue[qi].data[i].acc, g_queue[qi].data[i].buf);
+        // 取り出せるだけ取り出して送信
+        for (; head != tail; head++) {
+            d = q->data[head & QUEUE_MASK];
+            // 1件ごとにheadを進めて受信スレッドが早く空きを使えるようにする
+            __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+            lat_record(LAT_QUEUE, d->recv_at, lat_clock());
+
+            if (d->len == 0) {
+                // EOF 前のデータは送信済みなのでクローズする
+                (void) close(d->acc);
+                free(d);
+                continue;
+            }
 
-        // 応答文字列作成
-        (void) mystrlcat(g_queue[qi].data[i].buf, ":OK\r\n", sizeof(g_queue[qi].data[i].buf));
-        g_queue[qi].data[i].len = strlen(g_queue[qi].data[i].buf);
+            // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+            mlen = msg_line_len(d->buf, d->len);
+            LOGDEBUG("[child%d]%.*s", d->acc, (int) mlen, d->buf);
 
-        // 応答
-        if ((len = send(g_queue[qi].data[i].acc, g_queue[qi].data[i].buf, g_queue[qi].data[i].len, 0)) == -1) {
-            // エラー
-            perror("send");
+            // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+            resp_init(&resp);
+            (void) resp_add_ok(&resp, d->buf, mlen);
+
+            // 応答
+            if ((len = resp_send(d->acc, &resp, MSG_NOSIGNAL)) == -1) {
+                // エラー
+                perror("send");
+            }
+            lat_record(LAT_SERVICE, d->recv_at, lat_clock());
+            free(d);
         }
     }
     pthread_exit((void *) 0);
@@ -424,12 +644,28 @@ int main(int argc, char *argv[])
         return (EX_USAGE);
     }
 
+    // レイテンシの記録 SIGUSR1をブロックしてから送信スレッドを作る
+    if (lat_init() == -1 || lat_start(NULL, 0) == -1) {
+        perror("lat_start");
+        return (EX_OSERR);
+    }
+
+    // 受信再開通知用のeventfd
+    if ((g_resume_efd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        perror("eventfd");
+        return (EX_OSERR);
+    }
     for (i = 0; i < MAXSENDER; i++) {
-        // mutex初期化
-        (void) pthread_mutex_init(&g_queue[i].mutex, NULL);
-        (void) pthread_cond_init(&g_queue[i].cond, NULL);
+        // 送信スレッドを起こすためのeventfd
+        if ((g_queue[i].efd = eventfd(0, 0)) == -1) {
+            perror("eventfd");
+            return (EX_OSERR);
+        }
         // 送信用ワーカースレッドの作成
-        (void) pthread_create(&id, NULL, (void *) send_thread, (void *) i);
+        if (pthread_create(&id, NULL, send_thread, (void *) (intptr_t) i) != 0) {
+            perror("pthread_create");
+            return (EX_OSERR);
+        }
     }
 
     if ((soc = server_socket(argv[1])) == -1) {
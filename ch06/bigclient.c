@@ -6,9 +6,39 @@
  * 
  * ブロッキング・ノンブロッキング両方のテスト可能
  * 送信サイズは1,000,000バイト
+ *
+ * -f fileで任意のファイル(-は標準入力)を送る 送り方は-mで選ぶ
+ *   auto     通常のファイルはsendfile()、それ以外(パイプ、標準入力など)はsplice() (デフォルト)
+ *   sendfile ファイルからソケットへカーネル内で直接送る(ユーザ空間にコピーしない)
+ *   splice   パイプを介してソケットへ送る(同じくコピーしない) 入力がパイプならば直接ソケットへ
+ *   copy     read()でg_bufに読んでsend_all()で送る(比較用)
+ * 送り終わったら送信側をshutdown()し、サーバが受信し終えて切断するまで待ってから
+ * Gbit/sと1GBあたりのCPU時間を表示する(../common/xfer.h)。
+ *
+ * 第4引数がnの場合はノンブロッキングで、EAGAINになったらすぐにリトライする(待っている間もCPUを100%使う)
+ * eの場合はノンブロッキングで、EAGAINになったらepollでEPOLLOUTを待つ(イベント駆動)
+ *   送信側の低水位(-L、TCP_NOTSENT_LOWAT)を上げて細かく起こされないようにし、
+ *   1回に送る量を送信バッファの空き(SIOCOUTQ)から決める
+ * ブロッキング、n、eを同じファイルで送り比べると、1GBあたりのCPU時間と起床の回数の違いが分かる。
+ *
+ * -P nでファイルをn本の接続に分けて並列に送る(ストライプ転送 ../common/stripe.h、bigserver -m stripeで受ける)
+ * - ファイルを-kバイトのチャンクに分け、オフセットを付けて送る
+ * - スレッドプール(../common/pool.h)にストライプ数のワーカを作り、ストライプ1本を1つのタスクにする
+ *   各タスクは自分の接続で、次のチャンクを取ってsendfile()することを繰り返す
+ *   チャンクは取った順に送るので、速い接続ほど多くのチャンクを運ぶ
+ * - 全てのストライプでサーバから完了("OK バイト数")が返ったら、ストライプごとの量と全体の速度を表示する
+ * - どれかのストライプが接続・送信に失敗したら、他のストライプの接続をshutdown()して全てのタスクを終わらせる
+ *   (サーバは来なかったストライプを待たずに、期限が来たら"NG"を返す)
+ * - 完了はSO_RCVTIMEOで-t秒(STRIPE_CONFIRM_SEC)まで待つ
+ * ストライプの接続はブロッキングで、ファイルは通常のファイルに限る。
  */
+#define _GNU_SOURCE // splice()のため
+
+#include <sys/epoll.h>
 #include <sys/param.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -17,6 +47,7 @@
 #include <netdb.h>
 
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h> // add
 #include <signal.h>
@@ -26,6 +57,41 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/pool.h"
+#include "../common/stripe.h"
+#include "../common/xfer.h"
+
+/**
+ * SENDFILE_CHUNK: 1回のsendfile()、splice()で送る最大バイト数
+ * PIPE_SIZE: splice()で使うパイプのサイズ(F_SETPIPE_SZ) 大きいほどシステムコールの回数が減る
+ *            一般ユーザは/proc/sys/fs/pipe-max-size(デフォルト1MB)まで
+ */
+#define SENDFILE_CHUNK (4 * 1024 * 1024)
+#define PIPE_SIZE (1024 * 1024)
+/**
+ * SEND_LOWAT: イベント駆動での送信側の低水位のデフォルト
+ */
+#define SEND_LOWAT (256 * 1024)
+/**
+ * STRIPE_CHUNK: ストライプ転送のチャンクのデフォルト
+ */
+#define STRIPE_CHUNK (4 * 1024 * 1024)
+/**
+ * STRIPE_CONFIRM_SEC: ストライプ転送で送り終えてからサーバの完了を待つ秒数のデフォルト
+ * サーバが来ないストライプを待つ時間(bigserver -t)とfsync()の時間より長くする
+ */
+#define STRIPE_CONFIRM_SEC (60)
+
+/**
+ * ファイルの送り方
+ */
+enum xfer_method {
+    XFER_AUTO,
+    XFER_COPY,
+    XFER_SENDFILE,
+    XFER_SPLICE
+};
+
 /**
  * グローバル変数
  * 
@@ -33,6 +99,25 @@
  */
 // 送信バッファ
 char g_buf[1000 * 1000];
+// send()ごとのデバッグ表示(-v)
+int g_verbose = 0;
+// ブロッキング:'b' ノンブロッキング:'n' イベント駆動:'e'
+char g_mode = 'b';
+// EAGAINの時の待ち方 'e'の時だけepollで待つ
+struct xfer_wait g_wait = { -1, 0, 0 };
+// ストライプ数(-P) 0:ストライプ転送しない
+int g_stripes = 0;
+// ストライプ転送の完了を待つ秒数(-t)
+int g_confirm_sec = STRIPE_CONFIRM_SEC;
+
+/**
+ * 1回に送る量
+ * イベント駆動の場合は送信バッファの空きまでにして、EAGAINで返ってくる送信を減らす
+ */
+size_t send_chunk(int soc, size_t max)
+{
+    return (g_mode == 'e' ? xfer_chunk_out(soc, max) : max);
+}
 
 /**
  * サーバにソケット接続
@@ -151,33 +236,596 @@ ssize_t send_all(int soc, char *buf, size_t size, int flag)
     ssize_t len, lest;
     char *ptr;
     for (ptr = buf, lest = size; lest > 0; ptr += len, lest -= len) {
-        if ((len = send(soc, ptr, lest, flag)) == -1) {
+        if ((len = send(soc, ptr, send_chunk(soc, lest), flag)) == -1) {
             if (errno != EAGAIN) {
                 return (-1);
             }
+            // ノンブロッキングではすぐにリトライ、イベント駆動では送れるようになるまで待つ
+            xfer_wait(&g_wait);
             len = 0;
-        } else {
+        } else if (g_verbose) {
             // デバッグ用
-            (void) fprintf(stderr, "send:%d\n", len);
+            (void) fprintf(stderr, "send:%d\n", (int) len);
         }
     }
     return (size);
 }
 
+/**
+ * コピーで送る(比較用)
+ * read()でカーネルからg_bufへ、send()でg_bufからカーネルへと2回コピーする
+ * total: 送ったバイト数
+ */
+int send_copy(int soc, int fd, off_t *total)
+{
+    ssize_t len;
+
+    while ((len = read(fd, g_buf, sizeof(g_buf))) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("read");
+            return (-1);
+        }
+        if (send_all(soc, g_buf, (size_t) len, 0) == -1) {
+            perror("send");
+            return (-1);
+        }
+        *total += len;
+    }
+    return (0);
+}
+
+/**
+ * sendfile()で送る
+ * ファイルのページキャッシュからソケットへ直接送るので、データはユーザ空間を通らない
+ * 入力が通常のファイル(mmap()できるもの)でない場合はEINVALになる
+ * ノンブロッキングではEAGAINでリトライする(イベント駆動では待ってから)
+ */
+int send_sendfile(int soc, int fd, off_t *total)
+{
+    ssize_t len;
+
+    while ((len = sendfile(soc, fd, NULL, send_chunk(soc, SENDFILE_CHUNK))) != 0) {
+        if (len == -1) {
+            if (errno == EAGAIN) {
+                xfer_wait(&g_wait);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*total > 0 || errno != EINVAL) {
+                perror("sendfile");
+            }
+            return (-1);
+        }
+        *total += len;
+    }
+    return (0);
+}
+
+/**
+ * パイプからソケットへlenバイトsplice()する
+ */
+static int splice_out(int pfd, int soc, ssize_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        if ((n = splice(pfd, NULL, soc, NULL, send_chunk(soc, (size_t) len), SPLICE_F_MOVE | SPLICE_F_MORE)) == -1) {
+            if (errno == EAGAIN) {
+                xfer_wait(&g_wait);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            return (-1);
+        }
+        len -= n;
+    }
+    return (0);
+}
+
+/**
+ * splice()で送る
+ * splice()は片方がパイプでなければならないので
+ * - 入力がパイプ(標準入力にパイプでつないだ場合など)ならば、入力からソケットへ直接
+ * - それ以外は自前のパイプを介して 入力→パイプ→ソケット
+ * パイプはページの参照を渡すだけなので、データはユーザ空間を通らない
+ * splice()できない入力(端末など)の場合はEINVALになる
+ */
+int send_splice(int soc, int fd, off_t *total)
+{
+    struct stat st;
+    ssize_t len;
+    int pfd[2], ret;
+
+    if (fstat(fd, &st) == -1) {
+        perror("fstat");
+        return (-1);
+    }
+    if (S_ISFIFO(st.st_mode)) {
+        // 入力がパイプ
+        (void) fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE);
+        while ((len = splice(fd, NULL, soc, NULL, send_chunk(soc, SENDFILE_CHUNK), SPLICE_F_MOVE | SPLICE_F_MORE)) != 0) {
+            if (len == -1) {
+                if (errno == EAGAIN) {
+                    xfer_wait(&g_wait);
+                    continue;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("splice");
+                return (-1);
+            }
+            *total += len;
+        }
+        return (0);
+    }
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        return (-1);
+    }
+    // 失敗してもデフォルトのサイズ(64KB)で動く
+    (void) fcntl(pfd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    ret = 0;
+    for (;;) {
+        if ((len = splice(fd, NULL, pfd[1], NULL, PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (*total > 0 || errno != EINVAL) {
+                perror("splice");
+            }
+            ret = -1;
+            break;
+        }
+        if (len == 0) {
+            // EOF
+            break;
+        }
+        if (splice_out(pfd[0], soc, len) == -1) {
+            ret = -1;
+            break;
+        }
+        *total += len;
+    }
+    (void) close(pfd[0]);
+    (void) close(pfd[1]);
+    return (ret);
+}
+
+/**
+ * ファイルを送る
+ * path: ファイル名 "-"は標準入力
+ *
+ * autoで選んだ方式が使えない入力(sendfile()できない/procのファイル、splice()できない端末など)の場合は
+ * 何も送っていなければ sendfile→splice→copy の順に切り替える
+ */
+int send_file(int soc, const char *path, enum xfer_method method)
+{
+    static const char *const names[] = { "auto", "copy", "sendfile", "splice" };
+    struct xfer_stat xs;
+    struct stat st;
+    off_t total;
+    char buf[64];
+    int fd, ret;
+
+    if (strcmp(path, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return (-1);
+    }
+    if (method == XFER_AUTO) {
+        if (fstat(fd, &st) == -1) {
+            perror("fstat");
+            return (-1);
+        }
+        method = S_ISREG(st.st_mode) ? XFER_SENDFILE : XFER_SPLICE;
+    }
+    total = 0;
+    xfer_start(&xs);
+    for (;;) {
+        switch (method) {
+        case XFER_SENDFILE:
+            ret = send_sendfile(soc, fd, &total);
+            break;
+        case XFER_SPLICE:
+            ret = send_splice(soc, fd, &total);
+            break;
+        default:
+            ret = send_copy(soc, fd, &total);
+            break;
+        }
+        if (ret == -1 && total == 0 && errno == EINVAL && method != XFER_COPY) {
+            method = method == XFER_SENDFILE ? XFER_SPLICE : XFER_COPY;
+            (void) fprintf(stderr, "fallback to %s\n", names[method]);
+            continue;
+        }
+        break;
+    }
+    if (fd != STDIN_FILENO) {
+        (void) close(fd);
+    }
+    if (ret == -1) {
+        return (-1);
+    }
+    /**
+     * send()系が返った時点ではまだソケットの送信バッファにデータが残っているので、
+     * 送信側をshutdown()して、サーバが全て受信してクローズするのを待ってから計測を終える
+     */
+    (void) shutdown(soc, SHUT_WR);
+    (void) set_block(soc, 1);
+    while (recv(soc, buf, sizeof(buf), 0) > 0) {
+        ;
+    }
+    xfer_report(stderr, names[method], &xs, total, &g_wait);
+    return (0);
+}
+
+/**
+ * ストライプ転送の全体
+ */
+struct striped {
+    const char *host;
+    const char *port;
+    int fd; // 送るファイル
+    off_t size;
+    size_t chunk;
+    uint64_t id;
+    off_t next; // 次に送るチャンクのオフセット 各ストライプが__atomic_fetch_add()で取る
+    int done; // 終わったストライプ数
+    int failed; // どれかのストライプが失敗した
+    struct stripe *stripes;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/**
+ * ストライプ1本
+ */
+struct stripe {
+    struct striped *sd;
+    int index;
+    int soc; // -1:接続していない(lockで守る)
+    int ok; // サーバから"OK"が返った
+    off_t bytes;
+    unsigned long chunks;
+    double sec;
+};
+
+/**
+ * 全て送る(ヘッダ用 送りきるまでブロックする)
+ */
+static int send_full(int soc, const void *buf, size_t size, int flag)
+{
+    const char *ptr = buf;
+    ssize_t len;
+
+    while (size > 0) {
+        if ((len = send(soc, ptr, size, flag)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (-1);
+        }
+        ptr += len;
+        size -= len;
+    }
+    return (0);
+}
+
+/**
+ * 接続したソケットを登録する 既に他のストライプが失敗していれば-1
+ */
+static int stripe_register(struct stripe *sp, int soc)
+{
+    struct striped *sd = sp->sd;
+    int ret;
+
+    (void) pthread_mutex_lock(&sd->lock);
+    if ((ret = sd->failed ? -1 : 0) == 0) {
+        sp->soc = soc;
+    }
+    (void) pthread_mutex_unlock(&sd->lock);
+    return (ret);
+}
+
+/**
+ * ソケットの登録を外して閉じる(閉じた番号を他のストライプがshutdown()しないように)
+ */
+static void stripe_unregister(struct stripe *sp, int soc)
+{
+    (void) pthread_mutex_lock(&sp->sd->lock);
+    sp->soc = -1;
+    (void) pthread_mutex_unlock(&sp->sd->lock);
+    (void) close(soc);
+}
+
+/**
+ * ストライプの失敗 他のストライプの接続をshutdown()して、送信中・完了待ちのタスクを終わらせる
+ */
+static void stripe_abort(struct stripe *sp)
+{
+    struct striped *sd = sp->sd;
+    int i;
+
+    (void) pthread_mutex_lock(&sd->lock);
+    if (!sd->failed) {
+        sd->failed = 1;
+        (void) fprintf(stderr, "stripe %d failed, aborting the others\n", sp->index);
+        for (i = 0; i < g_stripes; i++) {
+            if (i != sp->index && sd->stripes[i].soc != -1) {
+                (void) shutdown(sd->stripes[i].soc, SHUT_RDWR);
+            }
+        }
+    }
+    (void) pthread_mutex_unlock(&sd->lock);
+}
+
+/**
+ * ストライプ1本を送るタスク
+ * 接続してstripe_helloを送り、チャンクが無くなるまで stripe_chunk + sendfile() を繰り返す
+ * shutdown()してサーバからの完了の行を待つ
+ */
+void stripe_task(void *arg)
+{
+    struct stripe *sp = arg;
+    struct striped *sd = sp->sd;
+    struct stripe_hello hello;
+    struct stripe_chunk ch;
+    struct timespec t0, t1;
+    struct timeval tv;
+    char buf[64];
+    ssize_t len;
+    size_t n, rest;
+    off_t off, pos;
+    int soc;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((soc = client_socket(sd->host, sd->port)) == -1) {
+        stripe_abort(sp);
+        goto out;
+    }
+    if (stripe_register(sp, soc) == -1) {
+        (void) close(soc);
+        goto out;
+    }
+    (void) memset(&hello, 0, sizeof(hello));
+    hello.magic = htonl(STRIPE_MAGIC);
+    hello.nstripes = htonl((uint32_t) g_stripes);
+    hello.index = htonl((uint32_t) sp->index);
+    hello.id = htobe64(sd->id);
+    hello.size = htobe64((uint64_t) sd->size);
+    if (send_full(soc, &hello, sizeof(hello), MSG_MORE) == -1) {
+        goto out_fail;
+    }
+    while ((off = __atomic_fetch_add(&sd->next, (off_t) sd->chunk, __ATOMIC_RELAXED)) < sd->size) {
+        n = sd->size - off < (off_t) sd->chunk ? (size_t) (sd->size - off) : sd->chunk;
+        (void) memset(&ch, 0, sizeof(ch));
+        ch.offset = htobe64((uint64_t) off);
+        ch.length = htonl((uint32_t) n);
+        // ヘッダはデータとまとめて送られるようにMSG_MORE
+        if (send_full(soc, &ch, sizeof(ch), MSG_MORE) == -1) {
+            goto out_fail;
+        }
+        // オフセットを指定するのでファイルの位置は共有しない
+        for (pos = off, rest = n; rest > 0; rest -= len) {
+            if ((len = sendfile(soc, sd->fd, &pos, rest)) <= 0) {
+                if (len == -1 && errno == EINTR) {
+                    len = 0;
+                    continue;
+                }
+                goto out_fail;
+            }
+        }
+        sp->bytes += n;
+        sp->chunks++;
+    }
+    (void) shutdown(soc, SHUT_WR);
+    // 完了の行を待つ 全てのストライプが終わるまで返らないので、期限を付ける
+    tv.tv_sec = g_confirm_sec;
+    tv.tv_usec = 0;
+    (void) setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if ((len = recv(soc, buf, sizeof(buf) - 1, MSG_WAITALL)) > 0) {
+        buf[len] = '\0';
+        sp->ok = strncmp(buf, "OK ", 3) == 0;
+        if (!sp->ok) {
+            (void) fprintf(stderr, "stripe %d: %s", sp->index, buf);
+        }
+    } else if (len == -1 && errno == EAGAIN) {
+        (void) fprintf(stderr, "stripe %d: confirmation timed out\n", sp->index);
+        stripe_abort(sp);
+    } else {
+        (void) fprintf(stderr, "stripe %d: no confirmation\n", sp->index);
+    }
+    stripe_unregister(sp, soc);
+    goto out;
+out_fail:
+    // 他のストライプがshutdown()した場合のエラーは表示しない
+    if (!__atomic_load_n(&sd->failed, __ATOMIC_RELAXED)) {
+        perror("send");
+    }
+    stripe_abort(sp);
+    stripe_unregister(sp, soc);
+out:
+    (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+    sp->sec = (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    (void) pthread_mutex_lock(&sd->lock);
+    sd->done++;
+    (void) pthread_cond_signal(&sd->cond);
+    (void) pthread_mutex_unlock(&sd->lock);
+}
+
+/**
+ * ストライプ転送
+ * 全てのストライプが終わるのを待って、ストライプごとの量と全体の結果を表示する
+ */
+int send_striped(const char *host, const char *port, const char *path, size_t chunk)
+{
+    struct stripe *sp;
+    struct striped sd;
+    struct xfer_stat xs;
+    struct timespec ts;
+    struct stat st;
+    struct pool *pool;
+    off_t total;
+    int i, ok;
+
+    (void) memset(&sd, 0, sizeof(sd));
+    if ((sd.fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return (-1);
+    }
+    if (fstat(sd.fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        (void) fprintf(stderr, "%s: striping needs a regular file\n", path);
+        (void) close(sd.fd);
+        return (-1);
+    }
+    sd.host = host;
+    sd.port = port;
+    sd.size = st.st_size;
+    sd.chunk = chunk;
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    sd.id = ((uint64_t) getpid() << 32) ^ (uint64_t) ts.tv_sec ^ ((uint64_t) ts.tv_nsec << 16);
+    (void) pthread_mutex_init(&sd.lock, NULL);
+    (void) pthread_cond_init(&sd.cond, NULL);
+    if ((sp = calloc((size_t) g_stripes, sizeof(*sp))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    for (i = 0; i < g_stripes; i++) {
+        sp[i].soc = -1;
+    }
+    sd.stripes = sp;
+    // 他のストライプがshutdown()した接続への送信でSIGPIPEを受けないように
+    (void) signal(SIGPIPE, SIG_IGN);
+    // タスクは接続を持ってブロックするので、ストライプと同じ数のワーカにする
+    if ((pool = pool_create(g_stripes, 0)) == NULL) {
+        perror("pool_create");
+        return (-1);
+    }
+    (void) fprintf(stderr, "stripe %016llx: size=%lld stripes=%d chunk=%lu\n",
+                   (unsigned long long) sd.id, (long long) sd.size, g_stripes, (unsigned long) chunk);
+    xfer_start(&xs);
+    for (i = 0; i < g_stripes; i++) {
+        sp[i].sd = &sd;
+        sp[i].index = i;
+        if (pool_submit(pool, stripe_task, &sp[i]) == -1) {
+            perror("pool_submit");
+            return (-1);
+        }
+    }
+    (void) pthread_mutex_lock(&sd.lock);
+    while (sd.done < g_stripes) {
+        (void) pthread_cond_wait(&sd.cond, &sd.lock);
+    }
+    (void) pthread_mutex_unlock(&sd.lock);
+    ok = 1;
+    total = 0;
+    for (i = 0; i < g_stripes; i++) {
+        (void) fprintf(stderr, "stripe [%d]: bytes=%lld chunks=%lu sec=%.3f%s\n",
+                       i, (long long) sp[i].bytes, sp[i].chunks, sp[i].sec, sp[i].ok ? "" : " failed");
+        ok = ok && sp[i].ok;
+        total += sp[i].bytes;
+    }
+    xfer_report(stderr, ok ? "stripe OK" : "stripe NG", &xs, total, NULL);
+    (void) close(sd.fd);
+    free(sp);
+    return (ok ? 0 : -1);
+}
+
 /**
  * main関数
  * 
  * 第4引数がnの場合にノンブロッキングモードにする処理を追加する
  * サーバに接続後、set_block()を使って切り替える。
+ *
+ * オプション
+ *   -f file   ファイルを送る(-は標準入力) 指定しなければsend_one()
+ *   -m method ファイルの送り方 auto、sendfile、splice、copy
+ *   -L bytes  イベント駆動での送信側の低水位
+ *   -P n      -fのファイルをn本の接続でストライプ転送する
+ *   -k bytes  ストライプ転送のチャンクサイズ
+ *   -t sec    ストライプ転送の完了を待つ秒数
+ *   -v        send()ごとに表示する
  */
 int main(int argc, char *argv[])
 {
-    int soc;
+    enum xfer_method method;
+    const char *path;
+    int soc, ch, ret, lowat;
+    size_t chunk;
+
+    path = NULL;
+    lowat = SEND_LOWAT;
+    chunk = STRIPE_CHUNK;
+    method = XFER_AUTO;
+    while ((ch = getopt(argc, argv, "f:m:L:P:k:t:v")) != -1) {
+        switch (ch) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "auto") == 0) {
+                method = XFER_AUTO;
+            } else if (strcmp(optarg, "copy") == 0) {
+                method = XFER_COPY;
+            } else if (strcmp(optarg, "sendfile") == 0) {
+                method = XFER_SENDFILE;
+            } else if (strcmp(optarg, "splice") == 0) {
+                method = XFER_SPLICE;
+            } else {
+                (void) fprintf(stderr, "unknown method:%s\n", optarg);
+                return (EX_USAGE);
+            }
+            break;
+        case 'L':
+            lowat = atoi(optarg);
+            break;
+        case 'P':
+            if ((g_stripes = atoi(optarg)) > STRIPE_MAX) {
+                g_stripes = STRIPE_MAX;
+            }
+            break;
+        case 'k':
+            chunk = (size_t) atol(optarg);
+            if (chunk == 0 || chunk > STRIPE_CHUNK_MAX) {
+                chunk = STRIPE_CHUNK;
+            }
+            break;
+        case 't':
+            g_confirm_sec = atoi(optarg);
+            break;
+        case 'v':
+            g_verbose = 1;
+            break;
+        default:
+            (void) fprintf(stderr, "bigclient [-f file] [-m auto|sendfile|splice|copy] [-L lowat] [-P stripes] [-k chunk] [-t sec] [-v] server-host port [n|e]\n");
+            return (EX_USAGE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     // 引数にホスト名・ポートが指定されているか?
     if (argc <= 2) {
-        (void) fprintf(stderr, "bigclient server-host port\n");
+        (void) fprintf(stderr, "bigclient [-f file] [-m auto|sendfile|splice|copy] [-L lowat] [-P stripes] [-k chunk] [-t sec] [-v] server-host port [n|e]\n");
         return (EX_USAGE);
     }
+    if (g_stripes > 0) {
+        // ストライプ転送 接続はストライプごとに行う
+        if (path == NULL) {
+            (void) fprintf(stderr, "-P needs -f file\n");
+            return (EX_USAGE);
+        }
+        return (send_striped(argv[1], argv[2], path, chunk) == -1 ? EX_IOERR : EX_OK);
+    }
     // サーバにソケット接続
     if ((soc = client_socket(argv[1], argv[2])) == -1) {
         (void) fprintf(stderr, "client_socket():error\n");
@@ -187,9 +835,30 @@ int main(int argc, char *argv[])
     if (argc >= 4 && argv[3][0] == 'n') {
         (void) fprintf(stderr, "Nonblocking mode\n");
         // ノンブロッキングモード
+        g_mode = 'n';
+        (void) set_block(soc, 0);
+    } else if (argc >= 4 && argv[3][0] == 'e') {
+        (void) fprintf(stderr, "Event-driven mode\n");
+        // ノンブロッキングにしてepollで待つ
+        g_mode = 'e';
         (void) set_block(soc, 0);
+        if (xfer_set_lowat(soc, EPOLLOUT, lowat) == -1) {
+            perror("setsockopt");
+        }
+        if (xfer_wait_init(&g_wait, soc, EPOLLOUT) == -1) {
+            perror("epoll");
+            (void) close(soc);
+            return (EX_OSERR);
+        }
     }
 
+    if (path != NULL) {
+        // ファイルの送信
+        ret = send_file(soc, path, method);
+        xfer_wait_close(&g_wait);
+        (void) close(soc);
+        return (ret == -1 ? EX_IOERR : EX_OK);
+    }
     // 送信処理
     send_one(soc);
 
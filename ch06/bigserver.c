@@ -6,9 +6,58 @@
  * 
  * ブロッキング・ノンブロッキング両方のテスト可能
  * 受信バッファは1,000,000バイト
+ *
+ * -o fileで受信したデータをファイルに保存する(接続ごとに作り直す) 保存の仕方は-mで選ぶ
+ *   recv   recv()でg_bufに受けてwrite()する(-oが無ければ捨てる) (デフォルト)
+ *   splice ソケット→パイプ→ファイルとsplice()する データはユーザ空間を通らない
+ *   direct O_DIRECTでページキャッシュを通さずに書く
+ *          アラインしたバッファを-b個(デフォルト2個のダブルバッファ)用意し、書き込みは専用のスレッドが行う
+ *          受信スレッドは書き込みを待たずに次のバッファに受信するので、受信とディスクへの書き込みが重なる
+ * recvとspliceは受信と同じスレッドで書くので、ディスクが遅いとその分受信も止まる。
+ * directで受信が止まるのは全てのバッファが書き込み待ちになった時だけで、その回数をstallsとして表示する
+ * (ディスクが回線より遅い状態が続けば、いずれはディスクの速さになる 短い遅れはバッファ数で吸収する)。
+ *
+ * 受信が終わった(EOF)時点で受信のGbit/sと1GBあたりのCPU時間を、
+ * ファイルへの書き込みとfsync()が終わった時点でディスクまでの値と、fsync()にかかった時間を表示する。
+ * -S MBで指定したMBごとにもfsync()する(ページキャッシュに溜めずに少しずつ書き出させる)。
+ *
+ * 第2引数がnの場合はノンブロッキングで、EAGAINになったらすぐにリトライする(待っている間もCPUを100%使う)
+ * eの場合はノンブロッキングで、EAGAINになったらepollでEPOLLINを待つ(イベント駆動)
+ *   低水位(-L、SO_RCVLOWAT)を上げて数KB届くたびに起こされないようにし、
+ *   1回に受信する量を受信キューに溜まっている量(SIOCINQ)から決める
+ * どのモードでも受信の結果に1GBあたりのCPU時間とEAGAIN・起床の回数を表示するので、そのまま比べられる。
+ *
+ * 以上は1つの接続を受信し終えるまで次のaccept()をしない(他の送信側はバックログで待たされる)。
+ * -w nで複数の送信側から同時に受信する
+ * - メインスレッドはaccept()だけを行い、アクセプトしたソケットを順番にn個のワーカスレッドにパイプで渡す
+ * - ワーカはそれぞれepollで自分の接続を監視し、自分専用の受信バッファ(WORKER_BUFSIZE)に受信する
+ *   ソケットはノンブロッキングにし、低水位(-L)を上げて少しずつ届くたびに起こされないようにする
+ * - 接続ごとに受信したバイト数を数え、切断時にバイト数と転送速度を表示する
+ *   -i secでsec秒ごとに受信中の全ての接続の直近と平均の速度を表示する
+ * -oを指定した場合は接続ごとにfile.番号に書き込む(-m recvのみ)。
+ *
+ * -m stripeはbigclient -P nのストライプ転送(../common/stripe.h)を受ける(-w、-oが必要)
+ * - 各接続の先頭で転送のIDとストライプの番号を受け取り、同じIDの接続を1つの転送としてまとめる
+ * - チャンクはワーカの受信バッファから、チャンクのオフセットの位置にそのままpwrite()する
+ *   ファイルは最初のストライプが来た時にファイルサイズまでftruncate()しておく
+ * - 全てのストライプがEOFになったらfsync()して、全てのストライプに完了を返す
+ * - 参加したストライプが全てEOFになっても残りのストライプが来ない(接続に失敗した、stripe_helloを送る前に
+ *   切断したなど)場合は、-t秒(STRIPE_TIMEOUT)待って参加したストライプに"NG"を返し、転送を破棄する
+ *   期限はワーカのepoll_wait()のタイムアウトごとに確かめる
+ * - 受信中のストライプが-t秒の間1バイトも進まない場合は、そのストライプをエラーとして終える
+ *   (止まったストライプが1本あるだけで転送全体が終わらなくなるため)
+ * - 終わった転送のIDはSTRIPE_TOMBSTONES個まで覚えておき、後から同じIDのストライプが来ても参加させない
+ *   ファイルもO_TRUNCせずに開くので、覚えていない古いIDで来ても書き終えたファイルは消さない
+ * - ストライプごとのバイト数、チャンク数、速度と、偏り(最も多く運んだストライプと平均の比 1.00が均等)を表示する
+ * ファイル名はfile.ID(16進)。
  */
+#define _GNU_SOURCE // splice()、O_DIRECTのため
+
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
@@ -17,15 +66,181 @@
 #include <netdb.h>
 
 #include <ctype.h>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h> // add
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "../common/stripe.h"
+#include "../common/xfer.h"
+
+/**
+ * PIPE_SIZE: spliceで使うパイプのサイズ(F_SETPIPE_SZ)
+ * DIRECT_ALIGN: O_DIRECTで書くバッファのアドレス、長さ、ファイル位置のアライメント
+ * DIRECT_BUFSIZE: directの1つのバッファのサイズ(DIRECT_ALIGNの倍数)
+ * DIRECT_NBUF: directのバッファ数のデフォルト
+ */
+#define PIPE_SIZE (1024 * 1024)
+#define DIRECT_ALIGN (4096)
+#define DIRECT_BUFSIZE (4 * 1024 * 1024)
+#define DIRECT_NBUF (2)
+/**
+ * RECV_LOWAT: イベント駆動での受信側の低水位のデフォルト
+ */
+#define RECV_LOWAT (256 * 1024)
+/**
+ * WORKER_BUFSIZE: -wのワーカごとの受信バッファ
+ * WORKER_EVENTS: 1回のepoll_wait()で受け取るイベント数
+ */
+#define WORKER_BUFSIZE (1000 * 1000)
+#define WORKER_EVENTS (64)
+/**
+ * STRIPE_WORKERS: -m stripeで-wを指定しなかった場合のワーカ数
+ */
+#define STRIPE_WORKERS (4)
+/**
+ * STRIPE_TIMEOUT: -m stripeで残りのストライプを待つ秒数のデフォルト
+ */
+#define STRIPE_TIMEOUT (10)
+/**
+ * STRIPE_TOMBSTONES: -m stripeで終わった転送のIDを覚えておく数
+ */
+#define STRIPE_TOMBSTONES (256)
+
+/**
+ * 受信したデータの保存の仕方
+ */
+enum sink_mode {
+    SINK_RECV,
+    SINK_SPLICE,
+    SINK_DIRECT,
+    SINK_STRIPE
+};
+
+/**
+ * fsync()にかかった時間
+ */
+struct fsync_stat {
+    int count;
+    double total; // 秒
+    double max;
+    double last; // 最後(受信終了後)の1回
+    off_t pending; // 前回のfsync()から書いたバイト数
+};
+
+/**
+ * directのバッファ
+ */
+struct dbuf {
+    char *data;
+    size_t len;
+};
+
+/**
+ * directの書き込みスレッドとの受け渡し
+ * バッファはリングとして順番に使う
+ * 受信スレッドはfilled番目に受信してfilledを進め、書き込みスレッドはwritten番目を書いてwrittenを進める
+ * filled - writtenがnbufになったら空きが無い
+ */
+struct direct_writer {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dbuf *buf;
+    int nbuf;
+    unsigned long filled;
+    unsigned long written;
+    int eof;
+    int error; // 書き込みのerrno
+    int fd;
+    off_t offset;
+    unsigned long stalls; // 受信スレッドが空きを待った回数
+    struct fsync_stat fs;
+    pthread_t thread_id;
+};
+
+/**
+ * -m stripeの転送1つ分
+ * ストライプの接続は別々のワーカが受信するので、参加と終了はg_stripe_lockで排他する
+ * (pwrite()はオフセットを指定するので排他しない)
+ */
+struct stripe_stat {
+    int joined;
+    int fd; // EOFになったストライプの接続 完了を返すまで開いておく -1:まだ
+    int ok;
+    off_t bytes;
+    unsigned long chunks;
+    double sec;
+};
+
+struct stripe_xfer {
+    uint64_t id;
+    int fd; // 書き込むファイル
+    off_t size;
+    int nstripes;
+    int joined; // 参加したストライプ数
+    int finished; // EOFになったストライプ数
+    int armed; // deadlineが有効
+    struct timespec deadline; // 残りのストライプを待つ期限
+    struct timespec start; // 最初のストライプが来た時刻
+    struct stripe_stat *st; // ストライプごと
+    struct stripe_xfer *next;
+};
+
+/**
+ * -wの接続
+ * ワーカのリストにつなぎ、そのワーカだけが触る
+ */
+struct bconn {
+    int fd;
+    int out; // 保存するファイル -1:捨てる
+    unsigned long no; // 接続の通し番号
+    char name[NI_MAXHOST + NI_MAXSERV + 1]; // 送信元のアドレス:ポート
+    off_t bytes; // 受信したバイト数
+    off_t last_bytes; // 前回-iで表示した時のバイト数
+    struct timespec start;
+    struct bconn *prev, *next;
+    // -m stripe
+    struct stripe_xfer *xfer; // NULL:stripe_helloを受信中
+    int index; // ストライプの番号
+    char hdr[sizeof(struct stripe_hello)]; // 受信中のstripe_hello、stripe_chunk
+    size_t hdr_len;
+    off_t chunk_off; // 受信中のチャンクの次に書く位置
+    size_t chunk_left; // 受信中のチャンクの残り 0:stripe_chunkを受信中
+    unsigned long chunks;
+    int error;
+    off_t seen_bytes; // 前回進んでいるか確かめた時のバイト数
+    int seen_queued; // 同じく受信キューに溜まっていたバイト数(低水位未満で起こされていない分)
+    struct timespec progress; // 最後にバイト数が増えたのを確かめた時刻
+};
+
+/**
+ * -wのワーカスレッド
+ */
+struct bworker {
+    int no;
+    int epfd;
+    int inbox[2]; // アクセプトしたソケットを受け取るパイプ
+    char *buf; // このワーカ専用の受信バッファ
+    struct bconn *conns; // 受信中の接続
+    int nconn;
+    pthread_t thread_id;
+};
+
+/**
+ * メインスレッドからワーカへ渡すもの
+ */
+struct bhandoff {
+    int fd;
+    unsigned long no;
+};
+
 /**
  * グローバル変数
  * 
@@ -35,10 +250,38 @@
  * 強制終了する。
  */
 
-// ノンブロッキング:'n'
+// ノンブロッキング:'n' イベント駆動:'e'
 char g_mode = 'b';
 // 受信バッファ
 char g_buf[1000 * 1000];
+// 保存するファイル(-o)
+const char *g_out = NULL;
+// 保存の仕方(-m)
+enum sink_mode g_sink = SINK_RECV;
+// directのバッファ数(-b)
+int g_nbuf = DIRECT_NBUF;
+// fsync()する間隔(-S)
+off_t g_sync_every = 0;
+// recv()ごとのデバッグ表示(-v)
+int g_verbose = 0;
+// イベント駆動での低水位(-L)
+int g_lowat = RECV_LOWAT;
+// EAGAINの時の待ち方 'e'の時だけepollで待つ
+struct xfer_wait g_wait = { -1, 0, 0 };
+// 同時に受信するワーカスレッド数(-w) 0:1接続ずつ
+int g_workers = 0;
+// -wで接続ごとの速度を表示する間隔(秒)(-i) 0:表示しない
+int g_interval = 0;
+// -m stripeの受信中の転送
+struct stripe_xfer *g_stripes = NULL;
+// -m stripeで残りのストライプを待つ秒数(-t)
+int g_stripe_timeout = STRIPE_TIMEOUT;
+pthread_mutex_t g_stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+// -m stripeで終わった転送のID(リング) g_stripe_lockで排他する
+uint64_t g_stripe_tombs[STRIPE_TOMBSTONES];
+unsigned long g_stripe_ntombs = 0;
+
+int set_block(int fd, int flag);
 
 /**
  * サーバソケットの準備
@@ -150,6 +393,74 @@ int server_socket(const char *portnm)
   return (soc);
 }
 
+/**
+ * fsync()して時間を記録する
+ */
+int sync_file(int fd, struct fsync_stat *fs)
+{
+    struct timespec t0, t1;
+    double sec;
+    int ret;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &t0);
+    if ((ret = fsync(fd)) == -1) {
+        perror("fsync");
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &t1);
+    sec = (double) (t1.tv_sec - t0.tv_sec) + (double) (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fs->count++;
+    fs->total += sec;
+    fs->last = sec;
+    if (sec > fs->max) {
+        fs->max = sec;
+    }
+    fs->pending = 0;
+    return (ret);
+}
+
+/**
+ * lenバイト書いたことを記録し、-Sの間隔を超えたらfsync()する
+ * 戻り値 0:成功 -1:fsync()のエラー
+ */
+int sync_written(int fd, struct fsync_stat *fs, off_t len)
+{
+    fs->pending += len;
+    if (g_sync_every > 0 && fs->pending >= g_sync_every) {
+        return (sync_file(fd, fs));
+    }
+    return (0);
+}
+
+/**
+ * 1回に受信する量
+ * イベント駆動の場合は受信キューに溜まっている量にする
+ */
+size_t recv_chunk(int acc, size_t max)
+{
+    return (g_mode == 'e' ? xfer_chunk_in(acc, max) : max);
+}
+
+/**
+ * 全て書き込む
+ */
+int write_all(int fd, const char *buf, size_t size)
+{
+    ssize_t len;
+
+    while (size > 0) {
+        if ((len = write(fd, buf, size)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("write");
+            return (-1);
+        }
+        buf += len;
+        size -= len;
+    }
+    return (0);
+}
+
 /**
  * 受信ループ
  * ch01 server.cでは送受信ループだったが
@@ -157,20 +468,24 @@ int server_socket(const char *portnm)
  * 
  * 起動時にノンブロッキングモードが指定された場合はset_block()で変更し、recv()で受信
  * ノンブロッキングの場合はrecv()でEAGAINが発生することがあり、この場合はリトライが必要
+ * イベント駆動の場合はxfer_wait()で受信できるようになるまで待ってからリトライする
+ *
+ * fdが-1でなければ受信したデータを書き込む
+ * 書き込み(fsync()を含む)に失敗したら*failedを立てて受信をやめる
+ * 戻り値 受信したバイト数
  */
-void recv_loop(int acc)
+ssize_t recv_loop(int acc, int fd, struct fsync_stat *fs, int *failed)
 {
     ssize_t total, len;
-    if (g_mode == 'n') {
-        // ノンブロッキングモード
-        (void) set_block(acc, 0);
-    }
     for (total = 0; ;) {
         // 受信
-        if ((len = recv(acc, g_buf, sizeof(g_buf), 0)) == -1) {
+        if ((len = recv(acc, g_buf, recv_chunk(acc, sizeof(g_buf)), 0)) == -1) {
             // error
             if (errno == EAGAIN) {
-                (void) fprintf(stderr, ".");
+                if (g_verbose) {
+                    (void) fprintf(stderr, ".");
+                }
+                xfer_wait(&g_wait);
                 continue;
             } else {
                 perror("recv");
@@ -182,10 +497,345 @@ void recv_loop(int acc)
             (void) fprintf(stderr, "recv:EOF\n");
             break;
         }
-        (void) fprintf(stderr, "recv:%d\n", (int) len);
+        if (g_verbose) {
+            (void) fprintf(stderr, "recv:%d\n", (int) len);
+        }
         total += len;
+        if (fd != -1 && (write_all(fd, g_buf, (size_t) len) == -1 || sync_written(fd, fs, len) == -1)) {
+            *failed = 1;
+            break;
+        }
     }
-    (void) fprintf(stderr, "total:%d\n", (int) total);
+    (void) fprintf(stderr, "total:%lld\n", (long long) total);
+    return (total);
+}
+
+/**
+ * splice()で受信してファイルに書く
+ * splice()は片方がパイプでなければならないので ソケット→パイプ→ファイル と2回に分ける
+ * パイプはページの参照を渡すだけなので、データはユーザ空間を通らない
+ * ファイルへのsplice()(fsync()を含む)に失敗したら*failedを立てて受信をやめる
+ */
+ssize_t recv_splice(int acc, int fd, struct fsync_stat *fs, int *failed)
+{
+    ssize_t total, len, rest, n;
+    int pfd[2];
+
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        *failed = 1;
+        return (0);
+    }
+    // 失敗してもデフォルトのサイズ(64KB)で動く
+    (void) fcntl(pfd[1], F_SETPIPE_SZ, PIPE_SIZE);
+    for (total = 0; ;) {
+        if ((len = splice(acc, NULL, pfd[1], NULL, recv_chunk(acc, PIPE_SIZE), SPLICE_F_MOVE | SPLICE_F_MORE)) == -1) {
+            if (errno == EAGAIN) {
+                xfer_wait(&g_wait);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("splice");
+            break;
+        }
+        if (len == 0) {
+            // EOF
+            break;
+        }
+        total += len;
+        // パイプに入った分を全てファイルへ
+        for (rest = len; rest > 0; rest -= n) {
+            if ((n = splice(pfd[0], NULL, fd, NULL, (size_t) rest, SPLICE_F_MOVE)) == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                perror("splice");
+                break;
+            }
+        }
+        if (rest > 0 || sync_written(fd, fs, len) == -1) {
+            *failed = 1;
+            break;
+        }
+    }
+    (void) close(pfd[0]);
+    (void) close(pfd[1]);
+    (void) fprintf(stderr, "total:%lld\n", (long long) total);
+    return (total);
+}
+
+/**
+ * directの書き込みスレッド
+ * 受信スレッドが埋めたバッファを順番にpwrite()する
+ * 最後のバッファの端数はDIRECT_ALIGNに切り上げて書き、direct_finish()でファイルを切り詰める
+ */
+void *direct_thread(void *arg)
+{
+    struct direct_writer *w = (struct direct_writer *) arg;
+    struct dbuf *b;
+    size_t len, off;
+    ssize_t n;
+
+    (void) pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (w->written == w->filled && !w->eof) {
+            (void) pthread_cond_wait(&w->cond, &w->lock);
+        }
+        if (w->written == w->filled) {
+            break;
+        }
+        b = &w->buf[w->written % w->nbuf];
+        (void) pthread_mutex_unlock(&w->lock);
+
+        len = (b->len + DIRECT_ALIGN - 1) & ~((size_t) DIRECT_ALIGN - 1);
+        (void) memset(b->data + b->len, 0, len - b->len);
+        for (off = 0; off < len && w->error == 0; off += n) {
+            if ((n = pwrite(w->fd, b->data + off, len - off, w->offset + off)) == -1) {
+                if (errno == EINTR) {
+                    n = 0;
+                    continue;
+                }
+                // 以降は書かずにバッファを返すだけにする(受信スレッドを止めない)
+                w->error = errno;
+                perror("pwrite");
+            }
+        }
+        if (w->error == 0) {
+            w->offset += len;
+            if (sync_written(w->fd, &w->fs, len) == -1) {
+                w->error = errno;
+            }
+        }
+
+        (void) pthread_mutex_lock(&w->lock);
+        w->written++;
+        (void) pthread_cond_signal(&w->cond);
+    }
+    (void) pthread_mutex_unlock(&w->lock);
+    return (NULL);
+}
+
+/**
+ * 埋めたバッファ(長さlen)を書き込みスレッドに渡し、次に受信するバッファを返す
+ * 空きが無ければ書き込みが終わるのを待つ
+ */
+char *direct_put(struct direct_writer *w, size_t len)
+{
+    char *next;
+
+    (void) pthread_mutex_lock(&w->lock);
+    w->buf[w->filled % w->nbuf].len = len;
+    w->filled++;
+    (void) pthread_cond_signal(&w->cond);
+    if (w->filled - w->written == (unsigned long) w->nbuf) {
+        w->stalls++;
+        do {
+            (void) pthread_cond_wait(&w->cond, &w->lock);
+        } while (w->filled - w->written == (unsigned long) w->nbuf);
+    }
+    next = w->buf[w->filled % w->nbuf].data;
+    (void) pthread_mutex_unlock(&w->lock);
+    return (next);
+}
+
+/**
+ * directの準備 バッファを確保して書き込みスレッドを起動する
+ */
+int direct_start(struct direct_writer *w, int fd)
+{
+    int i;
+
+    (void) memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    w->nbuf = g_nbuf;
+    if ((w->buf = calloc(w->nbuf, sizeof(w->buf[0]))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    for (i = 0; i < w->nbuf; i++) {
+        if ((errno = posix_memalign((void **) &w->buf[i].data, DIRECT_ALIGN, DIRECT_BUFSIZE)) != 0) {
+            perror("posix_memalign");
+            return (-1);
+        }
+    }
+    (void) pthread_mutex_init(&w->lock, NULL);
+    (void) pthread_cond_init(&w->cond, NULL);
+    if ((errno = pthread_create(&w->thread_id, NULL, direct_thread, w)) != 0) {
+        perror("pthread_create");
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * directで受信する
+ * 1つのバッファが一杯になるまでrecv()し、一杯になったら書き込みスレッドに渡して次のバッファに受信する
+ * 最後の端数のバッファはdirect_finish()で渡す
+ */
+ssize_t recv_direct(int acc, struct direct_writer *w, size_t *fill)
+{
+    ssize_t total, len;
+    char *data;
+
+    data = w->buf[0].data;
+    *fill = 0;
+    for (total = 0; ;) {
+        if ((len = recv(acc, data + *fill, recv_chunk(acc, DIRECT_BUFSIZE - *fill), 0)) == -1) {
+            if (errno == EAGAIN) {
+                xfer_wait(&g_wait);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            break;
+        }
+        if (len == 0) {
+            // EOF
+            break;
+        }
+        total += len;
+        if ((*fill += len) == DIRECT_BUFSIZE) {
+            data = direct_put(w, *fill);
+            *fill = 0;
+        }
+    }
+    (void) fprintf(stderr, "total:%lld\n", (long long) total);
+    return (total);
+}
+
+/**
+ * directの終了 端数のバッファを渡し、書き込みが終わるのを待ってファイルを実際の長さに切り詰める
+ */
+int direct_finish(struct direct_writer *w, size_t fill, off_t total)
+{
+    int i;
+
+    if (fill > 0) {
+        (void) direct_put(w, fill);
+    }
+    (void) pthread_mutex_lock(&w->lock);
+    w->eof = 1;
+    (void) pthread_cond_signal(&w->cond);
+    (void) pthread_mutex_unlock(&w->lock);
+    (void) pthread_join(w->thread_id, NULL);
+    (void) pthread_mutex_destroy(&w->lock);
+    (void) pthread_cond_destroy(&w->cond);
+    for (i = 0; i < w->nbuf; i++) {
+        free(w->buf[i].data);
+    }
+    free(w->buf);
+    if (w->error != 0) {
+        return (-1);
+    }
+    if (ftruncate(w->fd, total) == -1) {
+        perror("ftruncate");
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * 保存するファイルを開く
+ * directはO_DIRECTで開く ファイルシステムが対応していない(tmpfsなど)場合は通常の書き込みにする
+ */
+int open_out(const char *path)
+{
+    int fd, flags;
+
+    flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (g_sink == SINK_DIRECT) {
+        if ((fd = open(path, flags | O_DIRECT, 0644)) != -1) {
+            return (fd);
+        }
+        if (errno != EINVAL) {
+            perror(path);
+            return (-1);
+        }
+        (void) fprintf(stderr, "%s: O_DIRECT not supported, using page cache\n", path);
+    }
+    if ((fd = open(path, flags, 0644)) == -1) {
+        perror(path);
+    }
+    return (fd);
+}
+
+/**
+ * 1つの接続からの受信
+ * 受信の終わり(EOF)までと、ファイルへの書き込み・fsync()の終わりまでの結果を表示する
+ * ファイルへの書き込み、切り詰め、fsync()のどれかに失敗した場合は、失敗したことだけを表示して
+ * ディスクまでの速度とfsync()の統計は表示しない(途中までのファイルの数字になるため)
+ */
+void recv_conn(int acc)
+{
+    static const char *const names[] = { "recv", "splice", "direct" };
+    struct direct_writer w;
+    struct fsync_stat fs;
+    struct xfer_stat xs;
+    ssize_t total;
+    size_t fill;
+    int fd, failed;
+
+    fd = -1;
+    failed = 0;
+    if (g_out != NULL && (fd = open_out(g_out)) == -1) {
+        return;
+    }
+    g_wait.epfd = -1;
+    g_wait.eagain = g_wait.wakeups = 0;
+    if (g_mode == 'n') {
+        // ノンブロッキングモード
+        (void) set_block(acc, 0);
+    } else if (g_mode == 'e') {
+        // ノンブロッキングにしてepollで待つ
+        (void) set_block(acc, 0);
+        if (xfer_set_lowat(acc, EPOLLIN, g_lowat) == -1) {
+            perror("setsockopt");
+        }
+        if (xfer_wait_init(&g_wait, acc, EPOLLIN) == -1) {
+            perror("epoll");
+        }
+    }
+    (void) memset(&fs, 0, sizeof(fs));
+    xfer_start(&xs);
+    if (fd == -1) {
+        // 捨てる
+        total = recv_loop(acc, -1, &fs, &failed);
+    } else if (g_sink == SINK_SPLICE) {
+        total = recv_splice(acc, fd, &fs, &failed);
+    } else if (g_sink == SINK_DIRECT) {
+        if (direct_start(&w, fd) == -1) {
+            xfer_wait_close(&g_wait);
+            (void) close(fd);
+            return;
+        }
+        total = recv_direct(acc, &w, &fill);
+    } else {
+        total = recv_loop(acc, fd, &fs, &failed);
+    }
+    xfer_report(stderr, names[fd == -1 ? SINK_RECV : g_sink], &xs, total, &g_wait);
+    xfer_wait_close(&g_wait);
+    if (fd == -1) {
+        return;
+    }
+    if (g_sink == SINK_DIRECT) {
+        failed = direct_finish(&w, fill, total) == -1;
+        (void) fprintf(stderr, "direct: buffers=%d stalls=%lu\n", w.nbuf, w.stalls);
+        fs = w.fs;
+    }
+    if (failed || sync_file(fd, &fs) == -1) {
+        (void) fprintf(stderr, "disk: failed, %s is incomplete (received %lld bytes)\n", g_out, (long long) total);
+        (void) close(fd);
+        return;
+    }
+    xfer_report(stderr, "disk", &xs, total, NULL);
+    (void) fprintf(stderr, "fsync: count=%d mean=%.3fms max=%.3fms last=%.3fms\n",
+                   fs.count, fs.total * 1000 / fs.count, fs.max * 1000, fs.last * 1000);
+    (void) close(fd);
 }
 
 /**
@@ -219,7 +869,7 @@ void accept_loop(int soc)
       (void) fprintf(stderr, "accept: %s:%s\n", hbuf, sbuf);
 
       // 受信ループ
-      recv_loop(acc);
+      recv_conn(acc);
 
       // アクセプトソケットのクローズ
       (void) close(acc);
@@ -228,6 +878,611 @@ void accept_loop(int soc)
   }
 }
 
+/**
+ * 2つの時刻の差(秒)
+ */
+double ts_diff(const struct timespec *from, const struct timespec *to)
+{
+    return ((double) (to->tv_sec - from->tv_sec) + (double) (to->tv_nsec - from->tv_nsec) / 1e9);
+}
+
+/**
+ * -w: 渡されたソケットを自分のepollに登録する
+ */
+void worker_add(struct bworker *wk, const struct bhandoff *h)
+{
+    struct sockaddr_storage peer;
+    struct epoll_event ev;
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV], path[MAXPATHLEN];
+    struct bconn *c;
+    socklen_t len;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL) {
+        perror("calloc");
+        (void) close(h->fd);
+        return;
+    }
+    c->fd = h->fd;
+    c->no = h->no;
+    c->out = -1;
+    len = (socklen_t) sizeof(peer);
+    if (getpeername(c->fd, (struct sockaddr *) &peer, &len) == -1
+        || getnameinfo((struct sockaddr *) &peer, len, hbuf, sizeof(hbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        (void) strcpy(hbuf, "?");
+        (void) strcpy(sbuf, "?");
+    }
+    (void) snprintf(c->name, sizeof(c->name), "%s:%s", hbuf, sbuf);
+    if (g_out != NULL && g_sink != SINK_STRIPE) {
+        (void) snprintf(path, sizeof(path), "%s.%lu", g_out, c->no);
+        if ((c->out = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            perror(path);
+        }
+    }
+    (void) set_block(c->fd, 0);
+    if (xfer_set_lowat(c->fd, EPOLLIN, g_lowat) == -1) {
+        perror("setsockopt");
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(wk->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        if (c->out != -1) {
+            (void) close(c->out);
+        }
+        (void) close(c->fd);
+        free(c);
+        return;
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &c->start);
+    c->progress = c->start;
+    // リストの先頭につなぐ
+    c->next = wk->conns;
+    if (wk->conns != NULL) {
+        wk->conns->prev = c;
+    }
+    wk->conns = c;
+    wk->nconn++;
+    (void) fprintf(stderr, "[%d] accept #%lu %s (%d conns)\n", wk->no, c->no, c->name, wk->nconn);
+}
+
+/**
+ * -m stripe: 終わった転送のIDを覚える g_stripe_lockを取った状態で呼ぶ
+ * 古いものから上書きする
+ */
+static void stripe_bury(uint64_t id)
+{
+    g_stripe_tombs[g_stripe_ntombs++ % STRIPE_TOMBSTONES] = id;
+}
+
+/**
+ * -m stripe: 終わった転送のIDか g_stripe_lockを取った状態で呼ぶ
+ */
+static int stripe_buried(uint64_t id)
+{
+    unsigned long i, n;
+
+    n = g_stripe_ntombs < STRIPE_TOMBSTONES ? g_stripe_ntombs : STRIPE_TOMBSTONES;
+    for (i = 0; i < n; i++) {
+        if (g_stripe_tombs[i] == id) {
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/**
+ * -m stripe: 期限の設定 g_stripe_lockを取った状態で呼ぶ
+ * 参加したストライプが全てEOFになっていて、まだ来ていないストライプがある場合だけ期限を付ける
+ * (受信中のストライプがあれば、そのEOFかエラー、止まった場合はstripe_idle()で必ずstripe_finish()が
+ * 呼ばれるので待てばよい)
+ */
+static void stripe_arm(struct stripe_xfer *x)
+{
+    if (x->finished == x->joined && x->joined < x->nstripes) {
+        (void) clock_gettime(CLOCK_MONOTONIC, &x->deadline);
+        x->deadline.tv_sec += g_stripe_timeout;
+        x->armed = 1;
+    } else {
+        x->armed = 0;
+    }
+}
+
+/**
+ * -m stripe: 受信したstripe_helloで転送に参加する
+ * 同じIDの転送が無ければ作り、ファイルを開いてファイルサイズまで伸ばしておく
+ * 終わった(完了した、期限切れで破棄した)転送のIDならば参加させない
+ */
+int stripe_join(struct bconn *c, const struct stripe_hello *hello)
+{
+    char path[MAXPATHLEN];
+    struct stripe_xfer *x;
+    uint64_t id;
+    uint32_t n, index;
+    int i;
+
+    n = ntohl(hello->nstripes);
+    index = ntohl(hello->index);
+    id = be64toh(hello->id);
+    if (ntohl(hello->magic) != STRIPE_MAGIC || n == 0 || n > STRIPE_MAX || index >= n) {
+        (void) fprintf(stderr, "#%lu %s: bad stripe header\n", c->no, c->name);
+        return (-1);
+    }
+    (void) pthread_mutex_lock(&g_stripe_lock);
+    for (x = g_stripes; x != NULL; x = x->next) {
+        if (x->id == id) {
+            break;
+        }
+    }
+    if (x == NULL && stripe_buried(id)) {
+        (void) pthread_mutex_unlock(&g_stripe_lock);
+        (void) fprintf(stderr, "#%lu %s: stripe %016llx already finished\n", c->no, c->name, (unsigned long long) id);
+        return (-1);
+    }
+    if (x == NULL) {
+        if ((x = calloc(1, sizeof(*x))) == NULL || (x->st = calloc(n, sizeof(x->st[0]))) == NULL) {
+            perror("calloc");
+            free(x);
+            (void) pthread_mutex_unlock(&g_stripe_lock);
+            return (-1);
+        }
+        x->id = id;
+        x->size = (off_t) be64toh(hello->size);
+        x->nstripes = (int) n;
+        for (i = 0; i < x->nstripes; i++) {
+            x->st[i].fd = -1;
+        }
+        (void) snprintf(path, sizeof(path), "%s.%016llx", g_out, (unsigned long long) id);
+        // O_TRUNCしない 覚えていない古いIDで来ても、ファイルサイズが同じならば書き終えた内容は残る
+        if ((x->fd = open(path, O_WRONLY | O_CREAT, 0644)) == -1 || ftruncate(x->fd, x->size) == -1) {
+            perror(path);
+            if (x->fd != -1) {
+                (void) close(x->fd);
+            }
+            free(x->st);
+            free(x);
+            (void) pthread_mutex_unlock(&g_stripe_lock);
+            return (-1);
+        }
+        (void) clock_gettime(CLOCK_MONOTONIC, &x->start);
+        x->next = g_stripes;
+        g_stripes = x;
+        (void) fprintf(stderr, "stripe %016llx: size=%lld stripes=%d -> %s\n",
+                       (unsigned long long) id, (long long) x->size, x->nstripes, path);
+    }
+    if ((int) n != x->nstripes || x->st[index].joined) {
+        (void) pthread_mutex_unlock(&g_stripe_lock);
+        (void) fprintf(stderr, "#%lu %s: stripe %u mismatch\n", c->no, c->name, index);
+        return (-1);
+    }
+    x->st[index].joined = 1;
+    x->joined++;
+    stripe_arm(x);
+    (void) pthread_mutex_unlock(&g_stripe_lock);
+    c->xfer = x;
+    c->index = (int) index;
+    return (0);
+}
+
+/**
+ * -m stripe: 受信したデータを解釈してファイルに書く
+ * stripe_hello、stripe_chunkはrecv()の区切りと関係なく分かれて届くのでhdrに貯める
+ * チャンクのデータは受信バッファからオフセットの位置にそのまま書く
+ */
+int stripe_input(struct bconn *c, const char *buf, size_t len)
+{
+    const struct stripe_chunk *ch;
+    size_t need, n;
+    ssize_t w;
+
+    while (len > 0) {
+        if (c->xfer != NULL && c->chunk_left > 0) {
+            // チャンクのデータ
+            n = len < c->chunk_left ? len : c->chunk_left;
+            if ((w = pwrite(c->xfer->fd, buf, n, c->chunk_off)) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("pwrite");
+                return (-1);
+            }
+            c->chunk_off += w;
+            c->chunk_left -= (size_t) w;
+            buf += w;
+            len -= (size_t) w;
+            continue;
+        }
+        // ヘッダ
+        need = c->xfer == NULL ? sizeof(struct stripe_hello) : sizeof(struct stripe_chunk);
+        n = need - c->hdr_len < len ? need - c->hdr_len : len;
+        (void) memcpy(c->hdr + c->hdr_len, buf, n);
+        c->hdr_len += n;
+        buf += n;
+        len -= n;
+        if (c->hdr_len < need) {
+            break;
+        }
+        c->hdr_len = 0;
+        if (c->xfer == NULL) {
+            if (stripe_join(c, (const struct stripe_hello *) c->hdr) == -1) {
+                return (-1);
+            }
+            continue;
+        }
+        ch = (const struct stripe_chunk *) c->hdr;
+        c->chunk_off = (off_t) be64toh(ch->offset);
+        c->chunk_left = ntohl(ch->length);
+        if (c->chunk_left > STRIPE_CHUNK_MAX || c->chunk_off < 0 || c->chunk_off + (off_t) c->chunk_left > c->xfer->size) {
+            (void) fprintf(stderr, "#%lu %s: bad chunk offset=%lld length=%lu\n",
+                           c->no, c->name, (long long) c->chunk_off, (unsigned long) c->chunk_left);
+            return (-1);
+        }
+        c->chunks++;
+    }
+    return (0);
+}
+
+/**
+ * -m stripe: 全てのストライプが終わった転送の完了
+ * fsync()して全てのストライプに結果を返し、ストライプごとの量と偏りを表示する
+ */
+void stripe_complete(struct stripe_xfer *x)
+{
+    struct fsync_stat fs;
+    struct timespec now;
+    off_t total, max;
+    double sec;
+    char msg[64];
+    int i, ok;
+
+    (void) memset(&fs, 0, sizeof(fs));
+    ok = sync_file(x->fd, &fs) == 0;
+    total = 0;
+    max = 0;
+    for (i = 0; i < x->nstripes; i++) {
+        ok = ok && x->st[i].ok;
+        total += x->st[i].bytes;
+        max = x->st[i].bytes > max ? x->st[i].bytes : max;
+    }
+    // チャンクが重ならない限り、合計はファイルサイズになる
+    ok = ok && total == x->size;
+    (void) snprintf(msg, sizeof(msg), "%s %lld\r\n", ok ? "OK" : "NG", (long long) total);
+    for (i = 0; i < x->nstripes; i++) {
+        if (x->st[i].fd == -1) {
+            // 期限切れで参加しなかったストライプ
+            continue;
+        }
+        (void) send(x->st[i].fd, msg, strlen(msg), MSG_NOSIGNAL);
+        (void) close(x->st[i].fd);
+    }
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    sec = ts_diff(&x->start, &now);
+    for (i = 0; i < x->nstripes; i++) {
+        (void) fprintf(stderr, "stripe %016llx [%d]: bytes=%lld (%.1f%%) chunks=%lu sec=%.3f Gbit/s=%.3f%s\n",
+                       (unsigned long long) x->id, i, (long long) x->st[i].bytes,
+                       total > 0 ? (double) x->st[i].bytes * 100 / total : 0.0,
+                       x->st[i].chunks, x->st[i].sec,
+                       x->st[i].sec > 0 ? (double) x->st[i].bytes * 8 / x->st[i].sec / 1e9 : 0.0,
+                       x->st[i].ok ? "" : x->st[i].joined ? " error" : " missing");
+    }
+    (void) fprintf(stderr, "stripe %016llx: %s bytes=%lld sec=%.3f Gbit/s=%.3f balance(max/mean)=%.2f fsync=%.3fms\n",
+                   (unsigned long long) x->id, ok ? "OK" : "NG", (long long) total, sec,
+                   sec > 0 ? (double) total * 8 / sec / 1e9 : 0.0,
+                   total > 0 ? (double) max * x->nstripes / total : 0.0, fs.last * 1000);
+    (void) close(x->fd);
+    free(x->st);
+    free(x);
+}
+
+/**
+ * -m stripe: ストライプの終了(EOFまたはエラー)
+ * 接続は完了を返すまで閉じずに転送に預け、epollからは外す
+ * 最後のストライプが終わったワーカがstripe_complete()を行う
+ */
+void stripe_finish(struct bworker *wk, struct bconn *c, double sec)
+{
+    struct stripe_xfer *x = c->xfer, **pp;
+    struct stripe_stat *st = &x->st[c->index];
+    int done;
+
+    (void) epoll_ctl(wk->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    (void) pthread_mutex_lock(&g_stripe_lock);
+    st->fd = c->fd;
+    st->ok = !c->error && c->chunk_left == 0 && c->hdr_len == 0;
+    st->bytes = c->bytes - (off_t) sizeof(struct stripe_hello) - (off_t) (c->chunks * sizeof(struct stripe_chunk));
+    st->chunks = c->chunks;
+    st->sec = sec;
+    if ((done = ++x->finished == x->nstripes)) {
+        for (pp = &g_stripes; *pp != x; pp = &(*pp)->next) {
+            ;
+        }
+        *pp = x->next;
+        stripe_bury(x->id);
+    } else {
+        stripe_arm(x);
+    }
+    (void) pthread_mutex_unlock(&g_stripe_lock);
+    c->fd = -1;
+    if (done) {
+        stripe_complete(x);
+    }
+}
+
+/**
+ * -m stripe: 期限を過ぎた転送を破棄する
+ * 期限が付いている転送は参加したストライプが全てEOFになっていて、どのワーカも触っていないので、
+ * リストから外せばこのスレッドだけで片付けられる
+ */
+void stripe_expire(void)
+{
+    struct stripe_xfer *x, **pp, *expired;
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    expired = NULL;
+    (void) pthread_mutex_lock(&g_stripe_lock);
+    for (pp = &g_stripes; (x = *pp) != NULL; ) {
+        if (x->armed && ts_diff(&x->deadline, &now) >= 0) {
+            *pp = x->next;
+            stripe_bury(x->id);
+            x->next = expired;
+            expired = x;
+        } else {
+            pp = &x->next;
+        }
+    }
+    (void) pthread_mutex_unlock(&g_stripe_lock);
+    while ((x = expired) != NULL) {
+        expired = x->next;
+        (void) fprintf(stderr, "stripe %016llx: timeout, %d of %d stripes joined\n",
+                       (unsigned long long) x->id, x->joined, x->nstripes);
+        stripe_complete(x);
+    }
+}
+
+/**
+ * -w: 接続の終了 バイト数と平均の速度を表示する
+ */
+void worker_close(struct bworker *wk, struct bconn *c)
+{
+    struct timespec now;
+    double sec;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    sec = ts_diff(&c->start, &now);
+    (void) fprintf(stderr, "[%d] close #%lu %s bytes=%lld sec=%.3f Gbit/s=%.3f\n",
+                   wk->no, c->no, c->name, (long long) c->bytes, sec,
+                   sec > 0 ? (double) c->bytes * 8 / sec / 1e9 : 0.0);
+    if (c->xfer != NULL) {
+        // ストライプの接続は転送の完了まで閉じない
+        stripe_finish(wk, c, sec);
+    } else {
+        // closeでepollからも外れる
+        (void) close(c->fd);
+    }
+    if (c->out != -1) {
+        (void) close(c->out);
+    }
+    if (c->prev != NULL) {
+        c->prev->next = c->next;
+    } else {
+        wk->conns = c->next;
+    }
+    if (c->next != NULL) {
+        c->next->prev = c->prev;
+    }
+    wk->nconn--;
+    free(c);
+}
+
+/**
+ * -w: 受信できる接続から受信する
+ * レベルトリガなので、1回で読み切れなかった分は次のepoll_wait()ですぐに返ってくる
+ * (1つの接続を読み続けて、同じワーカの他の接続を待たせないように1回だけにする)
+ */
+void worker_recv(struct bworker *wk, struct bconn *c)
+{
+    ssize_t len;
+
+    if ((len = recv(c->fd, wk->buf, WORKER_BUFSIZE, 0)) == -1) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        perror("recv");
+        worker_close(wk, c);
+        return;
+    }
+    if (len == 0) {
+        // EOF
+        worker_close(wk, c);
+        return;
+    }
+    c->bytes += len;
+    if (g_sink == SINK_STRIPE) {
+        if (stripe_input(c, wk->buf, (size_t) len) == -1) {
+            c->error = 1;
+            worker_close(wk, c);
+        }
+        return;
+    }
+    if (c->out != -1 && write_all(c->out, wk->buf, (size_t) len) == -1) {
+        worker_close(wk, c);
+    }
+}
+
+/**
+ * -m stripe: 進まなくなった接続を終える
+ * -t秒の間バイト数が増えていない接続をエラーとしてworker_close()する
+ * 低水位(-L)未満で起こされずに受信キューに溜まっている分が増えていれば進んでいるとみなす
+ * 参加したストライプならば転送はそのストライプを"error"としてNGで終わり、参加前の接続はそのまま閉じる
+ */
+void stripe_idle(struct bworker *wk, const struct timespec *now)
+{
+    struct bconn *c, *next;
+    int queued;
+
+    for (c = wk->conns; c != NULL; c = next) {
+        next = c->next;
+        if (ioctl(c->fd, FIONREAD, &queued) == -1) {
+            queued = 0;
+        }
+        if (c->bytes != c->seen_bytes || queued > c->seen_queued) {
+            c->seen_bytes = c->bytes;
+            c->seen_queued = queued;
+            c->progress = *now;
+            continue;
+        }
+        if (ts_diff(&c->progress, now) >= g_stripe_timeout) {
+            (void) fprintf(stderr, "[%d] #%lu %s: no progress for %d sec\n", wk->no, c->no, c->name, g_stripe_timeout);
+            c->error = 1;
+            worker_close(wk, c);
+        }
+    }
+}
+
+/**
+ * -w: 受信中の接続ごとに、前回からの速度と平均の速度を表示する
+ */
+void worker_status(struct bworker *wk, double interval)
+{
+    struct timespec now;
+    struct bconn *c;
+    double sec;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    for (c = wk->conns; c != NULL; c = c->next) {
+        sec = ts_diff(&c->start, &now);
+        (void) fprintf(stderr, "[%d] #%lu %s bytes=%lld Gbit/s=%.3f avg=%.3f\n",
+                       wk->no, c->no, c->name, (long long) c->bytes,
+                       (double) (c->bytes - c->last_bytes) * 8 / interval / 1e9,
+                       sec > 0 ? (double) c->bytes * 8 / sec / 1e9 : 0.0);
+        c->last_bytes = c->bytes;
+    }
+}
+
+/**
+ * -w: ワーカスレッド
+ */
+void *worker_thread(void *arg)
+{
+    struct bworker *wk = (struct bworker *) arg;
+    struct epoll_event events[WORKER_EVENTS];
+    struct timespec last, last_idle, now;
+    struct bhandoff h;
+    int i, nready;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &last);
+    last_idle = last;
+    for (;;) {
+        if ((nready = epoll_wait(wk->epfd, events, WORKER_EVENTS, g_interval > 0 || g_sink == SINK_STRIPE ? 1000 : -1)) == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nready; i++) {
+            if (events[i].data.ptr == NULL) {
+                // メインスレッドからの受け渡し
+                if (read(wk->inbox[0], &h, sizeof(h)) == sizeof(h)) {
+                    worker_add(wk, &h);
+                }
+                continue;
+            }
+            worker_recv(wk, (struct bconn *) events[i].data.ptr);
+        }
+        if (g_sink == SINK_STRIPE) {
+            stripe_expire();
+            // 接続を全て見るので、受信が続いていても1秒に1回だけにする
+            (void) clock_gettime(CLOCK_MONOTONIC, &now);
+            if (ts_diff(&last_idle, &now) >= 1) {
+                stripe_idle(wk, &now);
+                last_idle = now;
+            }
+        }
+        if (g_interval > 0) {
+            (void) clock_gettime(CLOCK_MONOTONIC, &now);
+            if (ts_diff(&last, &now) >= g_interval) {
+                worker_status(wk, ts_diff(&last, &now));
+                last = now;
+            }
+        }
+    }
+    // NOT REACHED
+    return (NULL);
+}
+
+/**
+ * -w: ワーカスレッドの起動
+ */
+struct bworker *workers_start(int n)
+{
+    struct epoll_event ev;
+    struct bworker *wks;
+    int i;
+
+    if ((wks = calloc((size_t) n, sizeof(*wks))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    for (i = 0; i < n; i++) {
+        wks[i].no = i;
+        if ((wks[i].buf = malloc(WORKER_BUFSIZE)) == NULL) {
+            perror("malloc");
+            return (NULL);
+        }
+        if (pipe(wks[i].inbox) == -1) {
+            perror("pipe");
+            return (NULL);
+        }
+        if ((wks[i].epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            perror("epoll_create1");
+            return (NULL);
+        }
+        // data.ptrがNULLならばパイプ
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(wks[i].epfd, EPOLL_CTL_ADD, wks[i].inbox[0], &ev) == -1) {
+            perror("epoll_ctl");
+            return (NULL);
+        }
+        if ((errno = pthread_create(&wks[i].thread_id, NULL, worker_thread, &wks[i])) != 0) {
+            perror("pthread_create");
+            return (NULL);
+        }
+    }
+    return (wks);
+}
+
+/**
+ * -w: アクセプトループ
+ * アクセプトしたソケットを順番にワーカへ渡す 受信はワーカが行うので、すぐに次のaccept()に戻る
+ */
+void accept_loop_workers(int soc)
+{
+    struct bworker *wks;
+    struct bhandoff h;
+    unsigned long no;
+    int acc;
+
+    if ((wks = workers_start(g_workers)) == NULL) {
+        return;
+    }
+    (void) fprintf(stderr, "workers=%d\n", g_workers);
+    for (no = 0; ; no++) {
+        if ((acc = accept(soc, NULL, NULL)) == -1) {
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            continue;
+        }
+        h.fd = acc;
+        h.no = no;
+        if (write(wks[no % g_workers].inbox[1], &h, sizeof(h)) != sizeof(h)) {
+            perror("write");
+            (void) close(acc);
+        }
+    }
+}
+
 /**
  * ブロッキングモードのセット
  */
@@ -252,20 +1507,96 @@ int set_block(int fd, int flag)
 /**
  * main
  * 
- * 第3引数に'n'を指定した場合はノンブロッキングモード
+ * 第3引数に'n'を指定した場合はノンブロッキングモード、'e'の場合はイベント駆動
+ *
+ * オプション
+ *   -o file   受信したデータを保存するファイル
+ *   -m mode   保存の仕方 recv、splice、direct、stripe
+ *   -b nbuf   directのバッファ数
+ *   -S MB     MBごとにfsync()する
+ *   -L bytes  イベント駆動、-wでの低水位
+ *   -w n      n個のワーカスレッドで複数の接続から同時に受信する
+ *   -i sec    -wで接続ごとの速度を表示する間隔
+ *   -t sec    -m stripeで残りのストライプを待つ秒数
+ *   -v        recv()ごとに表示する
  */
 int main(int argc, char *argv[])
 {
-    int soc;
+    int soc, ch;
+
+    while ((ch = getopt(argc, argv, "o:m:b:S:L:w:i:t:v")) != -1) {
+        switch (ch) {
+        case 'o':
+            g_out = optarg;
+            break;
+        case 'm':
+            if (strcmp(optarg, "recv") == 0) {
+                g_sink = SINK_RECV;
+            } else if (strcmp(optarg, "splice") == 0) {
+                g_sink = SINK_SPLICE;
+            } else if (strcmp(optarg, "direct") == 0) {
+                g_sink = SINK_DIRECT;
+            } else if (strcmp(optarg, "stripe") == 0) {
+                g_sink = SINK_STRIPE;
+            } else {
+                (void) fprintf(stderr, "unknown mode:%s\n", optarg);
+                return (EX_USAGE);
+            }
+            break;
+        case 'b':
+            if ((g_nbuf = atoi(optarg)) < 2) {
+                g_nbuf = 2;
+            }
+            break;
+        case 'S':
+            g_sync_every = (off_t) atoi(optarg) * 1024 * 1024;
+            break;
+        case 'L':
+            g_lowat = atoi(optarg);
+            break;
+        case 'w':
+            g_workers = atoi(optarg);
+            break;
+        case 'i':
+            g_interval = atoi(optarg);
+            break;
+        case 't':
+            g_stripe_timeout = atoi(optarg);
+            break;
+        case 'v':
+            g_verbose = 1;
+            break;
+        default:
+            (void) fprintf(stderr, "bigserver [-o file] [-m recv|splice|direct|stripe] [-b nbuf] [-S MB] [-L lowat] [-w workers] [-i sec] [-t sec] [-v] port [n|e]\n");
+            return (EX_USAGE);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
     // 引数にポートが指定されているか
     if (argc <= 1) {
-        (void) fprintf(stderr, "bigserver port \n");
+        (void) fprintf(stderr, "bigserver [-o file] [-m recv|splice|direct|stripe] [-b nbuf] [-S MB] [-L lowat] [-w workers] [-i sec] [-t sec] [-v] port [n|e]\n");
+        return (EX_USAGE);
+    }
+    if (g_sink == SINK_STRIPE) {
+        if (g_out == NULL) {
+            (void) fprintf(stderr, "-m stripe needs -o file\n");
+            return (EX_USAGE);
+        }
+        if (g_workers == 0) {
+            g_workers = STRIPE_WORKERS;
+        }
+    } else if (g_workers > 0 && g_sink != SINK_RECV) {
+        (void) fprintf(stderr, "-w supports only -m recv, stripe\n");
         return (EX_USAGE);
     }
     // ブロッキングモードオプションの判定
     if (argc >= 3 && argv[2][0] == 'n') {
         (void) fprintf(stderr, "Nonblocking mode\n");
         g_mode = 'n';
+    } else if (argc >= 3 && argv[2][0] == 'e') {
+        (void) fprintf(stderr, "Event-driven mode\n");
+        g_mode = 'e';
     } else {
         g_mode = 'b';
     }
@@ -277,7 +1608,11 @@ int main(int argc, char *argv[])
     }
     (void) fprintf(stderr, "ready for accept\n");
     // アクセプトループ
-    accept_loop(soc);
+    if (g_workers > 0) {
+        accept_loop_workers(soc);
+    } else {
+        accept_loop(soc);
+    }
     // ソケットクローズ
     (void) close(soc);
     return (EX_OK);
@@ -26,6 +26,8 @@
 #include <sysexits.h>
 #include <unistd.h>
 
+#include "../common/iobuf.h"
+
 /**
  * UPDマルチキャストサーバソケットの準備
  * 
@@ -120,34 +122,14 @@ int udp_server_socket_mcast(const char *m_address,
  * ノンブロッキングの場合は1パケットも受信できない状態でもすぐに戻る。
  */
 
-// サイズ指定文字列連結
-size_t mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-    dlen = pd - dst;
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-    pde = dst + size - 1;
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
-    }
-    while (*ps++);
-    return (dlen + (ps - src - 1));
-}
-
 // 送受信
 void send_recv_loop(int soc)
 {
     char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    char buf[512], *ptr;
+    char buf[512];
+    struct iobuf in = IOBUF_INIT(buf);
+    struct resp resp;
+    size_t mlen;
     struct sockaddr_storage from;
     ssize_t len;
     socklen_t fromlen;
@@ -155,13 +137,12 @@ void send_recv_loop(int soc)
     for (;;) {
         // 受信
         fromlen = sizeof(from);
-        if ((len = recvfrom(soc,
-                            buf,
-                            sizeof(buf),
-                            0,
-                            (struct sockaddr *) &from,
-                            &fromlen
-                            )) == -1) {
+        if ((len = iobuf_recvfrom(soc,
+                                  &in,
+                                  0,
+                                  (struct sockaddr *) &from,
+                                  &fromlen
+                                  )) == -1) {
             // error
             perror("recvfrom");
         }
@@ -171,22 +152,18 @@ void send_recv_loop(int soc)
                             NI_NUMERICHOST | NI_NUMERICSERV);
         (void) fprintf(stderr, "recvfrom:%s:%s:len=%d\n", hbuf, sbuf, (int) len);
 
-        // 文字列化・表示
-        buf[len] = '\0';
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
-        (void) fprintf(stderr, "[client]%s\n", buf);
-        // 応答文字列作成
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = strlen(buf);
+        // 1行目の切り出し・表示 長さを保持しているので'\0'終端は不要
+        mlen = msg_line_len(in.data, in.len);
+        (void) fprintf(stderr, "[client]%.*s\n", (int) mlen, in.data);
+        // 応答作成 1行目と":OK\r\n"をiovecで並べるだけでコピーはしない
+        resp_init(&resp);
+        (void) resp_add_ok(&resp, in.data, mlen);
         // 応答
-        if ((len = sendto(soc,
-                          buf,
-                          len,
-                          0,
-                          (struct sockaddr *) &from,
-                          fromlen)) == -1) {
+        if ((len = resp_sendto(soc,
+                               &resp,
+                               0,
+                               (struct sockaddr *) &from,
+                               fromlen)) == -1) {
             // error
             perror("sendto");
             break;
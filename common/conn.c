@@ -0,0 +1,274 @@
+/**
+ * 接続ごとの処理(プロトコルの共通部分)
+ *
+ * conn.hを参照
+ */
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "conn.h"
+#include "iobuf.h"
+#include "lat.h"
+#include "log.h"
+
+// 統計 conn_stat_init(1)で共有メモリに移す
+static struct conn_stat g_stat_local;
+static struct conn_stat *g_stat = &g_stat_local;
+
+/**
+ * 統計の初期化
+ * sharedが真ならばfork()した子プロセスとも共有する
+ */
+int conn_stat_init(int shared)
+{
+    struct conn_stat *st;
+
+    if (!shared) {
+        g_stat = &g_stat_local;
+    } else {
+        if ((st = mmap(NULL, sizeof(*st), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+            return (-1);
+        }
+        g_stat = st;
+    }
+    (void) memset(g_stat, 0, sizeof(*g_stat));
+    return (0);
+}
+
+void conn_stat_get(struct conn_stat *st)
+{
+    st->accepted = __atomic_load_n(&g_stat->accepted, __ATOMIC_RELAXED);
+    st->closed = __atomic_load_n(&g_stat->closed, __ATOMIC_RELAXED);
+    st->msgs = __atomic_load_n(&g_stat->msgs, __ATOMIC_RELAXED);
+}
+
+/**
+ * タイムアウト
+ * shutdown()だけして、次のイベント(POLLHUP)からいつもの経路(EOF、送信エラー)でクローズさせる
+ */
+static void conn_timeout(struct twheel_timer *t, void *arg)
+{
+    struct conn *c = arg;
+
+    LOGINFO("[fd%d] %s timeout", c->fd, c->tkind == CONN_TMO_WRITE ? "write" : c->tkind == CONN_TMO_READ ? "read" : "idle");
+    (void) shutdown(c->fd, SHUT_RDWR);
+}
+
+/**
+ * アクセプトしたソケットで初期化
+ * accepted: アクセプトした時刻(lat_clock())
+ */
+void conn_init(struct conn *c, int fd, uint64_t accepted)
+{
+    c->fd = fd;
+    framer_init(&c->fr);
+    outq_init(&c->out);
+    c->eof = 0;
+    c->events = 0;
+    c->accepted = accepted;
+    c->wheel = NULL;
+    twheel_timer_init(&c->timer, conn_timeout, c);
+    __atomic_add_fetch(&g_stat->accepted, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * クローズ
+ */
+void conn_fini(struct conn *c)
+{
+    if (c->wheel != NULL) {
+        twheel_del(c->wheel, &c->timer);
+    }
+    outq_free(&c->out);
+    (void) close(c->fd);
+    c->fd = -1;
+    __atomic_add_fetch(&g_stat->closed, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * イベントループ用 確保して初期化
+ */
+struct conn *conn_new(int fd, uint64_t accepted)
+{
+    struct conn *c;
+
+    if ((c = malloc(sizeof(*c))) == NULL) {
+        return (NULL);
+    }
+    conn_init(c, fd, accepted);
+    return (c);
+}
+
+void conn_close(struct conn *c)
+{
+    conn_fini(c);
+    free(c);
+}
+
+/**
+ * 受信と応答
+ *
+ * recv()したデータから完全な行を全て切り出し、各行の応答をまとめて1回で送信する。
+ * EOFの場合は改行の無い最後の行にも応答し、c->eofを立てる。
+ * 最初の受信ではアクセプトからの時間を、応答した場合はrecv()から送信(送信待ちに積む)までの時間を記録する。
+ * 戻り値 0:継続 -1:エラー
+ */
+static int conn_input(struct conn *c)
+{
+    struct resp resp;
+    const char *line;
+    size_t mlen;
+    ssize_t len;
+    unsigned long n;
+    uint64_t now;
+
+    if ((len = framer_recv(c->fd, &c->fr, 0)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return (0);
+        }
+        LOGDEBUG("[fd%d] recv:%s", c->fd, strerror(errno));
+        return (-1);
+    }
+    now = lat_clock();
+    if (c->accepted != 0 && len > 0) {
+        lat_record(LAT_FIRST_BYTE, c->accepted, now);
+        c->accepted = 0;
+    }
+    if (len == 0) {
+        c->eof = 1;
+    }
+
+    n = 0;
+    resp_init(&resp);
+    while (framer_next(&c->fr, &line, &mlen) || (c->eof && framer_rest(&c->fr, &line, &mlen))) {
+        n++;
+        if (resp_add_ok(&resp, line, mlen) == -1) {
+            // iovが一杯 ここまでを送信して続ける
+            if (outq_send(c->fd, &c->out, &resp) == -1) {
+                return (-1);
+            }
+            (void) resp_add_ok(&resp, line, mlen);
+        }
+    }
+    if (n > 0) {
+        // 統計は行ごとではなくrecv()ごとにまとめて足す
+        __atomic_add_fetch(&g_stat->msgs, n, __ATOMIC_RELAXED);
+    }
+    if (resp.iovcnt > 0 && outq_send(c->fd, &c->out, &resp) == -1) {
+        return (-1);
+    }
+    if (n > 0) {
+        lat_record(LAT_SERVICE, now, lat_clock());
+    }
+    return (0);
+}
+
+/**
+ * 監視するイベントの決定
+ * 送信待ちがある間だけ書き込み可能を監視し、送信待ちが多い間とEOFの後は受信を監視しない
+ * 戻り値 POLLIN、POLLOUTの組み合わせ 0:EOFの後に送り切ったのでクローズしてよい
+ */
+static short conn_events(struct conn *c)
+{
+    short events;
+
+    events = 0;
+    if (!c->eof && outq_readable(&c->out)) {
+        events |= POLLIN;
+    }
+    if (outq_pending(&c->out) > 0) {
+        events |= POLLOUT;
+    }
+    return (events);
+}
+
+/**
+ * イベントの処理
+ * revents: poll()のrevents(epollのeventsでもよい)
+ * 戻り値 次に監視するイベント 0:クローズすること(エラー、切断)
+ */
+short conn_handle(struct conn *c, short revents)
+{
+    if ((revents & POLLOUT) && outq_flush(c->fd, &c->out) == -1) {
+        return (0);
+    }
+    if ((revents & (POLLIN | POLLHUP | POLLERR)) && !c->eof && conn_input(c) == -1) {
+        return (0);
+    }
+    return (conn_events(c));
+}
+
+/**
+ * タイムアウトの張り直し
+ * conn_handle()の後に呼ぶ。状態に応じて1つだけ張る(張り直しはO(1))。
+ * - 送信待ちがある: WRITE 送信待ちが減った時だけ張り直す
+ * - 行の途中: READ 最初に行の途中になった時から数え、張り直さない
+ * - それ以外: IDLE 毎回張り直す
+ * w: 接続を扱うループのホイール 接続は同じループのまま動かないこと
+ */
+void conn_arm(struct conn *c, struct twheel *w)
+{
+    enum conn_timeout kind;
+    unsigned long ms;
+    size_t pending;
+
+    pending = outq_pending(&c->out);
+    if (pending > 0) {
+        kind = CONN_TMO_WRITE;
+        ms = CONN_WRITE_TIMEOUT_MS;
+    } else if (framer_pending(&c->fr) > 0) {
+        kind = CONN_TMO_READ;
+        ms = CONN_READ_TIMEOUT_MS;
+    } else {
+        kind = CONN_TMO_IDLE;
+        ms = CONN_IDLE_TIMEOUT_MS;
+    }
+    if (kind == c->tkind && twheel_pending(&c->timer)
+        && (kind == CONN_TMO_READ || (kind == CONN_TMO_WRITE && pending >= c->tmark))) {
+        return;
+    }
+    c->wheel = w;
+    c->tkind = kind;
+    c->tmark = pending;
+    twheel_add(w, &c->timer, ms);
+}
+
+/**
+ * 1つの接続をブロッキングで最後まで処理してクローズする
+ * 1接続1プロセス・1スレッドの方式用
+ * 受信だけを待つ間はそのままrecv()でブロックし、送信待ちがある時だけpoll()で待つ
+ * レイテンシのスロットはそのまま持つ(preforkの子プロセスは次の接続も同じスロットに記録する)
+ * 接続ごとのプロセス・スレッドは終了する前にlat_release()すること
+ */
+void conn_serve(int fd, uint64_t accepted)
+{
+    struct conn c;
+    struct pollfd pfd;
+    short events;
+
+    conn_init(&c, fd, accepted);
+    events = POLLIN;
+    while (events != 0) {
+        if (events == POLLIN) {
+            events = conn_handle(&c, POLLIN);
+            continue;
+        }
+        pfd.fd = fd;
+        pfd.events = events;
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        events = conn_handle(&c, pfd.revents);
+    }
+    conn_fini(&c);
+}
@@ -0,0 +1,89 @@
+/**
+ * 接続ごとの処理(プロトコルの共通部分)
+ *
+ * ch05のサーバは方式(select、poll、epoll、fork、スレッド...)ごとに送受信の処理を別々に持っていて、
+ * 細かい所(パイプライン化された行、送れなかった応答、EOFの扱い)が少しずつ違うため、方式同士を比べられなかった。
+ *
+ * ここでは1つの接続の処理を方式に依存しない形にまとめる。
+ * - 受信: framer(framer.h)で行を切り出し、各行に"行:OK\r\n"を返す
+ * - 送信: outq(outq.h)でノンブロッキングに送り、送れなかった分は積んでおく
+ * - conn_handle()に起きたイベント(POLLIN、POLLOUT)を渡すと処理して、次に監視するイベントを返す
+ *   0が返ったらconn_fini()でクローズする
+ * イベントループの方式はconn_handle()をpoll()、select()、epollの結果で呼ぶだけで、
+ * 1接続1プロセス・1スレッドの方式はconn_serve()でブロッキングに処理する。
+ * POLLIN、POLLOUTとEPOLLIN、EPOLLOUTは同じ値なので、epollの結果もそのまま渡してよい。
+ *
+ * 統計(アクセプト数、処理した行数)は全体で1つ持つ。
+ * fork()する方式では、fork()する前にconn_stat_init(1)で共有メモリに置いておく。
+ *
+ * アクセプトから最初の受信まで、受信から応答の送信までの時間はlat.hに記録する。
+ * アクセプトした時刻は、アクセプトした実行単位と処理する実行単位が違う方式(fork、thread、pipeline)でも
+ * アクセプトした時点のものを渡す。
+ *
+ * イベントループの方式では、接続ごとのタイムアウトをループのタイミングホイール(twheel.h)に張る。
+ * conn_handle()の後にconn_arm()を呼ぶと、状態に応じてIDLE、READ、WRITEのどれか1つを張り直す。
+ * 期限が来るとshutdown()するだけなので、クローズは次のイベントでconn_handle()が0を返して行う。
+ */
+#ifndef CONN_H
+#define CONN_H
+
+#include <poll.h>
+#include <stdint.h>
+
+#include "framer.h"
+#include "outq.h"
+#include "twheel.h"
+
+/**
+ * 接続ごとのタイムアウト(ms)
+ * IDLE: 行の切れ目で何も送ってこない
+ * READ: 行の途中で止まっている(少しずつ送ってきても延長しない)
+ * WRITE: 送信待ちが減らない(相手が受信しない)
+ */
+#ifndef CONN_IDLE_TIMEOUT_MS
+#define CONN_IDLE_TIMEOUT_MS (60 * 1000)
+#endif
+#ifndef CONN_READ_TIMEOUT_MS
+#define CONN_READ_TIMEOUT_MS (10 * 1000)
+#endif
+#ifndef CONN_WRITE_TIMEOUT_MS
+#define CONN_WRITE_TIMEOUT_MS (10 * 1000)
+#endif
+
+enum conn_timeout {
+    CONN_TMO_IDLE,
+    CONN_TMO_READ,
+    CONN_TMO_WRITE
+};
+
+struct conn {
+    int fd;
+    struct framer fr; // 受信 行の途中を次のrecv()まで持ち越す
+    struct outq out; // 送信待ち
+    int eof; // EOFを受信した 送信待ちを送り切ったらクローズする
+    short events; // 呼び出し側が登録しているイベント
+    uint64_t accepted; // アクセプトした時刻(ns) 最初の受信を記録したら0にする
+    struct twheel *wheel; // タイムアウトを張っているホイール NULL:張っていない
+    struct twheel_timer timer;
+    enum conn_timeout tkind; // 張っているタイムアウトの種類
+    size_t tmark; // WRITEを張った時の送信待ち
+};
+
+struct conn_stat {
+    unsigned long accepted;
+    unsigned long closed;
+    unsigned long msgs; // 処理した行数
+};
+
+int conn_stat_init(int shared);
+void conn_stat_get(struct conn_stat *st);
+
+void conn_init(struct conn *c, int fd, uint64_t accepted);
+void conn_fini(struct conn *c);
+struct conn *conn_new(int fd, uint64_t accepted);
+void conn_close(struct conn *c);
+short conn_handle(struct conn *c, short revents);
+void conn_arm(struct conn *c, struct twheel *w);
+void conn_serve(int fd, uint64_t accepted);
+
+#endif
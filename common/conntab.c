@@ -0,0 +1,175 @@
+/**
+ * ディスクリプタで引く接続テーブル
+ *
+ * conntab.hを参照
+ */
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "conntab.h"
+
+/**
+ * 初期化 sizeは最初に確保するスロット数
+ */
+int conntab_init(struct conntab *t, int size)
+{
+    (void) memset(t, 0, sizeof(*t));
+    t->free = -1;
+    t->maxfd = -1;
+    if (size < 16) {
+        size = 16;
+    }
+    if ((t->slot = malloc(sizeof(*t->slot) * (size_t) size)) == NULL
+        || (t->pfd = malloc(sizeof(*t->pfd) * (size_t) size)) == NULL
+        || (t->pfd2slot = malloc(sizeof(*t->pfd2slot) * (size_t) size)) == NULL) {
+        conntab_free(t);
+        return (-1);
+    }
+    t->size = size;
+    return (0);
+}
+
+void conntab_free(struct conntab *t)
+{
+    free(t->fd2slot);
+    free(t->slot);
+    free(t->pfd);
+    free(t->pfd2slot);
+    (void) memset(t, 0, sizeof(*t));
+    t->free = -1;
+    t->maxfd = -1;
+}
+
+/**
+ * fd2slot[]をfdが入る大きさまで伸ばす
+ */
+static int conntab_grow_fd(struct conntab *t, int fd)
+{
+    int *p, n, i;
+
+    for (n = t->fdsize > 0 ? t->fdsize : 64; n <= fd; n *= 2);
+    if ((p = realloc(t->fd2slot, sizeof(*p) * (size_t) n)) == NULL) {
+        return (-1);
+    }
+    for (i = t->fdsize; i < n; i++) {
+        p[i] = -1;
+    }
+    t->fd2slot = p;
+    t->fdsize = n;
+    return (0);
+}
+
+/**
+ * スロットとpollfdの配列を倍にする
+ */
+static int conntab_grow_slot(struct conntab *t)
+{
+    struct conntab_slot *s;
+    struct pollfd *pfd;
+    int *p2s, n;
+
+    n = t->size * 2;
+    if ((s = realloc(t->slot, sizeof(*s) * (size_t) n)) == NULL) {
+        return (-1);
+    }
+    t->slot = s;
+    if ((pfd = realloc(t->pfd, sizeof(*pfd) * (size_t) n)) == NULL) {
+        return (-1);
+    }
+    t->pfd = pfd;
+    if ((p2s = realloc(t->pfd2slot, sizeof(*p2s) * (size_t) n)) == NULL) {
+        return (-1);
+    }
+    t->pfd2slot = p2s;
+    t->size = n;
+    return (0);
+}
+
+/**
+ * 登録
+ * pollfdは末尾に追加し、reventsは0にしておく(今回のpoll()の結果を見ている途中で追加してもよい)
+ * 戻り値 スロット番号 -1:エラー(登録済み、メモリ不足)
+ */
+int conntab_add(struct conntab *t, int fd, short events)
+{
+    int s;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return (-1);
+    }
+    if (fd >= t->fdsize && conntab_grow_fd(t, fd) == -1) {
+        return (-1);
+    }
+    if (t->fd2slot[fd] != -1) {
+        errno = EEXIST;
+        return (-1);
+    }
+    if ((s = t->free) != -1) {
+        // 空きリストから払い出す
+        t->free = t->slot[s].next;
+    } else {
+        // 空きが無い場合は未使用の末尾 一杯なら伸ばす
+        if (t->count >= t->size && conntab_grow_slot(t) == -1) {
+            return (-1);
+        }
+        s = t->count;
+    }
+    t->slot[s].fd = fd;
+    t->slot[s].pidx = t->count;
+    t->slot[s].next = -1;
+    t->slot[s].data = NULL;
+    t->pfd[t->count].fd = fd;
+    t->pfd[t->count].events = events;
+    t->pfd[t->count].revents = 0;
+    t->pfd2slot[t->count] = s;
+    t->count++;
+    t->fd2slot[fd] = s;
+    if (fd > t->maxfd) {
+        t->maxfd = fd;
+    }
+    return (s);
+}
+
+/**
+ * 削除
+ * pollfdの配列は末尾の要素を削除した位置に移して詰める
+ * 戻り値 0:成功 -1:未登録
+ */
+int conntab_del(struct conntab *t, int fd)
+{
+    int s, pidx, last;
+
+    if ((s = conntab_slot(t, fd)) == -1) {
+        errno = ENOENT;
+        return (-1);
+    }
+    pidx = t->slot[s].pidx;
+    last = t->count - 1;
+    if (pidx != last) {
+        t->pfd[pidx] = t->pfd[last];
+        t->pfd2slot[pidx] = t->pfd2slot[last];
+        t->slot[t->pfd2slot[pidx]].pidx = pidx;
+    }
+    t->count--;
+    t->fd2slot[fd] = -1;
+    t->slot[s].fd = -1;
+    t->slot[s].data = NULL;
+    t->slot[s].next = t->free;
+    t->free = s;
+    if (fd == t->maxfd) {
+        // 最大値が消えた場合は下に向かって次を探す
+        for (t->maxfd = fd - 1; t->maxfd >= 0 && t->fd2slot[t->maxfd] == -1; t->maxfd--);
+    }
+    return (0);
+}
+
+/**
+ * 登録されている最大のfd select()の第1引数用
+ */
+int conntab_maxfd(struct conntab *t)
+{
+    return (t->maxfd);
+}
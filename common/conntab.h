@@ -0,0 +1,95 @@
+/**
+ * ディスクリプタで引く接続テーブル
+ *
+ * server2.c、server3.c はchild[MAX_CHILD]の固定配列でクライアントを管理していたため
+ * - accept()のたびに空きを線形に探す
+ * - ループのたびにfd_set、pollfdの配列を全件作り直す
+ * となっていて、接続数を増やすとそれだけでループ1回がO(最大接続数)になる。
+ *
+ * ここでは
+ * - fd -> スロット番号の表をfdの値で直接引く
+ * - スロット番号は空きリストで払い出す(クライアント番号として使える)
+ * - poll()に渡すpollfdの配列は詰めて持ち、削除は末尾と入れ替えるだけにする
+ * ことで、追加・削除・検索をO(1)にして、ループごとの作り直しを無くす。
+ * どの表も足りなくなったら倍に伸ばす。
+ *
+ * pollfdの配列(t->pfd)はconntab_add()で再確保されることがあるので、追加した後はポインタを取り直すこと。
+ * poll()の結果を見ながら削除する場合は、削除した位置に末尾が入ってくるので添字を進めずにもう一度見る。
+ */
+#ifndef CONNTAB_H
+#define CONNTAB_H
+
+#include <poll.h>
+
+struct conntab_slot {
+    int fd; // -1: 空き
+    int pidx; // pfd[]の位置
+    int next; // 空きリストの次
+    void *data; // 呼び出し側が自由に使う
+};
+
+struct conntab {
+    int *fd2slot; // fd -> スロット番号 -1:未登録
+    int fdsize;
+    struct conntab_slot *slot;
+    int free; // 空きスロットの先頭 -1:無し
+    struct pollfd *pfd; // 監視中のディスクリプタ 先頭からcount個
+    int *pfd2slot; // pfd[]の位置 -> スロット番号
+    int size; // slot、pfd、pfd2slotの大きさ
+    int count;
+    int maxfd; // 登録されている最大のfd -1:無し
+};
+
+int conntab_init(struct conntab *t, int size);
+void conntab_free(struct conntab *t);
+int conntab_add(struct conntab *t, int fd, short events);
+int conntab_del(struct conntab *t, int fd);
+int conntab_maxfd(struct conntab *t);
+
+/**
+ * fdのスロット番号 未登録の場合は-1
+ */
+static inline int conntab_slot(const struct conntab *t, int fd)
+{
+    return (fd >= 0 && fd < t->fdsize ? t->fd2slot[fd] : -1);
+}
+
+/**
+ * fdに結び付けたデータ
+ */
+static inline void *conntab_data(const struct conntab *t, int fd)
+{
+    int s;
+
+    return ((s = conntab_slot(t, fd)) == -1 ? NULL : t->slot[s].data);
+}
+
+static inline void conntab_set_data(struct conntab *t, int fd, void *data)
+{
+    int s;
+
+    if ((s = conntab_slot(t, fd)) != -1) {
+        t->slot[s].data = data;
+    }
+}
+
+/**
+ * fdの監視するイベント(pollfdのevents)
+ */
+static inline short conntab_events(const struct conntab *t, int fd)
+{
+    int s;
+
+    return ((s = conntab_slot(t, fd)) == -1 ? 0 : t->pfd[t->slot[s].pidx].events);
+}
+
+static inline void conntab_set_events(struct conntab *t, int fd, short events)
+{
+    int s;
+
+    if ((s = conntab_slot(t, fd)) != -1) {
+        t->pfd[t->slot[s].pidx].events = events;
+    }
+}
+
+#endif
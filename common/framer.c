@@ -0,0 +1,91 @@
+/**
+ * 行単位の受信(フレーミング)
+ * 
+ * framer.hを参照
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "framer.h"
+
+void framer_init(struct framer *f)
+{
+    f->len = 0;
+    f->pos = 0;
+}
+
+/**
+ * 受信
+ * 切り出し済みの部分を捨てて未処理のデータを先頭に詰めてから、その後ろに受信する
+ * (前回framer_next()で返した行はここで無効になる)
+ * 戻り値はrecv()と同じ
+ */
+ssize_t framer_recv(int fd, struct framer *f, int flags)
+{
+    ssize_t len;
+
+    if (f->pos > 0) {
+        (void) memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+        f->len -= f->pos;
+        f->pos = 0;
+    }
+    if (f->len >= sizeof(f->buf)) {
+        // framer_next()で取り出していない 呼び出し側の誤り
+        errno = ENOBUFS;
+        return (-1);
+    }
+    if ((len = recv(fd, f->buf + f->len, sizeof(f->buf) - f->len, flags)) > 0) {
+        f->len += (size_t) len;
+    }
+    return (len);
+}
+
+/**
+ * 次の行の取り出し
+ * lineに行の先頭、lenに改行("\n"または"\r\n")を除いた長さを入れる
+ * 戻り値 1:取り出した 0:完全な行が無い
+ */
+int framer_next(struct framer *f, const char **line, size_t *len)
+{
+    char *start, *nl;
+
+    start = f->buf + f->pos;
+    if ((nl = memchr(start, '\n', f->len - f->pos)) == NULL) {
+        if (f->pos == 0 && f->len == sizeof(f->buf)) {
+            // 改行が無いまま一杯になった そこまでを1行とする
+            *line = start;
+            *len = f->len;
+            f->pos = f->len;
+            return (1);
+        }
+        return (0);
+    }
+    *line = start;
+    *len = (size_t) (nl - start);
+    if (*len > 0 && start[*len - 1] == '\r') {
+        (*len)--;
+    }
+    f->pos = (size_t) (nl - f->buf) + 1;
+    return (1);
+}
+
+/**
+ * 改行が来ていない残りの取り出し EOFを受信した時に使う
+ * 戻り値 1:取り出した 0:残り無し
+ */
+int framer_rest(struct framer *f, const char **line, size_t *len)
+{
+    if (f->pos >= f->len) {
+        return (0);
+    }
+    *line = f->buf + f->pos;
+    *len = f->len - f->pos;
+    if (*len > 0 && (*line)[*len - 1] == '\r') {
+        (*len)--;
+    }
+    f->pos = f->len;
+    return (1);
+}
@@ -0,0 +1,52 @@
+/**
+ * 行単位の受信(フレーミング)
+ * 
+ * これまでのイベントループのサーバのsend_recv()は、recv()1回を1メッセージとして扱い、
+ * 最初の"\r\n"までを切り出して残りを捨てていた。
+ * そのためクライアントが複数行をまとめて送る(パイプライン化する)と、最初の1行にしか応答しない。
+ * また1行がrecv()の途中で分かれて届くと、それぞれを別のメッセージとして扱ってしまう。
+ * 
+ * ここでは接続ごとに受信バッファを持ち続け
+ * - recv()したデータから完全な行を全て切り出す
+ * - 改行が来ていない残りは次のrecv()まで持ち越し、続きのデータと合わせて切り出す
+ * ようにする。切り出した行は受信バッファを指すだけでコピーしないので、
+ * まとめてiovecに並べて1回のwritev()/sendmsg()で応答できる。
+ * 
+ * 使い方
+ *   framer_recv()で受信 -> framer_next()が0を返すまで行を取り出して応答を作る -> 応答を送信
+ * framer_next()が返した行は、次のframer_recv()で受信バッファが詰められるまで有効。
+ * 
+ * 改行が無いまま受信バッファが一杯になった場合は、これまでと同様にそこまでを1行とする。
+ */
+#ifndef FRAMER_H
+#define FRAMER_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+// 接続ごとの受信バッファサイズ
+#ifndef FRAMER_BUFSIZE
+#define FRAMER_BUFSIZE (4096)
+#endif
+
+struct framer {
+    char buf[FRAMER_BUFSIZE];
+    size_t len; // 受信済みのデータ
+    size_t pos; // 次に切り出す位置 buf[pos]からbuf[len - 1]までが未処理
+};
+
+void framer_init(struct framer *f);
+ssize_t framer_recv(int fd, struct framer *f, int flags);
+int framer_next(struct framer *f, const char **line, size_t *len);
+int framer_rest(struct framer *f, const char **line, size_t *len);
+
+/**
+ * 改行が来ていない残りのバイト数
+ */
+static inline size_t framer_pending(const struct framer *f)
+{
+    return (f->len - f->pos);
+}
+
+#endif
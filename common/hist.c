@@ -0,0 +1,125 @@
+/**
+ * レイテンシのヒストグラム(HDR Histogram風)
+ *
+ * hist.hを参照
+ */
+#include <string.h>
+
+#include "hist.h"
+
+void hist_init(struct hist *h)
+{
+    (void) memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+/**
+ * 記録を消す
+ * hist_init()、hist_reset()の後、または0で埋めた領域(mmap()など)に記録したものが対象で、
+ * 記録のあるバケツはminからmaxの間だけなので、そこだけ0に戻す(全体のmemset()は約100KBになる)
+ */
+void hist_reset(struct hist *h)
+{
+    int i, end;
+
+    if (h->total > 0) {
+        for (i = hist_index(h->min), end = hist_index(h->max); i <= end; i++) {
+            h->count[i] = 0;
+        }
+    }
+    h->total = 0;
+    h->sum = 0;
+    h->min = UINT64_MAX;
+    h->max = 0;
+}
+
+/**
+ * srcをdstに足す
+ */
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+    int i, end;
+
+    if (src->total == 0) {
+        return;
+    }
+    // 記録のあるバケツはminからmaxの間だけ(接続ごとに足し込むような使い方で全体を回さない)
+    for (i = hist_index(src->min), end = hist_index(src->max); i <= end; i++) {
+        dst->count[i] += src->count[i];
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+}
+
+/**
+ * バケツの位置から、そのバケツに入る値の範囲の上限
+ */
+static uint64_t hist_bucket_high(int index)
+{
+    int shift;
+
+    if (index < 2 * HIST_SUB) {
+        return ((uint64_t) index);
+    }
+    shift = index / HIST_SUB - 1;
+    return ((((uint64_t) (index % HIST_SUB + HIST_SUB) + 1) << shift) - 1);
+}
+
+/**
+ * パーセンタイル(0から100)の値
+ * そのパーセンタイルの記録が入っているバケツの上限を返す(ただし最大値を超えない)
+ */
+uint64_t hist_value_at(const struct hist *h, double percentile)
+{
+    uint64_t target, seen, v;
+    int i;
+
+    if (h->total == 0) {
+        return (0);
+    }
+    target = (uint64_t) (percentile / 100.0 * (double) h->total + 0.5);
+    if (target < 1) {
+        target = 1;
+    }
+    if (target > h->total) {
+        target = h->total;
+    }
+    for (seen = 0, i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->count[i]) >= target) {
+            v = hist_bucket_high(i);
+            return (v < h->max ? v : h->max);
+        }
+    }
+    return (h->max);
+}
+
+double hist_mean(const struct hist *h)
+{
+    return (h->total > 0 ? (double) h->sum / (double) h->total : 0.0);
+}
+
+/**
+ * 分布の表示 値はナノ秒としてマイクロ秒で表示する
+ */
+void hist_print(FILE *fp, const char *title, const struct hist *h)
+{
+    static const double pct[] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+    size_t i;
+
+    (void) fprintf(fp, "%s: count=%llu", title, (unsigned long long) h->total);
+    if (h->total == 0) {
+        (void) fprintf(fp, "\n");
+        return;
+    }
+    (void) fprintf(fp, " min=%.1fus mean=%.1fus", (double) h->min / 1000.0, hist_mean(h) / 1000.0);
+    for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+        (void) fprintf(fp, " p%g=%.1fus", pct[i], (double) hist_value_at(h, pct[i]) / 1000.0);
+    }
+    (void) fprintf(fp, " max=%.1fus\n", (double) h->max / 1000.0);
+}
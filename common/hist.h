@@ -0,0 +1,77 @@
+/**
+ * レイテンシのヒストグラム(HDR Histogram風)
+ *
+ * 平均や最大だけでは、p99、p99.99のような裾の遅延が分からない。
+ * 全ての値を保存してソートするとメモリも時間もかかるので、値を対数・線形の2段のバケツで数える。
+ * - 2のべき乗ごとの区間を、さらにHIST_SUB個に等分する
+ *   (例: 1024から2047は8ずつの128個のバケツ) どの値も相対誤差1/HIST_SUB未満で数えられる
+ * - 0からHIST_MAX(ns単位ならば約18分)まで固定の配列で、記録はシフトと加算だけ
+ * - 同じ構造なのでスレッドごとに記録して、最後に足し合わせられる
+ *
+ * 単位は呼び出し側が決める(ここではナノ秒を想定した表示にしている)。
+ * 1つのヒストグラムに記録するのは1スレッドだけにすること(ロックはしない)。
+ */
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// 2のべき乗の区間を2^HIST_SUB_BITS個に分ける
+#define HIST_SUB_BITS (7)
+#define HIST_SUB (1 << HIST_SUB_BITS)
+// 記録できる最大値 これより大きい値はここに丸める
+#define HIST_MAX_BITS (40)
+#define HIST_MAX ((1ULL << HIST_MAX_BITS) - 1)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct hist {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t total; // 記録した数
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum; // 平均用
+};
+
+void hist_init(struct hist *h);
+void hist_reset(struct hist *h);
+void hist_merge(struct hist *dst, const struct hist *src);
+uint64_t hist_value_at(const struct hist *h, double percentile);
+double hist_mean(const struct hist *h);
+void hist_print(FILE *fp, const char *title, const struct hist *h);
+
+/**
+ * 値からバケツの位置
+ * HIST_SUB*2未満はそのまま、それ以上は最上位ビットから上位HIST_SUB_BITS+1ビットを残す
+ */
+static inline int hist_index(uint64_t v)
+{
+    int shift;
+
+    if (v > HIST_MAX) {
+        v = HIST_MAX;
+    }
+    if (v < 2 * HIST_SUB) {
+        return ((int) v);
+    }
+    shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift * HIST_SUB + (int) (v >> shift));
+}
+
+/**
+ * 記録
+ */
+static inline void hist_record(struct hist *h, uint64_t v)
+{
+    h->count[hist_index(v)]++;
+    h->total++;
+    h->sum += v;
+    if (v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+#endif
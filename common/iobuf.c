@@ -0,0 +1,150 @@
+/**
+ * 長さ付きバッファと応答の組み立て
+ * 
+ * iobuf.hを参照
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include "iobuf.h"
+
+const char RESP_OK[] = ":OK\r\n";
+
+/**
+ * 受信
+ * bのdata[0]から受信し、受信したサイズをlenに入れる
+ * 戻り値はrecv()と同じ
+ */
+ssize_t iobuf_recv(int fd, struct iobuf *b, int flags)
+{
+    ssize_t len;
+
+    if ((len = recv(fd, b->data, b->size, flags)) >= 0) {
+        b->len = (size_t) len;
+    }
+    return (len);
+}
+
+ssize_t iobuf_recvfrom(int fd, struct iobuf *b, int flags, struct sockaddr *from, socklen_t *fromlen)
+{
+    ssize_t len;
+
+    if ((len = recvfrom(fd, b->data, b->size, flags, from, fromlen)) >= 0) {
+        b->len = (size_t) len;
+    }
+    return (len);
+}
+
+/**
+ * 1行目の長さ
+ * 最初の'\r'または'\n'までのバイト数 どちらも無ければlen
+ * (strpbrk(buf, "\r\n")と同じ位置を、'\0'終端を使わずに求める)
+ */
+size_t msg_line_len(const char *data, size_t len)
+{
+    const char *p, *end;
+
+    for (p = data, end = data + len; p < end; p++) {
+        if (*p == '\r' || *p == '\n') {
+            break;
+        }
+    }
+    return ((size_t) (p - data));
+}
+
+void resp_init(struct resp *r)
+{
+    r->iovcnt = 0;
+    r->len = 0;
+}
+
+/**
+ * 応答にデータを追加
+ * dataは送信が終わるまで変更しないこと
+ * 戻り値 0:成功 -1:iovが一杯
+ */
+int resp_add(struct resp *r, const void *data, size_t len)
+{
+    if (len == 0) {
+        return (0);
+    }
+    if (r->iovcnt >= RESP_MAXIOV) {
+        return (-1);
+    }
+    r->iov[r->iovcnt].iov_base = (void *) data;
+    r->iov[r->iovcnt].iov_len = len;
+    r->iovcnt++;
+    r->len += len;
+    return (0);
+}
+
+/**
+ * 受信データ + ":OK\r\n" の応答を追加
+ */
+int resp_add_ok(struct resp *r, const char *data, size_t len)
+{
+    if (r->iovcnt + 2 > RESP_MAXIOV) {
+        return (-1);
+    }
+    (void) resp_add(r, data, len);
+    (void) resp_add(r, RESP_OK, RESP_OK_LEN);
+    return (0);
+}
+
+/**
+ * 応答の送信
+ * 
+ * iovをそのままsendmsg()に渡す。ブロッキングソケットで途中までしか送信できなかった場合は
+ * 残りのiovを詰め直して送信を続ける。
+ * 応答は1行分の小さなデータなので、MSG_ZEROCOPYはページのピン留めと完了通知の方が
+ * コピーより高くつき、完了まで受信バッファを再利用できなくなるので使わない。
+ * 
+ * 戻り値 送信したバイト数 エラーは-1
+ * (UDPはtoに宛先を指定する)
+ */
+ssize_t resp_sendto(int fd, struct resp *r, int flags, const struct sockaddr *to, socklen_t tolen)
+{
+    struct msghdr msg;
+    struct iovec *iov;
+    ssize_t len, total;
+    int iovcnt;
+
+    iov = r->iov;
+    iovcnt = r->iovcnt;
+    for (total = 0; iovcnt > 0;) {
+        (void) memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *) to;
+        msg.msg_namelen = tolen;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        if ((len = sendmsg(fd, &msg, flags)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            total = -1;
+            break;
+        }
+        total += len;
+        // 送信できた分のiovを進める
+        while (iovcnt > 0 && (size_t) len >= iov->iov_len) {
+            len -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + len;
+            iov->iov_len -= len;
+        }
+    }
+    resp_init(r);
+    return (total);
+}
+
+ssize_t resp_send(int fd, struct resp *r, int flags)
+{
+    return (resp_sendto(fd, r, flags, NULL, 0));
+}
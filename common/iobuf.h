@@ -0,0 +1,66 @@
+/**
+ * 長さ付きバッファと応答の組み立て
+ * 
+ * これまでのサーバはメッセージごとに
+ * - buf[len] = '\0'で文字列化
+ * - strpbrk()で"\r\n"を探して切り詰め
+ * - mystrlcat()で":OK\r\n"を連結(1バイトずつ走査)
+ * - strlen()でもう一度長さを数えてsend()
+ * と同じバッファを何度も走査していた。
+ * 
+ * ここでは長さを常に保持しておき、応答は「受信データの一部分」と「固定の文字列」を
+ * iovecで並べるだけにして、コピーせずにwritev()/sendmsg()の1回で送信する。
+ * 
+ * 各章のサーバから#include "../common/iobuf.h"で使い、Makefileのobjsに../common/iobuf.oを追加する。
+ */
+#ifndef IOBUF_H
+#define IOBUF_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stddef.h>
+
+/**
+ * 長さ付きバッファ
+ * dataの領域はsize、そのうち有効なデータがlenバイト
+ * 文字列ではないので'\0'終端はしない
+ */
+struct iobuf {
+    char *data;
+    size_t len;
+    size_t size;
+};
+
+// 配列からiobufを初期化する
+#define IOBUF_INIT(a_) { (a_), 0, sizeof(a_) }
+
+/**
+ * 応答
+ * 送信するデータをiovecのリストとして持つ。データ自体はコピーしない
+ * パイプライン化された複数行の応答(1行につき2個)をまとめて1回で送れるように多めにしておく
+ */
+#define RESP_MAXIOV (256)
+
+struct resp {
+    struct iovec iov[RESP_MAXIOV];
+    int iovcnt;
+    size_t len; // iovの合計バイト数
+};
+
+// 応答の末尾に付ける文字列
+extern const char RESP_OK[];
+#define RESP_OK_LEN (sizeof(":OK\r\n") - 1)
+
+ssize_t iobuf_recv(int fd, struct iobuf *b, int flags);
+ssize_t iobuf_recvfrom(int fd, struct iobuf *b, int flags, struct sockaddr *from, socklen_t *fromlen);
+size_t msg_line_len(const char *data, size_t len);
+
+void resp_init(struct resp *r);
+int resp_add(struct resp *r, const void *data, size_t len);
+int resp_add_ok(struct resp *r, const char *data, size_t len);
+ssize_t resp_send(int fd, struct resp *r, int flags);
+ssize_t resp_sendto(int fd, struct resp *r, int flags, const struct sockaddr *to, socklen_t tolen);
+
+#endif
@@ -0,0 +1,367 @@
+/**
+ * サーバ内部のレイテンシの計測
+ *
+ * lat.hを参照
+ *
+ * スロットの取得・返却と表示は共有メモリのlockで排他する(fork()した子プロセスとも共有するので、
+ * pthread_mutexではなくアトミック操作のスピンロックにしている)。
+ * 取得・返却はプロセス・スレッドごと、表示は秒単位で、ロック中に触るのは記録のあるバケツだけなので、
+ * 記録の邪魔にはならない。
+ * lockには持っているプロセスのpidを入れる。子プロセスがロック中にSIGKILLされると誰も外せなくなるので、
+ * 待っている間にときどき持ち主を確かめ、もういなければ奪う
+ * (持ち主が途中まで足し込んでいた累計は多少ずれるが、表示が止まるよりよい)。
+ */
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lat.h"
+
+// 共有メモリに置くスロット数
+#define LAT_SLOTS (64)
+// ロックを待つ間、この回数ごとに持ち主が生きているか確かめる
+#define LAT_LOCK_CHECK (1000)
+
+struct lat_region {
+    int lock;
+    struct lat_slot retired; // lat_release()で返されたスロットの累計
+    struct lat_slot slot[LAT_SLOTS];
+};
+
+static const char *const g_lat_names[LAT_KINDS] = { "first_byte", "service", "queue" };
+
+static struct lat_region *g_region;
+
+// 返された、このプロセスで確保したスロットのリスト(lockで排他する)
+static struct lat_slot *g_lat_free;
+// このプロセスで確保したスロットの全て allでつなぐ(lockで排他する 解放はしない)
+static struct lat_slot *g_lat_private;
+
+__thread struct lat_slot *t_lat_slot;
+
+static struct {
+    const char *path;
+    int interval;
+} g_lat_out;
+
+/**
+ * プロセスが終わっている(回収済み)か
+ * 回収されていないゾンビは終わっていないとみなす(pidが再利用されていないことが分かるのは回収まで)
+ */
+static int lat_dead(pid_t pid)
+{
+    return (kill(pid, 0) == -1 && errno == ESRCH);
+}
+
+static void lat_lock(void)
+{
+    int me, holder;
+    unsigned long spins;
+
+    me = (int) getpid();
+    for (spins = 1; ; spins++) {
+        holder = 0;
+        if (__atomic_compare_exchange_n(&g_region->lock, &holder, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // 同じプロセスのスレッドが持っている場合は、そのスレッドが外すまで待つ
+        if (spins % LAT_LOCK_CHECK == 0 && holder != me && lat_dead((pid_t) holder)
+            && __atomic_compare_exchange_n(&g_region->lock, &holder, me, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        // 持っているのは同じCPUの別のプロセスかもしれないので譲る
+        (void) sched_yield();
+    }
+}
+
+static void lat_unlock(void)
+{
+    __atomic_store_n(&g_region->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void lat_slot_init(struct lat_slot *s)
+{
+    int i;
+
+    for (i = 0; i < LAT_KINDS; i++) {
+        hist_init(&s->h[i]);
+    }
+}
+
+/**
+ * スロットの記録を消す 記録のあるバケツだけ0に戻す
+ * 共有メモリのスロットはmmap()で0になっているので、最初もこれでよい
+ */
+static void lat_slot_reset(struct lat_slot *s)
+{
+    int i;
+
+    for (i = 0; i < LAT_KINDS; i++) {
+        hist_reset(&s->h[i]);
+    }
+}
+
+/**
+ * 共有メモリのスロットを累計に足し込んで空きにする lockを取った状態で呼ぶ
+ */
+static void lat_slot_retire(struct lat_slot *s)
+{
+    int i;
+
+    for (i = 0; i < LAT_KINDS; i++) {
+        hist_merge(&g_region->retired.h[i], &s->h[i]);
+    }
+    lat_slot_reset(s);
+    s->used = 0;
+}
+
+/**
+ * 持ち主が終わっている共有メモリのスロットを回収する lockを取った状態で呼ぶ
+ * 戻り値 回収したスロット数
+ */
+static int lat_sweep(void)
+{
+    struct lat_slot *s;
+    pid_t me;
+    int i, n;
+
+    me = getpid();
+    for (n = 0, i = 0; i < LAT_SLOTS; i++) {
+        s = &g_region->slot[i];
+        if (s->used && s->pid != me && lat_dead(s->pid)) {
+            lat_slot_retire(s);
+            n++;
+        }
+    }
+    return (n);
+}
+
+/**
+ * 初期化 fork()する方式ではfork()する前に呼ぶこと
+ * 使うのは触ったページだけなので、スロットの数だけメモリを使うわけではない
+ */
+int lat_init(void)
+{
+    struct lat_region *r;
+
+    if ((r = mmap(NULL, sizeof(*r), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        return (-1);
+    }
+    lat_slot_init(&r->retired);
+    g_region = r;
+    return (0);
+}
+
+/**
+ * このスレッドのスロットを取る
+ * 空きが無ければこのスレッドだけのものを確保する
+ * 戻り値 スロット NULL:lat_init()していない、確保できない
+ */
+struct lat_slot *lat_attach(void)
+{
+    struct lat_slot *s;
+    int i, swept;
+
+    if (g_region == NULL) {
+        return (NULL);
+    }
+    s = NULL;
+    lat_lock();
+    for (swept = 0; s == NULL && swept < 2; swept++) {
+        // 空きが無ければ、持ち主が終わっているスロットを回収してからもう一度探す
+        if (swept == 1 && lat_sweep() == 0) {
+            break;
+        }
+        for (i = 0; i < LAT_SLOTS; i++) {
+            if (!g_region->slot[i].used) {
+                s = &g_region->slot[i];
+                lat_slot_reset(s);
+                s->pid = getpid();
+                s->used = 1;
+                break;
+            }
+        }
+    }
+    if (s == NULL && g_lat_free != NULL) {
+        // 返されたものは消してあるのでそのまま使う
+        s = g_lat_free;
+        g_lat_free = s->next;
+        s->used = 1;
+    }
+    lat_unlock();
+    if (s == NULL) {
+        if ((s = malloc(sizeof(*s))) == NULL) {
+            return (NULL);
+        }
+        lat_slot_init(s);
+        s->private = 1;
+        s->pid = getpid();
+        lat_lock();
+        s->used = 1;
+        s->all = g_lat_private;
+        g_lat_private = s;
+        lat_unlock();
+    }
+    t_lat_slot = s;
+    return (s);
+}
+
+/**
+ * このスレッドのスロットを返す 記録した分は累計に足し込んで消す
+ * 接続ごとのプロセス・スレッドが終了する前に呼ぶ(長く動くプロセス・スレッドは呼ばなくてよい)
+ */
+void lat_release(void)
+{
+    struct lat_slot *s;
+    int i;
+
+    if ((s = t_lat_slot) == NULL) {
+        return;
+    }
+    t_lat_slot = NULL;
+    lat_lock();
+    if (s->private) {
+        for (i = 0; i < LAT_KINDS; i++) {
+            hist_merge(&g_region->retired.h[i], &s->h[i]);
+        }
+        lat_slot_reset(s);
+        // 次のスレッドが使う
+        s->used = 0;
+        s->next = g_lat_free;
+        g_lat_free = s;
+    } else if (s->used && s->pid == getpid()) {
+        // 持ち主が終わったとみなされて回収されていなければ
+        lat_slot_retire(s);
+    }
+    lat_unlock();
+}
+
+/**
+ * 終了した子プロセスのスロットを回収する
+ * 子プロセスをwait()で回収した親プロセスが呼ぶ(lat_release()せずに終わった分も累計に残す)
+ */
+void lat_reap(pid_t pid)
+{
+    int i;
+
+    if (g_region == NULL) {
+        return;
+    }
+    lat_lock();
+    for (i = 0; i < LAT_SLOTS; i++) {
+        if (g_region->slot[i].used && g_region->slot[i].pid == pid) {
+            lat_slot_retire(&g_region->slot[i]);
+        }
+    }
+    lat_unlock();
+}
+
+/**
+ * 全てのスロットと累計を足し合わせて表示する
+ * 先に持ち主が終わっているスロットを累計に回収しておく
+ */
+void lat_dump(FILE *fp)
+{
+    static struct lat_slot sum;
+    struct lat_slot *s;
+    char tbuf[64];
+    time_t t;
+    int i, k;
+
+    if (g_region == NULL) {
+        return;
+    }
+    lat_slot_reset(&sum);
+    lat_lock();
+    (void) lat_sweep();
+    for (k = 0; k < LAT_KINDS; k++) {
+        hist_merge(&sum.h[k], &g_region->retired.h[k]);
+    }
+    for (i = 0; i < LAT_SLOTS; i++) {
+        if (g_region->slot[i].used) {
+            for (k = 0; k < LAT_KINDS; k++) {
+                hist_merge(&sum.h[k], &g_region->slot[i].h[k]);
+            }
+        }
+    }
+    for (s = g_lat_private; s != NULL; s = s->all) {
+        if (s->used) {
+            for (k = 0; k < LAT_KINDS; k++) {
+                hist_merge(&sum.h[k], &s->h[k]);
+            }
+        }
+    }
+    lat_unlock();
+    t = time(NULL);
+    (void) strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    (void) fprintf(fp, "# latency %s pid=%d\n", tbuf, (int) getpid());
+    for (k = 0; k < LAT_KINDS; k++) {
+        hist_print(fp, g_lat_names[k], &sum.h[k]);
+    }
+    (void) fflush(fp);
+}
+
+/**
+ * 表示するスレッド
+ * SIGUSR1はlat_start()で全てのスレッドでブロックしてあるので、このスレッドだけがsigtimedwait()で受け取る
+ */
+static void *lat_thread(void *arg)
+{
+    struct timespec ts;
+    sigset_t set;
+    FILE *fp;
+    int sig;
+
+    (void) arg;
+    (void) sigemptyset(&set);
+    (void) sigaddset(&set, SIGUSR1);
+    ts.tv_sec = g_lat_out.path != NULL ? g_lat_out.interval : 3600;
+    ts.tv_nsec = 0;
+    for (;;) {
+        if ((sig = sigtimedwait(&set, NULL, &ts)) == SIGUSR1) {
+            lat_dump(stderr);
+            continue;
+        }
+        if (sig == -1 && errno == EAGAIN && g_lat_out.path != NULL) {
+            if ((fp = fopen(g_lat_out.path, "a")) == NULL) {
+                perror(g_lat_out.path);
+                continue;
+            }
+            lat_dump(fp);
+            (void) fclose(fp);
+        }
+    }
+    // NOT REACHED
+    return (NULL);
+}
+
+/**
+ * 表示するスレッドの起動
+ * 他のスレッドを作る前、fork()する前に呼ぶこと(SIGUSR1のブロックを引き継がせる)
+ * path: interval秒ごとに追記するファイル NULLならばSIGUSR1の時だけ表示する
+ */
+int lat_start(const char *path, int interval)
+{
+    pthread_t id;
+    sigset_t set;
+
+    g_lat_out.path = path;
+    g_lat_out.interval = interval > 0 ? interval : 1;
+    (void) sigemptyset(&set);
+    (void) sigaddset(&set, SIGUSR1);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &set, NULL)) != 0) {
+        return (-1);
+    }
+    if ((errno = pthread_create(&id, NULL, lat_thread, NULL)) != 0) {
+        return (-1);
+    }
+    (void) pthread_detach(id);
+    return (0);
+}
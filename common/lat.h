@@ -0,0 +1,96 @@
+/**
+ * サーバ内部のレイテンシの計測
+ *
+ * loadgenで測れるのはクライアントから見た往復の時間だけで、サーバの中でどこに時間がかかっているかは分からない。
+ * ここではサーバの中で次の時間をヒストグラム(hist.h)に記録する。
+ *   LAT_FIRST_BYTE アクセプトしてから最初のデータを受信するまで
+ *                  (fork()、pthread_create()、パイプでの受け渡しなど、接続を処理し始めるまでの時間を含む)
+ *   LAT_SERVICE    recv()から応答をsend()する(送信待ちに積む)まで 送信を別スレッドに任せる場合はその待ちも含む
+ *   LAT_QUEUE      スレッド間のキューに入れてから取り出すまで(ch05 serverのpipeline、server9.c)
+ *
+ * 記録はスレッドごとのヒストグラムに対して行い、ロックもアトミック操作も使わない(記録1回は数ns)。
+ * 時刻の取得(clock_gettime()のvDSO)はクロックソースによって20nsから数十nsかかるので、
+ * 受信ごとに取る時刻は1回にして、最初の受信と受信から送信までの記録で共用している。
+ * スレッドごとのヒストグラム(スロット)は共有メモリにLAT_SLOTS個用意しておき、
+ * 最初に記録する時に空いているものを取る。fork()した子プロセスも同じ共有メモリに記録するので、
+ * 親プロセスから全てのプロセス・スレッドの分をまとめて読める。
+ * スロットはプロセス・スレッドが終わるまで持ち続ける(preforkの子プロセスやワーカスレッドは
+ * 接続が変わっても同じスロットに記録する)。
+ * 接続ごとのプロセス・スレッドは終了する前にlat_release()でスロットを「終了した分」に足し込んで返す。
+ * 足し込みと消去は記録のあるバケツ(minからmax)だけなので、返すたびに全体を回すことはない。
+ * lat_release()を呼ばずに終わった(殺された、作り直されたpreforkの子プロセスなど)プロセスのスロットは、
+ * スロットに持たせた持ち主のpidで見分けて回収し、同じように足し込む。
+ * - 子プロセスをwait()する親プロセスは、回収したpidをlat_reap()に渡す
+ * - lat_dump()と、空きが無い時のlat_attach()は、持ち主がもういないスロットを回収する
+ * スロットが足りない場合はそのスレッドだけのヒストグラムを確保して、lat_release()で足し込む
+ * 返されたものは次のスレッドが使うので、確保するのは同時に動く分だけ。
+ * 表示するプロセスで確保したものは表示に含めるが、他のプロセス(fork()した子プロセス)で確保したものは
+ * lat_release()するまで表示に含まれない。
+ *
+ * 表示はlat_start()が起動するスレッドが行う。
+ * - SIGUSR1を受けたら標準エラー出力に表示する
+ * - pathを指定した場合はinterval秒ごとにファイルに追記する
+ * 値は起動からの累計で、記録中のスロットを読むので多少ずれることがある。
+ */
+#ifndef LAT_H
+#define LAT_H
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "hist.h"
+
+enum lat_kind {
+    LAT_FIRST_BYTE,
+    LAT_SERVICE,
+    LAT_QUEUE,
+    LAT_KINDS
+};
+
+struct lat_slot {
+    int used;
+    int private; // 共有メモリのスロットではなく、このスレッドで確保したもの
+    pid_t pid; // 使っているプロセス
+    struct lat_slot *next; // 返されたprivateのスロットのリスト
+    struct lat_slot *all; // このプロセスで確保したprivateのスロットの全て(表示用)
+    struct hist h[LAT_KINDS];
+};
+
+int lat_init(void);
+struct lat_slot *lat_attach(void);
+void lat_release(void);
+void lat_reap(pid_t pid);
+void lat_dump(FILE *fp);
+int lat_start(const char *path, int interval);
+
+extern __thread struct lat_slot *t_lat_slot;
+
+/**
+ * 現在時刻(ns)
+ */
+static inline uint64_t lat_clock(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec);
+}
+
+/**
+ * 記録 fromからの経過時間を記録する
+ * lat_init()していない場合、スロットが確保できない場合は何もしない
+ */
+static inline void lat_record(enum lat_kind kind, uint64_t from, uint64_t now)
+{
+    struct lat_slot *s;
+
+    if ((s = t_lat_slot) == NULL && (s = lat_attach()) == NULL) {
+        return;
+    }
+    hist_record(&s->h[kind], now > from ? now - from : 0);
+}
+
+#endif
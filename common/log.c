@@ -0,0 +1,575 @@
+/**
+ * 非同期ログ
+ *
+ * log.hを参照
+ *
+ * スレッドごとのリングバッファは1つの書き込み側(そのスレッド)と1つの読み出し側(ログスレッド)なので、
+ * headとtailのアトミックな読み書きだけでロックは要らない。
+ * リングバッファのリストへの追加と、読み出し側になることだけをg_log.lockで排他する。
+ */
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <netdb.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+/**
+ * プリプロセッサ定義・グローバル変数
+ * LOG_RINGSIZE: スレッドごとのリングバッファのレコード数 2のべき乗
+ * LOG_STRSIZE: 1レコードで文字列とsockaddrのコピーに使える領域
+ * LOG_OUTSIZE: 書き出し用のバッファ
+ * LOG_BATCH_NSEC: 起こされてから書き出すまで待つ時間 この間に溜まったものをまとめて書く
+ */
+#define LOG_RINGSIZE (1024)
+#define LOG_RINGMASK (LOG_RINGSIZE - 1)
+#define LOG_STRSIZE (160)
+#define LOG_OUTSIZE (64 * 1024)
+#define LOG_LINEMAX (1024)
+#define LOG_BATCH_NSEC (1000 * 1000)
+
+struct log_rec {
+    struct timespec ts;
+    const char *fmt;
+    unsigned char level;
+    unsigned char nargs;
+    unsigned char type[LOG_MAXARGS];
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+        struct {
+            unsigned short off;
+            unsigned short len;
+        } s; // 文字列、sockaddrはstr[]の中の位置
+    } v[LOG_MAXARGS];
+    char str[LOG_STRSIZE];
+};
+
+struct log_ring {
+    unsigned long head __attribute__((aligned(64))); // ログスレッドが進める
+    unsigned long tail __attribute__((aligned(64))); // 書き込むスレッドが進める
+    unsigned long dropped; // 一杯で捨てた数
+    unsigned long reported; // 捨てた数のうち表示済みの数(ログスレッドのみ)
+    int closed; // スレッドが終了した 空になったら解放する
+    struct log_ring *next;
+    struct log_rec rec[LOG_RINGSIZE];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    struct log_ring *rings;
+    int started;
+    int registered; // atexit()、pthread_atfork()は1回だけ
+    int sleeping;
+    int efd;
+    pthread_key_t key;
+    char out[LOG_OUTSIZE];
+    size_t outlen;
+    time_t sec; // tstrを作った時刻
+    char tstr[16];
+} g_log = { .lock = PTHREAD_MUTEX_INITIALIZER, .efd = -1 };
+
+static __thread struct log_ring *t_ring;
+
+static void *log_thread(void *arg);
+
+/**
+ * スレッド終了時 リングバッファはログスレッドが空にしてから解放する
+ */
+static void log_ring_close(void *arg)
+{
+    struct log_ring *r = arg;
+
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * fork()後の子プロセス
+ * ログスレッドは引き継がれないので、最初から作り直す
+ * 親のリングバッファの中身は親が書き出すので捨てる
+ */
+static void log_atfork_child(void)
+{
+    (void) pthread_mutex_init(&g_log.lock, NULL);
+    g_log.rings = NULL;
+    g_log.started = 0;
+    g_log.sleeping = 0;
+    g_log.outlen = 0;
+    if (g_log.efd != -1) {
+        (void) close(g_log.efd);
+        g_log.efd = -1;
+    }
+    (void) pthread_setspecific(g_log.key, NULL);
+    t_ring = NULL;
+}
+
+static void log_atexit(void)
+{
+    log_flush();
+}
+
+/**
+ * ログスレッドの開始 g_log.lockを取った状態で呼ぶ
+ */
+static int log_start(void)
+{
+    pthread_attr_t attr;
+    pthread_t id;
+
+    if (!g_log.registered) {
+        if (pthread_key_create(&g_log.key, log_ring_close) != 0) {
+            return (-1);
+        }
+        (void) atexit(log_atexit);
+        (void) pthread_atfork(NULL, NULL, log_atfork_child);
+        g_log.registered = 1;
+    }
+    if ((g_log.efd = eventfd(0, EFD_CLOEXEC)) == -1) {
+        return (-1);
+    }
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&id, &attr, log_thread, NULL) != 0) {
+        (void) pthread_attr_destroy(&attr);
+        (void) close(g_log.efd);
+        g_log.efd = -1;
+        return (-1);
+    }
+    (void) pthread_attr_destroy(&attr);
+    g_log.started = 1;
+    return (0);
+}
+
+/**
+ * 呼び出したスレッドのリングバッファを作ってリストに追加する
+ * 最初の1つの時にログスレッドを開始する
+ */
+static struct log_ring *log_ring_new(void)
+{
+    struct log_ring *r;
+
+    if ((r = calloc(1, sizeof(*r))) == NULL) {
+        return (NULL);
+    }
+    (void) pthread_mutex_lock(&g_log.lock);
+    if (!g_log.started && log_start() == -1) {
+        (void) pthread_mutex_unlock(&g_log.lock);
+        free(r);
+        return (NULL);
+    }
+    r->next = g_log.rings;
+    g_log.rings = r;
+    (void) pthread_setspecific(g_log.key, r);
+    (void) pthread_mutex_unlock(&g_log.lock);
+    t_ring = r;
+    return (r);
+}
+
+/**
+ * 書式文字列を見ながら引数をレコードにコピーする
+ * 文字列の長さは精度(%.*s、%.10s)があればそれまでしか見ない
+ * (送受信バッファは'\0'終端されていないため)
+ */
+static void log_capture(struct log_rec *rec, const char *fmt, int nargs, const struct log_arg *args)
+{
+    const struct sockaddr *sa;
+    const char *p, *s;
+    size_t off, n, prec;
+    int i;
+
+    off = 0;
+    for (i = 0, p = fmt; *p != '\0' && i < nargs; p++) {
+        if (*p != '%') {
+            continue;
+        }
+        if (*++p == '%') {
+            continue;
+        }
+        // フラグ、幅
+        for (; *p != '\0' && strchr("-+ #0", *p) != NULL; p++);
+        if (*p == '*') {
+            rec->type[i] = LOG_T_INT;
+            rec->v[i].i = args[i].v.i;
+            if (++i >= nargs) {
+                break;
+            }
+            p++;
+        }
+        for (; *p >= '0' && *p <= '9'; p++);
+        // 精度
+        prec = SIZE_MAX;
+        if (*p == '.') {
+            if (*++p == '*') {
+                prec = args[i].v.i < 0 ? SIZE_MAX : (size_t) args[i].v.i;
+                rec->type[i] = LOG_T_INT;
+                rec->v[i].i = args[i].v.i;
+                if (++i >= nargs) {
+                    break;
+                }
+                p++;
+            } else {
+                for (prec = 0; *p >= '0' && *p <= '9'; p++) {
+                    prec = prec * 10 + (size_t) (*p - '0');
+                }
+            }
+        }
+        // 長さ修飾子は無視する 型は引数の方で分かっている
+        for (; *p != '\0' && strchr("hlLqjzt", *p) != NULL; p++);
+        if (*p == '\0') {
+            break;
+        }
+
+        rec->type[i] = (unsigned char) args[i].type;
+        switch (args[i].type) {
+        case LOG_T_STR:
+            if ((s = args[i].v.p) == NULL) {
+                s = "(null)";
+            }
+            if (off > LOG_STRSIZE - 1) {
+                off = LOG_STRSIZE - 1; // 領域が無いので空文字列
+            }
+            n = strnlen(s, prec < LOG_STRSIZE ? prec : LOG_STRSIZE);
+            if (n > LOG_STRSIZE - off - 1) {
+                n = LOG_STRSIZE - off - 1;
+            }
+            (void) memcpy(rec->str + off, s, n);
+            rec->str[off + n] = '\0';
+            rec->v[i].s.off = (unsigned short) off;
+            rec->v[i].s.len = (unsigned short) n;
+            off += n + 1;
+            break;
+        case LOG_T_PEER:
+            // アドレスの文字列化はログスレッドで行うので、sockaddrをそのままコピーする
+            sa = args[i].v.p;
+            n = 0;
+            if (sa != NULL && sa->sa_family == AF_INET) {
+                n = sizeof(struct sockaddr_in);
+            } else if (sa != NULL && sa->sa_family == AF_INET6) {
+                n = sizeof(struct sockaddr_in6);
+            }
+            if (n > LOG_STRSIZE - off) {
+                n = 0;
+            }
+            (void) memcpy(rec->str + off, sa, n);
+            rec->v[i].s.off = (unsigned short) off;
+            rec->v[i].s.len = (unsigned short) n;
+            off += n;
+            break;
+        default:
+            rec->v[i].u = args[i].v.u;
+            break;
+        }
+        i++;
+    }
+    rec->nargs = (unsigned char) i;
+}
+
+/**
+ * ログの書き込み
+ * リングバッファにレコードを1つ追加するだけで、書式化も書き出しもしない
+ * ログスレッドが眠っている場合だけeventfdで起こす
+ */
+void log_write(int level, const char *fmt, int nargs, const struct log_arg *args)
+{
+    struct log_ring *r;
+    struct log_rec *rec;
+    unsigned long tail;
+    uint64_t val;
+
+    if ((r = t_ring) == NULL && (r = log_ring_new()) == NULL) {
+        return;
+    }
+    tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RINGSIZE) {
+        // 一杯 待たずに捨てる
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    rec = &r->rec[tail & LOG_RINGMASK];
+    (void) clock_gettime(CLOCK_REALTIME_COARSE, &rec->ts);
+    rec->fmt = fmt;
+    rec->level = (unsigned char) level;
+    log_capture(rec, fmt, nargs > LOG_MAXARGS ? LOG_MAXARGS : nargs, args);
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+    // ログスレッドが眠る前に確認するのと行き違わないように、tailの更新とsleepingの確認の間にフェンスを置く
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_log.sleeping, __ATOMIC_RELAXED)
+        && __atomic_exchange_n(&g_log.sleeping, 0, __ATOMIC_SEQ_CST)) {
+        val = 1;
+        (void) write(g_log.efd, &val, sizeof(val));
+    }
+}
+
+/**
+ * 書き出し用バッファをstderrに書く
+ */
+static void log_out_flush(void)
+{
+    struct iovec iov;
+    ssize_t len;
+
+    iov.iov_base = g_log.out;
+    iov.iov_len = g_log.outlen;
+    while (iov.iov_len > 0) {
+        if ((len = writev(STDERR_FILENO, &iov, 1)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        iov.iov_base = (char *) iov.iov_base + len;
+        iov.iov_len -= (size_t) len;
+    }
+    g_log.outlen = 0;
+}
+
+/**
+ * 書き出し用バッファに1行分の領域を確保する
+ */
+static char *log_out_reserve(void)
+{
+    if (LOG_OUTSIZE - g_log.outlen < LOG_LINEMAX) {
+        log_out_flush();
+    }
+    return (g_log.out + g_log.outlen);
+}
+
+/**
+ * レコード1つを書式化して1行にする
+ * 書式の変換指定ごとに、レコードの引数の型に合わせたsnprintf()を行う
+ */
+static size_t log_format(char *buf, size_t size, const struct log_rec *rec)
+{
+    static const char lvstr[] = "EWID";
+    struct sockaddr_storage ss;
+    struct tm tm;
+    char spec[32], hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    const char *p;
+    size_t pos, slen;
+    int i, n, c;
+
+#define LOG_ROOM (pos < size ? size - pos : 0)
+#define LOG_ADV(n_) do { if ((n_) > 0) { pos += (size_t) (n_); } } while (0)
+
+    // 時刻 秒が変わった時だけlocaltime_r()する
+    if (rec->ts.tv_sec != g_log.sec) {
+        (void) localtime_r(&rec->ts.tv_sec, &tm);
+        (void) strftime(g_log.tstr, sizeof(g_log.tstr), "%H:%M:%S", &tm);
+        g_log.sec = rec->ts.tv_sec;
+    }
+    pos = 0;
+    n = snprintf(buf, size, "%s.%03ld %c ", g_log.tstr, rec->ts.tv_nsec / 1000000,
+                 lvstr[rec->level & 3]);
+    LOG_ADV(n);
+
+    for (i = 0, p = rec->fmt; *p != '\0' && pos < size; p++) {
+        if (*p == '%' && p[1] == '%') {
+            buf[pos++] = '%';
+            p++;
+            continue;
+        }
+        if (*p != '%' || i >= rec->nargs) {
+            buf[pos++] = *p;
+            continue;
+        }
+        // 変換指定を取り出す '*'は引数の値に置き換え、長さ修飾子は落とす
+        slen = 0;
+        spec[slen++] = *p++;
+        for (; *p != '\0' && slen < sizeof(spec) - 24; p++) {
+            if (*p == '*') {
+                n = snprintf(spec + slen, sizeof(spec) - slen, "%d", i < rec->nargs ? (int) rec->v[i].i : 0);
+                slen += (size_t) (n > 0 ? n : 0);
+                i++;
+            } else if (strchr("hlLqjzt", *p) != NULL) {
+                continue;
+            } else if (strchr("-+ #0.123456789", *p) != NULL) {
+                spec[slen++] = *p;
+            } else {
+                break;
+            }
+        }
+        if (*p == '\0') {
+            break;
+        }
+        if (i >= rec->nargs) {
+            continue;
+        }
+        c = *p;
+        switch (rec->type[i]) {
+        case LOG_T_INT:
+        case LOG_T_UINT:
+            if (c == 'c') {
+                spec[slen++] = 'c';
+                spec[slen] = '\0';
+                n = snprintf(buf + pos, LOG_ROOM, spec, (int) rec->v[i].i);
+                break;
+            }
+            if (strchr("diouxX", c) == NULL) {
+                c = rec->type[i] == LOG_T_INT ? 'd' : 'u';
+            }
+            spec[slen++] = 'l';
+            spec[slen++] = 'l';
+            spec[slen++] = (char) c;
+            spec[slen] = '\0';
+            if (c == 'd' || c == 'i') {
+                n = snprintf(buf + pos, LOG_ROOM, spec, rec->v[i].i);
+            } else {
+                n = snprintf(buf + pos, LOG_ROOM, spec, rec->v[i].u);
+            }
+            break;
+        case LOG_T_DBL:
+            spec[slen++] = strchr("eEfFgGaA", c) != NULL ? (char) c : 'g';
+            spec[slen] = '\0';
+            n = snprintf(buf + pos, LOG_ROOM, spec, rec->v[i].d);
+            break;
+        case LOG_T_STR:
+            spec[slen++] = 's';
+            spec[slen] = '\0';
+            n = snprintf(buf + pos, LOG_ROOM, spec, rec->str + rec->v[i].s.off);
+            break;
+        case LOG_T_PEER:
+            // ここで初めてアドレスを文字列化する
+            (void) memcpy(&ss, rec->str + rec->v[i].s.off, rec->v[i].s.len);
+            if (rec->v[i].s.len == 0
+                || getnameinfo((struct sockaddr *) &ss, (socklen_t) rec->v[i].s.len,
+                               hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+                               NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+                (void) strcpy(hbuf, "?");
+                (void) strcpy(sbuf, "?");
+            }
+            n = snprintf(buf + pos, LOG_ROOM, "%s:%s", hbuf, sbuf);
+            break;
+        default:
+            n = snprintf(buf + pos, LOG_ROOM, "%p", rec->v[i].p);
+            break;
+        }
+        LOG_ADV(n);
+        i++;
+    }
+    if (pos > size - 1) {
+        pos = size - 1;
+    }
+    buf[pos++] = '\n';
+    return (pos);
+#undef LOG_ROOM
+#undef LOG_ADV
+}
+
+/**
+ * 全リングバッファのレコードを書き出す g_log.lockを取った状態で呼ぶ
+ * 戻り値は書き出したレコード数
+ */
+static int log_drain(void)
+{
+    struct log_ring *r, **pr;
+    unsigned long head, tail, dropped;
+    char *buf;
+    int count;
+
+    count = 0;
+    for (pr = &g_log.rings; (r = *pr) != NULL;) {
+        head = r->head;
+        tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            buf = log_out_reserve();
+            g_log.outlen += log_format(buf, LOG_LINEMAX, &r->rec[head & LOG_RINGMASK]);
+            __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+            count++;
+        }
+        dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            buf = log_out_reserve();
+            g_log.outlen += (size_t) snprintf(buf, LOG_LINEMAX, "log: %lu records dropped\n",
+                                              dropped - r->reported);
+            r->reported = dropped;
+        }
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)
+            && __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head) {
+            // スレッドは終了済みで、もう書き込まれない
+            *pr = r->next;
+            free(r);
+            continue;
+        }
+        pr = &r->next;
+    }
+    log_out_flush();
+    return (count);
+}
+
+/**
+ * 溜まっているレコードがあるか
+ */
+static int log_pending(void)
+{
+    struct log_ring *r;
+    int ret;
+
+    ret = 0;
+    (void) pthread_mutex_lock(&g_log.lock);
+    for (r = g_log.rings; r != NULL; r = r->next) {
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != r->head) {
+            ret = 1;
+            break;
+        }
+    }
+    (void) pthread_mutex_unlock(&g_log.lock);
+    return (ret);
+}
+
+/**
+ * ログスレッド
+ * 書き出すものが無くなったら眠り、起こされたら少し待ってからまとめて書き出す
+ */
+static void *log_thread(void *arg)
+{
+    struct timespec ts;
+    uint64_t val;
+    int count;
+
+    (void) arg;
+    ts.tv_sec = 0;
+    ts.tv_nsec = LOG_BATCH_NSEC;
+    for (;;) {
+        (void) pthread_mutex_lock(&g_log.lock);
+        count = log_drain();
+        (void) pthread_mutex_unlock(&g_log.lock);
+        if (count > 0) {
+            continue;
+        }
+        __atomic_store_n(&g_log.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (log_pending()) {
+            // 眠る前に追加されていた
+            (void) __atomic_exchange_n(&g_log.sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        (void) read(g_log.efd, &val, sizeof(val));
+        (void) nanosleep(&ts, NULL);
+    }
+    // NOT REACHED
+    return (NULL);
+}
+
+/**
+ * 溜まっているログを呼び出したスレッドで全て書き出す
+ * exit()時にも呼ばれる
+ */
+void log_flush(void)
+{
+    (void) pthread_mutex_lock(&g_log.lock);
+    (void) log_drain();
+    (void) pthread_mutex_unlock(&g_log.lock);
+}
@@ -0,0 +1,170 @@
+/**
+ * 非同期ログ
+ *
+ * これまでのサーバはメッセージごと、ループごとにfprintf(stderr, ...)を呼んでいた。
+ * fprintf()はその場で書式化し、stderrのロックを取ってwrite()するので、
+ * 送受信の処理より表示の方が重いくらいになっている。
+ *
+ * ここでは
+ * - 呼び出し側は書式文字列のポインタと引数の値だけをレコードに詰め、スレッドごとのリングバッファに入れる(ロック無し)
+ * - ログスレッドがリングバッファからレコードを取り出して書式化し、まとめてwritev()する
+ * - アドレスは%Pでsockaddrを渡すと、getnameinfo()はログスレッドで行う
+ * - ログレベルはコンパイル時に決まり、LOG_LEVELより詳細なものは引数の評価も含めてコードが消える
+ *
+ * 使い方
+ *   LOGINFO("accept:%P", &from);
+ *   LOGDEBUG("<<child count:%d>>", count);
+ *
+ * 書式はprintf()と同じで、末尾の改行はログ側で付ける。
+ * 引数は整数、浮動小数点数、文字列(char *)、sockaddr(%P)で8個まで。
+ * 文字列はレコードにコピーするので、呼び出し後にバッファを書き換えてよい。
+ * リングバッファが一杯の場合は待たずに捨て、捨てた数を後で表示する。
+ *
+ * コンパイル時に-DLOG_LEVEL=LOGLV_DEBUGなどでレベルを変更できる。
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <netinet/in.h>
+
+#define LOGLV_ERR   (0)
+#define LOGLV_WARN  (1)
+#define LOGLV_INFO  (2)
+#define LOGLV_DEBUG (3)
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOGLV_INFO
+#endif
+
+// 1レコードの引数の最大数
+#define LOG_MAXARGS (8)
+
+/**
+ * 引数
+ * 型は_Genericで呼び出し側のコンパイル時に決まる
+ */
+enum log_type {
+    LOG_T_INT,
+    LOG_T_UINT,
+    LOG_T_DBL,
+    LOG_T_STR,
+    LOG_T_PEER,
+    LOG_T_PTR
+};
+
+struct log_arg {
+    enum log_type type;
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+    } v;
+};
+
+static inline struct log_arg log_arg_int(long long i)
+{
+    struct log_arg a = { LOG_T_INT, { .i = i } };
+    return (a);
+}
+
+static inline struct log_arg log_arg_uint(unsigned long long u)
+{
+    struct log_arg a = { LOG_T_UINT, { .u = u } };
+    return (a);
+}
+
+static inline struct log_arg log_arg_dbl(double d)
+{
+    struct log_arg a = { LOG_T_DBL, { .d = d } };
+    return (a);
+}
+
+static inline struct log_arg log_arg_str(const char *s)
+{
+    struct log_arg a = { LOG_T_STR, { .p = s } };
+    return (a);
+}
+
+static inline struct log_arg log_arg_peer(const void *sa)
+{
+    struct log_arg a = { LOG_T_PEER, { .p = sa } };
+    return (a);
+}
+
+static inline struct log_arg log_arg_ptr(const void *p)
+{
+    struct log_arg a = { LOG_T_PTR, { .p = p } };
+    return (a);
+}
+
+#define LOG_ARG(x) _Generic((x), \
+    _Bool: log_arg_int, \
+    char: log_arg_int, \
+    signed char: log_arg_int, \
+    short: log_arg_int, \
+    int: log_arg_int, \
+    long: log_arg_int, \
+    long long: log_arg_int, \
+    unsigned char: log_arg_uint, \
+    unsigned short: log_arg_uint, \
+    unsigned int: log_arg_uint, \
+    unsigned long: log_arg_uint, \
+    unsigned long long: log_arg_uint, \
+    float: log_arg_dbl, \
+    double: log_arg_dbl, \
+    char *: log_arg_str, \
+    const char *: log_arg_str, \
+    struct sockaddr *: log_arg_peer, \
+    const struct sockaddr *: log_arg_peer, \
+    struct sockaddr_storage *: log_arg_peer, \
+    const struct sockaddr_storage *: log_arg_peer, \
+    struct sockaddr_in *: log_arg_peer, \
+    struct sockaddr_in6 *: log_arg_peer, \
+    default: log_arg_ptr)(x)
+
+// 引数の数を数えて、それぞれをLOG_ARG()で包む
+#define LOG_NARG_(_1, _2, _3, _4, _5, _6, _7, _8, _9, n_, ...) n_
+#define LOG_NARG(...) LOG_NARG_(__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0, -1)
+#define LOG_CAT_(a_, b_) a_##b_
+#define LOG_CAT(a_, b_) LOG_CAT_(a_, b_)
+#define LOG_A0(f_)
+#define LOG_A1(f_, a_) LOG_ARG(a_)
+#define LOG_A2(f_, a_, ...) LOG_ARG(a_), LOG_A1(f_, __VA_ARGS__)
+#define LOG_A3(f_, a_, ...) LOG_ARG(a_), LOG_A2(f_, __VA_ARGS__)
+#define LOG_A4(f_, a_, ...) LOG_ARG(a_), LOG_A3(f_, __VA_ARGS__)
+#define LOG_A5(f_, a_, ...) LOG_ARG(a_), LOG_A4(f_, __VA_ARGS__)
+#define LOG_A6(f_, a_, ...) LOG_ARG(a_), LOG_A5(f_, __VA_ARGS__)
+#define LOG_A7(f_, a_, ...) LOG_ARG(a_), LOG_A6(f_, __VA_ARGS__)
+#define LOG_A8(f_, a_, ...) LOG_ARG(a_), LOG_A7(f_, __VA_ARGS__)
+
+/**
+ * レベルがLOG_LEVEL以下の時だけlog_write()を呼ぶ
+ * 条件は定数なので、無効なレベルは引数の評価ごと消える
+ * 先頭の{0}は引数が無い場合に配列を空にしないためのもの
+ */
+#define LOG_(lv_, ...) \
+    do { \
+        if ((lv_) <= LOG_LEVEL) { \
+            const struct log_arg log_args_[] = { \
+                { LOG_T_INT, { 0 } }, \
+                LOG_CAT(LOG_A, LOG_NARG(__VA_ARGS__))(__VA_ARGS__) \
+            }; \
+            log_write((lv_), LOG_FIRST_(__VA_ARGS__, 0), \
+                      LOG_NARG(__VA_ARGS__), log_args_ + 1); \
+        } \
+    } while (0)
+#define LOG_FIRST_(f_, ...) (f_)
+
+#define LOGERR(...)   LOG_(LOGLV_ERR, __VA_ARGS__)
+#define LOGWARN(...)  LOG_(LOGLV_WARN, __VA_ARGS__)
+#define LOGINFO(...)  LOG_(LOGLV_INFO, __VA_ARGS__)
+#define LOGDEBUG(...) LOG_(LOGLV_DEBUG, __VA_ARGS__)
+
+void log_write(int level, const char *fmt, int nargs, const struct log_arg *args);
+void log_flush(void);
+
+#endif
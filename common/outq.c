@@ -0,0 +1,151 @@
+/**
+ * 接続ごとの送信待ちキュー
+ * 
+ * outq.hを参照
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "outq.h"
+
+// 空になった時にこれより大きいバッファは解放する(一時的に溜まった分を持ち続けない)
+#define OUTQ_KEEP (OUTQ_HIGH)
+
+// 全接続の送信待ちの合計
+static size_t g_outq_total;
+
+void outq_init(struct outq *q)
+{
+    (void) memset(q, 0, sizeof(*q));
+}
+
+void outq_free(struct outq *q)
+{
+    __atomic_sub_fetch(&g_outq_total, outq_pending(q), __ATOMIC_RELAXED);
+    free(q->buf);
+    outq_init(q);
+}
+
+/**
+ * キューの末尾に追加
+ * 送信済みの領域を詰めてから、それでも足りなければ拡張する
+ */
+static int outq_append(struct outq *q, const void *data, size_t len)
+{
+    char *p;
+    size_t n;
+
+    if (q->off > 0 && q->len + len > q->size) {
+        (void) memmove(q->buf, q->buf + q->off, q->len - q->off);
+        q->len -= q->off;
+        q->off = 0;
+    }
+    if (q->len + len > q->size) {
+        for (n = q->size > 0 ? q->size : 1024; n < q->len + len; n *= 2);
+        if ((p = realloc(q->buf, n)) == NULL) {
+            return (-1);
+        }
+        q->buf = p;
+        q->size = n;
+    }
+    (void) memcpy(q->buf + q->len, data, len);
+    q->len += len;
+    __atomic_add_fetch(&g_outq_total, len, __ATOMIC_RELAXED);
+    return (0);
+}
+
+/**
+ * 送信したlenバイトをキューから落とす 空になったら先頭に戻す
+ */
+static void outq_consume(struct outq *q, size_t len)
+{
+    q->off += len;
+    __atomic_sub_fetch(&g_outq_total, len, __ATOMIC_RELAXED);
+    if (q->off == q->len) {
+        q->off = q->len = 0;
+        if (q->size > OUTQ_KEEP) {
+            free(q->buf);
+            q->buf = NULL;
+            q->size = 0;
+        }
+    }
+}
+
+/**
+ * 応答の送信
+ * キューが空ならばiovecのままノンブロッキングで送信し、送れなかった残りをキューにコピーする。
+ * キューが空でなければ全てキューに積んで、キューの送信を試みる。
+ * 戻り値 0:成功(送信待ちが残っていてもよい) -1:エラー
+ */
+int outq_send(int fd, struct outq *q, struct resp *r)
+{
+    struct msghdr msg;
+    ssize_t len;
+    int i;
+
+    len = 0;
+    if (outq_pending(q) == 0) {
+        (void) memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = r->iov;
+        msg.msg_iovlen = r->iovcnt;
+        while ((len = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) == -1 && errno == EINTR);
+        if (len == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                resp_init(r);
+                return (-1);
+            }
+            len = 0;
+        }
+    }
+    // 送れなかった残りを積む
+    for (i = 0; i < r->iovcnt; i++) {
+        if ((size_t) len >= r->iov[i].iov_len) {
+            len -= r->iov[i].iov_len;
+            continue;
+        }
+        if (outq_append(q, (char *) r->iov[i].iov_base + len, r->iov[i].iov_len - len) == -1) {
+            resp_init(r);
+            return (-1);
+        }
+        len = 0;
+    }
+    resp_init(r);
+    return (outq_flush(fd, q));
+}
+
+/**
+ * 送信待ちの送信
+ * EAGAINになるか空になるまで送信する
+ * 戻り値 0:成功(送信待ちが残っていてもよい) -1:エラー
+ */
+int outq_flush(int fd, struct outq *q)
+{
+    ssize_t len;
+
+    while (outq_pending(q) > 0) {
+        if ((len = send(fd, q->buf + q->off, outq_pending(q), MSG_DONTWAIT | MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return (-1);
+        }
+        outq_consume(q, (size_t) len);
+    }
+    return (0);
+}
+
+/**
+ * 全接続の送信待ちの合計
+ */
+size_t outq_total(void)
+{
+    return (__atomic_load_n(&g_outq_total, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,70 @@
+/**
+ * 接続ごとの送信待ちキュー
+ * 
+ * イベントループのサーバ(server2.c、server3.c、server4.c)はループの中からブロッキングのsend()をしていたため、
+ * 受信しないクライアントが1つあるとソケットの送信バッファが一杯になった時点でsend()が戻らなくなり、
+ * 他の全ての接続も止まっていた。
+ * 
+ * ここでは送信をノンブロッキングで行い、送れなかった分を接続ごとのキューに積んでおく。
+ * - キューが空ならば応答のiovecをそのまま送信し(コピーしない)、送れなかった残りだけをキューにコピーする
+ * - キューが空でなければ順序を保つためキューの後ろに積む
+ * - 呼び出し側は送信待ちがある間だけ書き込み可能(EPOLLOUT/POLLOUT)を監視し、通知されたらoutq_flush()する
+ * - 送信待ちがOUTQ_HIGHを超えたら受信を止め、OUTQ_LOWを下回ったら再開する(相手が読まない分だけ溜め込まない)
+ * 
+ * 全接続の送信待ちの合計はoutq_total()で得られる。
+ */
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <sys/types.h>
+
+#include <stddef.h>
+
+#include "iobuf.h"
+
+// 受信を止める送信待ちのバイト数
+#ifndef OUTQ_HIGH
+#define OUTQ_HIGH (64 * 1024)
+#endif
+// 受信を再開する送信待ちのバイト数
+#ifndef OUTQ_LOW
+#define OUTQ_LOW (16 * 1024)
+#endif
+
+struct outq {
+    char *buf; // buf[off]からbuf[len - 1]までが未送信
+    size_t off;
+    size_t len;
+    size_t size;
+    int paused; // 送信待ちが多いため受信を止めている
+};
+
+void outq_init(struct outq *q);
+void outq_free(struct outq *q);
+int outq_send(int fd, struct outq *q, struct resp *r);
+int outq_flush(int fd, struct outq *q);
+size_t outq_total(void);
+
+/**
+ * 送信待ちのバイト数
+ */
+static inline size_t outq_pending(const struct outq *q)
+{
+    return (q->len - q->off);
+}
+
+/**
+ * 受信してよいか
+ * 送信待ちがOUTQ_HIGHを超えたら止め、OUTQ_LOWを下回るまでは止めたままにする
+ */
+static inline int outq_readable(struct outq *q)
+{
+    if (q->paused && outq_pending(q) < OUTQ_LOW) {
+        q->paused = 0;
+    } else if (!q->paused && outq_pending(q) > OUTQ_HIGH) {
+        q->paused = 1;
+    }
+    return (!q->paused);
+}
+
+#endif
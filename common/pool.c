@@ -0,0 +1,258 @@
+/**
+ * ワークスティーリングのスレッドプール
+ *
+ * pool.hを参照
+ *
+ * 各ワーカのキューはワーカごとのロックで守る。
+ * 自分のキューへの出し入れと盗む側がぶつかるのは、盗む時(=暇な時)だけなので、ロックはほぼ競合しない。
+ * 眠る・起こすはpool全体のlock、condで行い、queued(全キューのタスク数)とidle(眠っている数)で
+ * 行き違いを防ぐ(投入側はqueuedを増やしてからidleを見て、ワーカはidleを増やしてからqueuedを見る)。
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+// ワーカごとのキューの初期サイズ 2のべき乗
+#define POOL_QUEUE_SIZE (256)
+
+// 実行中のワーカ ワーカの中からの投入は自分のキューに入れる
+static __thread struct pool_worker *t_worker;
+
+/**
+ * キューを倍にする ロックを取った状態で呼ぶ
+ */
+static int pool_queue_grow(struct pool_worker *w)
+{
+    struct pool_task *t;
+    unsigned long i, n;
+
+    n = w->size * 2;
+    if ((t = malloc(sizeof(*t) * n)) == NULL) {
+        return (-1);
+    }
+    for (i = w->head; i != w->tail; i++) {
+        t[i & (n - 1)] = w->task[i & (w->size - 1)];
+    }
+    free(w->task);
+    w->task = t;
+    w->size = n;
+    return (0);
+}
+
+/**
+ * 末尾に追加
+ */
+static int pool_push(struct pool_worker *w, void (*fn)(void *), void *arg)
+{
+    (void) pthread_mutex_lock(&w->lock);
+    if (w->tail - w->head >= w->size && pool_queue_grow(w) == -1) {
+        (void) pthread_mutex_unlock(&w->lock);
+        return (-1);
+    }
+    w->task[w->tail & (w->size - 1)].fn = fn;
+    w->task[w->tail & (w->size - 1)].arg = arg;
+    w->tail++;
+    (void) pthread_mutex_unlock(&w->lock);
+    return (0);
+}
+
+/**
+ * 自分のキューの末尾から取り出す
+ */
+static int pool_pop(struct pool_worker *w, struct pool_task *t)
+{
+    int ret;
+
+    ret = 0;
+    (void) pthread_mutex_lock(&w->lock);
+    if (w->tail != w->head) {
+        w->tail--;
+        *t = w->task[w->tail & (w->size - 1)];
+        ret = 1;
+    }
+    (void) pthread_mutex_unlock(&w->lock);
+    return (ret);
+}
+
+/**
+ * 他のワーカのキューの先頭から盗む
+ * 古いもの(先に投入されたもの)から持っていく
+ */
+static int pool_steal(struct pool_worker *victim, struct pool_task *t)
+{
+    int ret;
+
+    ret = 0;
+    if (pthread_mutex_trylock(&victim->lock) != 0) {
+        return (0);
+    }
+    if (victim->tail != victim->head) {
+        *t = victim->task[victim->head & (victim->size - 1)];
+        victim->head++;
+        ret = 1;
+    }
+    (void) pthread_mutex_unlock(&victim->lock);
+    return (ret);
+}
+
+/**
+ * ワーカスレッド
+ * 自分のキュー -> 他のワーカのキュー の順に探し、どこにも無ければ眠る
+ */
+static void *pool_thread(void *arg)
+{
+    struct pool_worker *w = arg;
+    struct pool *p = w->pool;
+    struct pool_task t;
+    int i, found;
+
+    t_worker = w;
+    while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+        found = pool_pop(w, &t);
+        for (i = 1; !found && i < p->nworker; i++) {
+            if ((found = pool_steal(&p->worker[(w->no + i) % p->nworker], &t))) {
+                __atomic_add_fetch(&w->stolen, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (found) {
+            (void) __atomic_sub_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+            t.fn(t.arg);
+            __atomic_add_fetch(&w->run, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // 何も無い 眠る
+        (void) pthread_mutex_lock(&p->lock);
+        (void) __atomic_add_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&p->queued, __ATOMIC_SEQ_CST) <= 0 && !p->stop) {
+            (void) pthread_cond_wait(&p->cond, &p->lock);
+        }
+        (void) __atomic_sub_fetch(&p->idle, 1, __ATOMIC_SEQ_CST);
+        (void) pthread_mutex_unlock(&p->lock);
+    }
+    return (NULL);
+}
+
+/**
+ * 作成途中のプールの破棄
+ * 起動済みのnthread個のワーカを止めて回収してから、キューとプールを解放する
+ * (タスクを投入する前にしか呼ばないので、キューは空)
+ */
+static void pool_destroy(struct pool *p, int nthread)
+{
+    int i, err;
+
+    err = errno;
+    (void) pthread_mutex_lock(&p->lock);
+    __atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+    (void) pthread_cond_broadcast(&p->cond);
+    (void) pthread_mutex_unlock(&p->lock);
+    for (i = 0; i < nthread; i++) {
+        (void) pthread_join(p->worker[i].thread_id, NULL);
+    }
+    for (i = 0; i < p->nworker; i++) {
+        free(p->worker[i].task);
+        (void) pthread_mutex_destroy(&p->worker[i].lock);
+    }
+    (void) pthread_cond_destroy(&p->cond);
+    (void) pthread_mutex_destroy(&p->lock);
+    free(p->worker);
+    free(p);
+    errno = err;
+}
+
+/**
+ * プールの作成
+ * nworker個のワーカを起動時に全て作る stacksizeが0の場合はデフォルト
+ * 途中で失敗した場合は作ったワーカを止めて全て解放し、NULLを返す(errnoは失敗の原因)
+ * ワーカは失敗時に回収できるようにjoinableで作り、全て作れてからデタッチする
+ */
+struct pool *pool_create(int nworker, size_t stacksize)
+{
+    pthread_attr_t attr;
+    struct pool *p;
+    int i;
+
+    if (nworker <= 0) {
+        errno = EINVAL;
+        return (NULL);
+    }
+    if ((p = calloc(1, sizeof(*p))) == NULL
+        || (p->worker = calloc((size_t) nworker, sizeof(*p->worker))) == NULL) {
+        free(p);
+        return (NULL);
+    }
+    p->nworker = nworker;
+    (void) pthread_mutex_init(&p->lock, NULL);
+    (void) pthread_cond_init(&p->cond, NULL);
+    for (i = 0; i < nworker; i++) {
+        (void) pthread_mutex_init(&p->worker[i].lock, NULL);
+        p->worker[i].no = i;
+        p->worker[i].pool = p;
+        p->worker[i].size = POOL_QUEUE_SIZE;
+        if ((p->worker[i].task = malloc(sizeof(struct pool_task) * POOL_QUEUE_SIZE)) == NULL) {
+            pool_destroy(p, 0);
+            return (NULL);
+        }
+    }
+
+    (void) pthread_attr_init(&attr);
+    if (stacksize > 0 && (errno = pthread_attr_setstacksize(&attr, stacksize)) != 0) {
+        (void) pthread_attr_destroy(&attr);
+        pool_destroy(p, 0);
+        return (NULL);
+    }
+    for (i = 0; i < nworker; i++) {
+        if ((errno = pthread_create(&p->worker[i].thread_id, &attr, pool_thread, &p->worker[i])) != 0) {
+            (void) pthread_attr_destroy(&attr);
+            pool_destroy(p, i);
+            return (NULL);
+        }
+    }
+    (void) pthread_attr_destroy(&attr);
+    for (i = 0; i < nworker; i++) {
+        (void) pthread_detach(p->worker[i].thread_id);
+    }
+    return (p);
+}
+
+/**
+ * タスクの投入
+ * ワーカの中から呼ばれた場合は自分のキュー、それ以外は順番に各ワーカのキューに入れる
+ * 眠っているワーカがいれば1つ起こす(自分のキューでなくても盗んでいく)
+ */
+int pool_submit(struct pool *p, void (*fn)(void *), void *arg)
+{
+    struct pool_worker *w;
+
+    if ((w = t_worker) == NULL || w->pool != p) {
+        w = &p->worker[__atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED) % (unsigned long) p->nworker];
+    }
+    if (pool_push(w, fn, arg) == -1) {
+        return (-1);
+    }
+    (void) __atomic_add_fetch(&p->queued, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->idle, __ATOMIC_SEQ_CST) > 0) {
+        (void) pthread_mutex_lock(&p->lock);
+        (void) pthread_cond_signal(&p->cond);
+        (void) pthread_mutex_unlock(&p->lock);
+    }
+    return (0);
+}
+
+/**
+ * ワーカnoの統計
+ */
+void pool_stat(struct pool *p, int no, struct pool_stat *st)
+{
+    struct pool_worker *w = &p->worker[no];
+
+    (void) pthread_mutex_lock(&w->lock);
+    st->depth = w->tail - w->head;
+    (void) pthread_mutex_unlock(&w->lock);
+    st->run = __atomic_load_n(&w->run, __ATOMIC_RELAXED);
+    st->stolen = __atomic_load_n(&w->stolen, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/**
+ * ワークスティーリングのスレッドプール
+ *
+ * server6.cは接続ごとにpthread_create()していたため
+ * - 接続が集中するとそのたびにスレッド生成のコストがかかる
+ * - デフォルトのスタック(8MB)のスレッドが上限無く増える
+ * となっていた。
+ *
+ * ここでは起動時に決まった数のワーカスレッドを作っておき、仕事(タスク)を投入する。
+ * - ワーカごとに両端キュー(deque)を持ち、自分のキューは末尾から取り出す(直前に入れたものから)
+ * - 自分のキューが空になったら、他のワーカのキューの先頭から盗む(ワークスティーリング)
+ * - どのキューも空ならば眠り、投入時に眠っているワーカがいれば起こす
+ * スタックサイズは指定でき、ブロッキングする処理を多数のワーカで動かす場合は小さくしておく。
+ */
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+struct pool_task {
+    void (*fn)(void *);
+    void *arg;
+};
+
+struct pool_worker {
+    pthread_mutex_t lock;
+    struct pool_task *task; // リングバッファ
+    unsigned long head; // 先頭(盗まれる側)
+    unsigned long tail; // 末尾(自分で出し入れする側)
+    unsigned long size; // 2のべき乗
+    unsigned long run; // 実行したタスク数
+    unsigned long stolen; // 他のワーカから盗んだ数
+    int no;
+    struct pool *pool;
+    pthread_t thread_id;
+};
+
+struct pool {
+    struct pool_worker *worker;
+    int nworker;
+    unsigned long next; // 投入先の選択用
+    long queued; // 全キューのタスク数
+    int idle; // 眠っているワーカ数
+    int stop; // ワーカの終了指示 pool_create()の失敗時に使う
+    pthread_mutex_t lock; // 眠る・起こす時だけ使う
+    pthread_cond_t cond;
+};
+
+/**
+ * 統計 pool_stat()で取得する
+ */
+struct pool_stat {
+    unsigned long depth; // キューに溜まっている数
+    unsigned long run;
+    unsigned long stolen;
+};
+
+struct pool *pool_create(int nworker, size_t stacksize);
+int pool_submit(struct pool *p, void (*fn)(void *), void *arg);
+void pool_stat(struct pool *p, int no, struct pool_stat *st);
+
+#endif
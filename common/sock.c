@@ -0,0 +1,120 @@
+/**
+ * サーバソケットの準備
+ *
+ * sock.hを参照
+ */
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sock.h"
+
+/**
+ * サーバソケットの生成
+ * ch01と同じ getaddrinfo() -> socket() -> SO_REUSEADDR -> bind() -> listen()
+ * 戻り値 ソケット -1:エラー
+ */
+int server_socket(const char *portnm)
+{
+    char nbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    struct addrinfo hints, *res0;
+    int soc, opt, errcode;
+
+    (void) memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    if ((errcode = getaddrinfo(NULL, portnm, &hints, &res0)) != 0) {
+        (void) fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(errcode));
+        return (-1);
+    }
+    if ((errcode = getnameinfo(res0->ai_addr, res0->ai_addrlen, nbuf, sizeof(nbuf), sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV)) != 0) {
+        (void) fprintf(stderr, "getnameinfo(): %s\n", gai_strerror(errcode));
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    (void) fprintf(stderr, "port=%s\n", sbuf);
+
+    if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+        perror("socket");
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    opt = 1;
+    if (setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+        perror("bind");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    if (listen(soc, SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+    freeaddrinfo(res0);
+    return (soc);
+}
+
+/**
+ * 接続先のアドレスの決定
+ * ch04 client.cのclient_socket()と同じく、ホスト名はまずIPアドレスとして解釈し、ダメならば名前を引く
+ * 戻り値 0:成功 -1:エラー
+ */
+int client_addr(const char *hostnm, const char *portnm, struct sockaddr_in *addr)
+{
+    struct addrinfo hints, *res0;
+    int errcode;
+
+    (void) memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    if (inet_pton(AF_INET, hostnm, &addr->sin_addr) == 1 && isdigit((unsigned char) portnm[0])) {
+        if (atoi(portnm) <= 0 || atoi(portnm) > 65535) {
+            (void) fprintf(stderr, "bad port no\n");
+            return (-1);
+        }
+        addr->sin_port = htons((uint16_t) atoi(portnm));
+        return (0);
+    }
+    (void) memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((errcode = getaddrinfo(hostnm, portnm, &hints, &res0)) != 0) {
+        (void) fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(errcode));
+        return (-1);
+    }
+    (void) memcpy(addr, res0->ai_addr, sizeof(*addr));
+    freeaddrinfo(res0);
+    return (0);
+}
+
+/**
+ * ノンブロッキングにする
+ */
+int sock_nonblock(int fd)
+{
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) == -1) {
+        return (-1);
+    }
+    return (fcntl(fd, F_SETFL, flags | O_NONBLOCK));
+}
@@ -0,0 +1,20 @@
+/**
+ * サーバソケットの準備
+ *
+ * ch01からch05の各サーバはserver_socket()をそれぞれコピーして持っている。
+ * 1つのプログラムで複数の方式を切り替えるサーバ(ch05/server.c)用に、同じものをここに置く。
+ *
+ * クライアント側はch04 client.cのclient_socket()のアドレスを決める部分だけをclient_addr()にする。
+ * 負荷をかけるクライアント(bench/)は同じ宛先に多数の接続を張るので、名前の解決は最初に1回だけ行い、
+ * socket()、connect()は呼び出し側でノンブロッキングに行う。
+ */
+#ifndef SOCK_H
+#define SOCK_H
+
+#include <netinet/in.h>
+
+int server_socket(const char *portnm);
+int client_addr(const char *hostnm, const char *portnm, struct sockaddr_in *addr);
+int sock_nonblock(int fd);
+
+#endif
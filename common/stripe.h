@@ -0,0 +1,46 @@
+/**
+ * ストライプ転送のプロトコル
+ *
+ * 1本のTCP接続の転送速度は、1つの輻輳ウィンドウと1つのコアのコピー速度で頭打ちになる。
+ * ch06 bigclient.c(-P n)は1つのファイルをチャンクに分け、n本の接続に分散して送り、
+ * bigserver.c(-m stripe)はチャンクに付いているオフセットの位置にpwrite()して元のファイルに組み立てる
+ * (GridFTPや並列のiperfと同じ考え方)。
+ *
+ * 各接続(ストライプ)では
+ *   struct stripe_hello 1回 転送のID、ファイルサイズ、ストライプ数、自分の番号
+ *   struct stripe_chunk + データ(length) の繰り返し
+ * を送り、最後にshutdown(SHUT_WR)する。チャンクをどのストライプで送るかは決まっておらず、
+ * 空いたストライプが次のチャンクを取る(速い接続ほど多く運ぶ)。
+ * サーバは同じIDの全てのストライプがEOFになったらfsync()し、全てのストライプに
+ *   "OK 受信したバイト数\r\n" (失敗した場合は"NG ...")
+ * を返して切断する。
+ * 数値はすべてネットワークバイトオーダー(ビッグエンディアン)。
+ */
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdint.h>
+
+// "STRP"
+#define STRIPE_MAGIC (0x53545250U)
+// ストライプ数の上限
+#define STRIPE_MAX (256)
+// チャンクの長さの上限
+#define STRIPE_CHUNK_MAX (64 * 1024 * 1024)
+
+struct stripe_hello {
+    uint32_t magic;
+    uint32_t nstripes;
+    uint32_t index; // 0からnstripes - 1
+    uint32_t reserved;
+    uint64_t id; // 転送のID 同じファイルのストライプは同じID
+    uint64_t size; // ファイルサイズ
+};
+
+struct stripe_chunk {
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+#endif
@@ -0,0 +1,270 @@
+/**
+ * 階層化タイミングホイール
+ *
+ * twheel.hを参照
+ *
+ * w->nowは「次に処理するティック」で、twheel_advance()は現在時刻のティックまでを1つずつ処理する。
+ * 1段目のスロットが一周して0に戻るたびに、2段目の現在位置のスロットを降ろす(2段目も0ならば3段目も、と続く)。
+ */
+#include <string.h>
+#include <time.h>
+
+#include "twheel.h"
+
+/**
+ * 現在時刻(ms) 時刻の変更の影響を受けないCLOCK_MONOTONIC
+ */
+uint64_t twheel_clock_ms(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000);
+}
+
+void twheel_init(struct twheel *w, unsigned int tick_ms, uint64_t now_ms)
+{
+    (void) memset(w, 0, sizeof(*w));
+    w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+    w->base_ms = now_ms;
+}
+
+void twheel_timer_init(struct twheel_timer *t, void (*fn)(struct twheel_timer *, void *), void *arg)
+{
+    (void) memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+static struct twheel_timer **twheel_head(struct twheel *w, int level, int slot)
+{
+    return (level == 0 ? &w->l0[slot] : &w->ln[level - 1][slot]);
+}
+
+/**
+ * スロットにつなぐ
+ * 期限までのティック数で段を決め、期限のその段のビットをスロット番号にする
+ */
+static void twheel_link(struct twheel *w, struct twheel_timer *t)
+{
+    struct twheel_timer **head;
+    uint64_t delta;
+    int level, shift;
+
+    if (t->expires < w->now) {
+        t->expires = w->now;
+    }
+    if ((delta = t->expires - w->now) > TWHEEL_MAX_TICKS) {
+        delta = TWHEEL_MAX_TICKS;
+        t->expires = w->now + delta;
+    }
+    if (delta < TWHEEL_L0_SIZE) {
+        level = 0;
+        t->slot = (uint16_t) (t->expires & (TWHEEL_L0_SIZE - 1));
+        w->map0[t->slot / 64] |= 1ULL << (t->slot % 64);
+    } else {
+        for (level = 1, shift = TWHEEL_L0_BITS; level < TWHEEL_LEVELS - 1; level++, shift += TWHEEL_LN_BITS) {
+            if (delta < (1ULL << (shift + TWHEEL_LN_BITS))) {
+                break;
+            }
+        }
+        t->slot = (uint16_t) ((t->expires >> shift) & (TWHEEL_LN_SIZE - 1));
+        w->mapn[level - 1] |= 1ULL << t->slot;
+    }
+    t->level = (uint16_t) level;
+    head = twheel_head(w, level, t->slot);
+    if ((t->next = *head) != NULL) {
+        t->next->pprev = &t->next;
+    }
+    *head = t;
+    t->pprev = head;
+}
+
+/**
+ * スロットから外す 空になったらビットマップも落とす
+ */
+static void twheel_unlink(struct twheel *w, struct twheel_timer *t)
+{
+    if ((*t->pprev = t->next) != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+    if (*twheel_head(w, t->level, t->slot) == NULL) {
+        if (t->level == 0) {
+            w->map0[t->slot / 64] &= ~(1ULL << (t->slot % 64));
+        } else {
+            w->mapn[t->level - 1] &= ~(1ULL << t->slot);
+        }
+    }
+}
+
+/**
+ * 登録(張り直し)
+ * 登録済みの場合は外してから、timeout_ms後(ティックに切り上げ)に登録し直す
+ * 期限は最後にtwheel_advance()に渡された時刻から数える
+ * (遅れを取り戻している途中のコールバックから張り直しても、過ぎたティックを基準にしない)
+ */
+void twheel_add(struct twheel *w, struct twheel_timer *t, unsigned long timeout_ms)
+{
+    if (twheel_pending(t)) {
+        twheel_unlink(w, t);
+    } else {
+        w->count++;
+    }
+    t->expires = w->cur + 1 + (timeout_ms + w->tick_ms - 1) / w->tick_ms;
+    twheel_link(w, t);
+}
+
+/**
+ * 取り消し 登録されていなければ何もしない
+ */
+void twheel_del(struct twheel *w, struct twheel_timer *t)
+{
+    if (twheel_pending(t)) {
+        twheel_unlink(w, t);
+        w->count--;
+    }
+}
+
+/**
+ * 上の段のスロットを現在のティックから見た段に入れ直す
+ * 戻り値 スロット番号(0ならばさらに上の段も降ろす)
+ */
+static int twheel_cascade(struct twheel *w, int level, int slot)
+{
+    struct twheel_timer *t, *list;
+
+    list = *twheel_head(w, level, slot);
+    *twheel_head(w, level, slot) = NULL;
+    w->mapn[level - 1] &= ~(1ULL << slot);
+    while ((t = list) != NULL) {
+        list = t->next;
+        twheel_link(w, t);
+    }
+    return (slot);
+}
+
+/**
+ * 時刻を進めて期限の来たタイマのコールバックを呼ぶ
+ * コールバックの中でタイマの登録・取り消しをしてよい
+ * 戻り値 呼んだコールバックの数
+ */
+unsigned long twheel_advance(struct twheel *w, uint64_t now_ms)
+{
+    struct twheel_timer *t, *list;
+    uint64_t target;
+    unsigned long fired;
+    int index, level, shift;
+
+    if (now_ms < w->base_ms) {
+        return (0);
+    }
+    target = (now_ms - w->base_ms) / w->tick_ms;
+    if (target > w->cur) {
+        w->cur = target;
+    }
+    fired = 0;
+    while (w->now <= target) {
+        if (w->count == 0) {
+            // タイマが無いので一気に進める
+            w->now = target + 1;
+            break;
+        }
+        index = (int) (w->now & (TWHEEL_L0_SIZE - 1));
+        if (index == 0) {
+            // 1段目が一周した 上の段を降ろす
+            for (level = 1, shift = TWHEEL_L0_BITS; level < TWHEEL_LEVELS; level++, shift += TWHEEL_LN_BITS) {
+                if (twheel_cascade(w, level, (int) ((w->now >> shift) & (TWHEEL_LN_SIZE - 1))) != 0) {
+                    break;
+                }
+            }
+        }
+        // 先に進めておく(コールバックで期限0で張り直されたら次のティックで処理する)
+        w->now++;
+        list = w->l0[index];
+        w->l0[index] = NULL;
+        w->map0[index / 64] &= ~(1ULL << (index % 64));
+        if (list != NULL) {
+            list->pprev = &list;
+        }
+        while ((t = list) != NULL) {
+            list = t->next;
+            if (list != NULL) {
+                list->pprev = &list;
+            }
+            t->next = NULL;
+            t->pprev = NULL;
+            w->count--;
+            fired++;
+            t->fn(t, t->arg);
+        }
+    }
+    return (fired);
+}
+
+/**
+ * 1段目で次に空でないスロットまでのティック数 無ければ-1
+ * ビットマップを現在位置から一周分見る
+ */
+static int twheel_next_l0(struct twheel *w)
+{
+    uint64_t bits;
+    int start, i, word, pos;
+
+    start = (int) (w->now & (TWHEEL_L0_SIZE - 1));
+    for (i = 0; i <= TWHEEL_L0_SIZE / 64; i++) {
+        word = (start / 64 + i) % (TWHEEL_L0_SIZE / 64);
+        bits = w->map0[word];
+        if (i == 0) {
+            // 現在位置より前は一周後に回す
+            bits &= ~0ULL << (start % 64);
+        } else if (i == TWHEEL_L0_SIZE / 64) {
+            bits &= (start % 64) ? ~(~0ULL << (start % 64)) : 0;
+        }
+        if (bits != 0) {
+            pos = word * 64 + __builtin_ctzll(bits);
+            return ((pos - start + TWHEEL_L0_SIZE) % TWHEEL_L0_SIZE);
+        }
+    }
+    return (-1);
+}
+
+/**
+ * 次に期限が来るまでのms poll()、epoll_wait()のタイムアウトに使う
+ *
+ * 1段目のタイマは期限そのもの、上の段にタイマがあれば次に降ろすティック(1段目が一周する所)も候補にする
+ * (上の段のタイマの期限はそれより前には来ない)。
+ * 戻り値 次の期限までのms(max_msで頭打ち) タイマが無ければmax_ms(-1ならば無期限)
+ */
+int twheel_next_timeout(struct twheel *w, uint64_t now_ms, int max_ms)
+{
+    uint64_t next, cascade, due_ms;
+    int d, level;
+
+    if (w->count == 0) {
+        return (max_ms);
+    }
+    next = UINT64_MAX;
+    if ((d = twheel_next_l0(w)) != -1) {
+        next = w->now + (uint64_t) d;
+    }
+    for (level = 0; level < TWHEEL_LEVELS - 1; level++) {
+        if (w->mapn[level] != 0) {
+            // w->nowが1段目の先頭ならば、そのティックの処理で降ろす
+            cascade = (w->now + TWHEEL_L0_SIZE - 1) & ~(uint64_t) (TWHEEL_L0_SIZE - 1);
+            if (cascade < next) {
+                next = cascade;
+            }
+            break;
+        }
+    }
+    due_ms = w->base_ms + next * w->tick_ms;
+    if (due_ms <= now_ms) {
+        return (0);
+    }
+    if (max_ms >= 0 && due_ms - now_ms > (uint64_t) max_ms) {
+        return (max_ms);
+    }
+    return ((int) (due_ms - now_ms));
+}
@@ -0,0 +1,79 @@
+/**
+ * 階層化タイミングホイール
+ *
+ * ch06 timeout.cは1つのブロッキングrecv()のタイムアウトを扱っていたが、
+ * select()/poll()/epollで多重化したサーバにはループ全体の10秒のタイムアウトしか無く、
+ * 何も送ってこない接続はクライアントが切断するまで残り続けていた。
+ *
+ * 接続ごとのタイマを多数(10万個以上)持ち、そのほとんどがリクエストのたびに張り直される用途では
+ * 二分ヒープなどの整列した構造では張り直しのたびにO(log n)かかる。
+ * ここではタイミングホイール(時刻を添字にしたリストの配列)を使い、
+ * - 登録・取り消し・張り直しはリストへのつなぎ替えだけのO(1)
+ * - 期限切れの処理は進んだティック数に比例
+ * にする。
+ *
+ * 1段だけでは遠い期限のために大きな配列が必要になるので、4段にしてティックの上位ビットで上の段に入れておき、
+ * 下の段が一周するたびに上の段の1スロット分を下の段に降ろす(カスケード)。
+ *   1段目 256スロット: 256ティック未満
+ *   2段目  64スロット: 2^14ティック未満
+ *   3段目  64スロット: 2^20ティック未満
+ *   4段目  64スロット: 2^26ティック未満(これより先は最後に丸める)
+ * ティックが10msならば4段目で約7.7日まで扱える。
+ *
+ * 空でないスロットをビットマップで持ち、次に期限が来るまでの時間(poll()、epoll_wait()のタイムアウト)を
+ * 配列を走査せずに求める。
+ *
+ * タイマの構造体は呼び出し側の構造体(接続ごとの状態など)に埋め込んで使い、メモリの確保はしない。
+ * 1スレッドから使うこと(ロックはしない)。
+ */
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdint.h>
+
+#define TWHEEL_LEVELS (4)
+#define TWHEEL_L0_BITS (8)
+#define TWHEEL_LN_BITS (6)
+#define TWHEEL_L0_SIZE (1 << TWHEEL_L0_BITS)
+#define TWHEEL_LN_SIZE (1 << TWHEEL_LN_BITS)
+// 扱える最大のティック数 これより先の期限はここに丸める
+#define TWHEEL_MAX_TICKS ((1UL << (TWHEEL_L0_BITS + TWHEEL_LN_BITS * (TWHEEL_LEVELS - 1))) - 1)
+
+struct twheel_timer {
+    struct twheel_timer *next;
+    struct twheel_timer **pprev; // NULL:登録されていない
+    uint64_t expires; // 期限(ティック)
+    uint16_t level, slot; // 入っているスロット
+    void (*fn)(struct twheel_timer *t, void *arg);
+    void *arg;
+};
+
+struct twheel {
+    uint64_t now; // 次に処理するティック
+    uint64_t cur; // 最後にtwheel_advance()に渡された時刻のティック
+    uint64_t base_ms; // ティック0の時刻
+    unsigned int tick_ms;
+    unsigned long count; // 登録されているタイマ数
+    struct twheel_timer *l0[TWHEEL_L0_SIZE];
+    struct twheel_timer *ln[TWHEEL_LEVELS - 1][TWHEEL_LN_SIZE];
+    uint64_t map0[TWHEEL_L0_SIZE / 64]; // 空でないスロット
+    uint64_t mapn[TWHEEL_LEVELS - 1];
+};
+
+uint64_t twheel_clock_ms(void);
+void twheel_init(struct twheel *w, unsigned int tick_ms, uint64_t now_ms);
+void twheel_timer_init(struct twheel_timer *t, void (*fn)(struct twheel_timer *, void *), void *arg);
+void twheel_add(struct twheel *w, struct twheel_timer *t, unsigned long timeout_ms);
+void twheel_del(struct twheel *w, struct twheel_timer *t);
+unsigned long twheel_advance(struct twheel *w, uint64_t now_ms);
+int twheel_next_timeout(struct twheel *w, uint64_t now_ms, int max_ms);
+
+/**
+ * 登録されているか
+ */
+static inline int twheel_pending(const struct twheel_timer *t)
+{
+    return (t->pprev != NULL);
+}
+
+#endif
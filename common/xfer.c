@@ -0,0 +1,186 @@
+/**
+ * 大きなデータ転送の計測と待ち
+ *
+ * xfer.hを参照
+ */
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include "xfer.h"
+
+/**
+ * XFER_CHUNK_MIN: xfer_chunk_out()で返す最小のサイズ
+ * 送信バッファの空きが少ない時に細かく送るとシステムコールが増えるだけなので、これより小さくはしない
+ */
+#define XFER_CHUNK_MIN (64 * 1024)
+
+static double tv_sec(const struct timeval *tv)
+{
+    return ((double) tv->tv_sec + (double) tv->tv_usec / 1e6);
+}
+
+/**
+ * 計測開始
+ */
+void xfer_start(struct xfer_stat *st)
+{
+    (void) clock_gettime(CLOCK_MONOTONIC, &st->start);
+    (void) getrusage(RUSAGE_SELF, &st->ru);
+}
+
+/**
+ * 計測開始からの秒数
+ */
+double xfer_elapsed(const struct xfer_stat *st)
+{
+    struct timespec now;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double) (now.tv_sec - st->start.tv_sec) + (double) (now.tv_nsec - st->start.tv_nsec) / 1e9);
+}
+
+/**
+ * 計測開始からの結果を表示する
+ * cpu/GBは1GB(10^9バイト)を転送するのに使ったCPU時間(秒) 転送方式のコストの比較に使う
+ * cswは自発的・非自発的コンテキストスイッチの合計 wがNULLでなければEAGAINと起床の回数も表示する
+ */
+void xfer_report(FILE *fp, const char *label, const struct xfer_stat *st, off_t bytes, const struct xfer_wait *w)
+{
+    struct rusage ru;
+    double sec, user, sys, gb;
+
+    sec = xfer_elapsed(st);
+    (void) getrusage(RUSAGE_SELF, &ru);
+    user = tv_sec(&ru.ru_utime) - tv_sec(&st->ru.ru_utime);
+    sys = tv_sec(&ru.ru_stime) - tv_sec(&st->ru.ru_stime);
+    gb = (double) bytes / 1e9;
+    (void) fprintf(fp, "%s: bytes=%lld sec=%.3f Gbit/s=%.3f user=%.3f sys=%.3f cpu/GB=%.3f csw=%ld",
+                   label, (long long) bytes, sec,
+                   sec > 0 ? gb * 8 / sec : 0.0,
+                   user, sys,
+                   gb > 0 ? (user + sys) / gb : 0.0,
+                   (ru.ru_nvcsw - st->ru.ru_nvcsw) + (ru.ru_nivcsw - st->ru.ru_nivcsw));
+    if (w != NULL) {
+        (void) fprintf(fp, " eagain=%lu wakeups=%lu", w->eagain, w->wakeups);
+    }
+    (void) fprintf(fp, "\n");
+}
+
+/**
+ * イベント駆動で待つ準備
+ * fdをeventsで監視するepollを作る レベルトリガなので、読み書きしきれなかった分は次のxfer_wait()ですぐに戻る
+ */
+int xfer_wait_init(struct xfer_wait *w, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+
+    w->eagain = 0;
+    w->wakeups = 0;
+    if ((w->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        return (-1);
+    }
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        (void) close(w->epfd);
+        w->epfd = -1;
+        return (-1);
+    }
+    return (0);
+}
+
+/**
+ * EAGAINになった時に呼ぶ
+ * スピン(epfd == -1)ならばすぐに戻る イベント駆動ならば読み書きできるようになるまで眠る
+ */
+void xfer_wait(struct xfer_wait *w)
+{
+    struct epoll_event ev;
+
+    w->eagain++;
+    if (w->epfd == -1) {
+        return;
+    }
+    while (epoll_wait(w->epfd, &ev, 1, -1) == -1 && errno == EINTR) {
+        ;
+    }
+    w->wakeups++;
+}
+
+void xfer_wait_close(struct xfer_wait *w)
+{
+    if (w->epfd != -1) {
+        (void) close(w->epfd);
+        w->epfd = -1;
+    }
+}
+
+/**
+ * 低水位の設定 bytes以上読み書きできるようになるまでEPOLLIN/EPOLLOUTにしない
+ * EPOLLIN: SO_RCVLOWAT (EOFやエラーは低水位に関係なく通知される)
+ * EPOLLOUT: SO_SNDLOWAT Linuxでは変更できない(ENOPROTOOPT)ので、
+ *           代わりにTCP_NOTSENT_LOWAT(未送信のデータがbytes未満になったら書き込み可能)を使う
+ */
+int xfer_set_lowat(int fd, uint32_t events, int bytes)
+{
+    if (events & EPOLLIN) {
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &bytes, sizeof(bytes)) == -1) {
+            return (-1);
+        }
+    }
+    if (events & EPOLLOUT) {
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDLOWAT, &bytes, sizeof(bytes)) == -1) {
+            if (errno != ENOPROTOOPT) {
+                return (-1);
+            }
+            if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &bytes, sizeof(bytes)) == -1) {
+                return (-1);
+            }
+        }
+    }
+    return (0);
+}
+
+/**
+ * 1回に受信する量 受信キューに溜まっている量(SIOCINQ)をmaxまで
+ * 何も溜まっていない(またはEOF)ならばmax
+ */
+size_t xfer_chunk_in(int fd, size_t max)
+{
+    int n;
+
+    if (ioctl(fd, SIOCINQ, &n) == -1 || n <= 0 || (size_t) n > max) {
+        return (max);
+    }
+    return ((size_t) n);
+}
+
+/**
+ * 1回に送信する量 送信バッファの空き(SO_SNDBUFから送信キューの量SIOCOUTQを引いたもの)をmaxまで
+ * SO_SNDBUFはカーネル内の管理領域を含めて設定値の2倍になっているので、その半分をデータの量とみなす
+ * 空きがXFER_CHUNK_MIN未満ならばXFER_CHUNK_MIN
+ */
+size_t xfer_chunk_out(int fd, size_t max)
+{
+    socklen_t len;
+    int sndbuf, outq, room;
+
+    len = sizeof(sndbuf);
+    if (getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len) == -1 || ioctl(fd, SIOCOUTQ, &outq) == -1) {
+        return (max);
+    }
+    if ((room = sndbuf / 2 - outq) < XFER_CHUNK_MIN) {
+        room = XFER_CHUNK_MIN;
+    }
+    return ((size_t) room < max ? (size_t) room : max);
+}
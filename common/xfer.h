@@ -0,0 +1,49 @@
+/**
+ * 大きなデータ転送の計測と待ち
+ *
+ * ch06 bigclient.c、bigserver.cの送り方・受け方(コピー、sendfile()、splice()、ノンブロッキングなど)を
+ * 比べるため、転送にかかった時間とCPU時間を測って
+ *   バイト数、秒数、Gbit/s、ユーザ・システムCPU時間、1GBあたりのCPU時間、コンテキストスイッチ数、
+ *   EAGAINの回数、epoll_wait()から戻った回数
+ * を1行で表示する。
+ * CPU時間はgetrusage(RUSAGE_SELF)なのでプロセス全体の値で、複数の転送を同時に行う場合は合計になる。
+ *
+ * ノンブロッキングのソケットでEAGAINになった時の待ち方(struct xfer_wait)
+ * - スピン: すぐにリトライする 待っている間もCPUを100%使う
+ * - イベント駆動: epollでEPOLLIN/EPOLLOUTになるまで眠る
+ *   さらに低水位(SO_RCVLOWAT、送信側はTCP_NOTSENT_LOWAT)を上げて、少しずつ読み書きできるたびに
+ *   起こされないようにし、1回のrecv()/send()の量をSIOCINQ/SIOCOUTQから決める
+ */
+#ifndef XFER_H
+#define XFER_H
+
+#include <sys/resource.h>
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+struct xfer_stat {
+    struct timespec start;
+    struct rusage ru;
+};
+
+struct xfer_wait {
+    int epfd; // -1: スピン
+    unsigned long eagain; // EAGAINになった回数
+    unsigned long wakeups; // epoll_wait()から戻った回数
+};
+
+void xfer_start(struct xfer_stat *st);
+double xfer_elapsed(const struct xfer_stat *st);
+void xfer_report(FILE *fp, const char *label, const struct xfer_stat *st, off_t bytes, const struct xfer_wait *w);
+
+int xfer_wait_init(struct xfer_wait *w, int fd, uint32_t events);
+void xfer_wait(struct xfer_wait *w);
+void xfer_wait_close(struct xfer_wait *w);
+int xfer_set_lowat(int fd, uint32_t events, int bytes);
+size_t xfer_chunk_in(int fd, size_t max);
+size_t xfer_chunk_out(int fd, size_t max);
+
+#endif